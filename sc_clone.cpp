@@ -1,500 +1,12147 @@
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600  // NotifyServiceStatusChangeW
+#endif
 #include <windows.h>
+#include <winsvc.h>
+#include <fcntl.h>
+#include <io.h>
+#else
+#include "win32_compat.h"
+#include <clocale>
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 #include <iostream>
+#include <fstream>
+#include <filesystem>
 #include <string>
-#include <winsvc.h>
 #include <vector>
 #include <sstream>
+#include <map>
+#include <optional>
+#include <regex>
+#include <list>
+#include <unordered_map>
+#include <array>
+#include <set>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <cwctype>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cwchar>
+#include <ctime>
+
+// Streams the handlers write to. Worker threads that must not interleave (e.g. one per remote host)
+// point these at their own buffers; everywhere else they are the console.
+thread_local std::wostream* t_out = nullptr;
+thread_local std::wostream* t_err = nullptr;
+
+std::wostream& Out() {
+    return t_out ? *t_out : std::wcout;
+}
+
+std::wostream& Err() {
+    return t_err ? *t_err : std::wcerr;
+}
 
 // Function to print error messages related to service control management (SCM) failures
 void PrintErrorMessage(const std::wstring& message, DWORD error){
-    std::wcerr << L"[SC_CLONE] OpenSCManager failed with error code: " << error << std::endl;
+    Err() << message << error << std::endl;
 
+#ifdef _WIN32
     // Convert error code to a human-readable message
-    LPVOID errormessage;
-    FormatMessage(
+    LPWSTR errormessage = NULL;
+    FormatMessageW(
             FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
-            NULL, error, 0,(LPWSTR)&errormessage, 0, NULL);
+            NULL, error, 0, (LPWSTR)&errormessage, 0, NULL);
 
-    std::wcerr << L"Error Message: " << (LPWSTR)errormessage << std::endl;
+    Err() << L"Error Message: " << (errormessage ? errormessage : L"(unknown)") << std::endl;
 
     // Free allocated memory for error message
     LocalFree(errormessage);
+#else
+    Err() << L"Error Message: " << Win32ErrorText(error) << std::endl;
+#endif
+}
+
+// Lower-cases a string; service names are compared case-insensitively by the SCM
+std::wstring ToLower(const std::wstring& text) {
+    std::wstring result = text;
+    for (auto& ch : result) {
+        ch = static_cast<wchar_t>(std::towlower(ch));
+    }
+    return result;
 }
 
-// Converts service type flags into a human-readable string for display
-std::wstring ServiceTypeToString(DWORD serviceType) {
-    std::wstring result = L"Unknown";
+// Decodes UTF-8 text (batch files, fixtures, non-Windows argv) into a wide string
+std::wstring Utf8ToWide(const std::string& text) {
+    std::wstring result;
+    result.reserve(text.size());
+
+    size_t i = 0;
+    while (i < text.size()) {
+        unsigned char lead = static_cast<unsigned char>(text[i]);
+        uint32_t codePoint = 0xFFFD;
+        size_t extra = 0;
+        if (lead < 0x80) {
+            codePoint = lead;
+        } else if ((lead >> 5) == 0x6) {
+            codePoint = lead & 0x1F;
+            extra = 1;
+        } else if ((lead >> 4) == 0xE) {
+            codePoint = lead & 0x0F;
+            extra = 2;
+        } else if ((lead >> 3) == 0x1E) {
+            codePoint = lead & 0x07;
+            extra = 3;
+        }
+
+        if (i + extra >= text.size()) {
+            codePoint = 0xFFFD;
+            extra = text.size() - i - 1;
+        } else {
+            for (size_t k = 1; k <= extra; ++k) {
+                codePoint = (codePoint << 6) | (static_cast<unsigned char>(text[i + k]) & 0x3F);
+            }
+        }
+        i += extra + 1;
 
-    // Check the flags and append corresponding service type to the result string
-    if (serviceType & SERVICE_WIN32_OWN_PROCESS) {
-        result = L"SERVICE_WIN32_OWN_PROCESS";
+        // Windows wide strings are UTF-16, so characters outside the BMP become surrogate pairs
+        if (sizeof(wchar_t) == 2 && codePoint > 0xFFFF) {
+            codePoint -= 0x10000;
+            result += static_cast<wchar_t>(0xD800 + (codePoint >> 10));
+            result += static_cast<wchar_t>(0xDC00 + (codePoint & 0x3FF));
+        } else {
+            result += static_cast<wchar_t>(codePoint);
+        }
     }
-    if (serviceType & SERVICE_WIN32_SHARE_PROCESS) {
-        result += L" | SERVICE_WIN32_SHARE_PROCESS";
+
+    return result;
+}
+
+// Encodes a wide string (UTF-16 on Windows, UTF-32 elsewhere) as UTF-8
+std::string WideToUtf8(const std::wstring& text) {
+    std::string result;
+    result.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        uint32_t codePoint = static_cast<uint32_t>(text[i]);
+        if (codePoint >= 0xD800 && codePoint < 0xDC00 && i + 1 < text.size() &&
+            text[i + 1] >= 0xDC00 && text[i + 1] < 0xE000) {
+            codePoint = 0x10000 + ((codePoint - 0xD800) << 10) + (static_cast<uint32_t>(text[++i]) - 0xDC00);
+        }
+        if (codePoint < 0x80) {
+            result += static_cast<char>(codePoint);
+        } else if (codePoint < 0x800) {
+            result += static_cast<char>(0xC0 | (codePoint >> 6));
+            result += static_cast<char>(0x80 | (codePoint & 0x3F));
+        } else if (codePoint < 0x10000) {
+            result += static_cast<char>(0xE0 | (codePoint >> 12));
+            result += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+            result += static_cast<char>(0x80 | (codePoint & 0x3F));
+        } else {
+            result += static_cast<char>(0xF0 | (codePoint >> 18));
+            result += static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F));
+            result += static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F));
+            result += static_cast<char>(0x80 | (codePoint & 0x3F));
+        }
     }
-    if (serviceType & SERVICE_KERNEL_DRIVER) {
-        result += L" | SERVICE_KERNEL_DRIVER";
+    return result;
+}
+
+// Splits a command line into arguments; double quotes group words (e.g. paths with spaces)
+std::vector<std::wstring> SplitCommandLine(const std::wstring& line) {
+    std::vector<std::wstring> args;
+    std::wstring current;
+    bool inQuotes = false;
+    bool hasToken = false;
+
+    for (wchar_t ch : line) {
+        if (ch == L'"') {
+            inQuotes = !inQuotes;
+            hasToken = true;
+        } else if (!inQuotes && (ch == L' ' || ch == L'\t' || ch == L'\r' || ch == L'\n')) {
+            if (hasToken) {
+                args.push_back(current);
+                current.clear();
+                hasToken = false;
+            }
+        } else {
+            current += ch;
+            hasToken = true;
+        }
     }
-    if (serviceType & SERVICE_FILE_SYSTEM_DRIVER) {
-        result += L" | SERVICE_FILE_SYSTEM_DRIVER";
+    if (hasToken) {
+        args.push_back(current);
     }
-    if (serviceType & SERVICE_RECOGNIZER_DRIVER) {
-        result += L" | SERVICE_RECOGNIZER_DRIVER";
+
+    return args;
+}
+
+// Milliseconds elapsed since start
+double ElapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Serialises lines written by worker threads so their output does not interleave
+std::mutex g_outputMutex;
+
+// Runs fn(i) for every i in [0, count) on up to `workers` threads
+template <typename Fn>
+void ParallelFor(size_t count, size_t workers, Fn fn) {
+    workers = std::max<size_t>(1, std::min(workers, count));
+    if (workers == 1) {
+        for (size_t i = 0; i < count; ++i) {
+            fn(i);
+        }
+        return;
     }
-    if (serviceType & SERVICE_WIN32) {
-        result += L" | SERVICE_WIN32";
+
+    // Workers inherit the caller's output streams, so a per-host capture also covers its worker threads
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> threads;
+    std::wostream* out = t_out;
+    std::wostream* err = t_err;
+    for (size_t w = 0; w < workers; ++w) {
+        threads.emplace_back([&, out, err]() {
+            t_out = out;
+            t_err = err;
+            for (size_t i = next++; i < count; i = next++) {
+                fn(i);
+            }
+        });
     }
-    if (serviceType & SERVICE_ADAPTER) {
-        result += L" | SERVICE_ADAPTER";
+    for (auto& thread : threads) {
+        thread.join();
     }
-    if (serviceType & SERVICE_DRIVER) {
-        result += L" | SERVICE_DRIVER";
+}
+
+// Abstraction over the advapi32 service calls, so handlers can run against the real SCM or an in-memory stand-in.
+// Method names and signatures mirror the Win32 functions they replace.
+class ScmBackend {
+public:
+    virtual ~ScmBackend() {}
+
+    virtual SC_HANDLE OpenSCManagerW(LPCWSTR machineName, LPCWSTR databaseName, DWORD desiredAccess) = 0;
+    virtual SC_HANDLE OpenServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, DWORD desiredAccess) = 0;
+    virtual SC_HANDLE CreateServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, LPCWSTR displayName,
+                                     DWORD desiredAccess, DWORD serviceType, DWORD startType, DWORD errorControl,
+                                     LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                                     LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password) = 0;
+    virtual BOOL CloseServiceHandle(SC_HANDLE hSCObject) = 0;
+    virtual BOOL QueryServiceStatusEx(SC_HANDLE hService, SC_STATUS_TYPE infoLevel, LPBYTE buffer,
+                                      DWORD bufSize, LPDWORD bytesNeeded) = 0;
+    virtual BOOL StartServiceW(SC_HANDLE hService, DWORD numServiceArgs, LPCWSTR* serviceArgVectors) = 0;
+    virtual BOOL ControlService(SC_HANDLE hService, DWORD control, LPSERVICE_STATUS serviceStatus) = 0;
+    virtual BOOL DeleteService(SC_HANDLE hService) = 0;
+    virtual BOOL QueryServiceConfigW(SC_HANDLE hService, LPQUERY_SERVICE_CONFIGW serviceConfig,
+                                     DWORD bufSize, LPDWORD bytesNeeded) = 0;
+    virtual BOOL ChangeServiceConfigW(SC_HANDLE hService, DWORD serviceType, DWORD startType, DWORD errorControl,
+                                      LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                                      LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password,
+                                      LPCWSTR displayName) = 0;
+    virtual BOOL QueryServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPBYTE buffer,
+                                      DWORD bufSize, LPDWORD bytesNeeded) = 0;
+    virtual BOOL ChangeServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPVOID info) = 0;
+    virtual BOOL EnumServicesStatusExW(SC_HANDLE hSCManager, SC_ENUM_TYPE infoLevel, DWORD serviceType,
+                                       DWORD serviceState, LPBYTE services, DWORD bufSize, LPDWORD bytesNeeded,
+                                       LPDWORD servicesReturned, LPDWORD resumeHandle, LPCWSTR groupName) = 0;
+    virtual BOOL EnumDependentServicesW(SC_HANDLE hService, DWORD serviceState, LPENUM_SERVICE_STATUSW services,
+                                        DWORD bufSize, LPDWORD bytesNeeded, LPDWORD servicesReturned) = 0;
+    // Notifications are delivered as APCs, so they arrive while the registering thread sits in an alertable SleepEx
+    virtual DWORD NotifyServiceStatusChangeW(SC_HANDLE hService, DWORD notifyMask, PSERVICE_NOTIFYW notifyBuffer) = 0;
+    virtual DWORD SleepEx(DWORD milliseconds, BOOL alertable) = 0;
+    // Host CPU time (idle, kernel including idle, user), for callers that pace themselves by load
+    virtual BOOL GetSystemTimes(LPFILETIME idleTime, LPFILETIME kernelTime, LPFILETIME userTime) = 0;
+};
+
+#ifdef _WIN32
+// Backend that forwards every call to advapi32
+class Win32ScmBackend : public ScmBackend {
+public:
+    SC_HANDLE OpenSCManagerW(LPCWSTR machineName, LPCWSTR databaseName, DWORD desiredAccess) override {
+        return ::OpenSCManagerW(machineName, databaseName, desiredAccess);
     }
-    if (serviceType & SERVICE_INTERACTIVE_PROCESS) {
-        result += L" | SERVICE_INTERACTIVE_PROCESS";
+
+    SC_HANDLE OpenServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, DWORD desiredAccess) override {
+        return ::OpenServiceW(hSCManager, serviceName, desiredAccess);
     }
 
-    // If no specific service type matches, display the numeric value
-    if (result == L"Unknown") {
-        result = std::to_wstring(serviceType);
+    SC_HANDLE CreateServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, LPCWSTR displayName,
+                             DWORD desiredAccess, DWORD serviceType, DWORD startType, DWORD errorControl,
+                             LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                             LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password) override {
+        return ::CreateServiceW(hSCManager, serviceName, displayName, desiredAccess, serviceType, startType,
+                                errorControl, binaryPathName, loadOrderGroup, tagId, dependencies,
+                                serviceStartName, password);
     }
 
-    return result;
-}
+    BOOL CloseServiceHandle(SC_HANDLE hSCObject) override {
+        return ::CloseServiceHandle(hSCObject);
+    }
 
-// Queries the status of a service and prints relevant information
-void QueryServiceStatus(const std::wstring& serviceName) {
-    // Open the Service Control Manager
-    SC_HANDLE hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
-    if (!hSCManager) {
-        PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", GetLastError());
-        return;
+    BOOL QueryServiceStatusEx(SC_HANDLE hService, SC_STATUS_TYPE infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        return ::QueryServiceStatusEx(hService, infoLevel, buffer, bufSize, bytesNeeded);
     }
 
-    // Open the specified service
-    SC_HANDLE hService = OpenServiceW(hSCManager, serviceName.c_str(), SERVICE_QUERY_STATUS);
-    if (!hService) {
-        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", GetLastError());
-        CloseServiceHandle(hSCManager);
-        return;
+    BOOL StartServiceW(SC_HANDLE hService, DWORD numServiceArgs, LPCWSTR* serviceArgVectors) override {
+        return ::StartServiceW(hService, numServiceArgs, serviceArgVectors);
     }
 
-    // Query the service status
-    SERVICE_STATUS_PROCESS ssp;
-    DWORD bytesNeeded;
-    if (QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp, sizeof(ssp), &bytesNeeded)) {
-        std::wcout << L"[SC_CLONE] SERVICE_NAME: " << serviceName << std::endl;
-        std::wcout << L"        TYPE               : " << ServiceTypeToString(ssp.dwServiceType) << std::endl;
-        std::wcout << L"        STATE              : " << ((ssp.dwCurrentState == SERVICE_RUNNING) ? L"RUNNING" :
-                                                            (ssp.dwCurrentState == SERVICE_STOPPED) ? L"STOPPED" :
-                                                            (ssp.dwCurrentState == SERVICE_PAUSED) ? L"PAUSED" : L"UNKNOWN") << std::endl;
-    } else {
-        PrintErrorMessage(L"[SC_CLONE] QueryServiceStatus failed with error code: ", GetLastError());
+    BOOL ControlService(SC_HANDLE hService, DWORD control, LPSERVICE_STATUS serviceStatus) override {
+        return ::ControlService(hService, control, serviceStatus);
     }
 
-    // Close handles
-    CloseServiceHandle(hService);
-    CloseServiceHandle(hSCManager);
-}
+    BOOL DeleteService(SC_HANDLE hService) override {
+        return ::DeleteService(hService);
+    }
 
-// Creates a new service entry in the Service Control Manager
-void CreateServiceEntry(const std::wstring& serviceName, const std::wstring& executablePath) {
-    SC_HANDLE hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
-    if (!hSCManager) {
-        PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", GetLastError());
-        return;
+    BOOL QueryServiceConfigW(SC_HANDLE hService, LPQUERY_SERVICE_CONFIGW serviceConfig,
+                             DWORD bufSize, LPDWORD bytesNeeded) override {
+        return ::QueryServiceConfigW(hService, serviceConfig, bufSize, bytesNeeded);
     }
 
-    // Create the service
-    SC_HANDLE hService = CreateServiceW(
-        hSCManager, 
-        serviceName.c_str(),
-        serviceName.c_str(),
-        SERVICE_ALL_ACCESS, 
-        SERVICE_WIN32_OWN_PROCESS,
-        SERVICE_AUTO_START,
-        SERVICE_ERROR_NORMAL,
-        executablePath.c_str(),
-        NULL, 
-        NULL, 
-        NULL, 
-        NULL, 
-        NULL
-    );
+    BOOL ChangeServiceConfigW(SC_HANDLE hService, DWORD serviceType, DWORD startType, DWORD errorControl,
+                              LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                              LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password,
+                              LPCWSTR displayName) override {
+        return ::ChangeServiceConfigW(hService, serviceType, startType, errorControl, binaryPathName,
+                                      loadOrderGroup, tagId, dependencies, serviceStartName, password,
+                                      displayName);
+    }
 
-    if (!hService) {
-        PrintErrorMessage(L"[SC_CLONE] CreateService failed with error code: ", GetLastError());
-        return;
+    BOOL QueryServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        return ::QueryServiceConfig2W(hService, infoLevel, buffer, bufSize, bytesNeeded);
     }
 
-    // Confirm service creation
-    std::wcout << L"[SC_CLONE] Service " << serviceName << L" created successfully." << std::endl;
-    
-    // Close handles
-    CloseServiceHandle(hService);
-    CloseServiceHandle(hSCManager);
-}
+    BOOL ChangeServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPVOID info) override {
+        return ::ChangeServiceConfig2W(hService, infoLevel, info);
+    }
 
-// Starts a service entry
-void StartServiceEntry(const std::wstring& serviceName) {
-    SC_HANDLE hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!hSCManager) {
-        PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", GetLastError());
-        return;
+    BOOL EnumServicesStatusExW(SC_HANDLE hSCManager, SC_ENUM_TYPE infoLevel, DWORD serviceType,
+                               DWORD serviceState, LPBYTE services, DWORD bufSize, LPDWORD bytesNeeded,
+                               LPDWORD servicesReturned, LPDWORD resumeHandle, LPCWSTR groupName) override {
+        return ::EnumServicesStatusExW(hSCManager, infoLevel, serviceType, serviceState, services, bufSize,
+                                       bytesNeeded, servicesReturned, resumeHandle, groupName);
     }
 
-    // Open the specified service for starting
-    SC_HANDLE hService = OpenService(hSCManager, serviceName.c_str(), SERVICE_START);
-    if (!hService) {
-        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", GetLastError());
-        CloseServiceHandle(hSCManager);
-        return;
+    BOOL EnumDependentServicesW(SC_HANDLE hService, DWORD serviceState, LPENUM_SERVICE_STATUSW services,
+                                DWORD bufSize, LPDWORD bytesNeeded, LPDWORD servicesReturned) override {
+        return ::EnumDependentServicesW(hService, serviceState, services, bufSize, bytesNeeded, servicesReturned);
     }
 
-    // Attempt to start the service
-    if (StartService(hService, 0, NULL)) {
-        std::wcout << L"[SC_CLONE] StartService SUCCESS" << std::endl;
-    } else {
-        PrintErrorMessage(L"[SC_CLONE] StartService failed with error code: ", GetLastError());
+    DWORD NotifyServiceStatusChangeW(SC_HANDLE hService, DWORD notifyMask, PSERVICE_NOTIFYW notifyBuffer) override {
+        return ::NotifyServiceStatusChangeW(hService, notifyMask, notifyBuffer);
     }
 
-    // Close handles
-    CloseServiceHandle(hService);
-    CloseServiceHandle(hSCManager);
-}
+    DWORD SleepEx(DWORD milliseconds, BOOL alertable) override {
+        return ::SleepEx(milliseconds, alertable);
+    }
 
-// Stops a service entry
-void StopServiceEntry(const std::wstring& serviceName) {
-    SC_HANDLE hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!hSCManager) {
-        PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", GetLastError());
-        return;
+    BOOL GetSystemTimes(LPFILETIME idleTime, LPFILETIME kernelTime, LPFILETIME userTime) override {
+        return ::GetSystemTimes(idleTime, kernelTime, userTime);
     }
+};
+#endif
 
-    // Open the specified service for stopping
-    SC_HANDLE hService = OpenService(hSCManager, serviceName.c_str(), SERVICE_STOP);
-    if (!hService) {
-        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", GetLastError());
-        CloseServiceHandle(hSCManager);
-        return;
+// A service held by the in-memory backend
+struct MemoryService {
+    std::wstring name;
+    std::wstring displayName;
+    std::wstring binaryPath;
+    std::wstring loadOrderGroup;
+    std::vector<std::wstring> dependencies;
+    std::wstring startName;
+    std::wstring description;
+    DWORD serviceType = SERVICE_WIN32_OWN_PROCESS;
+    DWORD startType = SERVICE_DEMAND_START;
+    DWORD errorControl = SERVICE_ERROR_NORMAL;
+    DWORD tagId = 0;
+    SERVICE_STATUS_PROCESS status = {};
+
+    DWORD resetPeriod = 0;
+    std::wstring rebootMsg;
+    std::wstring failureCommand;
+    std::vector<SC_ACTION> failureActions;
+    BOOL failureActionsOnNonCrash = FALSE;
+
+    // Simulated transition times; zero makes start/stop complete immediately
+    DWORD startDelayMs = 0;
+    DWORD stopDelayMs = 0;
+    std::chrono::steady_clock::time_point transitionStarted;
+    // Under a resource model, the start's share of the host: startDelayMs of work, drained at the shared rate
+    bool sharesResources = false;
+    double workLeftMs = 0;
+
+    bool markedForDelete = false;
+    DWORD openHandles = 0;
+};
+
+// An SC_HANDLE issued by the in-memory backend
+struct MemoryHandle {
+    bool isManager = false;
+    std::wstring serviceKey;
+    DWORD access = 0;
+    DWORD latencyMs = 0;  // simulated round trip of the host the handle belongs to
+    size_t scmEventCursor = 0;  // SCM handles: first created/deleted event not yet reported to this client
+};
+
+// One step of a fixture's event script: at atMs after loading, apply action to a service, or with count > 0
+// to the services prefix0001..prefixNNNN all at once
+struct MemoryScriptStep {
+    DWORD atMs = 0;
+    std::wstring action;  // start, stop, create or delete
+    std::wstring target;
+    size_t count = 0;
+};
+
+// Simulated network behaviour of a (remote) host in the in-memory backend
+struct MemoryHostProfile {
+    DWORD latencyMs = 0;
+    bool unreachable = false;
+};
+
+// Simulated CPU of the in-memory backend's host, shared by the services that are starting
+struct MemoryResourceModel {
+    double cores = 0;        // zero leaves every transition on its own timer
+    double contention = 0;   // capacity lost to thrashing per start beyond the core count, as a fraction of the cores
+    DWORD timeoutMs = 0;     // a start still pending after this long fails with ERROR_SERVICE_REQUEST_TIMEOUT
+    std::chrono::steady_clock::time_point epoch;
+    double clockMs = 0;      // how far the model has been run, in ms since epoch
+    double busyMs = 0;       // core-milliseconds spent starting services
+    std::vector<std::wstring> starting;
+};
+
+// Splits a '/'-separated dependency list (the sc.exe "depend=" syntax) into service names
+std::vector<std::wstring> SplitDependencies(const std::wstring& list) {
+    std::vector<std::wstring> names;
+    std::wstringstream ss(list);
+    std::wstring token;
+    while (std::getline(ss, token, L'/')) {
+        if (!token.empty()) {
+            names.push_back(token);
+        }
+    }
+    return names;
+}
+
+// Copies a string (including embedded NULs) into an output buffer and advances the cursor
+LPWSTR Pack(wchar_t*& cursor, const std::wstring& text) {
+    LPWSTR start = cursor;
+    std::copy(text.begin(), text.end(), cursor);
+    cursor += text.size();
+    *cursor++ = L'\0';
+    return start;
+}
+
+// Lays out a service's QUERY_SERVICE_CONFIGW the way advapi32 does: the struct, then its strings
+BOOL PackServiceConfig(const MemoryService& service, LPQUERY_SERVICE_CONFIGW serviceConfig, DWORD bufSize, LPDWORD bytesNeeded) {
+    std::wstring dependencies;
+    for (const auto& dependency : service.dependencies) {
+        dependencies += dependency;
+        dependencies += L'\0';
     }
 
-    // Attempt to stop the service
-    SERVICE_STATUS status;
-    if (ControlService(hService, SERVICE_CONTROL_STOP, &status)) {
-        std::wcout << L"[SC_CLONE] ControlService SUCCESS" << std::endl;
-    } else {
-        PrintErrorMessage(L"[SC_CLONE] ControlService failed with error code: ", GetLastError());
+    DWORD required = sizeof(QUERY_SERVICE_CONFIGW) + static_cast<DWORD>(sizeof(wchar_t) * (
+                         service.binaryPath.size() + 1 + service.loadOrderGroup.size() + 1 +
+                         dependencies.size() + 1 + service.startName.size() + 1 +
+                         service.displayName.size() + 1));
+    *bytesNeeded = required;
+    if (!serviceConfig || bufSize < required) {
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return FALSE;
     }
 
-    // Close handles
-    CloseServiceHandle(hService);
-    CloseServiceHandle(hSCManager);
+    wchar_t* cursor = reinterpret_cast<wchar_t*>(serviceConfig + 1);
+    serviceConfig->dwServiceType = service.serviceType;
+    serviceConfig->dwStartType = service.startType;
+    serviceConfig->dwErrorControl = service.errorControl;
+    serviceConfig->dwTagId = service.tagId;
+    serviceConfig->lpBinaryPathName = Pack(cursor, service.binaryPath);
+    serviceConfig->lpLoadOrderGroup = Pack(cursor, service.loadOrderGroup);
+    serviceConfig->lpDependencies = Pack(cursor, dependencies);
+    serviceConfig->lpServiceStartName = Pack(cursor, service.startName);
+    serviceConfig->lpDisplayName = Pack(cursor, service.displayName);
+    return TRUE;
 }
 
-// Deletes a service entry from the Service Control Manager
-void DeleteServiceEntry(const std::wstring& serviceName) {
-    SC_HANDLE hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!hSCManager) {
-        PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", GetLastError());
-        return;
+// Lays out a QueryServiceConfig2W result (description, failure actions, failure-actions flag) for a service
+BOOL PackServiceConfig2(const MemoryService& service, DWORD infoLevel, LPBYTE buffer, DWORD bufSize, LPDWORD bytesNeeded) {
+    if (infoLevel == SERVICE_CONFIG_DESCRIPTION) {
+        DWORD required = sizeof(SERVICE_DESCRIPTIONW) +
+                         (service.description.empty() ? 0 : static_cast<DWORD>(sizeof(wchar_t) * (service.description.size() + 1)));
+        *bytesNeeded = required;
+        if (!buffer || bufSize < required) {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+        SERVICE_DESCRIPTIONW* info = reinterpret_cast<SERVICE_DESCRIPTIONW*>(buffer);
+        wchar_t* cursor = reinterpret_cast<wchar_t*>(info + 1);
+        info->lpDescription = service.description.empty() ? nullptr : Pack(cursor, service.description);
+        return TRUE;
     }
 
-    // Open the specified service for deletion
-    SC_HANDLE hService = OpenService(hSCManager, serviceName.c_str(), DELETE);
-    if (!hService) {
-        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", GetLastError());
-        CloseServiceHandle(hSCManager);
-        return;
+    if (infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS) {
+        DWORD required = sizeof(SERVICE_FAILURE_ACTIONSW) +
+                         static_cast<DWORD>(sizeof(SC_ACTION) * service.failureActions.size());
+        if (!service.rebootMsg.empty()) {
+            required += static_cast<DWORD>(sizeof(wchar_t) * (service.rebootMsg.size() + 1));
+        }
+        if (!service.failureCommand.empty()) {
+            required += static_cast<DWORD>(sizeof(wchar_t) * (service.failureCommand.size() + 1));
+        }
+        *bytesNeeded = required;
+        if (!buffer || bufSize < required) {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+
+        SERVICE_FAILURE_ACTIONSW* info = reinterpret_cast<SERVICE_FAILURE_ACTIONSW*>(buffer);
+        SC_ACTION* actions = reinterpret_cast<SC_ACTION*>(info + 1);
+        std::copy(service.failureActions.begin(), service.failureActions.end(), actions);
+        wchar_t* cursor = reinterpret_cast<wchar_t*>(actions + service.failureActions.size());
+        info->dwResetPeriod = service.resetPeriod;
+        info->cActions = static_cast<DWORD>(service.failureActions.size());
+        info->lpsaActions = service.failureActions.empty() ? nullptr : actions;
+        info->lpRebootMsg = service.rebootMsg.empty() ? nullptr : Pack(cursor, service.rebootMsg);
+        info->lpCommand = service.failureCommand.empty() ? nullptr : Pack(cursor, service.failureCommand);
+        return TRUE;
     }
 
-    // Attempt to delete the service
-    if (DeleteService(hService)) {
-        std::wcout << L"[SC_CLONE] DeleteService SUCCESS" << std::endl;
-    } else {
-        PrintErrorMessage(L"[SC_CLONE] DeleteService failed with error code: ", GetLastError());
+    if (infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS_FLAG) {
+        *bytesNeeded = sizeof(SERVICE_FAILURE_ACTIONS_FLAG);
+        if (!buffer || bufSize < sizeof(SERVICE_FAILURE_ACTIONS_FLAG)) {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+        reinterpret_cast<SERVICE_FAILURE_ACTIONS_FLAG*>(buffer)->fFailureActionsOnNonCrashFailures =
+            service.failureActionsOnNonCrash;
+        return TRUE;
     }
 
-    // Close handles
-    CloseServiceHandle(hService);
-    CloseServiceHandle(hSCManager);
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
 }
 
-// Configures the service (set start type, etc.)
-void ConfigureService(const std::wstring& serviceName, const std::wstring& startType = L"") {
-    SC_HANDLE hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
-    if (!hSCManager) {
-        PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", GetLastError());
-        return;
+// In-memory stand-in for the Service Control Manager, used for testing and on non-Windows hosts.
+// It honours access masks, buffer sizing and delete-pending semantics the way advapi32 does.
+class MemoryScmBackend : public ScmBackend {
+public:
+    // Adds or replaces a service
+    void AddService(const MemoryService& service) {
+        std::lock_guard<std::mutex> lock(mutex);
+        AddServiceLocked(service);
     }
 
-    // Open the specified service for configuration
-    SC_HANDLE hService = OpenServiceW(hSCManager, serviceName.c_str(), SERVICE_QUERY_CONFIG | SERVICE_CHANGE_CONFIG);
-    if (!hService) {
-        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", GetLastError());
-        CloseServiceHandle(hSCManager);
-        return;
+    void AddServiceLocked(const MemoryService& service) {
+        enumCursorValid = false;
+        MemoryService& entry = services[ToLower(service.name)] = service;
+        if (entry.displayName.empty()) {
+            entry.displayName = entry.name;
+        }
+        entry.status.dwServiceType = entry.serviceType;
+        if (entry.status.dwCurrentState == 0) {
+            entry.status.dwCurrentState = SERVICE_STOPPED;
+        }
+        if (entry.status.dwCurrentState == SERVICE_RUNNING) {
+            entry.status.dwProcessId = nextProcessId++;
+            entry.status.dwControlsAccepted = SERVICE_ACCEPT_STOP;
+        }
     }
 
-    // If no startType specified, just query and display service configuration
-    if (startType.empty()) {
-        DWORD bytesNeeded = 0;
-        QueryServiceConfigW(hService, NULL, 0, &bytesNeeded);  // Get required buffer size
-
-        LPQUERY_SERVICE_CONFIGW pServiceConfig = (LPQUERY_SERVICE_CONFIGW)LocalAlloc(LPTR, bytesNeeded);
-        if (!pServiceConfig) {
-            std::wcerr << L"[SC_CLONE] Memory allocation failed." << std::endl;
-            CloseServiceHandle(hService);
-            CloseServiceHandle(hSCManager);
-            return;
+    ~MemoryScmBackend() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            scriptStopping = true;
+        }
+        changed.notify_all();
+        if (scriptThread.joinable()) {
+            scriptThread.join();
+        }
+        for (auto& handle : handles) {
+            delete handle.second;
         }
+    }
 
-        // Query and display service configuration
-        if (QueryServiceConfigW(hService, pServiceConfig, bytesNeeded, &bytesNeeded)) {
-            std::wcout << L"[SC_CLONE] Service Configuration for: " << serviceName << std::endl;
-            std::wcout << L"        BINARY_PATH_NAME    : " << (pServiceConfig->lpBinaryPathName ? pServiceConfig->lpBinaryPathName : L"(None)") << std::endl;
-            std::wcout << L"        START_TYPE          : " << pServiceConfig->dwStartType << std::endl;
-            std::wcout << L"        ERROR_CONTROL       : " << pServiceConfig->dwErrorControl << std::endl;
-            std::wcout << L"        SERVICE_DEPENDENCIES: " << (pServiceConfig->lpDependencies ? pServiceConfig->lpDependencies : L"(None)") << std::endl;
-            std::wcout << L"        SERVICE_START_NAME  : " << (pServiceConfig->lpServiceStartName ? pServiceConfig->lpServiceStartName : L"(None)") << std::endl;
-        } else {
-            PrintErrorMessage(L"[SC_CLONE] QueryServiceConfigW failed with error code: ", GetLastError());
-        }
-
-        LocalFree(pServiceConfig);
-    } 
-    else { 
-        // Determine start type based on user input
-        DWORD dwStartType = SERVICE_NO_CHANGE;
-        if (startType == L"auto") {
-            dwStartType = SERVICE_AUTO_START;
-        } else if (startType == L"manual") {
-            dwStartType = SERVICE_DEMAND_START;
-        } else if (startType == L"disabled") {
-            dwStartType = SERVICE_DISABLED;
-        } else {
-            std::wcerr << L"[SC_CLONE] Invalid start type: " << startType << L". Use 'automatic', 'manual', or 'disabled'." << std::endl;
-            CloseServiceHandle(hService);
-            CloseServiceHandle(hSCManager);
-            return;
+    // Loads services from a fixture file: one service per line, "<name> key=value ..."
+    // Keys: display, type, start, error, path, group, depend, obj, description, state,
+    // delay/startdelay/stopdelay (simulated transition time in ms). '#' starts a comment.
+    // Lines starting with '@' are backend directives rather than services.
+    bool LoadFixture(const std::wstring& path) {
+        std::ifstream file{std::filesystem::path(path)};
+        if (!file) {
+            return false;
         }
 
-        // Apply the configuration change
-        std::wcout << L"[SC_CLONE] Updating service start type to: " << startType << std::endl;
-        if (!ChangeServiceConfigW(hService, 
-                                  SERVICE_NO_CHANGE, 
-                                  dwStartType, 
-                                  SERVICE_ERROR_NORMAL,
-                                  NULL, NULL, NULL, NULL, NULL, NULL, NULL)) {
-            PrintErrorMessage(L"[SC_CLONE] ChangeServiceConfigW failed with error code: ", GetLastError());
-        } else {
-            std::wcout << L"[SC_CLONE] Service start type successfully changed to: " << startType << std::endl;
+        std::string rawLine;
+        while (std::getline(file, rawLine)) {
+            std::vector<std::wstring> fields = SplitCommandLine(Utf8ToWide(rawLine));
+            if (fields.empty() || fields[0][0] == L'#') {
+                continue;
+            }
+            // "@notify off" makes NotifyServiceStatusChangeW unavailable, as on systems that predate it
+            if (fields[0] == L"@notify") {
+                notificationsEnabled = !(fields.size() > 1 && fields[1] == L"off");
+                continue;
+            }
+            // "@host <name|*> [latency=ms] [unreachable]" shapes the simulated network of a remote host
+            if (fields[0] == L"@host" && fields.size() > 1) {
+                MemoryHostProfile& profile = hostProfiles[ToLower(fields[1])];
+                for (size_t i = 2; i < fields.size(); ++i) {
+                    if (fields[i].compare(0, 8, L"latency=") == 0) {
+                        profile.latencyMs = static_cast<DWORD>(std::wcstoul(fields[i].c_str() + 8, nullptr, 10));
+                    } else if (fields[i] == L"unreachable") {
+                        profile.unreachable = true;
+                    }
+                }
+                continue;
+            }
+            // "@resources cores=N [contention=F] [timeout=ms]" makes starting services share N cores (see AdvanceResources)
+            if (fields[0] == L"@resources") {
+                double cores = 1;
+                double contention = 0;
+                DWORD timeoutMs = 0;
+                for (size_t i = 1; i < fields.size(); ++i) {
+                    if (fields[i].compare(0, 6, L"cores=") == 0) {
+                        cores = std::wcstod(fields[i].c_str() + 6, nullptr);
+                    } else if (fields[i].compare(0, 11, L"contention=") == 0) {
+                        contention = std::wcstod(fields[i].c_str() + 11, nullptr);
+                    } else if (fields[i].compare(0, 8, L"timeout=") == 0) {
+                        timeoutMs = static_cast<DWORD>(std::wcstoul(fields[i].c_str() + 8, nullptr, 10));
+                    }
+                }
+                SetResourceModel(cores, contention, timeoutMs);
+                continue;
+            }
+            // "@script <ms> <start|stop|create|delete> <name> [count=N]" replays an event (or a burst over
+            // name0001..nameNNNN) at a fixed time after loading; steps at 0 ms are applied immediately
+            if (fields[0] == L"@script" && fields.size() > 3) {
+                MemoryScriptStep step;
+                step.atMs = static_cast<DWORD>(std::wcstoul(fields[1].c_str(), nullptr, 10));
+                step.action = ToLower(fields[2]);
+                step.target = fields[3];
+                if (fields.size() > 4 && fields[4].compare(0, 6, L"count=") == 0) {
+                    step.count = static_cast<size_t>(std::wcstoull(fields[4].c_str() + 6, nullptr, 10));
+                }
+                script.push_back(step);
+                continue;
+            }
+
+            MemoryService service;
+            service.name = fields[0];
+            for (size_t i = 1; i < fields.size(); ++i) {
+                size_t eq = fields[i].find(L'=');
+                if (eq == std::wstring::npos) {
+                    continue;
+                }
+                std::wstring key = ToLower(fields[i].substr(0, eq));
+                std::wstring value = fields[i].substr(eq + 1);
+                if (key == L"display") {
+                    service.displayName = value;
+                } else if (key == L"type") {
+                    service.serviceType = value == L"share" ? SERVICE_WIN32_SHARE_PROCESS :
+                                          value == L"kernel" ? SERVICE_KERNEL_DRIVER :
+                                          value == L"filesys" ? SERVICE_FILE_SYSTEM_DRIVER :
+                                          value == L"own" ? SERVICE_WIN32_OWN_PROCESS :
+                                          static_cast<DWORD>(std::wcstoul(value.c_str(), nullptr, 0));
+                } else if (key == L"start") {
+                    service.startType = value == L"boot" ? SERVICE_BOOT_START :
+                                        value == L"system" ? SERVICE_SYSTEM_START :
+                                        value == L"auto" ? SERVICE_AUTO_START :
+                                        value == L"disabled" ? SERVICE_DISABLED : SERVICE_DEMAND_START;
+                } else if (key == L"error") {
+                    service.errorControl = value == L"ignore" ? SERVICE_ERROR_IGNORE :
+                                           value == L"severe" ? SERVICE_ERROR_SEVERE :
+                                           value == L"critical" ? SERVICE_ERROR_CRITICAL : SERVICE_ERROR_NORMAL;
+                } else if (key == L"path") {
+                    service.binaryPath = value;
+                } else if (key == L"group") {
+                    service.loadOrderGroup = value;
+                } else if (key == L"depend") {
+                    service.dependencies = SplitDependencies(value);
+                } else if (key == L"obj") {
+                    service.startName = value;
+                } else if (key == L"description") {
+                    service.description = value;
+                } else if (key == L"state") {
+                    service.status.dwCurrentState = value == L"running" ? SERVICE_RUNNING : SERVICE_STOPPED;
+                } else if (key == L"delay") {
+                    service.startDelayMs = service.stopDelayMs = static_cast<DWORD>(std::wcstoul(value.c_str(), nullptr, 10));
+                } else if (key == L"startdelay") {
+                    service.startDelayMs = static_cast<DWORD>(std::wcstoul(value.c_str(), nullptr, 10));
+                } else if (key == L"stopdelay") {
+                    service.stopDelayMs = static_cast<DWORD>(std::wcstoul(value.c_str(), nullptr, 10));
+                }
+            }
+            AddService(service);
         }
+
+        StartScript();
+        return true;
     }
 
-    // Close handles
-    CloseServiceHandle(hService);
-    CloseServiceHandle(hSCManager);
-}
+    // Turns NotifyServiceStatusChangeW support on or off (off forces callers onto their polling fallback)
+    void SetNotificationsEnabled(bool enabled) {
+        std::lock_guard<std::mutex> lock(mutex);
+        notificationsEnabled = enabled;
+    }
 
+    // Makes starts share the given number of cores from now on; zero cores turns the model off
+    void SetResourceModel(double cores, double contention, DWORD timeoutMs) {
+        std::lock_guard<std::mutex> lock(mutex);
+        resources = MemoryResourceModel();
+        resources.cores = std::max(0.0, cores);
+        resources.contention = std::max(0.0, contention);
+        resources.timeoutMs = timeoutMs;
+        resources.epoch = std::chrono::steady_clock::now();
+    }
 
-// Function to query and display the description and configuration details of a service
-void QueryServiceDescription(const std::wstring& serviceName) {
-    // Open the Service Control Manager (SCM) with the necessary access rights
-    SC_HANDLE hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_CONNECT);
-    if (!hSCManager) {
-        PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", GetLastError());
-        return;
+    // Adds count generated services ("svc000001", ...) with a mix of driver/Win32 types and running/stopped states
+    void AddSyntheticServices(size_t count) {
+        for (size_t i = 1; i <= count; ++i) {
+            wchar_t name[32];
+            std::swprintf(name, 32, L"svc%06zu", i);
+            MemoryService service;
+            service.name = name;
+            service.displayName = std::wstring(L"Synthetic Service ") + name;
+            service.binaryPath = std::wstring(L"C:\\Windows\\System32\\") + name + L".exe";
+            service.serviceType = (i % 5 == 0) ? SERVICE_KERNEL_DRIVER :
+                                  (i % 3 == 0) ? SERVICE_WIN32_SHARE_PROCESS : SERVICE_WIN32_OWN_PROCESS;
+            service.startType = (i % 2 == 0) ? SERVICE_AUTO_START : SERVICE_DEMAND_START;
+            service.status.dwCurrentState = (i % 2 == 0) ? SERVICE_RUNNING : SERVICE_STOPPED;
+            AddService(service);
+        }
     }
 
-    // Open the specified service to query its configuration details
-    SC_HANDLE hService = OpenServiceW(hSCManager, serviceName.c_str(), SERVICE_QUERY_CONFIG);
-    if (!hService) {
-        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", GetLastError());
-        CloseServiceHandle(hSCManager);
-        return;
+    SC_HANDLE OpenSCManagerW(LPCWSTR machineName, LPCWSTR, DWORD desiredAccess) override {
+        // Every host shares the one service database; only the simulated network differs
+        MemoryHostProfile profile = HostProfile(machineName);
+        if (profile.latencyMs) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(profile.latencyMs));
+        }
+        if (profile.unreachable) {
+            SetLastError(RPC_S_SERVER_UNAVAILABLE);
+            return NULL;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryHandle* handle = new MemoryHandle();
+        handle->isManager = true;
+        handle->access = desiredAccess;
+        handle->latencyMs = profile.latencyMs;
+        handle->scmEventCursor = scmEvents.size();
+        return Issue(handle);
     }
 
-    // First, query the size of the buffer required to store the service configuration
-    DWORD dwBytesNeeded = 0;
-    DWORD dwBufSize = 0;
-    QueryServiceConfigW(hService, NULL, 0, &dwBytesNeeded);
-    
-    // Allocate memory for the buffer that will hold the service configuration
-    dwBufSize = dwBytesNeeded;
-    LPQUERY_SERVICE_CONFIGW pServiceConfig = (LPQUERY_SERVICE_CONFIGW)malloc(dwBufSize);
-    
-    // Query the service configuration and display relevant information
-    if (QueryServiceConfigW(hService, pServiceConfig, dwBufSize, &dwBytesNeeded)) {
-        std::wcout << L"[SC_CLONE] SERVICE_NAME: " << serviceName << std::endl;
-        std::wcout << L"        DESCRIPTION       : " << pServiceConfig->lpDisplayName << std::endl;  // Service description
-        std::wcout << L"        SERVICE_TYPE      : " << pServiceConfig->dwServiceType << std::endl;   // Service type
-        std::wcout << L"        START_TYPE        : " << pServiceConfig->dwStartType << std::endl;    // Service start type
-        std::wcout << L"        ERROR_CONTROL     : " << pServiceConfig->dwErrorControl << std::endl; // Error control level
-        std::wcout << L"        BINARY_PATH_NAME  : " << pServiceConfig->lpBinaryPathName << std::endl; // Path to the service binary
-    } else {
-        PrintErrorMessage(L"[SC_CLONE] QueryServiceConfig failed with error code: ", GetLastError());
+    SC_HANDLE OpenServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, DWORD desiredAccess) override {
+        RoundTrip(hSCManager);
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryHandle* manager = Lookup(hSCManager, true, SC_MANAGER_CONNECT);
+        if (!manager) {
+            return NULL;
+        }
+        if (!serviceName || !*serviceName) {
+            SetLastError(ERROR_INVALID_NAME);
+            return NULL;
+        }
+
+        std::wstring key = ToLower(serviceName);
+        auto it = services.find(key);
+        if (it == services.end()) {
+            SetLastError(ERROR_SERVICE_DOES_NOT_EXIST);
+            return NULL;
+        }
+        if (it->second.markedForDelete) {
+            SetLastError(ERROR_SERVICE_MARKED_FOR_DELETE);
+            return NULL;
+        }
+
+        MemoryHandle* handle = new MemoryHandle();
+        handle->serviceKey = key;
+        handle->access = desiredAccess;
+        handle->latencyMs = manager->latencyMs;
+        it->second.openHandles++;
+        return Issue(handle);
     }
 
-    // Free the allocated memory for service configuration and close handles
-    free(pServiceConfig);
-    CloseServiceHandle(hService);
-    CloseServiceHandle(hSCManager);
-}
+    SC_HANDLE CreateServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, LPCWSTR displayName,
+                             DWORD desiredAccess, DWORD serviceType, DWORD startType, DWORD errorControl,
+                             LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                             LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR) override {
+        RoundTrip(hSCManager);
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryHandle* manager = Lookup(hSCManager, true, SC_MANAGER_CREATE_SERVICE);
+        if (!manager) {
+            return NULL;
+        }
+        if (!serviceName || !*serviceName || !binaryPathName || !*binaryPathName) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return NULL;
+        }
 
-// Function to configure service failure actions (like restart, reboot, or run command on failure)
-void ConfigureServiceFailure(const std::wstring& serviceName, const std::vector<std::wstring>& args) {
-    // Open the Service Control Manager (SCM) with full access rights
-    SC_HANDLE hSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
-    if (!hSCManager) {
-        PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", GetLastError());
-        return;
+        std::wstring key = ToLower(serviceName);
+        auto existing = services.find(key);
+        if (existing != services.end()) {
+            SetLastError(existing->second.markedForDelete ? ERROR_SERVICE_MARKED_FOR_DELETE : ERROR_SERVICE_EXISTS);
+            return NULL;
+        }
+
+        enumCursorValid = false;
+        MemoryService& service = services[key];
+        service.name = serviceName;
+        service.displayName = (displayName && *displayName) ? displayName : serviceName;
+        service.serviceType = serviceType;
+        service.startType = startType;
+        service.errorControl = errorControl;
+        service.binaryPath = binaryPathName;
+        service.loadOrderGroup = loadOrderGroup ? loadOrderGroup : L"";
+        service.dependencies = ParseMultiSz(dependencies);
+        service.startName = (serviceStartName && *serviceStartName) ? serviceStartName : L"LocalSystem";
+        service.status.dwServiceType = serviceType;
+        service.status.dwCurrentState = SERVICE_STOPPED;
+        if (tagId) {
+            *tagId = 0;
+        }
+        RecordScmEvent(true, service.name);
+
+        MemoryHandle* handle = new MemoryHandle();
+        handle->serviceKey = key;
+        handle->access = desiredAccess;
+        handle->latencyMs = manager->latencyMs;
+        service.openHandles++;
+        return Issue(handle);
     }
 
-    // Open the specified service to modify its failure actions
-    SC_HANDLE hService = OpenServiceW(hSCManager, serviceName.c_str(), SC_MANAGER_ALL_ACCESS);
-    if (!hService) {
-        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", GetLastError());
-        CloseServiceHandle(hSCManager);
-        return;
+    BOOL CloseServiceHandle(SC_HANDLE hSCObject) override {
+        RoundTrip(hSCObject);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = handles.find(hSCObject);
+        if (it == handles.end()) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return FALSE;
+        }
+
+        std::unique_ptr<MemoryHandle> handle(it->second);
+        handles.erase(it);
+        // Closing a handle cancels its outstanding notification without calling it back
+        subscriptions.erase(std::remove_if(subscriptions.begin(), subscriptions.end(),
+                                           [&](const MemorySubscription& sub) { return sub.handle == hSCObject; }),
+                            subscriptions.end());
+        if (!handle->isManager) {
+            auto service = services.find(handle->serviceKey);
+            if (service != services.end() && --service->second.openHandles == 0 && service->second.markedForDelete) {
+                RemoveService(service);
+            }
+        }
+        return TRUE;
     }
 
-    // Query the current service failure actions
-    SERVICE_FAILURE_ACTIONS failureActions = {};
-    DWORD bytesNeeded = 0;
-    if (QueryServiceConfig2W(hService, SERVICE_CONFIG_FAILURE_ACTIONS, reinterpret_cast<LPBYTE>(&failureActions), sizeof(failureActions), &bytesNeeded)) {
-        std::wcout << L"[SC_CLONE] Current failure actions for service: " << serviceName << std::endl;
-        std::wcout << L"    Reset period (in seconds): " << failureActions.dwResetPeriod << std::endl;
-
-        // If failure actions exist, display them
-        if (failureActions.cActions > 0) {
-            for (DWORD i = 0; i < failureActions.cActions; ++i) {
-                SC_ACTION action = failureActions.lpsaActions[i];
-                std::wcout << L"    Action " << i + 1 << L": ";
-                switch (action.Type) {
-                    case SC_ACTION_RESTART:
-                        std::wcout << L"Restart";
-                        break;
-                    case SC_ACTION_REBOOT:
-                        std::wcout << L"Reboot";
-                        break;
-                    case SC_ACTION_RUN_COMMAND:
-                        std::wcout << L"Run Command";
-                        break;
-                    default:
-                        std::wcout << L"Unknown action";
-                        break;
-                }
-                std::wcout << L" with delay: " << action.Delay << L" seconds." << std::endl;
+    BOOL QueryServiceStatusEx(SC_HANDLE hService, SC_STATUS_TYPE infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        RoundTrip(hService);
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryService* service = LookupService(hService, SERVICE_QUERY_STATUS);
+        if (!service) {
+            return FALSE;
+        }
+        if (infoLevel != SC_STATUS_PROCESS_INFO) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        *bytesNeeded = sizeof(SERVICE_STATUS_PROCESS);
+        if (!buffer || bufSize < sizeof(SERVICE_STATUS_PROCESS)) {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+        std::memcpy(buffer, &service->status, sizeof(SERVICE_STATUS_PROCESS));
+        return TRUE;
+    }
+
+    // Like the SCM, a start first brings up the stopped dependencies, deepest first, each one waited on until it
+    // runs; 1068 only when one is missing, disabled or fails to start.
+    BOOL StartServiceW(SC_HANDLE hService, DWORD, LPCWSTR*) override {
+        RoundTrip(hService);
+        std::unique_lock<std::mutex> lock(mutex);
+        MemoryService* service = LookupService(hService, SERVICE_START);
+        if (!service) {
+            return FALSE;
+        }
+        if (service->startType == SERVICE_DISABLED) {
+            SetLastError(ERROR_SERVICE_DISABLED);
+            return FALSE;
+        }
+        if (service->status.dwCurrentState != SERVICE_STOPPED) {
+            SetLastError(ERROR_SERVICE_ALREADY_RUNNING);
+            return FALSE;
+        }
+        std::set<std::wstring> visited = {ToLower(service->name)};
+        std::vector<std::wstring> chain;
+        if (!CollectDependencies(*service, visited, chain)) {
+            SetLastError(ERROR_SERVICE_DEPENDENCY_FAIL);
+            return FALSE;
+        }
+        for (const auto& key : chain) {
+            // Looked up again each time, since the lock is let go while waiting
+            auto it = services.find(key);
+            if (it != services.end() && Settle(it->second).dwCurrentState == SERVICE_STOPPED &&
+                it->second.startType != SERVICE_DISABLED) {
+                it->second.status.dwProcessId = nextProcessId++;
+                it->second.status.dwWin32ExitCode = ERROR_SUCCESS;
+                BeginTransition(it->second, SERVICE_START_PENDING, it->second.startDelayMs);
+            }
+            while (it != services.end() && Settle(it->second).dwCurrentState == SERVICE_START_PENDING) {
+                changed.wait_for(lock, std::chrono::milliseconds(10));
+                it = services.find(key);
+            }
+            if (it == services.end() || it->second.status.dwCurrentState != SERVICE_RUNNING) {
+                SetLastError(ERROR_SERVICE_DEPENDENCY_FAIL);
+                return FALSE;
             }
-        } else {
-            std::wcout << L"    No failure actions set." << std::endl;
         }
-    } else if (args.empty()) {
-        // If no failure actions are found and no arguments are provided, display a message
-        std::wcout << L"[SC_CLONE] No existing failure actions found or failed to query service failure actions." << std::endl;
-    } else {
-        // If arguments are provided, configure new failure actions based on the input
-        DWORD resetPeriod = 0;
-        std::vector<SC_ACTION> actions;
-        std::wstring rebootMsg;
-        std::wstring failureCommand;
-
-        // Parse arguments for reset period, action types, and any additional parameters
-        for (const auto& arg : args) {
-            if (arg.find(L"reset=") == 0) {
-                resetPeriod = std::stoi(arg.substr(6));  // Extract number after "reset="
-            } else if (arg.find(L"actions=") == 0) {
-                std::wstring actionList = arg.substr(8);
-                std::wstringstream ss(actionList);
-                std::wstring token;
-                while (std::getline(ss, token, L'/')) {
-                    SC_ACTION action = {};
-                    if (token == L"restart") {
-                        action.Type = SC_ACTION_RESTART;
-                    } else if (token == L"run") {
-                        action.Type = SC_ACTION_RUN_COMMAND;
-                    } else if (token == L"reboot") {
-                        action.Type = SC_ACTION_REBOOT;
-                    } else {
-                        action.Delay = std::stoi(token);  // Delay after action type
-                        if (!actions.empty()) {
-                            actions.back().Delay = action.Delay;
-                        }
-                        continue;
+        if (!chain.empty()) {
+            service = LookupService(hService, SERVICE_START);
+            if (!service) {
+                return FALSE;
+            }
+            if (service->status.dwCurrentState != SERVICE_STOPPED) {
+                SetLastError(ERROR_SERVICE_ALREADY_RUNNING);
+                return FALSE;
+            }
+        }
+
+        service->status.dwProcessId = nextProcessId++;
+        service->status.dwWin32ExitCode = ERROR_SUCCESS;
+        BeginTransition(*service, SERVICE_START_PENDING, service->startDelayMs);
+        return TRUE;
+    }
+
+    BOOL ControlService(SC_HANDLE hService, DWORD control, LPSERVICE_STATUS serviceStatus) override {
+        RoundTrip(hService);
+        std::lock_guard<std::mutex> lock(mutex);
+        DWORD required = (control == SERVICE_CONTROL_STOP) ? SERVICE_STOP :
+                         (control == SERVICE_CONTROL_INTERROGATE) ? SERVICE_INTERROGATE : SERVICE_PAUSE_CONTINUE;
+        MemoryService* service = LookupService(hService, required);
+        if (!service) {
+            return FALSE;
+        }
+
+        if (control == SERVICE_CONTROL_STOP) {
+            if (service->status.dwCurrentState == SERVICE_STOPPED) {
+                SetLastError(ERROR_SERVICE_NOT_ACTIVE);
+                return FALSE;
+            }
+            if (service->status.dwCurrentState == SERVICE_START_PENDING ||
+                service->status.dwCurrentState == SERVICE_STOP_PENDING) {
+                SetLastError(ERROR_SERVICE_CANNOT_ACCEPT_CTRL);
+                return FALSE;
+            }
+            std::wstring key = ToLower(service->name);
+            for (auto& other : services) {
+                if (Settle(other.second).dwCurrentState == SERVICE_STOPPED) {
+                    continue;
+                }
+                for (const auto& dependency : other.second.dependencies) {
+                    if (ToLower(dependency) == key) {
+                        SetLastError(ERROR_DEPENDENT_SERVICES_RUNNING);
+                        return FALSE;
                     }
-                    actions.push_back(action);
                 }
-            } else if (arg.find(L"reboot=") == 0) {
-                rebootMsg = arg.substr(7);  // Custom reboot message
-            } else if (arg.find(L"command=") == 0) {
-                failureCommand = arg.substr(8);  // Command to run upon failure
             }
+            BeginTransition(*service, SERVICE_STOP_PENDING, service->stopDelayMs);
+        } else if (control != SERVICE_CONTROL_INTERROGATE) {
+            SetLastError(ERROR_INVALID_SERVICE_CONTROL);
+            return FALSE;
         }
 
-        // Dynamically allocate memory for the new failure actions
-        SERVICE_FAILURE_ACTIONS newFailureActions = {};
-        newFailureActions.dwResetPeriod = resetPeriod;
-        newFailureActions.cActions = static_cast<DWORD>(actions.size());
-        newFailureActions.lpsaActions = actions.empty() ? nullptr : &actions[0];  // Points to actions vector
-        newFailureActions.lpRebootMsg = rebootMsg.empty() ? nullptr : const_cast<LPWSTR>(rebootMsg.c_str());
-        newFailureActions.lpCommand = failureCommand.empty() ? nullptr : const_cast<LPWSTR>(failureCommand.c_str());
+        if (serviceStatus) {
+            std::memcpy(serviceStatus, &service->status, sizeof(SERVICE_STATUS));
+        }
+        return TRUE;
+    }
 
-        // Apply the new failure actions to the service
-        if (ChangeServiceConfig2W(hService, SERVICE_CONFIG_FAILURE_ACTIONS, &newFailureActions)) {
-            std::wcout << L"[SC_CLONE] Service failure actions configured for: " << serviceName << std::endl;
-        } else {
-            PrintErrorMessage(L"[SC_CLONE] ChangeServiceConfig2 failed with error code: ", GetLastError());
+    BOOL DeleteService(SC_HANDLE hService) override {
+        RoundTrip(hService);
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryService* service = LookupService(hService, DELETE);
+        if (!service) {
+            return FALSE;
+        }
+        if (service->markedForDelete) {
+            SetLastError(ERROR_SERVICE_MARKED_FOR_DELETE);
+            return FALSE;
         }
+        // Like the real SCM, the entry goes away once the last handle to it is closed
+        service->markedForDelete = true;
+        changed.notify_all();
+        return TRUE;
     }
 
-    // Close service and SCM handles
-    CloseServiceHandle(hService);
-    CloseServiceHandle(hSCManager);
-}
+    BOOL QueryServiceConfigW(SC_HANDLE hService, LPQUERY_SERVICE_CONFIGW serviceConfig,
+                             DWORD bufSize, LPDWORD bytesNeeded) override {
+        RoundTrip(hService);
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryService* service = LookupService(hService, SERVICE_QUERY_CONFIG);
+        if (!service) {
+            return FALSE;
+        }
 
-// Main function which handles command-line arguments and invokes relevant service management functions
-int wmain(int argc, wchar_t* argv[]) {
-    // Ensure enough arguments are provided
-    if (argc < 3) {
-        std::wcerr << L"[SC_CLONE] Usage: sc_clone <command> <service_name> [options]" << std::endl;
-        return 1;
+        return PackServiceConfig(*service, serviceConfig, bufSize, bytesNeeded);
     }
-    
-    std::wstring command = argv[1];
-    std::wstring serviceName = argv[2];
-    
-    // Parse the command and invoke the corresponding function
-    if (command == L"query") {
-        QueryServiceStatus(serviceName);
-    } else if (command == L"create" && argc == 4) {
-        std::wstring executablePath = argv[3];
-        CreateServiceEntry(serviceName, executablePath);
-    } else if (command == L"start") {
-        StartServiceEntry(serviceName);
-    } else if (command == L"stop") {
-        StopServiceEntry(serviceName);
-    } else if (command == L"delete") {
-        DeleteServiceEntry(serviceName);
-    } else if (command == L"config") {
-        if (argc > 3) {
-            std::wstring startType = argv[3];
-            ConfigureService(serviceName, startType);
-        } else {
-            ConfigureService(serviceName);
+
+    BOOL ChangeServiceConfigW(SC_HANDLE hService, DWORD serviceType, DWORD startType, DWORD errorControl,
+                              LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                              LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR,
+                              LPCWSTR displayName) override {
+        RoundTrip(hService);
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryService* service = LookupService(hService, SERVICE_CHANGE_CONFIG);
+        if (!service) {
+            return FALSE;
         }
-    } else if (command == L"qdescription") {
-        QueryServiceDescription(serviceName);
-    } else if (command == L"failure") {
-        std::vector<std::wstring> failureArgs;
-        for (int i = 3; i < argc; ++i) {
-            failureArgs.push_back(argv[i]);
+        if (service->markedForDelete) {
+            SetLastError(ERROR_SERVICE_MARKED_FOR_DELETE);
+            return FALSE;
         }
 
-        ConfigureServiceFailure(serviceName, failureArgs);
-    } else {
-        std::wcerr << L"[SC_CLONE] Unsupported or incorrect command usage." << std::endl;
+        if (serviceType != SERVICE_NO_CHANGE) {
+            service->serviceType = serviceType;
+            service->status.dwServiceType = serviceType;
+        }
+        if (startType != SERVICE_NO_CHANGE) {
+            service->startType = startType;
+        }
+        if (errorControl != SERVICE_NO_CHANGE) {
+            service->errorControl = errorControl;
+        }
+        if (binaryPathName) {
+            service->binaryPath = binaryPathName;
+        }
+        if (loadOrderGroup) {
+            service->loadOrderGroup = loadOrderGroup;
+        }
+        if (tagId) {
+            *tagId = service->tagId;
+        }
+        if (dependencies) {
+            service->dependencies = ParseMultiSz(dependencies);
+        }
+        if (serviceStartName) {
+            service->startName = serviceStartName;
+        }
+        if (displayName) {
+            service->displayName = displayName;
+        }
+        return TRUE;
     }
-    
-    return 0;
+
+    BOOL QueryServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        RoundTrip(hService);
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryService* service = LookupService(hService, SERVICE_QUERY_CONFIG);
+        if (!service) {
+            return FALSE;
+        }
+
+        return PackServiceConfig2(*service, infoLevel, buffer, bufSize, bytesNeeded);
+    }
+
+    BOOL ChangeServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPVOID info) override {
+        RoundTrip(hService);
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryService* service = LookupService(hService, SERVICE_CHANGE_CONFIG);
+        if (!service) {
+            return FALSE;
+        }
+        if (!info) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+
+        if (infoLevel == SERVICE_CONFIG_DESCRIPTION) {
+            const SERVICE_DESCRIPTIONW* description = static_cast<const SERVICE_DESCRIPTIONW*>(info);
+            if (description->lpDescription) {
+                service->description = description->lpDescription;
+            }
+            return TRUE;
+        }
+
+        if (infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS) {
+            const SERVICE_FAILURE_ACTIONSW* failure = static_cast<const SERVICE_FAILURE_ACTIONSW*>(info);
+            // A NULL action array leaves both the actions and the reset period unchanged
+            if (failure->lpsaActions) {
+                service->resetPeriod = failure->dwResetPeriod;
+                service->failureActions.assign(failure->lpsaActions, failure->lpsaActions + failure->cActions);
+            }
+            if (failure->lpRebootMsg) {
+                service->rebootMsg = failure->lpRebootMsg;
+            }
+            if (failure->lpCommand) {
+                service->failureCommand = failure->lpCommand;
+            }
+            return TRUE;
+        }
+
+        if (infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS_FLAG) {
+            service->failureActionsOnNonCrash =
+                static_cast<const SERVICE_FAILURE_ACTIONS_FLAG*>(info)->fFailureActionsOnNonCrashFailures;
+            return TRUE;
+        }
+
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+
+    BOOL EnumServicesStatusExW(SC_HANDLE hSCManager, SC_ENUM_TYPE infoLevel, DWORD serviceType,
+                               DWORD serviceState, LPBYTE buffer, DWORD bufSize, LPDWORD bytesNeeded,
+                               LPDWORD servicesReturned, LPDWORD resumeHandle, LPCWSTR) override {
+        RoundTrip(hSCManager);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!Lookup(hSCManager, true, SC_MANAGER_ENUMERATE_SERVICE)) {
+            return FALSE;
+        }
+        if (infoLevel != SC_ENUM_PROCESS_INFO || !bytesNeeded || !servicesReturned ||
+            serviceState == 0 || (serviceState & ~SERVICE_STATE_ALL) != 0) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+
+        // The resume handle is the position in name order; remember the iterator so chunked
+        // enumeration of large databases stays linear instead of re-walking the map every call
+        DWORD position = resumeHandle ? *resumeHandle : 0;
+        auto it = (position == enumCursorPosition && enumCursorValid) ? enumCursor : std::next(services.begin(), std::min<size_t>(position, services.size()));
+
+        ENUM_SERVICE_STATUS_PROCESSW* entries = reinterpret_cast<ENUM_SERVICE_STATUS_PROCESSW*>(buffer);
+        LPBYTE stringEnd = buffer + bufSize;
+        DWORD returned = 0;
+        DWORD used = 0;
+        DWORD remaining = 0;
+        for (; it != services.end(); ++it, ++position) {
+            MemoryService& service = it->second;
+            Settle(service);
+            bool active = service.status.dwCurrentState != SERVICE_STOPPED;
+            if (!(service.serviceType & serviceType) ||
+                (active && !(serviceState & SERVICE_ACTIVE)) || (!active && !(serviceState & SERVICE_INACTIVE))) {
+                continue;
+            }
+
+            DWORD entrySize = static_cast<DWORD>(sizeof(ENUM_SERVICE_STATUS_PROCESSW) +
+                                                 sizeof(wchar_t) * (service.name.size() + 1 + service.displayName.size() + 1));
+            if (remaining == 0 && buffer && used + entrySize <= bufSize) {
+                // Fixed-size records grow from the front, strings from the back, as advapi32 lays them out
+                ENUM_SERVICE_STATUS_PROCESSW& entry = entries[returned++];
+                wchar_t* cursor = reinterpret_cast<wchar_t*>(stringEnd) - (service.name.size() + 1 + service.displayName.size() + 1);
+                stringEnd = reinterpret_cast<LPBYTE>(cursor);
+                entry.lpServiceName = Pack(cursor, service.name);
+                entry.lpDisplayName = Pack(cursor, service.displayName);
+                entry.ServiceStatusProcess = service.status;
+                used += entrySize;
+                continue;
+            }
+
+            if (remaining == 0) {
+                if (resumeHandle) {
+                    *resumeHandle = position;
+                }
+                enumCursor = it;
+                enumCursorPosition = position;
+                enumCursorValid = true;
+            }
+            // advapi32 totals the whole remainder; stopping once a buffer's worth is counted keeps
+            // chunked enumeration linear and still tells callers how far to grow
+            remaining += entrySize;
+            if (remaining >= bufSize) {
+                break;
+            }
+        }
+
+        *servicesReturned = returned;
+        *bytesNeeded = remaining;
+        if (remaining) {
+            SetLastError(ERROR_MORE_DATA);
+            return FALSE;
+        }
+        if (resumeHandle) {
+            *resumeHandle = 0;
+        }
+        enumCursorValid = false;
+        return TRUE;
+    }
+
+    BOOL EnumDependentServicesW(SC_HANDLE hService, DWORD serviceState, LPENUM_SERVICE_STATUSW buffer,
+                                DWORD bufSize, LPDWORD bytesNeeded, LPDWORD servicesReturned) override {
+        RoundTrip(hService);
+        std::lock_guard<std::mutex> lock(mutex);
+        MemoryService* service = LookupService(hService, SERVICE_ENUMERATE_DEPENDENTS);
+        if (!service) {
+            return FALSE;
+        }
+
+        std::set<std::wstring> visited;
+        std::vector<MemoryService*> dependents;
+        visited.insert(ToLower(service->name));
+        CollectDependents(ToLower(service->name), visited, dependents);
+
+        DWORD required = 0;
+        std::vector<MemoryService*> matching;
+        for (MemoryService* dependent : dependents) {
+            bool active = Settle(*dependent).dwCurrentState != SERVICE_STOPPED;
+            if ((active && (serviceState & SERVICE_ACTIVE)) || (!active && (serviceState & SERVICE_INACTIVE))) {
+                matching.push_back(dependent);
+                required += static_cast<DWORD>(sizeof(ENUM_SERVICE_STATUSW) +
+                                               sizeof(wchar_t) * (dependent->name.size() + 1 + dependent->displayName.size() + 1));
+            }
+        }
+
+        *bytesNeeded = required;
+        *servicesReturned = 0;
+        if (!buffer || bufSize < required) {
+            SetLastError(ERROR_MORE_DATA);
+            return FALSE;
+        }
+
+        wchar_t* cursor = reinterpret_cast<wchar_t*>(buffer + matching.size());
+        for (size_t i = 0; i < matching.size(); ++i) {
+            buffer[i].lpServiceName = Pack(cursor, matching[i]->name);
+            buffer[i].lpDisplayName = Pack(cursor, matching[i]->displayName);
+            std::memcpy(&buffer[i].ServiceStatus, &matching[i]->status, sizeof(SERVICE_STATUS));
+        }
+        *servicesReturned = static_cast<DWORD>(matching.size());
+        return TRUE;
+    }
+
+    DWORD NotifyServiceStatusChangeW(SC_HANDLE hService, DWORD notifyMask, PSERVICE_NOTIFYW notifyBuffer) override {
+        RoundTrip(hService);
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!notificationsEnabled) {
+            return ERROR_CALL_NOT_IMPLEMENTED;
+        }
+        if (!notifyBuffer || notifyBuffer->dwVersion != SERVICE_NOTIFY_STATUS_CHANGE || !notifyBuffer->pfnNotifyCallback) {
+            return ERROR_INVALID_PARAMETER;
+        }
+        // On an SCM handle only service creation and deletion can be watched
+        auto handle = handles.find(hService);
+        if (handle != handles.end() && handle->second->isManager) {
+            if (!Lookup(hService, true, SC_MANAGER_ENUMERATE_SERVICE)) {
+                return GetLastError();
+            }
+            if (!(notifyMask & (SERVICE_NOTIFY_CREATED | SERVICE_NOTIFY_DELETED)) ||
+                (notifyMask & ~(SERVICE_NOTIFY_CREATED | SERVICE_NOTIFY_DELETED))) {
+                return ERROR_INVALID_PARAMETER;
+            }
+            subscriptions.push_back(MemorySubscription{hService, L"", notifyMask, notifyBuffer, std::this_thread::get_id()});
+            return ERROR_SUCCESS;
+        }
+        if (!LookupService(hService, SERVICE_QUERY_STATUS)) {
+            return GetLastError();
+        }
+
+        subscriptions.push_back(MemorySubscription{hService, handles[hService]->serviceKey, notifyMask, notifyBuffer,
+                                                   std::this_thread::get_id()});
+        return ERROR_SUCCESS;
+    }
+
+    // Alertable waits deliver this thread's notifications whose condition holds, mimicking APC delivery.
+    // Pending transitions complete on their own schedule, so the wait ends at the earliest one due.
+    DWORD SleepEx(DWORD milliseconds, BOOL alertable) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        auto deadline = (milliseconds == INFINITE) ? std::chrono::steady_clock::time_point::max()
+                                                   : now + std::chrono::milliseconds(milliseconds);
+        for (;;) {
+            std::vector<PSERVICE_NOTIFYW> ready;
+            auto wakeAt = deadline;
+            if (alertable) {
+                CollectNotifications(ready, wakeAt);
+            }
+            if (!ready.empty()) {
+                lock.unlock();
+                for (PSERVICE_NOTIFYW notify : ready) {
+                    notify->pfnNotifyCallback(notify);
+                }
+                return WAIT_IO_COMPLETION;
+            }
+
+            if (std::chrono::steady_clock::now() >= deadline) {
+                return 0;
+            }
+            if (wakeAt == std::chrono::steady_clock::time_point::max()) {
+                changed.wait(lock);
+            } else {
+                changed.wait_until(lock, wakeAt);
+            }
+        }
+    }
+
+    // Reports the resource model's accounting: busy time is the core-time starts have used, the rest is idle
+    BOOL GetSystemTimes(LPFILETIME idleTime, LPFILETIME kernelTime, LPFILETIME userTime) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (resources.cores <= 0) {
+            SetLastError(ERROR_CALL_NOT_IMPLEMENTED);
+            return FALSE;
+        }
+        AdvanceResources();
+        auto store = [](LPFILETIME time, double ms) {
+            uint64_t ticks = static_cast<uint64_t>(ms * 10000);
+            if (time) {
+                time->dwLowDateTime = static_cast<DWORD>(ticks);
+                time->dwHighDateTime = static_cast<DWORD>(ticks >> 32);
+            }
+        };
+        double idleMs = std::max(0.0, resources.clockMs * resources.cores - resources.busyMs);
+        store(idleTime, idleMs);
+        store(kernelTime, idleMs);
+        store(userTime, resources.busyMs);
+        return TRUE;
+    }
+
+private:
+    // Looks up the simulated network of a machine ("" or NULL is the local host; "*" covers unlisted remote hosts)
+    MemoryHostProfile HostProfile(LPCWSTR machineName) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::wstring machine = machineName ? ToLower(machineName) : L"";
+        while (!machine.empty() && machine[0] == L'\\') {
+            machine.erase(0, 1);
+        }
+        auto it = hostProfiles.find(machine);
+        if (it == hostProfiles.end() && !machine.empty()) {
+            it = hostProfiles.find(L"*");
+        }
+        return it != hostProfiles.end() ? it->second : MemoryHostProfile();
+    }
+
+    // Sleeps for the simulated round trip of the host a handle belongs to, outside the backend lock
+    void RoundTrip(SC_HANDLE h) {
+        DWORD latencyMs = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = handles.find(h);
+            if (it != handles.end()) {
+                latencyMs = it->second->latencyMs;
+            }
+        }
+        if (latencyMs) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(latencyMs));
+        }
+    }
+
+    // A registered NotifyServiceStatusChangeW request; one-shot, like the real API
+    struct MemorySubscription {
+        SC_HANDLE handle;
+        std::wstring serviceKey;
+        DWORD mask;
+        PSERVICE_NOTIFYW notify;
+        std::thread::id owner;
+    };
+
+    // Moves the calling thread's satisfied subscriptions into ready, and lowers wakeAt to the
+    // moment the next pending transition of a still-waiting subscription completes
+    void CollectNotifications(std::vector<PSERVICE_NOTIFYW>& ready, std::chrono::steady_clock::time_point& wakeAt) {
+        std::thread::id self = std::this_thread::get_id();
+        for (auto it = subscriptions.begin(); it != subscriptions.end();) {
+            if (it->owner == self && it->serviceKey.empty()) {
+                if (CollectScmEvents(*it)) {
+                    ready.push_back(it->notify);
+                    it = subscriptions.erase(it);
+                } else {
+                    ++it;
+                }
+                continue;
+            }
+            auto service = services.find(it->serviceKey);
+            if (it->owner != self || service == services.end()) {
+                ++it;
+                continue;
+            }
+
+            MemoryService& entry = service->second;
+            const SERVICE_STATUS_PROCESS& status = Settle(entry);
+            DWORD triggered = StateNotifyBit(status.dwCurrentState) & it->mask;
+            if (!triggered && !entry.markedForDelete) {
+                if (entry.sharesResources && status.dwCurrentState == SERVICE_START_PENDING) {
+                    wakeAt = std::min(wakeAt, ProjectedStart(entry));
+                } else if (status.dwCurrentState == SERVICE_START_PENDING || status.dwCurrentState == SERVICE_STOP_PENDING) {
+                    DWORD delay = status.dwCurrentState == SERVICE_START_PENDING ? entry.startDelayMs : entry.stopDelayMs;
+                    wakeAt = std::min(wakeAt, entry.transitionStarted + std::chrono::milliseconds(delay));
+                }
+                ++it;
+                continue;
+            }
+
+            it->notify->dwNotificationStatus = entry.markedForDelete ? ERROR_SERVICE_MARKED_FOR_DELETE : ERROR_SUCCESS;
+            it->notify->pszServiceNames = nullptr;
+            it->notify->ServiceStatus = status;
+            it->notify->dwNotificationTriggered = entry.markedForDelete ? SERVICE_NOTIFY_DELETE_PENDING : triggered;
+            ready.push_back(it->notify);
+            it = subscriptions.erase(it);
+        }
+    }
+
+    // Completes an SCM-handle subscription if services were created or deleted since its client last heard.
+    // Like the real SCM, the names come back as one LocalAlloc'ed multi-string in which created services carry
+    // a '/' prefix and deleted ones none; the callback must LocalFree it.
+    bool CollectScmEvents(MemorySubscription& subscription) {
+        MemoryHandle* handle = handles[subscription.handle];
+        DWORD triggered = 0;
+        std::wstring names;
+        for (size_t i = handle->scmEventCursor; i < scmEvents.size(); ++i) {
+            DWORD bit = scmEvents[i].first ? SERVICE_NOTIFY_CREATED : SERVICE_NOTIFY_DELETED;
+            if (subscription.mask & bit) {
+                triggered |= bit;
+                if (scmEvents[i].first) {
+                    names += L'/';
+                }
+                names += scmEvents[i].second;
+                names += L'\0';
+            }
+        }
+        handle->scmEventCursor = scmEvents.size();
+        if (!triggered) {
+            return false;
+        }
+
+        wchar_t* list = static_cast<wchar_t*>(LocalAlloc(LPTR, (names.size() + 1) * sizeof(wchar_t)));
+        std::copy(names.begin(), names.end(), list);
+        subscription.notify->dwNotificationStatus = ERROR_SUCCESS;
+        subscription.notify->dwNotificationTriggered = triggered;
+        subscription.notify->pszServiceNames = list;
+        return true;
+    }
+
+    void RecordScmEvent(bool created, const std::wstring& name) {
+        scmEvents.emplace_back(created, name);
+        changed.notify_all();
+    }
+
+    // Drops a service from the database once it is deleted and unreferenced
+    void RemoveService(std::map<std::wstring, MemoryService>::iterator service) {
+        enumCursorValid = false;
+        RecordScmEvent(false, service->second.name);
+        services.erase(service);
+    }
+
+    // Applies the fixture's 0 ms script steps now and replays the rest on a background thread
+    void StartScript() {
+        std::stable_sort(script.begin(), script.end(), [](const MemoryScriptStep& a, const MemoryScriptStep& b) {
+            return a.atMs < b.atMs;
+        });
+        auto loaded = std::chrono::steady_clock::now();
+        size_t next = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (; next < script.size() && script[next].atMs == 0; ++next) {
+                ApplyScriptStep(script[next]);
+            }
+        }
+        if (next == script.size()) {
+            return;
+        }
+        scriptThread = std::thread([this, loaded, next]() {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (size_t i = next; i < script.size(); ++i) {
+                auto due = loaded + std::chrono::milliseconds(script[i].atMs);
+                if (changed.wait_until(lock, due, [&]() { return scriptStopping; })) {
+                    return;
+                }
+                ApplyScriptStep(script[i]);
+            }
+        });
+    }
+
+    // Applies one scripted step to all of its services under a single lock, so a burst lands all at once
+    void ApplyScriptStep(const MemoryScriptStep& step) {
+        std::vector<std::wstring> names;
+        if (step.count == 0) {
+            names.push_back(step.target);
+        }
+        for (size_t i = 1; i <= step.count; ++i) {
+            wchar_t suffix[16];
+            std::swprintf(suffix, 16, L"%04zu", i);
+            names.push_back(step.target + suffix);
+        }
+
+        for (const auto& name : names) {
+            auto it = services.find(ToLower(name));
+            if (step.action == L"create") {
+                if (it == services.end()) {
+                    MemoryService service;
+                    service.name = name;
+                    service.binaryPath = L"C:\\Windows\\System32\\" + name + L".exe";
+                    AddServiceLocked(service);
+                    RecordScmEvent(true, name);
+                }
+                continue;
+            }
+            if (it == services.end() || it->second.markedForDelete) {
+                continue;
+            }
+            MemoryService& service = it->second;
+            DWORD state = Settle(service).dwCurrentState;
+            if (step.action == L"start" && state == SERVICE_STOPPED) {
+                service.status.dwProcessId = nextProcessId++;
+                BeginTransition(service, SERVICE_START_PENDING, service.startDelayMs);
+            } else if (step.action == L"stop" && state == SERVICE_RUNNING) {
+                BeginTransition(service, SERVICE_STOP_PENDING, service.stopDelayMs);
+            } else if (step.action == L"delete") {
+                service.markedForDelete = true;
+                if (service.openHandles == 0) {
+                    RemoveService(it);
+                }
+            }
+        }
+        changed.notify_all();
+    }
+
+    // SERVICE_NOTIFY_* bit for a SERVICE_* current state
+    static DWORD StateNotifyBit(DWORD state) {
+        return (state >= SERVICE_STOPPED && state <= SERVICE_PAUSED) ? (1u << (state - 1)) : 0;
+    }
+
+    // Registers a new handle and returns it as an opaque SC_HANDLE
+    SC_HANDLE Issue(MemoryHandle* handle) {
+        SC_HANDLE result = reinterpret_cast<SC_HANDLE>(handle);
+        handles[result] = handle;
+        return result;
+    }
+
+    // Validates a handle's kind and access rights, setting the last error on failure
+    MemoryHandle* Lookup(SC_HANDLE h, bool wantManager, DWORD requiredAccess) {
+        auto it = handles.find(h);
+        if (it == handles.end() || it->second->isManager != wantManager) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return nullptr;
+        }
+        if ((it->second->access & requiredAccess) != requiredAccess) {
+            SetLastError(ERROR_ACCESS_DENIED);
+            return nullptr;
+        }
+        return it->second;
+    }
+
+    MemoryService* LookupService(SC_HANDLE h, DWORD requiredAccess) {
+        MemoryHandle* handle = Lookup(h, false, requiredAccess);
+        if (!handle) {
+            return nullptr;
+        }
+        auto it = services.find(handle->serviceKey);
+        if (it == services.end()) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return nullptr;
+        }
+        Settle(it->second);
+        return &it->second;
+    }
+
+    // Moves a service into a pending state that completes after delayMs (immediately when zero). Under a
+    // resource model a start is delayMs of work on a shared core instead, so it takes longer when others start too.
+    void BeginTransition(MemoryService& service, DWORD pendingState, DWORD delayMs) {
+        service.status.dwCurrentState = pendingState;
+        service.status.dwControlsAccepted = 0;
+        service.status.dwCheckPoint = 1;
+        service.status.dwWaitHint = delayMs + 100;
+        service.transitionStarted = std::chrono::steady_clock::now();
+        service.sharesResources = false;
+        if (pendingState == SERVICE_START_PENDING && resources.cores > 0 && delayMs > 0) {
+            AdvanceResources();
+            service.sharesResources = true;
+            service.workLeftMs = delayMs;
+            std::wstring key = ToLower(service.name);
+            if (std::find(resources.starting.begin(), resources.starting.end(), key) == resources.starting.end()) {
+                resources.starting.push_back(key);
+            }
+        }
+        if (delayMs == 0) {
+            Settle(service);
+        }
+        changed.notify_all();
+    }
+
+    // Runs the resource model up to now. The n services starting share the cores equally, none getting more
+    // than one, so each one's work drains at min(1, capacity / n) per ms. Beyond the core count they thrash (disk
+    // seeks, paging): capacity is cores / (1 + contention * (n - cores) / cores). The model steps from one completion
+    // or timeout to the next, since each changes n.
+    void AdvanceResources() {
+        double nowMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - resources.epoch).count();
+        std::vector<MemoryService*> starting;
+        while (resources.clockMs < nowMs) {
+            starting.clear();
+            for (const auto& key : resources.starting) {
+                auto it = services.find(key);
+                if (it != services.end() && it->second.sharesResources && it->second.status.dwCurrentState == SERVICE_START_PENDING) {
+                    starting.push_back(&it->second);
+                }
+            }
+            if (starting.empty()) {
+                resources.starting.clear();
+                resources.clockMs = nowMs;
+                break;
+            }
+
+            double active = static_cast<double>(starting.size());
+            double rate = std::min(1.0, ResourceCapacity(active) / active);
+            double step = nowMs - resources.clockMs;
+            for (MemoryService* service : starting) {
+                step = std::min(step, service->workLeftMs / rate);
+                if (resources.timeoutMs) {
+                    step = std::min(step, std::max(0.0, StartedMs(*service) + resources.timeoutMs - resources.clockMs));
+                }
+            }
+            resources.clockMs += step;
+            resources.busyMs += step * std::min(active, resources.cores);
+
+            bool settled = false;
+            for (MemoryService* service : starting) {
+                service->workLeftMs -= step * rate;
+                SERVICE_STATUS_PROCESS& status = service->status;
+                if (service->workLeftMs <= 1e-6) {
+                    status.dwCurrentState = SERVICE_RUNNING;
+                    status.dwControlsAccepted = SERVICE_ACCEPT_STOP;
+                } else if (resources.timeoutMs && resources.clockMs >= StartedMs(*service) + resources.timeoutMs) {
+                    status.dwCurrentState = SERVICE_STOPPED;
+                    status.dwControlsAccepted = 0;
+                    status.dwWin32ExitCode = ERROR_SERVICE_REQUEST_TIMEOUT;
+                    status.dwProcessId = 0;
+                } else {
+                    continue;
+                }
+                status.dwCheckPoint = 0;
+                status.dwWaitHint = 0;
+                service->sharesResources = false;
+                settled = true;
+            }
+            if (settled) {
+                resources.starting.erase(std::remove_if(resources.starting.begin(), resources.starting.end(), [&](const std::wstring& key) {
+                    auto it = services.find(key);
+                    return it == services.end() || !it->second.sharesResources;
+                }), resources.starting.end());
+                changed.notify_all();
+            }
+        }
+    }
+
+    double ResourceCapacity(double active) const {
+        return resources.cores / (1 + resources.contention * std::max(0.0, active - resources.cores) / resources.cores);
+    }
+
+    double StartedMs(const MemoryService& service) const {
+        return std::chrono::duration<double, std::milli>(service.transitionStarted - resources.epoch).count();
+    }
+
+    // When a resource-bound start would complete (or time out) if the services starting now kept starting
+    std::chrono::steady_clock::time_point ProjectedStart(const MemoryService& service) const {
+        double active = static_cast<double>(std::max<size_t>(1, resources.starting.size()));
+        double doneMs = resources.clockMs + service.workLeftMs / std::min(1.0, ResourceCapacity(active) / active);
+        if (resources.timeoutMs) {
+            doneMs = std::min(doneMs, StartedMs(service) + resources.timeoutMs);
+        }
+        return resources.epoch + std::chrono::microseconds(static_cast<int64_t>(std::ceil(doneMs * 1000)));
+    }
+
+    // Completes a pending transition whose simulated delay has elapsed, and returns the current status
+    const SERVICE_STATUS_PROCESS& Settle(MemoryService& service) {
+        SERVICE_STATUS_PROCESS& status = service.status;
+        if (status.dwCurrentState != SERVICE_START_PENDING && status.dwCurrentState != SERVICE_STOP_PENDING) {
+            return status;
+        }
+
+        bool starting = status.dwCurrentState == SERVICE_START_PENDING;
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - service.transitionStarted).count();
+        if (starting && service.sharesResources) {
+            AdvanceResources();
+            if (status.dwCurrentState == SERVICE_START_PENDING) {
+                status.dwCheckPoint = 1 + static_cast<DWORD>(elapsed / 100);
+            }
+            return status;
+        }
+        if (elapsed < (starting ? service.startDelayMs : service.stopDelayMs)) {
+            status.dwCheckPoint = 1 + static_cast<DWORD>(elapsed / 100);
+            return status;
+        }
+
+        status.dwCurrentState = starting ? SERVICE_RUNNING : SERVICE_STOPPED;
+        status.dwControlsAccepted = starting ? SERVICE_ACCEPT_STOP : 0;
+        status.dwCheckPoint = 0;
+        status.dwWaitHint = 0;
+        if (!starting) {
+            status.dwProcessId = 0;
+        }
+        return status;
+    }
+
+    // Collects the transitive dependencies of service not yet running, deepest first (the order in which they must
+    // start); false when one is missing, or disabled and not running
+    bool CollectDependencies(MemoryService& service, std::set<std::wstring>& visited, std::vector<std::wstring>& ordered) {
+        for (const auto& dependency : service.dependencies) {
+            std::wstring key = ToLower(dependency);
+            if (!visited.insert(key).second) {
+                continue;
+            }
+            auto it = services.find(key);
+            if (it == services.end()) {
+                return false;
+            }
+            if (Settle(it->second).dwCurrentState == SERVICE_RUNNING) {
+                continue;
+            }
+            if (it->second.startType == SERVICE_DISABLED || !CollectDependencies(it->second, visited, ordered)) {
+                return false;
+            }
+            ordered.push_back(key);
+        }
+        return true;
+    }
+
+    // Collects the transitive dependents of key, deepest first (the order in which they must stop)
+    void CollectDependents(const std::wstring& key, std::set<std::wstring>& visited, std::vector<MemoryService*>& ordered) {
+        for (auto& other : services) {
+            if (visited.count(other.first)) {
+                continue;
+            }
+            for (const auto& dependency : other.second.dependencies) {
+                if (ToLower(dependency) == key) {
+                    visited.insert(other.first);
+                    CollectDependents(other.first, visited, ordered);
+                    ordered.push_back(&other.second);
+                    break;
+                }
+            }
+        }
+    }
+
+    static std::vector<std::wstring> ParseMultiSz(LPCWSTR list) {
+        std::vector<std::wstring> names;
+        while (list && *list) {
+            names.push_back(list);
+            list += names.back().size() + 1;
+        }
+        return names;
+    }
+
+    std::mutex mutex;
+    std::map<std::wstring, MemoryService> services;
+    std::map<SC_HANDLE, MemoryHandle*> handles;
+    DWORD nextProcessId = 1000;
+
+    std::vector<MemorySubscription> subscriptions;
+    std::condition_variable changed;
+    bool notificationsEnabled = true;
+    std::map<std::wstring, MemoryHostProfile> hostProfiles;
+    MemoryResourceModel resources;
+
+    // Created (true) / deleted (false) services in order, for SCM-handle notifications
+    std::vector<std::pair<bool, std::wstring>> scmEvents;
+    std::vector<MemoryScriptStep> script;
+    std::thread scriptThread;
+    bool scriptStopping = false;
+
+    // Where the last partial enumeration stopped, invalidated whenever services are added or removed
+    std::map<std::wstring, MemoryService>::iterator enumCursor;
+    DWORD enumCursorPosition = 0;
+    bool enumCursorValid = false;
+};
+
+// The backend every handler talks to; chosen once in wmain
+std::unique_ptr<ScmBackend> g_scmBackend;
+
+// What it reads from ("scm", "memory:<fixture>", "offline:<hive>", ...), so files cached per source stay apart
+std::wstring g_backendSource;
+
+ScmBackend& Scm() {
+    return *g_scmBackend;
+}
+
+// Collects high-resolution durations (in microseconds) by name and reports count, total, p50, p99 and max.
+// Shared by every thread, so recording takes a lock; the clock is read outside it.
+class TimingRecorder {
+public:
+    void Record(const std::wstring& name, double micros) {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples[name].push_back(micros);
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        samples.clear();
+    }
+
+    size_t Count(const std::wstring& name) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = samples.find(name);
+        return it != samples.end() ? it->second.size() : 0;
+    }
+
+    // Nearest-rank percentile of sorted samples
+    static double Percentile(const std::vector<double>& sorted, double fraction) {
+        size_t rank = static_cast<size_t>(std::ceil(fraction * sorted.size()));
+        return sorted[rank ? rank - 1 : 0];
+    }
+
+    void Print(std::wostream& out) {
+        std::lock_guard<std::mutex> lock(mutex);
+        wchar_t line[160];
+        std::swprintf(line, 160, L"%-40ls %8ls %12ls %10ls %10ls %10ls", L"[SC_CLONE] TIMINGS (us)", L"CALLS", L"TOTAL", L"P50", L"P99", L"MAX");
+        out << line << std::endl;
+        for (auto& entry : samples) {
+            std::vector<double>& values = entry.second;
+            std::sort(values.begin(), values.end());
+            double total = 0;
+            for (double value : values) {
+                total += value;
+            }
+            std::swprintf(line, 160, L"        %-32ls %8zu %12.1f %10.1f %10.1f %10.1f", entry.first.c_str(), values.size(),
+                          total, Percentile(values, 0.50), Percentile(values, 0.99), values.back());
+            out << line << std::endl;
+        }
+    }
+
+private:
+    std::mutex mutex;
+    std::map<std::wstring, std::vector<double>> samples;
+};
+
+// Set by --timings; when null nothing is measured
+TimingRecorder* g_timings = nullptr;
+
+// Microseconds spent inside SCM calls on this thread, so a command's own (parsing/output) time can be separated out
+thread_local double t_scmMicros = 0;
+
+// Backend decorator that times every call before forwarding it to the real backend
+class TimingScmBackend : public ScmBackend {
+public:
+    TimingScmBackend(std::unique_ptr<ScmBackend> inner, TimingRecorder& recorder)
+        : inner(std::move(inner)), recorder(recorder) {}
+
+    SC_HANDLE OpenSCManagerW(LPCWSTR machineName, LPCWSTR databaseName, DWORD desiredAccess) override {
+        return Time(L"OpenSCManagerW", [&] { return inner->OpenSCManagerW(machineName, databaseName, desiredAccess); });
+    }
+
+    SC_HANDLE OpenServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, DWORD desiredAccess) override {
+        return Time(L"OpenServiceW", [&] { return inner->OpenServiceW(hSCManager, serviceName, desiredAccess); });
+    }
+
+    SC_HANDLE CreateServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, LPCWSTR displayName,
+                             DWORD desiredAccess, DWORD serviceType, DWORD startType, DWORD errorControl,
+                             LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                             LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password) override {
+        return Time(L"CreateServiceW", [&] {
+            return inner->CreateServiceW(hSCManager, serviceName, displayName, desiredAccess, serviceType, startType,
+                                         errorControl, binaryPathName, loadOrderGroup, tagId, dependencies,
+                                         serviceStartName, password);
+        });
+    }
+
+    BOOL CloseServiceHandle(SC_HANDLE hSCObject) override {
+        return Time(L"CloseServiceHandle", [&] { return inner->CloseServiceHandle(hSCObject); });
+    }
+
+    BOOL QueryServiceStatusEx(SC_HANDLE hService, SC_STATUS_TYPE infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        return Time(L"QueryServiceStatusEx", [&] { return inner->QueryServiceStatusEx(hService, infoLevel, buffer, bufSize, bytesNeeded); });
+    }
+
+    BOOL StartServiceW(SC_HANDLE hService, DWORD numServiceArgs, LPCWSTR* serviceArgVectors) override {
+        return Time(L"StartServiceW", [&] { return inner->StartServiceW(hService, numServiceArgs, serviceArgVectors); });
+    }
+
+    BOOL ControlService(SC_HANDLE hService, DWORD control, LPSERVICE_STATUS serviceStatus) override {
+        return Time(L"ControlService", [&] { return inner->ControlService(hService, control, serviceStatus); });
+    }
+
+    BOOL DeleteService(SC_HANDLE hService) override {
+        return Time(L"DeleteService", [&] { return inner->DeleteService(hService); });
+    }
+
+    BOOL QueryServiceConfigW(SC_HANDLE hService, LPQUERY_SERVICE_CONFIGW serviceConfig,
+                             DWORD bufSize, LPDWORD bytesNeeded) override {
+        return Time(L"QueryServiceConfigW", [&] { return inner->QueryServiceConfigW(hService, serviceConfig, bufSize, bytesNeeded); });
+    }
+
+    BOOL ChangeServiceConfigW(SC_HANDLE hService, DWORD serviceType, DWORD startType, DWORD errorControl,
+                              LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                              LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password,
+                              LPCWSTR displayName) override {
+        return Time(L"ChangeServiceConfigW", [&] {
+            return inner->ChangeServiceConfigW(hService, serviceType, startType, errorControl, binaryPathName,
+                                               loadOrderGroup, tagId, dependencies, serviceStartName, password,
+                                               displayName);
+        });
+    }
+
+    BOOL QueryServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        return Time(L"QueryServiceConfig2W", [&] { return inner->QueryServiceConfig2W(hService, infoLevel, buffer, bufSize, bytesNeeded); });
+    }
+
+    BOOL ChangeServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPVOID info) override {
+        return Time(L"ChangeServiceConfig2W", [&] { return inner->ChangeServiceConfig2W(hService, infoLevel, info); });
+    }
+
+    BOOL EnumServicesStatusExW(SC_HANDLE hSCManager, SC_ENUM_TYPE infoLevel, DWORD serviceType,
+                               DWORD serviceState, LPBYTE services, DWORD bufSize, LPDWORD bytesNeeded,
+                               LPDWORD servicesReturned, LPDWORD resumeHandle, LPCWSTR groupName) override {
+        return Time(L"EnumServicesStatusExW", [&] {
+            return inner->EnumServicesStatusExW(hSCManager, infoLevel, serviceType, serviceState, services, bufSize,
+                                                bytesNeeded, servicesReturned, resumeHandle, groupName);
+        });
+    }
+
+    BOOL EnumDependentServicesW(SC_HANDLE hService, DWORD serviceState, LPENUM_SERVICE_STATUSW services,
+                                DWORD bufSize, LPDWORD bytesNeeded, LPDWORD servicesReturned) override {
+        return Time(L"EnumDependentServicesW", [&] {
+            return inner->EnumDependentServicesW(hService, serviceState, services, bufSize, bytesNeeded, servicesReturned);
+        });
+    }
+
+    DWORD NotifyServiceStatusChangeW(SC_HANDLE hService, DWORD notifyMask, PSERVICE_NOTIFYW notifyBuffer) override {
+        return Time(L"NotifyServiceStatusChangeW", [&] { return inner->NotifyServiceStatusChangeW(hService, notifyMask, notifyBuffer); });
+    }
+
+    // Time spent waiting, not working; kept under its own name so it does not skew the API figures
+    DWORD SleepEx(DWORD milliseconds, BOOL alertable) override {
+        return Time(L"SleepEx (wait)", [&] { return inner->SleepEx(milliseconds, alertable); });
+    }
+
+    BOOL GetSystemTimes(LPFILETIME idleTime, LPFILETIME kernelTime, LPFILETIME userTime) override {
+        return Time(L"GetSystemTimes", [&] { return inner->GetSystemTimes(idleTime, kernelTime, userTime); });
+    }
+
+private:
+    // Runs one call and records its duration, leaving the call's last error intact for the caller
+    template <typename Fn>
+    auto Time(const wchar_t* name, Fn call) -> decltype(call()) {
+        auto start = std::chrono::steady_clock::now();
+        auto result = call();
+        double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        DWORD error = GetLastError();
+        t_scmMicros += micros;
+        recorder.Record(name, micros);
+        SetLastError(error);
+        return result;
+    }
+
+    std::unique_ptr<ScmBackend> inner;
+    TimingRecorder& recorder;
+};
+
+// Holds one SCM connection and the service handles opened through it, so consecutive commands
+// (e.g. the lines of a batch file) reuse them instead of reconnecting each time.
+// The cache is safe to share between worker threads as long as each service is driven by one thread at a time.
+// A handle another thread may still hold is never closed under it: one replaced by a wider one is retired, and
+// the capacity is only enforced by Trim, which the owner calls between requests when no worker holds a handle.
+class ScmSession {
+public:
+    explicit ScmSession(const std::wstring& machineName = L"") : machineName(machineName) {}
+
+    ~ScmSession() {
+        Reset();
+    }
+
+    ScmSession(const ScmSession&) = delete;
+    ScmSession& operator=(const ScmSession&) = delete;
+
+    const std::wstring& Machine() const {
+        return machineName;
+    }
+
+    // Returns the SCM handle, reconnecting with wider rights if the current handle lacks desiredAccess
+    SC_HANDLE Manager(DWORD desiredAccess) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        if (hSCManager && (managerAccess & desiredAccess) == desiredAccess) {
+            return hSCManager;
+        }
+
+        SC_HANDLE widened = Scm().OpenSCManagerW(machineName.empty() ? NULL : machineName.c_str(), NULL,
+                                                 managerAccess | desiredAccess);
+        if (!widened) {
+            return NULL;
+        }
+        if (hSCManager) {
+            Scm().CloseServiceHandle(hSCManager);
+        }
+        hSCManager = widened;
+        managerAccess |= desiredAccess;
+        return hSCManager;
+    }
+
+    // Returns a handle to the service with at least desiredAccess, reusing a cached one when possible.
+    // A cached handle with too few rights is replaced by one opened with the union of both masks.
+    SC_HANDLE Service(const std::wstring& serviceName, DWORD desiredAccess) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        std::wstring key = ToLower(serviceName);
+        auto it = services.find(key);
+        if (it != services.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            if ((it->second->access & desiredAccess) == desiredAccess) {
+                return it->second->handle;
+            }
+        }
+
+        SC_HANDLE manager = Manager(SC_MANAGER_CONNECT);
+        if (!manager) {
+            return NULL;
+        }
+
+        DWORD access = desiredAccess | (it != services.end() ? it->second->access : 0);
+        SC_HANDLE hService = Scm().OpenServiceW(manager, serviceName.c_str(), access);
+        if (!hService) {
+            return NULL;
+        }
+        Store(key, hService, access);
+        return hService;
+    }
+
+    // Hands a freshly created service handle to the cache
+    void Adopt(const std::wstring& serviceName, SC_HANDLE hService, DWORD access) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        Store(ToLower(serviceName), hService, access);
+    }
+
+    // Closes and drops a cached service handle (after deletion the SCM only removes the entry once all handles close)
+    void Forget(const std::wstring& serviceName) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        auto it = services.find(ToLower(serviceName));
+        if (it != services.end()) {
+            Scm().CloseServiceHandle(it->second->handle);
+            lru.erase(it->second);
+            services.erase(it);
+        }
+    }
+
+    // Closes every cached handle, including the SCM connection; the next call reconnects
+    void Reset() {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        for (const auto& entry : lru) {
+            Scm().CloseServiceHandle(entry.handle);
+        }
+        lru.clear();
+        services.clear();
+        Trim();
+        if (hSCManager) {
+            Scm().CloseServiceHandle(hSCManager);
+            hSCManager = NULL;
+            managerAccess = 0;
+        }
+    }
+
+    // Caps the number of cached service handles (0 = no limit), enforced by Trim
+    void SetCapacity(size_t maxServices) {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        capacity = maxServices;
+    }
+
+    // Closes retired handles and the least recently used ones beyond the capacity. Only call it while no other
+    // thread holds a handle from this session, e.g. between served requests.
+    void Trim() {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        for (SC_HANDLE handle : retired) {
+            Scm().CloseServiceHandle(handle);
+        }
+        retired.clear();
+        while (capacity && lru.size() > capacity) {
+            Scm().CloseServiceHandle(lru.back().handle);
+            services.erase(lru.back().key);
+            lru.pop_back();
+        }
+    }
+
+    size_t CachedServices() {
+        std::lock_guard<std::recursive_mutex> lock(mutex);
+        return lru.size();
+    }
+
+private:
+    struct CachedService {
+        std::wstring key;
+        SC_HANDLE handle;
+        DWORD access;
+    };
+
+    // Puts a handle at the front of the LRU list, retiring the one it replaces
+    void Store(const std::wstring& key, SC_HANDLE hService, DWORD access) {
+        auto it = services.find(key);
+        if (it != services.end()) {
+            retired.push_back(it->second->handle);
+            it->second->handle = hService;
+            it->second->access = access;
+            lru.splice(lru.begin(), lru, it->second);
+            return;
+        }
+        lru.push_front(CachedService{key, hService, access});
+        services[key] = lru.begin();
+    }
+
+    std::wstring machineName;
+    SC_HANDLE hSCManager = NULL;
+    DWORD managerAccess = 0;
+    std::list<CachedService> lru;  // Most recently used first
+    std::unordered_map<std::wstring, std::list<CachedService>::iterator> services;
+    std::vector<SC_HANDLE> retired;  // Replaced by wider handles, closed by the next Trim
+    size_t capacity = 0;
+    std::recursive_mutex mutex;
+};
+
+// Output formats selected with --format=; text is the sc.exe-style block layout
+enum class OutputFormat { Text, Json, Csv, Table };
+
+OutputFormat g_outputFormat = OutputFormat::Text;
+
+// Maps a --format= value to an output format
+bool ParseOutputFormat(const std::wstring& name, OutputFormat& format) {
+    std::wstring lower = ToLower(name);
+    if (lower == L"text") {
+        format = OutputFormat::Text;
+    } else if (lower == L"json") {
+        format = OutputFormat::Json;
+    } else if (lower == L"csv") {
+        format = OutputFormat::Csv;
+    } else if (lower == L"table") {
+        format = OutputFormat::Table;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Name for one value of a service enum (state, start type, ...)
+struct EnumName {
+    DWORD value;
+    const wchar_t* name;
+};
+
+constexpr EnumName kServiceStateNames[] = {
+    {SERVICE_STOPPED, L"STOPPED"},
+    {SERVICE_START_PENDING, L"START_PENDING"},
+    {SERVICE_STOP_PENDING, L"STOP_PENDING"},
+    {SERVICE_RUNNING, L"RUNNING"},
+    {SERVICE_CONTINUE_PENDING, L"CONTINUE_PENDING"},
+    {SERVICE_PAUSE_PENDING, L"PAUSE_PENDING"},
+    {SERVICE_PAUSED, L"PAUSED"},
+};
+
+constexpr EnumName kStartTypeNames[] = {
+    {SERVICE_BOOT_START, L"BOOT_START"},
+    {SERVICE_SYSTEM_START, L"SYSTEM_START"},
+    {SERVICE_AUTO_START, L"AUTO_START"},
+    {SERVICE_DEMAND_START, L"DEMAND_START"},
+    {SERVICE_DISABLED, L"DISABLED"},
+};
+
+constexpr EnumName kErrorControlNames[] = {
+    {SERVICE_ERROR_IGNORE, L"IGNORE"},
+    {SERVICE_ERROR_NORMAL, L"NORMAL"},
+    {SERVICE_ERROR_SEVERE, L"SEVERE"},
+    {SERVICE_ERROR_CRITICAL, L"CRITICAL"},
+};
+
+// Failure action types, by the names the actions= option uses
+constexpr EnumName kFailureActionNames[] = {
+    {SC_ACTION_NONE, L"none"},
+    {SC_ACTION_RESTART, L"restart"},
+    {SC_ACTION_REBOOT, L"reboot"},
+    {SC_ACTION_RUN_COMMAND, L"run"},
+};
+
+// Service type bits, in the order sc.exe lists them
+constexpr EnumName kServiceTypeFlags[] = {
+    {SERVICE_KERNEL_DRIVER, L"KERNEL_DRIVER"},
+    {SERVICE_FILE_SYSTEM_DRIVER, L"FILE_SYSTEM_DRIVER"},
+    {SERVICE_ADAPTER, L"ADAPTER"},
+    {SERVICE_RECOGNIZER_DRIVER, L"RECOGNIZER_DRIVER"},
+    {SERVICE_WIN32_OWN_PROCESS, L"WIN32_OWN_PROCESS"},
+    {SERVICE_WIN32_SHARE_PROCESS, L"WIN32_SHARE_PROCESS"},
+    {SERVICE_INTERACTIVE_PROCESS, L"INTERACTIVE_PROCESS"},
+};
+
+template <size_t N>
+constexpr const wchar_t* EnumToName(const EnumName (&table)[N], DWORD value) {
+    for (size_t i = 0; i < N; ++i) {
+        if (table[i].value == value) {
+            return table[i].name;
+        }
+    }
+    return nullptr;
+}
+
+// Writes the names of the set type bits ("WIN32_OWN_PROCESS | INTERACTIVE_PROCESS") into a caller-supplied
+// buffer; returns nullptr when a bit has no name, so the caller falls back to the number
+const wchar_t* ServiceTypeName(DWORD serviceType, wchar_t* buffer, size_t capacity) {
+    size_t length = 0;
+    DWORD known = 0;
+    buffer[0] = L'\0';
+    for (const EnumName& flag : kServiceTypeFlags) {
+        if (!(serviceType & flag.value)) {
+            continue;
+        }
+        known |= flag.value;
+        for (const wchar_t* part = length ? L" | " : L""; *part && length + 1 < capacity; ++part) {
+            buffer[length++] = *part;
+        }
+        for (const wchar_t* part = flag.name; *part && length + 1 < capacity; ++part) {
+            buffer[length++] = *part;
+        }
+    }
+    buffer[length] = L'\0';
+    return (length && known == serviceType) ? buffer : nullptr;
+}
+
+// One column of a record: JSON/CSV key, text/table label, table width
+struct OutputColumn {
+    const wchar_t* key;
+    const wchar_t* label;
+    size_t width;
+};
+
+constexpr OutputColumn kStatusColumns[] = {
+    {L"service_name", L"SERVICE_NAME", 32},
+    {L"display_name", L"DISPLAY_NAME", 40},
+    {L"type", L"TYPE", 22},
+    {L"state", L"STATE", 16},
+    {L"pid", L"PID", 8},
+    {L"flags", L"FLAGS", 5},
+};
+
+constexpr OutputColumn kDescriptionColumns[] = {
+    {L"service_name", L"SERVICE_NAME", 32},
+    {L"display_name", L"DISPLAY_NAME", 32},
+    {L"description", L"DESCRIPTION", 48},
+    {L"type", L"SERVICE_TYPE", 22},
+    {L"start_type", L"START_TYPE", 14},
+    {L"error_control", L"ERROR_CONTROL", 14},
+    {L"binary_path_name", L"BINARY_PATH_NAME", 0},
+};
+
+constexpr OutputColumn kConfigColumns[] = {
+    {L"service_name", L"SERVICE_NAME", 32},
+    {L"type", L"TYPE", 22},
+    {L"start_type", L"START_TYPE", 14},
+    {L"error_control", L"ERROR_CONTROL", 14},
+    {L"binary_path_name", L"BINARY_PATH_NAME", 48},
+    {L"load_order_group", L"LOAD_ORDER_GROUP", 18},
+    {L"tag", L"TAG", 5},
+    {L"display_name", L"DISPLAY_NAME", 32},
+    {L"dependencies", L"DEPENDENCIES", 24},
+    {L"service_start_name", L"SERVICE_START_NAME", 0},
+};
+
+constexpr OutputColumn kFailureColumns[] = {
+    {L"service_name", L"SERVICE_NAME", 32},
+    {L"reset_period", L"RESET_PERIOD", 13},
+    {L"reboot_message", L"REBOOT_MESSAGE", 24},
+    {L"command_line", L"COMMAND_LINE", 32},
+    {L"failure_actions", L"FAILURE_ACTIONS", 40},
+    {L"failure_actions_on_non_crash_failures", L"NON_CRASH_FAILURES", 0},
+};
+
+// Formats records into one large reusable buffer and hands it to the output stream in big writes with a single
+// flush at the end, instead of a flush per line. Values are written field by field in column order, straight
+// into the buffer; the per-column text/JSON prefixes are built once, so formatting a record does not allocate.
+class RecordWriter {
+public:
+    RecordWriter(const OutputColumn* columns, size_t columnCount, OutputFormat format = g_outputFormat,
+                 std::wostream* stream = nullptr)
+        : columns(columns), columnCount(columnCount), format(format), stream(stream),
+          capacity(kBufferSize + 64 * 1024), data(new wchar_t[capacity]) {
+        for (size_t i = 0; i < columnCount; ++i) {
+            std::wstring prefix;
+            if (format == OutputFormat::Text) {
+                prefix = i == 0 ? std::wstring(L"[SC_CLONE] ") + columns[i].label : L"        " + std::wstring(columns[i].label);
+                prefix.resize(std::max<size_t>(prefix.size(), i == 0 ? 0 : 27), L' ');
+                prefix += L": ";
+            } else if (format == OutputFormat::Json) {
+                prefix = std::wstring(i == 0 ? L"{\"" : L",\"") + columns[i].key + L"\":";
+            } else if (format == OutputFormat::Csv && i > 0) {
+                prefix = L",";
+            }
+            prefixes.push_back(prefix);
+        }
+    }
+
+    ~RecordWriter() {
+        Flush();
+    }
+
+    // A null value is left out of text output, written as null in JSON and left empty in CSV/table
+    void String(const wchar_t* value) {
+        if (!value) {
+            Missing();
+            return;
+        }
+        size_t start = BeginValue();
+        if (format == OutputFormat::Json || format == OutputFormat::Csv) {
+            bool quote = format == OutputFormat::Json || std::wcspbrk(value, L",\"\r\n");
+            if (quote) {
+                Append(L'"');
+            }
+            AppendEscaped(value);
+            if (quote) {
+                Append(L'"');
+            }
+        } else {
+            Append(value, std::wcslen(value));
+        }
+        EndValue(start);
+    }
+
+    void String(const std::wstring& value) {
+        String(value.c_str());
+    }
+
+    void Number(DWORD value) {
+        size_t start = BeginValue();
+        AppendNumber(value, 10);
+        EndValue(start);
+    }
+
+    // Enumerated value: "4  RUNNING" in text (as sc.exe prints it), the name elsewhere, or the number if unnamed
+    void Enum(DWORD value, const wchar_t* name, bool hex = false) {
+        size_t start = BeginValue();
+        if (format == OutputFormat::Text || !name) {
+            AppendNumber(value, hex ? 16 : 10);
+        }
+        if (name) {
+            if (format == OutputFormat::Text) {
+                Append(L"  ", 2);
+            }
+            if (format == OutputFormat::Json) {
+                Append(L'"');
+            }
+            Append(name, std::wcslen(name));
+            if (format == OutputFormat::Json) {
+                Append(L'"');
+            }
+        }
+        EndValue(start);
+    }
+
+    void EndRecord() {
+        switch (format) {
+            case OutputFormat::Json:
+                Append(L"}\n", 2);
+                break;
+            case OutputFormat::Csv:
+            case OutputFormat::Table:
+                while (used && data[used - 1] == L' ') {
+                    --used;
+                }
+                Append(L'\n');
+                break;
+            case OutputFormat::Text:
+                break;
+        }
+        column = 0;
+        if (used >= kBufferSize) {
+            Drain();
+        }
+    }
+
+    void Flush() {
+        Drain();
+        Target().flush();
+    }
+
+private:
+    static const size_t kBufferSize = 1 << 20;
+
+    std::wostream& Target() {
+        return stream ? *stream : Out();
+    }
+
+    void Drain() {
+        if (used) {
+            Target().write(data.get(), static_cast<std::streamsize>(used));
+            used = 0;
+        }
+    }
+
+    void WriteHeader() {
+        headerWritten = true;
+        if (format != OutputFormat::Csv && format != OutputFormat::Table) {
+            return;
+        }
+        for (size_t i = 0; i < columnCount; ++i) {
+            size_t start = used;
+            const wchar_t* title = format == OutputFormat::Csv ? columns[i].key : columns[i].label;
+            Append(prefixes[i].data(), prefixes[i].size());
+            Append(title, std::wcslen(title));
+            if (format == OutputFormat::Table) {
+                Pad(start, columns[i].width);
+            }
+        }
+        EndRecord();
+    }
+
+    size_t BeginValue() {
+        if (!headerWritten) {
+            WriteHeader();
+        }
+        Append(prefixes[column].data(), prefixes[column].size());
+        return used;
+    }
+
+    void EndValue(size_t start) {
+        if (format == OutputFormat::Text) {
+            Append(L'\n');
+        } else if (format == OutputFormat::Table) {
+            Pad(start, columns[column].width);
+        }
+        ++column;
+    }
+
+    void Missing() {
+        if (format == OutputFormat::Text) {
+            ++column;
+            return;
+        }
+        size_t start = BeginValue();
+        if (format == OutputFormat::Json) {
+            Append(L"null", 4);
+        } else if (format == OutputFormat::Table) {
+            Append(L'-');
+        }
+        EndValue(start);
+    }
+
+    // Pads the text written since start to width, always leaving at least one space as the column separator
+    void Pad(size_t start, size_t width) {
+        size_t written = used - start;
+        size_t count = written < width ? width - written : 1;
+        Reserve(count);
+        std::wmemset(data.get() + used, L' ', count);
+        used += count;
+    }
+
+    // The buffer is drained between records; it only grows if a single record outgrows the slack
+    void Reserve(size_t length) {
+        if (used + length > capacity) {
+            capacity = std::max(capacity * 2, used + length);
+            std::unique_ptr<wchar_t[]> larger(new wchar_t[capacity]);
+            std::wmemcpy(larger.get(), data.get(), used);
+            data = std::move(larger);
+        }
+    }
+
+    void Append(const wchar_t* text, size_t length) {
+        Reserve(length);
+        std::wmemcpy(data.get() + used, text, length);
+        used += length;
+    }
+
+    void Append(wchar_t c) {
+        Reserve(1);
+        data[used++] = c;
+    }
+
+    void AppendNumber(DWORD value, unsigned base) {
+        wchar_t digits[16];
+        size_t count = sizeof(digits) / sizeof(digits[0]);
+        size_t first = count;
+        do {
+            digits[--first] = L"0123456789abcdef"[value % base];
+            value /= base;
+        } while (value);
+        Append(digits + first, count - first);
+    }
+
+    // Copies runs of plain characters in bulk and escapes the rest (JSON: quote, backslash, controls; CSV: quote)
+    void AppendEscaped(const wchar_t* text) {
+        bool json = format == OutputFormat::Json;
+        for (;;) {
+            const wchar_t* run = text;
+            while (*text && *text != L'"' && !(json && (*text == L'\\' || static_cast<unsigned>(*text) < 0x20))) {
+                ++text;
+            }
+            Append(run, static_cast<size_t>(text - run));
+            if (!*text) {
+                return;
+            }
+            wchar_t c = *text++;
+            if (!json) {
+                Append(L"\"\"", 2);
+            } else if (c == L'"' || c == L'\\') {
+                Append(L'\\');
+                Append(c);
+            } else {
+                const wchar_t escaped[] = {L'\\', L'u', L'0', L'0', L"0123456789abcdef"[(c >> 4) & 0xF], L"0123456789abcdef"[c & 0xF]};
+                Append(escaped, 6);
+            }
+        }
+    }
+
+    const OutputColumn* columns;
+    size_t columnCount;
+    OutputFormat format;
+    std::wostream* stream;  // Null writes to Out()
+    std::vector<std::wstring> prefixes;
+    size_t column = 0;
+    bool headerWritten = false;
+    size_t capacity;
+    size_t used = 0;
+    std::unique_ptr<wchar_t[]> data;
+};
+
+// Writes the status record for one service; the extended (queryex) form adds the process id and flags
+void WriteServiceStatus(RecordWriter& writer, const wchar_t* serviceName, const wchar_t* displayName,
+                        const SERVICE_STATUS_PROCESS& ssp, bool extended) {
+    wchar_t typeName[128];
+    writer.String(serviceName);
+    writer.String(displayName);
+    writer.Enum(ssp.dwServiceType, ServiceTypeName(ssp.dwServiceType, typeName, 128), true);
+    writer.Enum(ssp.dwCurrentState, EnumToName(kServiceStateNames, ssp.dwCurrentState));
+    if (extended) {
+        writer.Number(ssp.dwProcessId);
+        writer.Number(ssp.dwServiceFlags);
+    }
+    writer.EndRecord();
+}
+
+// Queries the status of a service and prints relevant information
+DWORD QueryServiceStatus(ScmSession& session, const std::wstring& serviceName, bool extended = false) {
+    // Open the specified service through the session's SCM connection
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_QUERY_STATUS);
+    if (!hService) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", error);
+        return error;
+    }
+
+    // Query the service status
+    SERVICE_STATUS_PROCESS ssp;
+    DWORD bytesNeeded;
+    if (!Scm().QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp, sizeof(ssp), &bytesNeeded)) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] QueryServiceStatus failed with error code: ", error);
+        return error;
+    }
+
+    RecordWriter writer(kStatusColumns, extended ? 6 : 4);
+    WriteServiceStatus(writer, serviceName.c_str(), nullptr, ssp, extended);
+    return ERROR_SUCCESS;
+}
+
+// Collects sc.exe-style "key= value" options; accepts both "key= value" and "key=value"
+std::vector<std::pair<std::wstring, std::wstring>> ParseKeyValueArgs(const std::vector<std::wstring>& args, size_t start) {
+    std::vector<std::pair<std::wstring, std::wstring>> options;
+    for (size_t i = start; i < args.size(); ++i) {
+        size_t eq = args[i].find(L'=');
+        if (eq == std::wstring::npos) {
+            continue;
+        }
+        std::wstring key = ToLower(args[i].substr(0, eq));
+        std::wstring value = args[i].substr(eq + 1);
+        if (value.empty() && i + 1 < args.size()) {
+            value = args[++i];
+        }
+        options.emplace_back(key, value);
+    }
+    return options;
+}
+
+// Streams every service matching the type/state filters to the callback, one EnumServicesStatusExW chunk at a
+// time through a single reusable buffer, so memory stays flat however many services the host has.
+// The callback returns false to stop early.
+template <typename Callback>
+DWORD ForEachService(ScmSession& session, DWORD serviceType, DWORD serviceState, Callback callback) {
+    SC_HANDLE hSCManager = session.Manager(SC_MANAGER_CONNECT | SC_MANAGER_ENUMERATE_SERVICE);
+    if (!hSCManager) {
+        return GetLastError();
+    }
+
+    std::vector<BYTE> buffer(64 * 1024);
+    DWORD resumeHandle = 0;
+    for (;;) {
+        DWORD bytesNeeded = 0;
+        DWORD servicesReturned = 0;
+        BOOL done = Scm().EnumServicesStatusExW(hSCManager, SC_ENUM_PROCESS_INFO, serviceType, serviceState,
+                                                buffer.data(), static_cast<DWORD>(buffer.size()), &bytesNeeded,
+                                                &servicesReturned, &resumeHandle, NULL);
+        DWORD error = done ? ERROR_SUCCESS : GetLastError();
+        if (!done && error != ERROR_MORE_DATA) {
+            return error;
+        }
+
+        const ENUM_SERVICE_STATUS_PROCESSW* entries = reinterpret_cast<const ENUM_SERVICE_STATUS_PROCESSW*>(buffer.data());
+        for (DWORD i = 0; i < servicesReturned; ++i) {
+            if (!callback(entries[i])) {
+                return ERROR_SUCCESS;
+            }
+        }
+
+        if (done) {
+            return ERROR_SUCCESS;
+        }
+        // A single entry larger than the buffer: grow once and retry from the same resume point. Without progress
+        // and without room to grow, retrying would repeat the same call forever, so give up instead.
+        if (servicesReturned == 0) {
+            const size_t kMaxBuffer = 1024 * 1024;
+            if (bytesNeeded <= buffer.size()) {
+                return ERROR_INVALID_DATA;
+            }
+            if (buffer.size() >= kMaxBuffer) {
+                return ERROR_MORE_DATA;
+            }
+            buffer.resize(std::min<size_t>(bytesNeeded, kMaxBuffer));
+        }
+    }
+}
+
+// Maps the sc.exe "type=" and "state=" filter values to EnumServicesStatusExW flags
+bool ParseEnumerationFilters(const std::vector<std::wstring>& args, size_t start, DWORD& serviceType, DWORD& serviceState) {
+    serviceType = SERVICE_WIN32;
+    serviceState = SERVICE_ACTIVE;
+    for (const auto& option : ParseKeyValueArgs(args, start)) {
+        const std::wstring value = ToLower(option.second);
+        if (option.first == L"type") {
+            if (value == L"service") serviceType = SERVICE_WIN32;
+            else if (value == L"driver") serviceType = SERVICE_DRIVER;
+            else if (value == L"all") serviceType = SERVICE_WIN32 | SERVICE_DRIVER;
+            else if (value == L"own") serviceType = SERVICE_WIN32_OWN_PROCESS;
+            else if (value == L"share") serviceType = SERVICE_WIN32_SHARE_PROCESS;
+            else if (value == L"kernel") serviceType = SERVICE_KERNEL_DRIVER;
+            else if (value == L"filesys") serviceType = SERVICE_FILE_SYSTEM_DRIVER;
+            else return false;
+        } else if (option.first == L"state") {
+            if (value == L"active") serviceState = SERVICE_ACTIVE;
+            else if (value == L"inactive") serviceState = SERVICE_INACTIVE;
+            else if (value == L"all") serviceState = SERVICE_STATE_ALL;
+            else return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Enumerates all services matching the filters and prints each one as it arrives
+DWORD EnumerateServices(ScmSession& session, const std::vector<std::wstring>& args, size_t start, bool extended) {
+    DWORD serviceType = 0;
+    DWORD serviceState = 0;
+    if (!ParseEnumerationFilters(args, start, serviceType, serviceState)) {
+        Err() << L"[SC_CLONE] Invalid filter. Use type= service|driver|all|own|share|kernel|filesys and state= active|inactive|all." << std::endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    RecordWriter writer(kStatusColumns, extended ? 6 : 4);
+    DWORD error = ForEachService(session, serviceType, serviceState, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+        WriteServiceStatus(writer, entry.lpServiceName, entry.lpDisplayName, entry.ServiceStatusProcess, extended);
+        return true;
+    });
+    writer.Flush();
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] EnumServicesStatusEx failed with error code: ", error);
+    }
+    return error;
+}
+
+// Folds a character for case-insensitive matching; ASCII is folded inline, the rest goes through towlower
+inline wchar_t FoldCase(wchar_t ch) {
+    if (ch < 0x80) {
+        return (ch >= L'A' && ch <= L'Z') ? static_cast<wchar_t>(ch + (L'a' - L'A')) : ch;
+    }
+    return static_cast<wchar_t>(std::towlower(ch));
+}
+
+// A service selector, compiled once and then tested against names and display names without allocating:
+//   worker-*, svc??01   glob ('*' any run, '?' any one character), matched against the whole name
+//   /^sql.*(agent)?$/   ECMAScript regex between slashes, searched anywhere in the name
+// Matching ignores case, like the SCM does. Service names cannot contain '/', so a slash-delimited
+// selector is never a literal name. A regex costs a std::regex_search for every name that gets past its
+// literal prefilter (see RequiredLiteral), so one without a literal every match must contain, or one that
+// many names share, is far slower than a glob.
+class ServiceSelector {
+public:
+    static bool IsSelector(const std::wstring& text) {
+        return text.find_first_of(L"*?") != std::wstring::npos || (text.size() > 2 && text.front() == L'/' && text.back() == L'/');
+    }
+
+    // Compiles a selector; on failure prints why and returns false
+    bool Compile(const std::wstring& text) {
+        source = text;
+        if (text.size() > 2 && text.front() == L'/' && text.back() == L'/') {
+            isRegex = true;
+            std::wstring pattern = text.substr(1, text.size() - 2);
+            try {
+                regex.assign(pattern, std::regex_constants::ECMAScript | std::regex_constants::icase | std::regex_constants::optimize);
+            } catch (const std::regex_error& error) {
+                Err() << L"[SC_CLONE] Invalid regular expression " << text << L": " << Utf8ToWide(error.what()) << std::endl;
+                return false;
+            }
+            // std::regex is slow, so each top-level alternative contributes a literal every match of it contains;
+            // a name holding none of them is rejected before the regex runs. An alternative that is nothing but
+            // its literal decides the match on its own. One alternative without a literal disables the filter.
+            anchoredStart = false;
+            size_t begin = 0;
+            for (size_t end : TopLevelBars(pattern)) {
+                bool anchored = false;
+                bool whole = false;
+                std::wstring literal = RequiredLiteral(pattern.substr(begin, end - begin), anchored, whole);
+                begin = end + 1;
+                if (literal.empty()) {
+                    segments.clear();
+                    anchoredLiterals.clear();
+                    wholeLiterals.clear();
+                    break;
+                }
+                segments.push_back(literal);
+                anchoredLiterals.push_back(anchored);
+                wholeLiterals.push_back(whole);
+            }
+            BuildShifts();
+            return true;
+        }
+
+        // Split at '*' into folded literal segments; '?' stays in a segment as a one-character wildcard
+        anchoredStart = text.front() != L'*';
+        anchoredEnd = text.back() != L'*';
+        std::wstring segment;
+        for (wchar_t ch : text) {
+            if (ch == L'*') {
+                if (!segment.empty()) {
+                    segments.push_back(segment);
+                }
+                segment.clear();
+            } else {
+                segment += FoldCase(ch);
+            }
+        }
+        if (!segment.empty()) {
+            segments.push_back(segment);
+        }
+        BuildShifts();
+        return true;
+    }
+
+    bool Matches(const wchar_t* name, const wchar_t* displayName) const {
+        return Matches(name) || (displayName && Matches(displayName));
+    }
+
+    bool Matches(const wchar_t* text) const {
+        if (isRegex) {
+            if (!segments.empty()) {
+                size_t length = std::wcslen(text);
+                size_t found = segments.size();
+                for (size_t i = 0; i < segments.size() && found == segments.size(); ++i) {
+                    if (anchoredLiterals[i] ? SegmentAt(text, length, 0, segments[i]) : FindSegment(text, length, 0, i) != SIZE_MAX) {
+                        found = i;
+                    }
+                }
+                if (found == segments.size()) {
+                    return false;
+                }
+                if (wholeLiterals[found]) {
+                    return true;
+                }
+            }
+            return std::regex_search(text, regex);
+        }
+
+        // The leading segment is checked before anything else, so most names are rejected within a character
+        // or two, without even measuring their length
+        size_t position = 0;
+        size_t first = 0;
+        if (anchoredStart && !segments.empty()) {
+            const std::wstring& prefix = segments[0];
+            for (; position < prefix.size(); ++position) {
+                if (!text[position] || (prefix[position] != L'?' && FoldCase(text[position]) != prefix[position])) {
+                    return false;
+                }
+            }
+            first = 1;
+        }
+
+        size_t length = position + std::wcslen(text + position);
+        size_t last = segments.size();
+        if (first == 1 && segments.size() == 1 && anchoredEnd) {
+            return length == position;
+        }
+        if (anchoredEnd && last > first) {
+            --last;
+        }
+        // Middle segments: leftmost match of each in turn leaves the most room for the rest
+        for (size_t i = first; i < last; ++i) {
+            position = FindSegment(text, length, position, i);
+            if (position == SIZE_MAX) {
+                return false;
+            }
+            position += segments[i].size();
+        }
+        if (anchoredEnd && last < segments.size()) {
+            const std::wstring& suffix = segments[last];
+            return length >= position + suffix.size() && SegmentAt(text, length, length - suffix.size(), suffix);
+        }
+        return true;
+    }
+
+    const std::wstring& Text() const {
+        return source;
+    }
+
+private:
+    // Horspool shift tables: on a mismatch the search moves ahead by how far the character under the segment's
+    // last position is from that character's last earlier occurrence ('?' occurs everywhere)
+    void BuildShifts() {
+        for (const std::wstring& literal : segments) {
+            size_t limit = std::min<size_t>(literal.size(), 255);
+            uint8_t fallback = static_cast<uint8_t>(limit);
+            for (size_t i = 0; i + 1 < limit; ++i) {
+                if (literal[i] == L'?') {
+                    fallback = static_cast<uint8_t>(limit - 1 - i);
+                }
+            }
+            std::array<uint8_t, 128> shift;
+            shift.fill(fallback);
+            for (size_t i = 0; i + 1 < limit; ++i) {
+                if (literal[i] < 0x80 && literal[i] != L'?') {
+                    shift[literal[i]] = std::min(shift[literal[i]], static_cast<uint8_t>(limit - 1 - i));
+                    if (literal[i] >= L'a' && literal[i] <= L'z') {
+                        shift[literal[i] - (L'a' - L'A')] = shift[literal[i]];
+                    }
+                }
+            }
+            shifts.push_back(shift);
+            fallbackShifts.push_back(fallback);
+        }
+    }
+
+    // Leftmost occurrence of segment i at or after position, or SIZE_MAX
+    size_t FindSegment(const wchar_t* text, size_t length, size_t position, size_t i) const {
+        const std::wstring& segment = segments[i];
+        const std::array<uint8_t, 128>& shift = shifts[i];
+        size_t tail = segment.size() - 1;
+        while (position + segment.size() <= length) {
+            wchar_t ch = text[position + tail];
+            wchar_t folded = FoldCase(ch);
+            if ((segment[tail] == L'?' || folded == segment[tail]) && SegmentAt(text, length, position, segment)) {
+                return position;
+            }
+            position += ch < 0x80 ? shift[ch] : fallbackShifts[i];
+        }
+        return SIZE_MAX;
+    }
+
+    // Positions of the '|' that separate a regex's top-level alternatives, then the pattern's end
+    static std::vector<size_t> TopLevelBars(const std::wstring& pattern) {
+        std::vector<size_t> bars;
+        int depth = 0;
+        bool inClass = false;
+        for (size_t i = 0; i < pattern.size(); ++i) {
+            wchar_t ch = pattern[i];
+            if (ch == L'\\') {
+                ++i;
+            } else if (inClass) {
+                inClass = ch != L']';
+            } else if (ch == L'[') {
+                inClass = true;
+            } else if (ch == L'(') {
+                ++depth;
+            } else if (ch == L')') {
+                --depth;
+            } else if (ch == L'|' && depth == 0) {
+                bars.push_back(i);
+            }
+        }
+        bars.push_back(pattern.size());
+        return bars;
+    }
+
+    // The longest run of plain characters, folded, outside any group or class of one alternative, which every
+    // match of it contains. A character a quantifier may repeat ends the run ('+') or is dropped ('*', '?', '{').
+    // anchored: the run starts right after a leading '^'; whole: the alternative is '^'? and the run, nothing else.
+    static std::wstring RequiredLiteral(const std::wstring& alternative, bool& anchored, bool& whole) {
+        std::wstring best;
+        std::wstring run;
+        size_t runStart = 0;
+        size_t bestStart = 0;
+        int depth = 0;
+        bool inClass = false;
+        bool plain = true;  // nothing but literal characters so far, after an optional '^'
+        auto endRun = [&]() {
+            if (run.size() > best.size()) {
+                best = run;
+                bestStart = runStart;
+            }
+            run.clear();
+        };
+        size_t start = !alternative.empty() && alternative[0] == L'^' ? 1 : 0;
+        for (size_t i = start; i < alternative.size(); ++i) {
+            wchar_t ch = alternative[i];
+            if (inClass) {
+                if (ch == L'\\') {
+                    ++i;
+                } else if (ch == L']') {
+                    inClass = false;
+                }
+                continue;
+            }
+            if (depth > 0) {
+                if (ch == L'\\') {
+                    ++i;
+                } else if (ch == L'[') {
+                    inClass = true;
+                } else {
+                    depth += ch == L'(' ? 1 : ch == L')' ? -1 : 0;
+                }
+                continue;
+            }
+            if (ch == L'*' || ch == L'?' || ch == L'{') {
+                if (!run.empty()) {
+                    run.pop_back();
+                }
+                endRun();
+                plain = false;
+                if (ch == L'{') {
+                    while (i < alternative.size() && alternative[i] != L'}') {
+                        ++i;
+                    }
+                }
+                continue;
+            }
+            if (ch == L'+') {
+                endRun();
+                plain = false;
+                continue;
+            }
+            wchar_t literal = ch;
+            if (ch == L'\\') {
+                if (i + 1 >= alternative.size()) {
+                    break;
+                }
+                literal = alternative[++i];
+                if (std::iswalnum(literal)) {
+                    // A class (\d), an assertion (\b) or a code (\x41, \1); its hex digits are not literal text
+                    endRun();
+                    plain = false;
+                    for (int digits = 0; digits < 4 && i + 1 < alternative.size() && std::iswxdigit(alternative[i + 1]); ++digits) {
+                        ++i;
+                    }
+                    continue;
+                }
+            } else if (ch == L'(' || ch == L'[' || ch == L'.' || ch == L'^' || ch == L'$' || ch == L')') {
+                endRun();
+                plain = false;
+                depth += ch == L'(' ? 1 : 0;
+                inClass = ch == L'[';
+                continue;
+            }
+            if (run.empty()) {
+                runStart = i;
+            }
+            run += FoldCase(literal);
+        }
+        endRun();
+        anchored = start == 1 && bestStart == 1 && !best.empty();
+        whole = plain && !best.empty() && (start == 0 || anchored);
+        return best;
+    }
+
+    static bool SegmentAt(const wchar_t* text, size_t length, size_t position, const std::wstring& segment) {
+        if (position + segment.size() > length) {
+            return false;
+        }
+        for (size_t i = 0; i < segment.size(); ++i) {
+            if (segment[i] != L'?' && FoldCase(text[position + i]) != segment[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::wstring source;
+    bool isRegex = false;
+    std::wregex regex;
+    std::vector<std::wstring> segments;
+    std::vector<std::array<uint8_t, 128>> shifts;
+    std::vector<uint8_t> fallbackShifts;
+    std::vector<bool> anchoredLiterals;  // regex only, per segment: must be at the start of the text
+    std::vector<bool> wholeLiterals;     // regex only, per segment: finding it is a match
+    bool anchoredStart = true;
+    bool anchoredEnd = true;
+};
+
+// Replaces the selectors among names with the services they match, found in one enumeration of every service
+// and driver; literal names are kept. Each service appears once, in order of first appearance. A selector that
+// matches nothing is an error.
+DWORD ExpandServiceSelectors(ScmSession& session, const std::vector<std::wstring>& names, std::vector<std::wstring>& expanded) {
+    std::vector<ServiceSelector> selectors;
+    std::vector<size_t> selectorOf(names.size(), SIZE_MAX);
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (ServiceSelector::IsSelector(names[i])) {
+            selectors.emplace_back();
+            if (!selectors.back().Compile(names[i])) {
+                return ERROR_INVALID_PARAMETER;
+            }
+            selectorOf[i] = selectors.size() - 1;
+        }
+    }
+
+    std::vector<std::vector<std::wstring>> matches(selectors.size());
+    if (!selectors.empty()) {
+        DWORD error = ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+            for (size_t s = 0; s < selectors.size(); ++s) {
+                if (selectors[s].Matches(entry.lpServiceName, entry.lpDisplayName)) {
+                    matches[s].push_back(entry.lpServiceName);
+                }
+            }
+            return true;
+        });
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] EnumServicesStatusEx failed with error code: ", error);
+            return error;
+        }
+    }
+
+    std::set<std::wstring> seen;
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (selectorOf[i] == SIZE_MAX) {
+            if (seen.insert(ToLower(names[i])).second) {
+                expanded.push_back(names[i]);
+            }
+            continue;
+        }
+        if (matches[selectorOf[i]].empty()) {
+            Err() << L"[SC_CLONE] No service matches " << names[i] << std::endl;
+            return ERROR_SERVICE_DOES_NOT_EXIST;
+        }
+        for (const auto& name : matches[selectorOf[i]]) {
+            if (seen.insert(ToLower(name)).second) {
+                expanded.push_back(name);
+            }
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// query/queryex with a selector: the statuses come straight from the enumeration, with no per-service calls
+DWORD QuerySelectedServices(ScmSession& session, const std::wstring& text, bool extended) {
+    ServiceSelector selector;
+    if (!selector.Compile(text)) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    RecordWriter writer(kStatusColumns, extended ? 6 : 4);
+    size_t matched = 0;
+    DWORD error = ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+        if (selector.Matches(entry.lpServiceName, entry.lpDisplayName)) {
+            WriteServiceStatus(writer, entry.lpServiceName, entry.lpDisplayName, entry.ServiceStatusProcess, extended);
+            ++matched;
+        }
+        return true;
+    });
+    writer.Flush();
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] EnumServicesStatusEx failed with error code: ", error);
+        return error;
+    }
+    if (!matched) {
+        Err() << L"[SC_CLONE] No service matches " << text << std::endl;
+        return ERROR_SERVICE_DOES_NOT_EXIST;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Grow-only bump allocator for query buffers. Reset() makes all of it reusable for the next service without
+// freeing anything, so a pass over thousands of services settles into a single block after the first few.
+class ConfigArena {
+public:
+    // Returns 8-byte aligned memory that stays valid until the next Reset
+    BYTE* Allocate(size_t bytes) {
+        bytes = (bytes + 7) & ~static_cast<size_t>(7);
+        if (blocks.empty() || used + bytes > blocks.back().size) {
+            size_t size = std::max<size_t>(std::max<size_t>(bytes, 16 * 1024), blocks.empty() ? 0 : blocks.back().size * 2);
+            blocks.push_back(Block{std::unique_ptr<BYTE[]>(new BYTE[size]), size});
+            used = 0;
+        }
+        BYTE* memory = blocks.back().data.get() + used;
+        used += bytes;
+        return memory;
+    }
+
+    // Folds any overflow blocks into one block of their combined size
+    void Reset() {
+        if (blocks.size() > 1) {
+            size_t total = 0;
+            for (const Block& block : blocks) {
+                total += block.size;
+            }
+            blocks.clear();
+            blocks.push_back(Block{std::unique_ptr<BYTE[]>(new BYTE[total]), total});
+        }
+        used = 0;
+    }
+
+private:
+    struct Block {
+        std::unique_ptr<BYTE[]> data;
+        size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t used = 0;
+};
+
+// Parts of a service's configuration that ServiceConfigReader can fetch
+enum ServiceConfigPart : DWORD {
+    CONFIG_PART_BASE = 0x1,                  // QueryServiceConfigW
+    CONFIG_PART_DESCRIPTION = 0x2,           // SERVICE_CONFIG_DESCRIPTION
+    CONFIG_PART_FAILURE_ACTIONS = 0x4,       // SERVICE_CONFIG_FAILURE_ACTIONS
+    CONFIG_PART_FAILURE_ACTIONS_FLAG = 0x8,  // SERVICE_CONFIG_FAILURE_ACTIONS_FLAG
+    CONFIG_PART_ALL = 0xF,
+};
+
+// A service's configuration as returned by the API; the pointers refer to the reader's arena. A part that was
+// not requested, or could not be read, is null.
+struct ServiceConfig {
+    const QUERY_SERVICE_CONFIGW* config = nullptr;
+    const SERVICE_DESCRIPTIONW* description = nullptr;
+    const SERVICE_FAILURE_ACTIONSW* failureActions = nullptr;
+    const SERVICE_FAILURE_ACTIONS_FLAG* failureActionsFlag = nullptr;
+};
+
+// The one place that queries service configuration. Buffers come from a reusable arena, and the size each part
+// needed is remembered per service (and as a running maximum for services not seen yet), so that a repeat read
+// of a service costs exactly one API round trip per part instead of a sizing call plus the real one.
+class ServiceConfigReader {
+public:
+    // Fetches the requested parts. Results stay valid until the next Read on this reader.
+    DWORD Read(SC_HANDLE hService, const std::wstring& serviceName, DWORD parts, ServiceConfig& result) {
+        arena.Reset();
+        result = ServiceConfig();
+        std::wstring key = ToLower(serviceName);
+        if (hints.size() >= kMaxHints && hints.find(key) == hints.end()) {
+            // The reader lives as long as its thread; past the cap the running maxima stand in for all services
+            hints.clear();
+        }
+        std::array<DWORD, kPartCount>& serviceHints = hints.emplace(std::move(key), defaultHints).first->second;
+
+        DWORD firstError = ERROR_SUCCESS;
+        for (size_t part = 0; part < kPartCount; ++part) {
+            if (!(parts & (1u << part))) {
+                continue;
+            }
+            DWORD error = ERROR_SUCCESS;
+            const BYTE* data = Query(hService, part, serviceHints[part], error);
+            if (!data) {
+                firstError = firstError == ERROR_SUCCESS ? error : firstError;
+                continue;
+            }
+            switch (part) {
+                case 0: result.config = reinterpret_cast<const QUERY_SERVICE_CONFIGW*>(data); break;
+                case 1: result.description = reinterpret_cast<const SERVICE_DESCRIPTIONW*>(data); break;
+                case 2: result.failureActions = reinterpret_cast<const SERVICE_FAILURE_ACTIONSW*>(data); break;
+                case 3: result.failureActionsFlag = reinterpret_cast<const SERVICE_FAILURE_ACTIONS_FLAG*>(data); break;
+            }
+        }
+        return firstError;
+    }
+
+    // Forgets what a service needed, e.g. after its configuration was changed
+    void Invalidate(const std::wstring& serviceName) {
+        hints.erase(ToLower(serviceName));
+    }
+
+    size_t RoundTrips() const {
+        return roundTrips;
+    }
+
+private:
+    static const size_t kPartCount = 4;
+    static const size_t kMaxHints = 16384;  // services remembered, far more than a machine has
+
+    // Queries one part into the arena, starting at the size hint and growing it on ERROR_INSUFFICIENT_BUFFER
+    const BYTE* Query(SC_HANDLE hService, size_t part, DWORD& hint, DWORD& error) {
+        static const DWORD kConfig2Levels[kPartCount] = {0, SERVICE_CONFIG_DESCRIPTION, SERVICE_CONFIG_FAILURE_ACTIONS,
+                                                         SERVICE_CONFIG_FAILURE_ACTIONS_FLAG};
+        for (;;) {
+            BYTE* buffer = arena.Allocate(hint);
+            DWORD bytesNeeded = 0;
+            ++roundTrips;
+            BOOL ok = part == 0 ? Scm().QueryServiceConfigW(hService, reinterpret_cast<LPQUERY_SERVICE_CONFIGW>(buffer), hint, &bytesNeeded)
+                                : Scm().QueryServiceConfig2W(hService, kConfig2Levels[part], buffer, hint, &bytesNeeded);
+            if (ok) {
+                defaultHints[part] = std::max(defaultHints[part], hint);
+                return buffer;
+            }
+            error = GetLastError();
+            if (error != ERROR_INSUFFICIENT_BUFFER || bytesNeeded <= hint) {
+                return nullptr;
+            }
+            hint = bytesNeeded;
+        }
+    }
+
+    ConfigArena arena;
+    std::unordered_map<std::wstring, std::array<DWORD, kPartCount>> hints;
+    // Starting sizes for services not read before: enough for a typical service, raised to the largest seen
+    std::array<DWORD, kPartCount> defaultHints = {{1024, 512, 256, sizeof(SERVICE_FAILURE_ACTIONS_FLAG)}};
+    size_t roundTrips = 0;
+};
+
+// Each thread keeps its own reader, so the arena and size hints carry over across the commands of a batch
+ServiceConfigReader& ConfigReader() {
+    thread_local ServiceConfigReader reader;
+    return reader;
+}
+
+// Joins a REG_MULTI_SZ dependency list with '/', the separator sc.exe accepts for depend=
+std::wstring JoinMultiSz(const wchar_t* list) {
+    std::wstring joined;
+    for (const wchar_t* entry = list; entry && *entry; entry += std::wcslen(entry) + 1) {
+        if (!joined.empty()) {
+            joined += L'/';
+        }
+        joined += entry;
+    }
+    return joined;
+}
+
+// Formats failure actions in the sc.exe actions= syntax, e.g. "restart/60000/run/1000"
+std::wstring FailureActionsToString(const SC_ACTION* actions, DWORD count) {
+    std::wstring text;
+    for (DWORD i = 0; i < count; ++i) {
+        const wchar_t* name = EnumToName(kFailureActionNames, static_cast<DWORD>(actions[i].Type));
+        text += (i ? L"/" : L"") + (name ? std::wstring(name) : std::to_wstring(actions[i].Type)) + L"/" +
+                std::to_wstring(actions[i].Delay);
+    }
+    return text;
+}
+
+// Parses an sc.exe actions= value: action/delay pairs, with delays in milliseconds
+bool ParseFailureActions(const std::wstring& list, std::vector<SC_ACTION>& actions) {
+    std::wstringstream ss(list);
+    std::wstring type;
+    std::wstring delay;
+    while (std::getline(ss, type, L'/')) {
+        SC_ACTION action = {};
+        const EnumName* match = std::find_if(std::begin(kFailureActionNames), std::end(kFailureActionNames),
+                                             [&](const EnumName& entry) { return type == entry.name; });
+        if (match == std::end(kFailureActionNames) || !std::getline(ss, delay, L'/') || delay.empty() ||
+            delay.find_first_not_of(L"0123456789") != std::wstring::npos) {
+            return false;
+        }
+        action.Type = static_cast<SC_ACTION_TYPE>(match->value);
+        action.Delay = static_cast<DWORD>(std::wcstoul(delay.c_str(), nullptr, 10));
+        actions.push_back(action);
+    }
+    return !actions.empty();
+}
+
+// Desired configuration of one service, from create/config options or a line of an apply manifest.
+// Fields left unset are not touched.
+struct ServiceSpec {
+    std::wstring name;
+    std::optional<DWORD> serviceType;
+    std::optional<DWORD> startType;
+    std::optional<DWORD> errorControl;
+    std::optional<std::wstring> binaryPath;
+    std::optional<std::wstring> loadOrderGroup;
+    std::optional<std::vector<std::wstring>> dependencies;
+    std::optional<std::wstring> account;
+    std::optional<std::wstring> password;  // Write-only: sent on create, or together with an account change
+    std::optional<std::wstring> displayName;
+    std::optional<std::wstring> description;
+    std::optional<DWORD> resetPeriod;
+    std::optional<std::wstring> rebootMessage;
+    std::optional<std::wstring> failureCommand;
+    std::optional<std::vector<SC_ACTION>> failureActions;
+    std::optional<BOOL> failureActionsOnNonCrash;
+
+    // Configuration parts that hold the fields this spec sets
+    DWORD Parts() const {
+        DWORD parts = 0;
+        if (serviceType || startType || errorControl || binaryPath || loadOrderGroup || dependencies || account || displayName) {
+            parts |= CONFIG_PART_BASE;
+        }
+        if (description) {
+            parts |= CONFIG_PART_DESCRIPTION;
+        }
+        if (resetPeriod || rebootMessage || failureCommand || failureActions) {
+            parts |= CONFIG_PART_FAILURE_ACTIONS;
+        }
+        if (failureActionsOnNonCrash) {
+            parts |= CONFIG_PART_FAILURE_ACTIONS_FLAG;
+        }
+        return parts;
+    }
+};
+
+// Values accepted for type=, start= and error=, as sc.exe spells them
+constexpr EnumName kServiceTypeOptions[] = {
+    {SERVICE_WIN32_OWN_PROCESS, L"own"},
+    {SERVICE_WIN32_SHARE_PROCESS, L"share"},
+    {SERVICE_KERNEL_DRIVER, L"kernel"},
+    {SERVICE_FILE_SYSTEM_DRIVER, L"filesys"},
+};
+
+constexpr EnumName kStartTypeOptions[] = {
+    {SERVICE_BOOT_START, L"boot"},
+    {SERVICE_SYSTEM_START, L"system"},
+    {SERVICE_AUTO_START, L"auto"},
+    {SERVICE_DEMAND_START, L"demand"},
+    {SERVICE_DEMAND_START, L"manual"},
+    {SERVICE_DISABLED, L"disabled"},
+};
+
+constexpr EnumName kErrorControlOptions[] = {
+    {SERVICE_ERROR_IGNORE, L"ignore"},
+    {SERVICE_ERROR_NORMAL, L"normal"},
+    {SERVICE_ERROR_SEVERE, L"severe"},
+    {SERVICE_ERROR_CRITICAL, L"critical"},
+};
+
+template <size_t N>
+bool NameToEnum(const EnumName (&table)[N], const std::wstring& name, std::optional<DWORD>& value) {
+    std::wstring lower = ToLower(name);
+    for (const EnumName& entry : table) {
+        if (lower == entry.name) {
+            value = entry.value;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Sets one field of a spec from a key=value option; false for an unknown key or a bad value
+bool SetServiceSpecOption(ServiceSpec& spec, const std::wstring& key, const std::wstring& value) {
+    if (key == L"type") {
+        return NameToEnum(kServiceTypeOptions, value, spec.serviceType);
+    } else if (key == L"start") {
+        return NameToEnum(kStartTypeOptions, value, spec.startType);
+    } else if (key == L"error") {
+        return NameToEnum(kErrorControlOptions, value, spec.errorControl);
+    } else if (key == L"binpath" || key == L"path") {
+        spec.binaryPath = value;
+    } else if (key == L"group") {
+        spec.loadOrderGroup = value;
+    } else if (key == L"depend") {
+        spec.dependencies = SplitDependencies(value);
+    } else if (key == L"obj") {
+        spec.account = value;
+    } else if (key == L"password") {
+        spec.password = value;
+    } else if (key == L"displayname" || key == L"display") {
+        spec.displayName = value;
+    } else if (key == L"description") {
+        spec.description = value;
+    } else if (key == L"reset") {
+        if (value.empty() || value.find_first_not_of(L"0123456789") != std::wstring::npos) {
+            return false;
+        }
+        spec.resetPeriod = static_cast<DWORD>(std::wcstoul(value.c_str(), nullptr, 10));
+    } else if (key == L"reboot") {
+        spec.rebootMessage = value;
+    } else if (key == L"command") {
+        spec.failureCommand = value;
+    } else if (key == L"actions") {
+        std::vector<SC_ACTION> actions;
+        if (!value.empty() && !ParseFailureActions(value, actions)) {
+            return false;
+        }
+        spec.failureActions = actions;  // Empty clears the actions
+    } else if (key == L"failureflag") {
+        if (value != L"0" && value != L"1") {
+            return false;
+        }
+        spec.failureActionsOnNonCrash = value == L"1";
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Builds a spec from sc.exe-style "key= value" options
+bool ParseServiceSpecArgs(const std::vector<std::wstring>& args, size_t start, ServiceSpec& spec) {
+    for (const auto& option : ParseKeyValueArgs(args, start)) {
+        if (!SetServiceSpecOption(spec, option.first, option.second)) {
+            Err() << L"[SC_CLONE] Invalid option: " << option.first << L"= " << option.second << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Packs names into the REG_MULTI_SZ form ChangeServiceConfigW/CreateServiceW take (double-null terminated)
+std::wstring ToMultiSz(const std::vector<std::wstring>& names) {
+    std::wstring list;
+    for (const auto& name : names) {
+        list += name;
+        list += L'\0';
+    }
+    list += L'\0';
+    return list;
+}
+
+// What applying a spec did to one service
+struct ApplyOutcome {
+    bool created = false;
+    std::vector<const wchar_t*> changed;  // Option names of the fields that differed
+    const wchar_t* failedCall = nullptr;  // The API that failed, if any
+};
+
+// Compares an API string (null meaning empty) with a desired value
+bool SameText(const wchar_t* current, const std::wstring& desired, bool ignoreCase = false) {
+    std::wstring value = current ? current : L"";
+    return ignoreCase ? ToLower(value) == ToLower(desired) : value == desired;
+}
+
+// Compares a REG_MULTI_SZ dependency list with desired names, ignoring case
+bool SameNames(const wchar_t* current, const std::vector<std::wstring>& desired) {
+    size_t i = 0;
+    for (const wchar_t* entry = current; entry && *entry; entry += std::wcslen(entry) + 1, ++i) {
+        if (i == desired.size() || ToLower(entry) != ToLower(desired[i])) {
+            return false;
+        }
+    }
+    return i == desired.size();
+}
+
+bool SameActions(const SC_ACTION* current, DWORD count, const std::vector<SC_ACTION>& desired) {
+    if (!current) {
+        count = 0;
+    }
+    if (count != desired.size()) {
+        return false;
+    }
+    for (DWORD i = 0; i < count; ++i) {
+        if (current[i].Type != desired[i].Type || current[i].Delay != desired[i].Delay) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Creates the service a spec describes. Unset fields get the sc.exe defaults: own process, demand start,
+// normal error control, LocalSystem. The full-access handle stays cached for follow-up calls.
+DWORD CreateServiceFromSpec(ScmSession& session, const ServiceSpec& spec) {
+    // CreateServiceW needs only SC_MANAGER_CREATE_SERVICE; asking for more fails for non-admin callers and costs
+    // an extra access check
+    SC_HANDLE hSCManager = session.Manager(SC_MANAGER_CONNECT | SC_MANAGER_CREATE_SERVICE);
+    if (!hSCManager) {
+        return GetLastError();
+    }
+
+    std::wstring dependencies = spec.dependencies ? ToMultiSz(*spec.dependencies) : L"";
+    SC_HANDLE hService = Scm().CreateServiceW(
+        hSCManager,
+        spec.name.c_str(),
+        spec.displayName ? spec.displayName->c_str() : spec.name.c_str(),
+        SERVICE_ALL_ACCESS,
+        spec.serviceType.value_or(SERVICE_WIN32_OWN_PROCESS),
+        spec.startType.value_or(SERVICE_DEMAND_START),
+        spec.errorControl.value_or(SERVICE_ERROR_NORMAL),
+        spec.binaryPath ? spec.binaryPath->c_str() : L"",
+        spec.loadOrderGroup ? spec.loadOrderGroup->c_str() : NULL,
+        NULL,
+        spec.dependencies ? dependencies.c_str() : NULL,
+        spec.account ? spec.account->c_str() : NULL,
+        spec.password ? spec.password->c_str() : NULL
+    );
+    if (!hService) {
+        return GetLastError();
+    }
+    session.Adopt(spec.name, hService, SERVICE_ALL_ACCESS);
+    return ERROR_SUCCESS;
+}
+
+// Compares a spec with a service's current configuration and issues only the calls for what differs: at most
+// one ChangeServiceConfigW (unchanged fields passed as SERVICE_NO_CHANGE/NULL) and one ChangeServiceConfig2W per
+// level. A service that does not exist is created when the spec has a binary path. The service is read through
+// a query-only handle, which is widened only when something has to be written, so applying a spec that already
+// matches costs the same as reading the service. With dryRun the differences are reported but not written.
+DWORD ApplyServiceSpec(ScmSession& session, const ServiceSpec& spec, ApplyOutcome& outcome, bool dryRun = false) {
+    bool restarts = spec.failureActions && std::any_of(spec.failureActions->begin(), spec.failureActions->end(),
+                                                        [](const SC_ACTION& action) { return action.Type == SC_ACTION_RESTART; });
+    DWORD writeAccess = SERVICE_QUERY_CONFIG | SERVICE_CHANGE_CONFIG | (restarts ? SERVICE_START : 0);
+
+    ServiceConfig current;
+    SC_HANDLE hService = session.Service(spec.name, SERVICE_QUERY_CONFIG);
+    if (!hService) {
+        DWORD error = GetLastError();
+        if (error != ERROR_SERVICE_DOES_NOT_EXIST || !spec.binaryPath) {
+            outcome.failedCall = L"OpenServiceW";
+            return error;
+        }
+        if (!dryRun) {
+            error = CreateServiceFromSpec(session, spec);
+            if (error != ERROR_SUCCESS) {
+                outcome.failedCall = L"CreateServiceW";
+                return error;
+            }
+        }
+        // The base fields went into CreateServiceW; description and failure settings start out empty
+        outcome.created = true;
+    } else if (spec.Parts()) {
+        DWORD error = ConfigReader().Read(hService, spec.name, spec.Parts(), current);
+        if (error != ERROR_SUCCESS) {
+            outcome.failedCall = (spec.Parts() & CONFIG_PART_BASE) && !current.config ? L"QueryServiceConfigW" : L"QueryServiceConfig2W";
+            return error;
+        }
+    }
+    auto writable = [&]() -> SC_HANDLE {
+        SC_HANDLE handle = session.Service(spec.name, writeAccess);
+        if (!handle) {
+            outcome.failedCall = L"OpenServiceW";
+        }
+        return handle;
+    };
+    auto failed = [&](const wchar_t* call) {
+        outcome.failedCall = call;
+        return GetLastError();
+    };
+
+    if (const QUERY_SERVICE_CONFIGW* now = current.config) {
+        DWORD serviceType = SERVICE_NO_CHANGE;
+        DWORD startType = SERVICE_NO_CHANGE;
+        DWORD errorControl = SERVICE_NO_CHANGE;
+        LPCWSTR binaryPath = NULL;
+        LPCWSTR group = NULL;
+        LPCWSTR dependencies = NULL;
+        LPCWSTR account = NULL;
+        LPCWSTR password = NULL;
+        LPCWSTR displayName = NULL;
+        std::wstring dependencyList;
+        size_t before = outcome.changed.size();
+        if (spec.serviceType && *spec.serviceType != now->dwServiceType) {
+            serviceType = *spec.serviceType;
+            outcome.changed.push_back(L"type");
+        }
+        if (spec.startType && *spec.startType != now->dwStartType) {
+            startType = *spec.startType;
+            outcome.changed.push_back(L"start");
+        }
+        if (spec.errorControl && *spec.errorControl != now->dwErrorControl) {
+            errorControl = *spec.errorControl;
+            outcome.changed.push_back(L"error");
+        }
+        if (spec.binaryPath && !SameText(now->lpBinaryPathName, *spec.binaryPath)) {
+            binaryPath = spec.binaryPath->c_str();
+            outcome.changed.push_back(L"binpath");
+        }
+        if (spec.loadOrderGroup && !SameText(now->lpLoadOrderGroup, *spec.loadOrderGroup, true)) {
+            group = spec.loadOrderGroup->c_str();
+            outcome.changed.push_back(L"group");
+        }
+        if (spec.dependencies && !SameNames(now->lpDependencies, *spec.dependencies)) {
+            dependencyList = ToMultiSz(*spec.dependencies);
+            dependencies = dependencyList.c_str();
+            outcome.changed.push_back(L"depend");
+        }
+        // The password cannot be read back, so it is only sent along with an account change
+        if (spec.account && !SameText(now->lpServiceStartName, *spec.account, true)) {
+            account = spec.account->c_str();
+            password = spec.password ? spec.password->c_str() : NULL;
+            outcome.changed.push_back(L"obj");
+        }
+        if (spec.displayName && !SameText(now->lpDisplayName, *spec.displayName)) {
+            displayName = spec.displayName->c_str();
+            outcome.changed.push_back(L"displayname");
+        }
+
+        if (outcome.changed.size() > before && !dryRun) {
+            SC_HANDLE handle = writable();
+            if (!handle) {
+                return GetLastError();
+            }
+            if (!Scm().ChangeServiceConfigW(handle, serviceType, startType, errorControl, binaryPath, group, NULL,
+                                            dependencies, account, password, displayName)) {
+                return failed(L"ChangeServiceConfigW");
+            }
+        }
+    }
+
+    if (spec.description) {
+        const wchar_t* now = current.description ? current.description->lpDescription : nullptr;
+        if (!SameText(now, *spec.description)) {
+            outcome.changed.push_back(L"description");
+            SERVICE_DESCRIPTIONW info = {const_cast<LPWSTR>(spec.description->c_str())};
+            SC_HANDLE handle = dryRun ? NULL : writable();
+            if (!dryRun && (!handle || !Scm().ChangeServiceConfig2W(handle, SERVICE_CONFIG_DESCRIPTION, &info))) {
+                return handle ? failed(L"ChangeServiceConfig2W") : GetLastError();
+            }
+        }
+    }
+
+    if (spec.resetPeriod || spec.rebootMessage || spec.failureCommand || spec.failureActions) {
+        const SERVICE_FAILURE_ACTIONSW* now = current.failureActions;
+        std::vector<SC_ACTION> actions;
+        if (now && now->lpsaActions) {
+            actions.assign(now->lpsaActions, now->lpsaActions + now->cActions);
+        }
+        DWORD resetPeriod = now ? now->dwResetPeriod : 0;
+        bool resetDiffers = spec.resetPeriod && *spec.resetPeriod != resetPeriod;
+        bool actionsDiffer = spec.failureActions && !SameActions(actions.data(), static_cast<DWORD>(actions.size()), *spec.failureActions);
+        bool rebootDiffers = spec.rebootMessage && !SameText(now ? now->lpRebootMsg : nullptr, *spec.rebootMessage);
+        bool commandDiffers = spec.failureCommand && !SameText(now ? now->lpCommand : nullptr, *spec.failureCommand);
+        if (resetDiffers) {
+            outcome.changed.push_back(L"reset");
+        }
+        if (actionsDiffer) {
+            outcome.changed.push_back(L"actions");
+        }
+        if (rebootDiffers) {
+            outcome.changed.push_back(L"reboot");
+        }
+        if (commandDiffers) {
+            outcome.changed.push_back(L"command");
+        }
+
+        if ((resetDiffers || actionsDiffer || rebootDiffers || commandDiffers) && !dryRun) {
+            // The reset period only takes effect together with an action array, so the two travel together;
+            // a non-null array with no entries clears the actions
+            SERVICE_FAILURE_ACTIONSW info = {};
+            SC_ACTION none = {};
+            if (spec.failureActions) {
+                actions = *spec.failureActions;
+            }
+            if (resetDiffers || actionsDiffer) {
+                info.dwResetPeriod = spec.resetPeriod.value_or(resetPeriod);
+                info.cActions = static_cast<DWORD>(actions.size());
+                info.lpsaActions = actions.empty() ? &none : actions.data();
+            }
+            info.lpRebootMsg = rebootDiffers ? const_cast<LPWSTR>(spec.rebootMessage->c_str()) : nullptr;
+            info.lpCommand = commandDiffers ? const_cast<LPWSTR>(spec.failureCommand->c_str()) : nullptr;
+            SC_HANDLE handle = writable();
+            if (!handle) {
+                return GetLastError();
+            }
+            if (!Scm().ChangeServiceConfig2W(handle, SERVICE_CONFIG_FAILURE_ACTIONS, &info)) {
+                return failed(L"ChangeServiceConfig2W");
+            }
+        }
+    }
+
+    if (spec.failureActionsOnNonCrash) {
+        BOOL now = current.failureActionsFlag ? current.failureActionsFlag->fFailureActionsOnNonCrashFailures : FALSE;
+        if (!now != !*spec.failureActionsOnNonCrash) {
+            outcome.changed.push_back(L"failureflag");
+            SERVICE_FAILURE_ACTIONS_FLAG info = {*spec.failureActionsOnNonCrash};
+            SC_HANDLE handle = dryRun ? NULL : writable();
+            if (!dryRun && (!handle || !Scm().ChangeServiceConfig2W(handle, SERVICE_CONFIG_FAILURE_ACTIONS_FLAG, &info))) {
+                return handle ? failed(L"ChangeServiceConfig2W") : GetLastError();
+            }
+        }
+    }
+
+    if ((outcome.created || !outcome.changed.empty()) && !dryRun) {
+        ConfigReader().Invalidate(spec.name);
+    }
+    return ERROR_SUCCESS;
+}
+
+// Creates a new service entry in the Service Control Manager, then sets any description and failure options
+DWORD CreateServiceEntry(ScmSession& session, const ServiceSpec& spec) {
+    if (!spec.binaryPath) {
+        Err() << L"[SC_CLONE] create needs a binary path (binPath= <path>)." << std::endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    DWORD error = CreateServiceFromSpec(session, spec);
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] CreateService failed with error code: ", error);
+        return error;
+    }
+
+    // The remaining settings are ChangeServiceConfig2W levels, written through the cached full-access handle
+    ServiceSpec extra;
+    extra.name = spec.name;
+    extra.description = spec.description;
+    extra.resetPeriod = spec.resetPeriod;
+    extra.rebootMessage = spec.rebootMessage;
+    extra.failureCommand = spec.failureCommand;
+    extra.failureActions = spec.failureActions;
+    extra.failureActionsOnNonCrash = spec.failureActionsOnNonCrash;
+    ApplyOutcome outcome;
+    error = ApplyServiceSpec(session, extra, outcome);
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(std::wstring(L"[SC_CLONE] Service ") + spec.name + L" created, but " + outcome.failedCall +
+                          L" failed with error code: ", error);
+        return error;
+    }
+
+    // Confirm service creation; the full-access handle stays cached for follow-up commands
+    Out() << L"[SC_CLONE] Service " << spec.name << L" created successfully." << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// Joins the option names ApplyServiceSpec reported as changed
+std::wstring JoinChanges(const std::vector<const wchar_t*>& changed) {
+    std::wstring text;
+    for (const wchar_t* name : changed) {
+        text += (text.empty() ? L"" : L", ") + std::wstring(name);
+    }
+    return text;
+}
+
+// Starts a service entry
+DWORD StartServiceEntry(ScmSession& session, const std::wstring& serviceName) {
+    // Open the specified service for starting
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_START);
+    if (!hService) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", error);
+        return error;
+    }
+
+    // Attempt to start the service
+    if (!Scm().StartServiceW(hService, 0, NULL)) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] StartService failed with error code: ", error);
+        return error;
+    }
+
+    Out() << L"[SC_CLONE] StartService SUCCESS" << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// Stops a service entry
+DWORD StopServiceEntry(ScmSession& session, const std::wstring& serviceName) {
+    // Open the specified service for stopping
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_STOP);
+    if (!hService) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", error);
+        return error;
+    }
+
+    // Attempt to stop the service
+    SERVICE_STATUS status;
+    if (!Scm().ControlService(hService, SERVICE_CONTROL_STOP, &status)) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] ControlService failed with error code: ", error);
+        return error;
+    }
+
+    Out() << L"[SC_CLONE] ControlService SUCCESS" << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// Deletes a service entry from the Service Control Manager
+DWORD DeleteServiceEntry(ScmSession& session, const std::wstring& serviceName) {
+    // Open the specified service for deletion
+    SC_HANDLE hService = session.Service(serviceName, DELETE);
+    if (!hService) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", error);
+        return error;
+    }
+
+    // Attempt to delete the service
+    if (!Scm().DeleteService(hService)) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] DeleteService failed with error code: ", error);
+        return error;
+    }
+
+    // Drop the cached handle so the SCM can actually remove the entry
+    session.Forget(serviceName);
+    Out() << L"[SC_CLONE] DeleteService SUCCESS" << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// Configures the service (set start type, etc.)
+DWORD ConfigureService(ScmSession& session, const std::wstring& serviceName, const std::wstring& startType = L"") {
+    // Open the specified service; reading its configuration must not need the right to change it
+    DWORD access = SERVICE_QUERY_CONFIG | (startType.empty() ? 0 : SERVICE_CHANGE_CONFIG);
+    SC_HANDLE hService = session.Service(serviceName, access);
+    if (!hService) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", error);
+        return error;
+    }
+
+    // If no startType specified, just query and display service configuration
+    if (startType.empty()) {
+        ServiceConfig config;
+        DWORD result = ConfigReader().Read(hService, serviceName, CONFIG_PART_BASE, config);
+        if (result != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] QueryServiceConfigW failed with error code: ", result);
+            return result;
+        }
+
+        wchar_t typeName[128];
+        const QUERY_SERVICE_CONFIGW* base = config.config;
+        RecordWriter writer(kConfigColumns, sizeof(kConfigColumns) / sizeof(kConfigColumns[0]));
+        writer.String(serviceName);
+        writer.Enum(base->dwServiceType, ServiceTypeName(base->dwServiceType, typeName, 128), true);
+        writer.Enum(base->dwStartType, EnumToName(kStartTypeNames, base->dwStartType));
+        writer.Enum(base->dwErrorControl, EnumToName(kErrorControlNames, base->dwErrorControl));
+        writer.String(base->lpBinaryPathName);
+        writer.String(base->lpLoadOrderGroup);
+        writer.Number(base->dwTagId);
+        writer.String(base->lpDisplayName);
+        writer.String(JoinMultiSz(base->lpDependencies));
+        writer.String(base->lpServiceStartName);
+        writer.EndRecord();
+        return ERROR_SUCCESS;
+    }
+
+    // Determine start type based on user input
+    DWORD dwStartType = SERVICE_NO_CHANGE;
+    if (startType == L"auto") {
+        dwStartType = SERVICE_AUTO_START;
+    } else if (startType == L"manual") {
+        dwStartType = SERVICE_DEMAND_START;
+    } else if (startType == L"disabled") {
+        dwStartType = SERVICE_DISABLED;
+    } else {
+        Err() << L"[SC_CLONE] Invalid start type: " << startType << L". Use 'automatic', 'manual', or 'disabled'." << std::endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    // Apply the configuration change
+    Out() << L"[SC_CLONE] Updating service start type to: " << startType << std::endl;
+    if (!Scm().ChangeServiceConfigW(hService,
+                                    SERVICE_NO_CHANGE,
+                                    dwStartType,
+                                    SERVICE_NO_CHANGE,
+                                    NULL, NULL, NULL, NULL, NULL, NULL, NULL)) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] ChangeServiceConfigW failed with error code: ", error);
+        return error;
+    }
+
+    ConfigReader().Invalidate(serviceName);
+    Out() << L"[SC_CLONE] Service start type successfully changed to: " << startType << std::endl;
+    return ERROR_SUCCESS;
+}
+
+
+// Function to query and display the description and configuration details of a service
+DWORD QueryServiceDescription(ScmSession& session, const std::wstring& serviceName) {
+    // Open the specified service to query its configuration details
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_QUERY_CONFIG);
+    if (!hService) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", error);
+        return error;
+    }
+
+    // Fetch the base configuration and the SERVICE_CONFIG_DESCRIPTION text in one pass
+    ServiceConfig config;
+    DWORD result = ConfigReader().Read(hService, serviceName, CONFIG_PART_BASE | CONFIG_PART_DESCRIPTION, config);
+    if (result != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] QueryServiceConfig failed with error code: ", result);
+        return result;
+    }
+
+    wchar_t typeName[128];
+    const QUERY_SERVICE_CONFIGW* base = config.config;
+    RecordWriter writer(kDescriptionColumns, sizeof(kDescriptionColumns) / sizeof(kDescriptionColumns[0]));
+    writer.String(serviceName);
+    writer.String(base->lpDisplayName);
+    writer.String(config.description->lpDescription);  // Null when the service has no description
+    writer.Enum(base->dwServiceType, ServiceTypeName(base->dwServiceType, typeName, 128), true);
+    writer.Enum(base->dwStartType, EnumToName(kStartTypeNames, base->dwStartType));
+    writer.Enum(base->dwErrorControl, EnumToName(kErrorControlNames, base->dwErrorControl));
+    writer.String(base->lpBinaryPathName);  // Path to the service binary
+    writer.EndRecord();
+    return ERROR_SUCCESS;
+}
+
+// Shows a service's failure actions, or changes them when reset=/actions=/reboot=/command= options are given
+DWORD ConfigureServiceFailure(ScmSession& session, const std::wstring& serviceName, const std::vector<std::wstring>& args) {
+    std::vector<std::pair<std::wstring, std::wstring>> options = ParseKeyValueArgs(args, 0);
+
+    if (options.empty()) {
+        SC_HANDLE hService = session.Service(serviceName, SERVICE_QUERY_CONFIG);
+        if (!hService) {
+            DWORD error = GetLastError();
+            PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", error);
+            return error;
+        }
+
+        ServiceConfig config;
+        DWORD result = ConfigReader().Read(hService, serviceName, CONFIG_PART_FAILURE_ACTIONS | CONFIG_PART_FAILURE_ACTIONS_FLAG, config);
+        if (!config.failureActions) {
+            PrintErrorMessage(L"[SC_CLONE] QueryServiceConfig2 failed with error code: ", result);
+            return result;
+        }
+
+        const SERVICE_FAILURE_ACTIONSW* failure = config.failureActions;
+        RecordWriter writer(kFailureColumns, sizeof(kFailureColumns) / sizeof(kFailureColumns[0]));
+        writer.String(serviceName);
+        writer.Number(failure->dwResetPeriod);
+        writer.String(failure->lpRebootMsg);
+        writer.String(failure->lpCommand);
+        writer.String(FailureActionsToString(failure->lpsaActions, failure->lpsaActions ? failure->cActions : 0));
+        if (config.failureActionsFlag) {
+            writer.Number(config.failureActionsFlag->fFailureActionsOnNonCrashFailures);
+        } else {
+            writer.String(nullptr);  // Flag not supported by this SCM
+        }
+        writer.EndRecord();
+        return ERROR_SUCCESS;
+    }
+
+    // Parse arguments for reset period, action types, and any additional parameters
+    DWORD resetPeriod = 0;
+    std::vector<SC_ACTION> actions;
+    std::wstring rebootMsg;
+    std::wstring failureCommand;
+    bool hasActions = false;
+    bool hasRebootMsg = false;
+    bool hasCommand = false;
+    for (const auto& option : options) {
+        if (option.first == L"reset") {
+            resetPeriod = static_cast<DWORD>(std::wcstoul(option.second.c_str(), nullptr, 10));
+        } else if (option.first == L"actions") {
+            if (!ParseFailureActions(option.second, actions)) {
+                Err() << L"[SC_CLONE] Invalid actions: " << option.second << L". Use <none|restart|reboot|run>/<delay ms>/..." << std::endl;
+                return ERROR_INVALID_PARAMETER;
+            }
+            hasActions = true;
+        } else if (option.first == L"reboot") {
+            rebootMsg = option.second;  // Custom reboot message
+            hasRebootMsg = true;
+        } else if (option.first == L"command") {
+            failureCommand = option.second;  // Command to run upon failure
+            hasCommand = true;
+        } else {
+            Err() << L"[SC_CLONE] Unknown failure option: " << option.first << L"=" << std::endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    // A restart action also needs SERVICE_START on the handle
+    bool restarts = std::any_of(actions.begin(), actions.end(), [](const SC_ACTION& action) { return action.Type == SC_ACTION_RESTART; });
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_CHANGE_CONFIG | (restarts ? SERVICE_START : 0));
+    if (!hService) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] OpenService failed with error code: ", error);
+        return error;
+    }
+
+    // Options that were not given are passed as NULL, which leaves them unchanged
+    SERVICE_FAILURE_ACTIONSW newFailureActions = {};
+    newFailureActions.dwResetPeriod = resetPeriod;
+    newFailureActions.cActions = static_cast<DWORD>(actions.size());
+    newFailureActions.lpsaActions = hasActions ? actions.data() : nullptr;
+    newFailureActions.lpRebootMsg = hasRebootMsg ? const_cast<LPWSTR>(rebootMsg.c_str()) : nullptr;
+    newFailureActions.lpCommand = hasCommand ? const_cast<LPWSTR>(failureCommand.c_str()) : nullptr;
+
+    // Apply the new failure actions to the service
+    if (!Scm().ChangeServiceConfig2W(hService, SERVICE_CONFIG_FAILURE_ACTIONS, &newFailureActions)) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] ChangeServiceConfig2 failed with error code: ", error);
+        return error;
+    }
+    ConfigReader().Invalidate(serviceName);
+    Out() << L"[SC_CLONE] Service failure actions configured for: " << serviceName << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// Changes a service's configuration from sc.exe-style options (start= error= binPath= depend= obj= password=
+// DisplayName= group= type=), writing only the fields that differ
+DWORD ReconfigureService(ScmSession& session, const std::wstring& serviceName, const std::vector<std::wstring>& args) {
+    ServiceSpec spec;
+    spec.name = serviceName;
+    if (!ParseServiceSpecArgs(args, 2, spec)) {
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    ApplyOutcome outcome;
+    DWORD error = ApplyServiceSpec(session, spec, outcome);
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(std::wstring(L"[SC_CLONE] ") + outcome.failedCall + L" failed with error code: ", error);
+        return error;
+    }
+    if (outcome.changed.empty()) {
+        Out() << L"[SC_CLONE] Configuration of " << serviceName << L" already matches; nothing changed." << std::endl;
+    } else {
+        Out() << L"[SC_CLONE] ChangeServiceConfig SUCCESS for " << serviceName << L" (" << JoinChanges(outcome.changed) << L")" << std::endl;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Reads an apply manifest: one service per line, "<name> key=value ..." with the create/config option names
+// (quotes group values with spaces; an empty value such as depend= clears the field). # starts a comment.
+bool LoadManifest(const std::wstring& path, std::vector<ServiceSpec>& specs) {
+    std::ifstream file{std::filesystem::path(path)};
+    if (!file) {
+        Err() << L"[SC_CLONE] Unable to open manifest: " << path << std::endl;
+        return false;
+    }
+
+    std::set<std::wstring> seen;
+    std::string rawLine;
+    size_t lineNumber = 0;
+    while (std::getline(file, rawLine)) {
+        ++lineNumber;
+        if (lineNumber == 1 && rawLine.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+            rawLine.erase(0, 3);
+        }
+        std::vector<std::wstring> fields = SplitCommandLine(Utf8ToWide(rawLine));
+        if (fields.empty() || fields[0][0] == L'#') {
+            continue;
+        }
+
+        ServiceSpec spec;
+        spec.name = fields[0];
+        if (!seen.insert(ToLower(spec.name)).second) {
+            Err() << L"[SC_CLONE] Manifest line " << lineNumber << L": " << spec.name << L" is listed twice." << std::endl;
+            return false;
+        }
+        for (size_t i = 1; i < fields.size(); ++i) {
+            size_t eq = fields[i].find(L'=');
+            if (eq == std::wstring::npos ||
+                !SetServiceSpecOption(spec, ToLower(fields[i].substr(0, eq)), fields[i].substr(eq + 1))) {
+                Err() << L"[SC_CLONE] Manifest line " << lineNumber << L": invalid option " << fields[i] << std::endl;
+                return false;
+            }
+        }
+        specs.push_back(std::move(spec));
+    }
+    return true;
+}
+
+// Brings every service in a manifest to its desired configuration. Services are independent, so they are
+// read, compared and written concurrently on a worker pool (each worker with its own configuration reader);
+// the results are printed in manifest order, unchanged services only in the summary.
+DWORD ApplyManifest(ScmSession& session, const std::vector<std::wstring>& args) {
+    std::wstring path;
+    size_t workers = 8;
+    bool dryRun = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i].compare(0, 11, L"--parallel=") == 0) {
+            workers = std::max<size_t>(1, std::wcstoul(args[i].c_str() + 11, nullptr, 10));
+        } else if (args[i] == L"--dry-run") {
+            dryRun = true;
+        } else if (path.empty()) {
+            path = args[i];
+        } else {
+            path.clear();
+            break;
+        }
+    }
+    if (path.empty()) {
+        Err() << L"[SC_CLONE] Usage: sc_clone apply <manifest> [--dry-run] [--parallel=N]" << std::endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    std::vector<ServiceSpec> specs;
+    if (!LoadManifest(path, specs)) {
+        return ERROR_INVALID_DATA;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<ApplyOutcome> outcomes(specs.size());
+    std::vector<DWORD> errors(specs.size());
+    ParallelFor(specs.size(), workers, [&](size_t i) {
+        errors[i] = ApplyServiceSpec(session, specs[i], outcomes[i], dryRun);
+    });
+
+    size_t created = 0;
+    size_t changed = 0;
+    size_t failed = 0;
+    DWORD firstError = ERROR_SUCCESS;
+    const wchar_t* verb = dryRun ? L"WOULD " : L"";
+    for (size_t i = 0; i < specs.size(); ++i) {
+        const ApplyOutcome& outcome = outcomes[i];
+        if (errors[i] != ERROR_SUCCESS) {
+            ++failed;
+            firstError = firstError == ERROR_SUCCESS ? errors[i] : firstError;
+            Out() << L"[SC_CLONE] " << specs[i].name << L": FAILED " << outcome.failedCall << L" " << errors[i] << std::endl;
+        } else if (outcome.created) {
+            ++created;
+            Out() << L"[SC_CLONE] " << specs[i].name << L": " << verb << L"CREATE" << (dryRun ? L"" : L"D")
+                  << (outcome.changed.empty() ? L"" : L" (" + JoinChanges(outcome.changed) + L")") << std::endl;
+        } else if (!outcome.changed.empty()) {
+            ++changed;
+            Out() << L"[SC_CLONE] " << specs[i].name << L": " << verb << L"CHANGE" << (dryRun ? L"" : L"D")
+                  << L" " << JoinChanges(outcome.changed) << std::endl;
+        }
+    }
+
+    Out() << L"[SC_CLONE] Apply " << (dryRun ? L"(dry run) " : L"") << L"complete: " << specs.size() << L" services, "
+          << created << L" created, " << changed << L" changed, " << specs.size() - created - changed - failed
+          << L" unchanged, " << failed << L" failed (" << static_cast<long long>(ElapsedMs(start)) << L" ms)." << std::endl;
+    return firstError;
+}
+
+// Reads a service's dependencies from QueryServiceConfigW; load-order group entries ("+Group") are skipped
+DWORD QueryServiceDependencies(ScmSession& session, const std::wstring& serviceName, std::vector<std::wstring>& dependencies) {
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_QUERY_CONFIG);
+    if (!hService) {
+        return GetLastError();
+    }
+
+    ServiceConfig config;
+    DWORD error = ConfigReader().Read(hService, serviceName, CONFIG_PART_BASE, config);
+    if (error != ERROR_SUCCESS) {
+        return error;
+    }
+    for (LPCWSTR entry = config.config->lpDependencies; entry && *entry; entry += std::wcslen(entry) + 1) {
+        if (*entry != L'+') {
+            dependencies.push_back(entry);
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// Lists the services that depend on this one, directly or indirectly (EnumDependentServicesW)
+DWORD QueryDependentServices(ScmSession& session, const std::wstring& serviceName, DWORD serviceState, std::vector<std::wstring>& dependents) {
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_ENUMERATE_DEPENDENTS);
+    if (!hService) {
+        return GetLastError();
+    }
+
+    DWORD bytesNeeded = 0;
+    DWORD count = 0;
+    std::vector<BYTE> buffer(1024);
+    while (!Scm().EnumDependentServicesW(hService, serviceState, reinterpret_cast<LPENUM_SERVICE_STATUSW>(buffer.data()),
+                                         static_cast<DWORD>(buffer.size()), &bytesNeeded, &count)) {
+        DWORD error = GetLastError();
+        if (error != ERROR_MORE_DATA) {
+            return error;
+        }
+        buffer.resize(bytesNeeded);
+    }
+
+    const ENUM_SERVICE_STATUSW* entries = reinterpret_cast<const ENUM_SERVICE_STATUSW*>(buffer.data());
+    for (DWORD i = 0; i < count; ++i) {
+        dependents.push_back(entries[i].lpServiceName);
+    }
+    return ERROR_SUCCESS;
+}
+
+// Polls QueryServiceStatusEx paced by the service's dwWaitHint until it reaches desiredState.
+// Only used when status change notifications are unavailable.
+DWORD PollForServiceState(SC_HANDLE hService, DWORD desiredState, DWORD timeoutMs, std::chrono::steady_clock::time_point start) {
+    for (;;) {
+        SERVICE_STATUS_PROCESS ssp;
+        DWORD bytesNeeded = 0;
+        if (!Scm().QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp, sizeof(ssp), &bytesNeeded)) {
+            return GetLastError();
+        }
+        if (ssp.dwCurrentState == desiredState) {
+            return ERROR_SUCCESS;
+        }
+        // A start that falls back to STOPPED has failed; report the service's exit code
+        if (desiredState == SERVICE_RUNNING && ssp.dwCurrentState == SERVICE_STOPPED) {
+            return ssp.dwWin32ExitCode ? ssp.dwWin32ExitCode : ERROR_SERVICE_NOT_ACTIVE;
+        }
+
+        double elapsed = ElapsedMs(start);
+        if (elapsed >= timeoutMs) {
+            return ERROR_SERVICE_REQUEST_TIMEOUT;
+        }
+
+        // Check back after a tenth of the wait hint, as the SCM documentation recommends
+        DWORD pace = std::min<DWORD>(std::max<DWORD>(ssp.dwWaitHint / 10, 25), 10000);
+        pace = std::min<DWORD>(pace, static_cast<DWORD>(timeoutMs - elapsed) + 1);
+        Scm().SleepEx(pace, FALSE);
+    }
+}
+
+// Callback for NotifyServiceStatusChangeW; runs on the waiting thread during its alertable wait
+void CALLBACK OnServiceStatusNotify(PVOID parameter) {
+    PSERVICE_NOTIFYW notify = static_cast<PSERVICE_NOTIFYW>(parameter);
+    *static_cast<bool*>(notify->pContext) = true;
+}
+
+// Waits until the service reaches desiredState. Blocks on NotifyServiceStatusChangeW callbacks and falls back
+// to dwWaitHint-paced polling only when notifications are not available.
+// Returns ERROR_SUCCESS, ERROR_SERVICE_REQUEST_TIMEOUT, or the error that ended the transition.
+DWORD WaitForServiceState(ScmSession& session, const std::wstring& serviceName, DWORD desiredState, DWORD timeoutMs,
+                          bool* notified = nullptr) {
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_QUERY_STATUS);
+    if (!hService) {
+        return GetLastError();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    // Also wake on STOPPED when waiting for RUNNING, so a failed start is reported at once
+    DWORD mask = (1u << (desiredState - 1)) | (desiredState == SERVICE_RUNNING ? SERVICE_NOTIFY_STOPPED : 0);
+    for (;;) {
+        bool fired = false;
+        SERVICE_NOTIFYW notify = {};
+        notify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+        notify.pfnNotifyCallback = OnServiceStatusNotify;
+        notify.pContext = &fired;
+
+        DWORD error = Scm().NotifyServiceStatusChangeW(hService, mask, &notify);
+        if (error != ERROR_SUCCESS) {
+            if (notified) {
+                *notified = false;
+            }
+            return PollForServiceState(hService, desiredState, timeoutMs, start);
+        }
+        if (notified) {
+            *notified = true;
+        }
+
+        while (!fired) {
+            double elapsed = ElapsedMs(start);
+            if (elapsed >= timeoutMs) {
+                // The notification buffer lives on this stack. Closing the handle cancels the request, but a
+                // callback queued just before still runs at this thread's next alertable wait, so run it now,
+                // while notify and fired are still here.
+                session.Forget(serviceName);
+                Scm().SleepEx(0, TRUE);
+                return ERROR_SERVICE_REQUEST_TIMEOUT;
+            }
+            Scm().SleepEx(static_cast<DWORD>(timeoutMs - elapsed) + 1, TRUE);
+        }
+
+        if (notify.dwNotificationStatus == ERROR_SERVICE_NOTIFY_CLIENT_LAGGING) {
+            continue;
+        }
+        if (notify.dwNotificationStatus != ERROR_SUCCESS) {
+            return notify.dwNotificationStatus;
+        }
+        if (notify.ServiceStatus.dwCurrentState == desiredState) {
+            return ERROR_SUCCESS;
+        }
+        if (desiredState == SERVICE_RUNNING && notify.ServiceStatus.dwCurrentState == SERVICE_STOPPED) {
+            return notify.ServiceStatus.dwWin32ExitCode ? notify.ServiceStatus.dwWin32ExitCode : ERROR_SERVICE_NOT_ACTIVE;
+        }
+    }
+}
+
+// One service in a dependency-ordered start/stop plan
+struct PlanNode {
+    std::wstring name;
+    std::vector<size_t> prerequisites;  // nodes that must reach their target state first
+    DWORD result = ERROR_SUCCESS;
+};
+
+// Builds the dependency DAG for starting or stopping the targets and layers it into waves whose members
+// are independent of each other. Starting pulls in every (transitive) dependency; stopping orders dependents
+// first. With withDependents the targets' dependents (EnumDependentServicesW) join the plan as well.
+DWORD BuildTransitionPlan(ScmSession& session, const std::vector<std::wstring>& targets, bool starting, bool withDependents,
+                          std::vector<PlanNode>& nodes, std::vector<std::vector<size_t>>& waves) {
+    std::map<std::wstring, size_t> index;
+    auto add = [&](const std::wstring& name) {
+        auto inserted = index.emplace(ToLower(name), nodes.size());
+        if (inserted.second) {
+            nodes.push_back(PlanNode{name, {}, ERROR_SUCCESS});
+        }
+        return inserted.first->second;
+    };
+
+    for (const auto& target : targets) {
+        add(target);
+    }
+    if (withDependents) {
+        for (const auto& target : targets) {
+            std::vector<std::wstring> dependents;
+            DWORD error = QueryDependentServices(session, target, starting ? SERVICE_STATE_ALL : SERVICE_ACTIVE, dependents);
+            if (error != ERROR_SUCCESS) {
+                return error;
+            }
+            for (const auto& dependent : dependents) {
+                add(dependent);
+            }
+        }
+    }
+
+    // Read every node's dependencies; starting also adds dependencies that are not in the plan yet
+    std::vector<std::vector<std::wstring>> dependencies;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        dependencies.emplace_back();
+        std::wstring name = nodes[i].name;
+        DWORD error = QueryServiceDependencies(session, name, dependencies.back());
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+        if (starting) {
+            for (const auto& dependency : dependencies.back()) {
+                add(dependency);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        for (const auto& dependency : dependencies[i]) {
+            auto it = index.find(ToLower(dependency));
+            if (it == index.end()) {
+                continue;
+            }
+            if (starting) {
+                nodes[i].prerequisites.push_back(it->second);
+            } else {
+                nodes[it->second].prerequisites.push_back(i);
+            }
+        }
+    }
+
+    // Kahn's algorithm, one layer at a time
+    std::vector<size_t> pending(nodes.size());
+    std::vector<std::vector<size_t>> unlocks(nodes.size());
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        pending[i] = nodes[i].prerequisites.size();
+        for (size_t prerequisite : nodes[i].prerequisites) {
+            unlocks[prerequisite].push_back(i);
+        }
+        if (pending[i] == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    size_t placed = 0;
+    while (!ready.empty()) {
+        waves.push_back(ready);
+        placed += ready.size();
+        std::vector<size_t> next;
+        for (size_t done : ready) {
+            for (size_t unlocked : unlocks[done]) {
+                if (--pending[unlocked] == 0) {
+                    next.push_back(unlocked);
+                }
+            }
+        }
+        ready.swap(next);
+    }
+
+    return placed == nodes.size() ? ERROR_SUCCESS : ERROR_CIRCULAR_DEPENDENCY;
+}
+
+// Starts or stops one service and waits for it to reach the target state
+DWORD TransitionService(ScmSession& session, const std::wstring& serviceName, bool starting, DWORD timeoutMs) {
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_QUERY_STATUS | (starting ? SERVICE_START : SERVICE_STOP));
+    if (!hService) {
+        return GetLastError();
+    }
+
+    BOOL issued = FALSE;
+    if (starting) {
+        issued = Scm().StartServiceW(hService, 0, NULL);
+    } else {
+        SERVICE_STATUS status;
+        issued = Scm().ControlService(hService, SERVICE_CONTROL_STOP, &status);
+    }
+    if (!issued) {
+        DWORD error = GetLastError();
+        // Already where we want it (or already heading there): just wait for the state
+        if (error != (starting ? ERROR_SERVICE_ALREADY_RUNNING : ERROR_SERVICE_NOT_ACTIVE) &&
+            error != ERROR_SERVICE_CANNOT_ACCEPT_CTRL) {
+            return error;
+        }
+    }
+
+    return WaitForServiceState(session, serviceName, starting ? SERVICE_RUNNING : SERVICE_STOPPED, timeoutMs);
+}
+
+// Runs a plan wave by wave; the members of a wave are driven concurrently on a worker pool.
+// A service whose prerequisite failed is skipped rather than attempted.
+DWORD RunTransitionPlan(ScmSession& session, std::vector<PlanNode>& nodes, const std::vector<std::vector<size_t>>& waves,
+                        bool starting, size_t workers, DWORD timeoutMs) {
+    auto planStart = std::chrono::steady_clock::now();
+    size_t failures = 0;
+
+    for (size_t w = 0; w < waves.size(); ++w) {
+        const std::vector<size_t>& wave = waves[w];
+        ParallelFor(wave.size(), workers, [&](size_t i) {
+            PlanNode& node = nodes[wave[i]];
+            for (size_t prerequisite : node.prerequisites) {
+                if (nodes[prerequisite].result != ERROR_SUCCESS) {
+                    node.result = ERROR_SERVICE_DEPENDENCY_FAIL;
+                    std::lock_guard<std::mutex> lock(g_outputMutex);
+                    Out() << L"[SC_CLONE] [wave " << w + 1 << L"] " << node.name
+                               << L" SKIPPED (prerequisite " << nodes[prerequisite].name << L" failed)" << std::endl;
+                    return;
+                }
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            node.result = TransitionService(session, node.name, starting, timeoutMs);
+            double elapsed = ElapsedMs(start);
+
+            std::lock_guard<std::mutex> lock(g_outputMutex);
+            Out() << L"[SC_CLONE] [wave " << w + 1 << L"] " << node.name << L" ";
+            if (node.result == ERROR_SUCCESS) {
+                Out() << (starting ? L"RUNNING" : L"STOPPED");
+            } else {
+                Out() << L"FAILED " << node.result;
+            }
+            Out() << L" (" << static_cast<long long>(elapsed) << L" ms)" << std::endl;
+        });
+
+        for (size_t i : wave) {
+            if (nodes[i].result != ERROR_SUCCESS) {
+                ++failures;
+            }
+        }
+    }
+
+    Out() << L"[SC_CLONE] " << (starting ? L"Start" : L"Stop") << L" plan: " << nodes.size() << L" services in "
+               << waves.size() << L" waves, " << failures << L" failed, "
+               << static_cast<long long>(ElapsedMs(planStart)) << L" ms" << std::endl;
+    return failures ? ERROR_SERVICE_DEPENDENCY_FAIL : ERROR_SUCCESS;
+}
+
+// Options shared by the multi-service start/stop forms
+struct TransitionOptions {
+    bool withDependents = false;
+    bool wait = false;
+    size_t workers = 8;
+    DWORD timeoutMs = 30000;
+    // Admission control for bulk starts (RunAdmissionPlan): a fixed ceiling, or an adaptive limit below it
+    size_t maxConcurrent = 0;
+    bool adaptive = false;
+    DWORD retries = 3;
+    DWORD backoffMs = 1000;
+};
+
+// Splits "start/stop A B C --with-dependents --parallel=N --timeout=ms --wait[=ms]" into service names and options,
+// plus "--max-concurrent=N --adaptive --retries=N --backoff=ms" for admission-controlled starts
+bool ParseTransitionArgs(const std::vector<std::wstring>& args, std::vector<std::wstring>& names, TransitionOptions& options) {
+    for (size_t i = 1; i < args.size(); ++i) {
+        const std::wstring& arg = args[i];
+        if (arg == L"--with-dependents") {
+            options.withDependents = true;
+        } else if (arg.compare(0, 11, L"--parallel=") == 0) {
+            options.workers = std::max<size_t>(1, std::wcstoul(arg.c_str() + 11, nullptr, 10));
+        } else if (arg.compare(0, 10, L"--timeout=") == 0) {
+            options.timeoutMs = static_cast<DWORD>(std::wcstoul(arg.c_str() + 10, nullptr, 10));
+        } else if (arg.compare(0, 17, L"--max-concurrent=") == 0) {
+            options.maxConcurrent = std::max<size_t>(1, std::wcstoul(arg.c_str() + 17, nullptr, 10));
+        } else if (arg == L"--adaptive") {
+            options.adaptive = true;
+        } else if (arg.compare(0, 10, L"--retries=") == 0) {
+            options.retries = static_cast<DWORD>(std::wcstoul(arg.c_str() + 10, nullptr, 10));
+        } else if (arg.compare(0, 10, L"--backoff=") == 0) {
+            options.backoffMs = static_cast<DWORD>(std::wcstoul(arg.c_str() + 10, nullptr, 10));
+        } else if (arg == L"--wait") {
+            options.wait = true;
+        } else if (arg.compare(0, 7, L"--wait=") == 0) {
+            options.wait = true;
+            options.timeoutMs = static_cast<DWORD>(std::wcstoul(arg.c_str() + 7, nullptr, 10));
+        } else if (arg.compare(0, 2, L"--") == 0) {
+            Err() << L"[SC_CLONE] Unknown option: " << arg << std::endl;
+            return false;
+        } else {
+            names.push_back(arg);
+        }
+    }
+    return !names.empty();
+}
+
+// What a bulk start did, for its summary and for bench start
+struct AdmissionStats {
+    size_t started = 0;
+    size_t failed = 0;
+    size_t retries = 0;
+    size_t peakStarting = 0;
+    size_t finalLimit = 0;
+    double makespanMs = 0;
+    std::vector<double> timeToRunningMs;
+};
+
+// How many services a bulk start keeps in START_PENDING at once. Fixed at the ceiling, or adaptive: it begins at two
+// and grows by one for each service that reaches RUNNING within its wait hint (doubling each round) until the first
+// late start, then by one per round. A late start (past its dwWaitHint, or without a hint past twice the fastest
+// seen) cuts it by 30% and a failed one halves it; the starts already under way began at the old limit, so their
+// outcomes are not held against the new one. It does not grow while the host's CPU is 90% busy.
+class AdmissionLimit {
+public:
+    AdmissionLimit(size_t ceiling, bool adaptive)
+        : ceiling(static_cast<double>(std::max<size_t>(1, ceiling))), adaptive(adaptive),
+          limit(adaptive ? std::min(2.0, this->ceiling) : this->ceiling) {
+        SampleLoad();
+    }
+
+    size_t Current() const {
+        return static_cast<size_t>(limit);
+    }
+
+    // A start reached RUNNING after ttrMs, having announced waitHint (0 when none); inFlight are still starting
+    void OnRunning(double ttrMs, DWORD waitHint, size_t inFlight) {
+        if (!adaptive || Held()) {
+            return;
+        }
+        bool late = waitHint ? ttrMs > waitHint : (fastestMs > 0 && ttrMs > 2 * fastestMs + 50);
+        if (!waitHint) {
+            fastestMs = fastestMs > 0 ? std::min(fastestMs, ttrMs) : ttrMs;
+        }
+        if (late) {
+            Decrease(0.7, inFlight);
+            return;
+        }
+        if (SampleLoad() < 0.9) {
+            limit = std::min(ceiling, limit + (slowStart ? 1 : 1 / limit));
+        }
+    }
+
+    void OnFailed(size_t inFlight) {
+        if (adaptive && !Held()) {
+            Decrease(0.5, inFlight);
+        }
+    }
+
+private:
+    bool Held() {
+        if (holdOff == 0) {
+            return false;
+        }
+        --holdOff;
+        return true;
+    }
+
+    void Decrease(double factor, size_t inFlight) {
+        limit = std::max(1.0, std::floor(limit * factor));
+        slowStart = false;
+        holdOff = inFlight;
+    }
+
+    // CPU busy fraction since the previous sample at least 50 ms back; -1 when the backend cannot tell
+    double SampleLoad() {
+        auto now = std::chrono::steady_clock::now();
+        if (sampled && now - sampledAt < std::chrono::milliseconds(50)) {
+            return load;
+        }
+        FILETIME idle, kernel, user;
+        if (!Scm().GetSystemTimes(&idle, &kernel, &user)) {
+            return load = -1;
+        }
+        auto ticks = [](const FILETIME& time) { return (uint64_t(time.dwHighDateTime) << 32) | time.dwLowDateTime; };
+        uint64_t idleTicks = ticks(idle);
+        uint64_t totalTicks = ticks(kernel) + ticks(user);
+        if (sampled && totalTicks > lastTotal) {
+            load = 1.0 - static_cast<double>(idleTicks - lastIdle) / static_cast<double>(totalTicks - lastTotal);
+        }
+        sampled = true;
+        sampledAt = now;
+        lastIdle = idleTicks;
+        lastTotal = totalTicks;
+        return load;
+    }
+
+    double ceiling;
+    bool adaptive;
+    double limit;
+    bool slowStart = true;
+    size_t holdOff = 0;
+    double fastestMs = 0;
+
+    bool sampled = false;
+    std::chrono::steady_clock::time_point sampledAt;
+    uint64_t lastIdle = 0;
+    uint64_t lastTotal = 0;
+    double load = -1;
+};
+
+// Errors another attempt cannot fix
+bool IsPermanentStartError(DWORD error) {
+    return error == ERROR_SERVICE_DOES_NOT_EXIST || error == ERROR_SERVICE_DISABLED || error == ERROR_ACCESS_DENIED ||
+           error == ERROR_SERVICE_MARKED_FOR_DELETE || error == ERROR_INVALID_NAME || error == ERROR_SERVICE_DEPENDENCY_FAIL;
+}
+
+// Starts one service and waits for RUNNING. waitHint is the hint it announced in START_PENDING; sampled is false when
+// it was already starting or running, so the time it took says nothing about this start.
+DWORD StartAndWaitForRunning(ScmSession& session, const std::wstring& serviceName, DWORD timeoutMs, DWORD& waitHint, bool& sampled) {
+    waitHint = 0;
+    sampled = true;
+    SC_HANDLE hService = session.Service(serviceName, SERVICE_QUERY_STATUS | SERVICE_START);
+    if (!hService) {
+        return GetLastError();
+    }
+    if (!Scm().StartServiceW(hService, 0, NULL)) {
+        DWORD error = GetLastError();
+        if (error != ERROR_SERVICE_ALREADY_RUNNING) {
+            return error;
+        }
+        sampled = false;
+    }
+
+    SERVICE_STATUS_PROCESS ssp;
+    DWORD bytesNeeded = 0;
+    if (Scm().QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, (LPBYTE)&ssp, sizeof(ssp), &bytesNeeded)) {
+        if (ssp.dwCurrentState == SERVICE_RUNNING) {
+            return ERROR_SUCCESS;
+        }
+        waitHint = ssp.dwWaitHint;
+    }
+    return WaitForServiceState(session, serviceName, SERVICE_RUNNING, timeoutMs);
+}
+
+// Starts a plan's services as their prerequisites reach RUNNING, keeping no more than the admission limit starting
+// at once, so a role's services do not all compete for the host together. A failed start goes back in the queue
+// after backoffMs, doubling with each attempt, up to retries times. Reports each service's time to RUNNING and the
+// makespan of the whole start.
+DWORD RunAdmissionPlan(ScmSession& session, std::vector<PlanNode>& nodes, const TransitionOptions& options, AdmissionStats& stats) {
+    enum class Phase { Queued, Starting, Done };
+    struct Slot {
+        Phase phase = Phase::Queued;
+        DWORD attempts = 0;
+        std::chrono::steady_clock::time_point notBefore;
+    };
+    std::vector<Slot> slots(nodes.size());
+    AdmissionLimit limit(options.maxConcurrent ? options.maxConcurrent : nodes.size(), options.adaptive);
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::thread> threads;
+    size_t starting = 0;
+    size_t done = 0;
+    auto planStart = std::chrono::steady_clock::now();
+
+    auto attempt = [&](size_t i) {
+        auto start = std::chrono::steady_clock::now();
+        DWORD waitHint = 0;
+        bool sampled = true;
+        DWORD result = StartAndWaitForRunning(session, nodes[i].name, options.timeoutMs, waitHint, sampled);
+        double elapsed = ElapsedMs(start);
+        double admittedAt = std::chrono::duration<double, std::milli>(start - planStart).count();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        Slot& slot = slots[i];
+        --starting;
+        std::lock_guard<std::mutex> outputLock(g_outputMutex);
+        Out() << L"[SC_CLONE] " << nodes[i].name << L" ";
+        if (result == ERROR_SUCCESS) {
+            if (sampled) {
+                limit.OnRunning(elapsed, waitHint, starting);
+            }
+            slot.phase = Phase::Done;
+            nodes[i].result = ERROR_SUCCESS;
+            ++stats.started;
+            stats.timeToRunningMs.push_back(elapsed);
+            Out() << L"RUNNING in " << static_cast<long long>(elapsed) << L" ms";
+        } else if (!IsPermanentStartError(result) && slot.attempts <= options.retries) {
+            limit.OnFailed(starting);
+            DWORD backoffMs = options.backoffMs << std::min<DWORD>(slot.attempts - 1, 16);
+            slot.phase = Phase::Queued;
+            slot.notBefore = std::chrono::steady_clock::now() + std::chrono::milliseconds(backoffMs);
+            ++stats.retries;
+            Out() << L"FAILED " << result << L" after " << static_cast<long long>(elapsed) << L" ms, retrying in " << backoffMs << L" ms";
+        } else {
+            if (!IsPermanentStartError(result)) {
+                limit.OnFailed(starting);
+            }
+            slot.phase = Phase::Done;
+            nodes[i].result = result;
+            ++stats.failed;
+            Out() << L"FAILED " << result << L" after " << static_cast<long long>(elapsed) << L" ms";
+        }
+        Out() << L" (attempt " << slot.attempts << L", admitted at " << static_cast<long long>(admittedAt) << L" ms)" << std::endl;
+        done += slot.phase == Phase::Done;
+        changed.notify_all();
+    };
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (done < nodes.size()) {
+        auto now = std::chrono::steady_clock::now();
+        auto wakeAt = std::chrono::steady_clock::time_point::max();
+        bool progressed = false;
+        for (size_t i = 0; i < nodes.size() && starting < limit.Current(); ++i) {
+            Slot& slot = slots[i];
+            if (slot.phase != Phase::Queued) {
+                continue;
+            }
+            bool ready = true;
+            const PlanNode* failedPrerequisite = nullptr;
+            for (size_t prerequisite : nodes[i].prerequisites) {
+                if (slots[prerequisite].phase != Phase::Done) {
+                    ready = false;
+                } else if (nodes[prerequisite].result != ERROR_SUCCESS) {
+                    failedPrerequisite = &nodes[prerequisite];
+                }
+            }
+            if (failedPrerequisite) {
+                slot.phase = Phase::Done;
+                nodes[i].result = ERROR_SERVICE_DEPENDENCY_FAIL;
+                ++stats.failed;
+                ++done;
+                progressed = true;
+                std::lock_guard<std::mutex> outputLock(g_outputMutex);
+                Out() << L"[SC_CLONE] " << nodes[i].name << L" SKIPPED (prerequisite " << failedPrerequisite->name << L" failed)" << std::endl;
+                continue;
+            }
+            if (!ready) {
+                continue;
+            }
+            if (slot.notBefore > now) {
+                wakeAt = std::min(wakeAt, slot.notBefore);
+                continue;
+            }
+            slot.phase = Phase::Starting;
+            ++slot.attempts;
+            ++starting;
+            stats.peakStarting = std::max(stats.peakStarting, starting);
+            threads.emplace_back(attempt, i);
+        }
+        if (progressed || done == nodes.size()) {
+            continue;
+        }
+        if (wakeAt == std::chrono::steady_clock::time_point::max()) {
+            changed.wait(lock);
+        } else {
+            changed.wait_until(lock, wakeAt);
+        }
+    }
+    lock.unlock();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    stats.makespanMs = ElapsedMs(planStart);
+    stats.finalLimit = limit.Current();
+    std::vector<double> sorted = stats.timeToRunningMs;
+    std::sort(sorted.begin(), sorted.end());
+    Out() << L"[SC_CLONE] Bulk start: " << nodes.size() << L" services, " << stats.failed << L" failed, " << stats.retries
+          << L" retries, makespan " << static_cast<long long>(stats.makespanMs) << L" ms" << std::endl;
+    if (!sorted.empty()) {
+        Out() << L"[SC_CLONE] Time to RUNNING: p50 " << static_cast<long long>(TimingRecorder::Percentile(sorted, 0.50)) << L" ms, p90 "
+              << static_cast<long long>(TimingRecorder::Percentile(sorted, 0.90)) << L" ms, max " << static_cast<long long>(sorted.back())
+              << L" ms; at most " << stats.peakStarting << L" starting at once";
+        if (options.adaptive) {
+            Out() << L" (adaptive limit ended at " << stats.finalLimit << L")";
+        }
+        Out() << std::endl;
+    }
+    return stats.failed ? ERROR_SERVICE_DEPENDENCY_FAIL : ERROR_SUCCESS;
+}
+
+// Dependency-aware start/stop of several services in topological waves, or under admission control
+DWORD TransitionServices(ScmSession& session, const std::vector<std::wstring>& names, bool starting, const TransitionOptions& options) {
+    std::vector<PlanNode> nodes;
+    std::vector<std::vector<size_t>> waves;
+    DWORD error = BuildTransitionPlan(session, names, starting, options.withDependents, nodes, waves);
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] Building the dependency plan failed with error code: ", error);
+        return error;
+    }
+    if (options.maxConcurrent || options.adaptive) {
+        if (!starting) {
+            Err() << L"[SC_CLONE] --max-concurrent and --adaptive apply to start only" << std::endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+        AdmissionStats stats;
+        return RunAdmissionPlan(session, nodes, options, stats);
+    }
+    return RunTransitionPlan(session, nodes, waves, starting, options.workers, options.timeoutMs);
+}
+
+// Starts or stops a single service and, with --wait, blocks until it reaches RUNNING/STOPPED and reports how long it took
+DWORD TransitionAndWait(ScmSession& session, const std::wstring& serviceName, bool starting, DWORD timeoutMs) {
+    auto start = std::chrono::steady_clock::now();
+    DWORD result = starting ? StartServiceEntry(session, serviceName) : StopServiceEntry(session, serviceName);
+    if (result != ERROR_SUCCESS) {
+        return result;
+    }
+
+    const wchar_t* stateName = starting ? L"RUNNING" : L"STOPPED";
+    bool notified = false;
+    result = WaitForServiceState(session, serviceName, starting ? SERVICE_RUNNING : SERVICE_STOPPED, timeoutMs, &notified);
+    if (result != ERROR_SUCCESS) {
+        PrintErrorMessage(std::wstring(L"[SC_CLONE] Waiting for ") + stateName + L" failed with error code: ", result);
+        return result;
+    }
+
+    Out() << L"[SC_CLONE] " << serviceName << L" reached " << stateName << L" in "
+               << static_cast<long long>(ElapsedMs(start)) << L" ms ("
+               << (notified ? L"notification" : L"polling") << L")" << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// Memory mapping of a whole file; the contents are used in place and never copied to the heap
+class MappedFile {
+public:
+    MappedFile() {}
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile() {
+#ifdef _WIN32
+        if (data) {
+            UnmapViewOfFile(data);
+        }
+        if (mapping) {
+            CloseHandle(mapping);
+        }
+        if (file != INVALID_HANDLE_VALUE) {
+            CloseHandle(file);
+        }
+#else
+        if (data) {
+            munmap(data, size);
+        }
+#endif
+    }
+
+    // Maps an existing file read-only. The mapping is shared, so a file another process keeps updating through
+    // its own writable mapping (the status cache) is seen as it changes.
+    DWORD Open(const std::wstring& path) {
+#ifdef _WIN32
+        file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return GetLastError();
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize)) {
+            return GetLastError();
+        }
+        if (fileSize.QuadPart == 0) {
+            return ERROR_INVALID_DATA;
+        }
+        mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!mapping) {
+            return GetLastError();
+        }
+        data = static_cast<BYTE*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!data) {
+            return GetLastError();
+        }
+        size = static_cast<size_t>(fileSize.QuadPart);
+#else
+        int fd = open(std::filesystem::path(path).c_str(), O_RDONLY);
+        if (fd < 0) {
+            return errno == ENOENT ? ERROR_FILE_NOT_FOUND : ERROR_ACCESS_DENIED;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            close(fd);
+            return ERROR_INVALID_DATA;
+        }
+        void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (view == MAP_FAILED) {
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        data = static_cast<BYTE*>(view);
+        size = static_cast<size_t>(info.st_size);
+#endif
+        return ERROR_SUCCESS;
+    }
+
+    // Maps a file for writing, creating it or resizing it to exactly bytes
+    DWORD OpenWritable(const std::wstring& path, size_t bytes) {
+#ifdef _WIN32
+        file = CreateFileW(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return GetLastError();
+        }
+        mapping = CreateFileMappingW(file, NULL, PAGE_READWRITE, static_cast<DWORD>(uint64_t(bytes) >> 32),
+                                     static_cast<DWORD>(bytes), NULL);
+        if (!mapping) {
+            return GetLastError();
+        }
+        data = static_cast<BYTE*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, bytes));
+        if (!data) {
+            return GetLastError();
+        }
+#else
+        int fd = open(std::filesystem::path(path).c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) {
+            return errno == ENOENT ? ERROR_FILE_NOT_FOUND : ERROR_ACCESS_DENIED;
+        }
+        if (ftruncate(fd, static_cast<off_t>(bytes)) != 0) {
+            close(fd);
+            return ERROR_ACCESS_DENIED;
+        }
+        void* view = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (view == MAP_FAILED) {
+            return ERROR_NOT_ENOUGH_MEMORY;
+        }
+        data = static_cast<BYTE*>(view);
+#endif
+        size = bytes;
+        return ERROR_SUCCESS;
+    }
+
+    const BYTE* Data() const { return data; }
+    BYTE* MutableData() { return data; }
+    size_t Size() const { return size; }
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+    BYTE* data = nullptr;
+    size_t size = 0;
+};
+
+// Offline registry hive ("regf") reader, used by --offline to answer service queries from an acquired SYSTEM
+// hive. A hive is a 4 KB base block followed by hive bins; records live in cells addressed by their offset
+// from the first bin, and each cell starts with its int32 size (negative while allocated). The file is
+// mapped and read in place: only the keys on the way to <control set>\Services and the values asked for
+// are ever touched, so the working set stays small however large the hive is.
+const size_t kHiveBinsStart = 4096;
+const uint32_t kHiveNoCell = 0xFFFFFFFF;
+const uint16_t kHiveKeyCompressedName = 0x0020;    // nk flag: the name is Latin-1, not UTF-16
+const uint16_t kHiveValueCompressedName = 0x0001;  // vk flag: likewise for value names
+const size_t kHiveBigDataSegment = 16344;          // payload of one "db" segment
+
+// Reads a little-endian field at an arbitrary (possibly unaligned) offset
+template <typename T>
+T HiveField(const BYTE* data, size_t offset) {
+    T value;
+    std::memcpy(&value, data + offset, sizeof(T));
+    return value;
+}
+
+// Decodes UTF-16LE registry data; stops at the first NUL unless keepNuls (REG_MULTI_SZ)
+std::wstring HiveUtf16(const BYTE* data, size_t bytes, bool keepNuls = false) {
+    std::wstring text;
+    text.reserve(bytes / 2);
+    for (size_t i = 0; i + 1 < bytes; i += 2) {
+        uint32_t c = HiveField<uint16_t>(data, i);
+        if (c == 0 && !keepNuls) {
+            break;
+        }
+        if (sizeof(wchar_t) == 4 && c >= 0xD800 && c < 0xDC00 && i + 3 < bytes) {
+            uint32_t low = HiveField<uint16_t>(data, i + 2);
+            if (low >= 0xDC00 && low < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (low - 0xDC00);
+                i += 2;
+            }
+        }
+        text += static_cast<wchar_t>(c);
+    }
+    return text;
+}
+
+class RegistryHive {
+public:
+    DWORD Open(const std::wstring& path) {
+        DWORD error = file.Open(path);
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+        const BYTE* base = file.Data();
+        if (file.Size() < kHiveBinsStart + 32 || std::memcmp(base, "regf", 4) != 0) {
+            return ERROR_BADDB;
+        }
+        root = HiveField<uint32_t>(base, 0x24);
+        dirty = HiveField<uint32_t>(base, 0x04) != HiveField<uint32_t>(base, 0x08);
+        return Cell(root, 76, "nk") ? ERROR_SUCCESS : ERROR_BADDB;
+    }
+
+    uint32_t Root() const { return root; }
+
+    // The primary and secondary sequence numbers differ: the hive was acquired mid-write and the
+    // changes still sitting in its .LOG1/.LOG2 transaction logs are not reflected here
+    bool Dirty() const { return dirty; }
+
+    // Returns the data of the cell at offset, or nullptr unless it lies inside the file, holds at least
+    // minSize bytes and carries the two-letter signature (when one is given)
+    const BYTE* Cell(uint32_t offset, size_t minSize, const char* signature = nullptr, size_t* dataSize = nullptr) const {
+        size_t position = kHiveBinsStart + offset;
+        if (offset == kHiveNoCell || position + 4 > file.Size()) {
+            return nullptr;
+        }
+        int32_t raw = HiveField<int32_t>(file.Data(), position);
+        size_t cellSize = static_cast<size_t>(raw < 0 ? -static_cast<int64_t>(raw) : raw);
+        if (cellSize < 4 + minSize || cellSize > file.Size() - position) {
+            return nullptr;
+        }
+        const BYTE* data = file.Data() + position + 4;
+        if (signature && (cellSize < 6 || data[0] != signature[0] || data[1] != signature[1])) {
+            return nullptr;
+        }
+        if (dataSize) {
+            *dataSize = cellSize - 4;
+        }
+        return data;
+    }
+
+    // Calls fn(key) for every subkey of a key, through lf/lh/li lists and one level of ri indirection;
+    // returns false if fn stopped the walk by returning false
+    template <typename Fn>
+    bool ForEachSubkey(uint32_t key, Fn fn) const {
+        const BYTE* nk = Cell(key, 76, "nk");
+        if (!nk || HiveField<uint32_t>(nk, 20) == 0) {
+            return true;
+        }
+        return WalkSubkeyList(HiveField<uint32_t>(nk, 28), fn, true);
+    }
+
+    // Finds a subkey by name, ignoring case; kHiveNoCell when there is none
+    uint32_t Subkey(uint32_t key, const wchar_t* name) const {
+        uint32_t found = kHiveNoCell;
+        ForEachSubkey(key, [&](uint32_t child) {
+            size_t size = 0;
+            const BYTE* nk = Cell(child, 76, "nk", &size);
+            if (nk && NameEquals(nk + 76, std::min<size_t>(HiveField<uint16_t>(nk, 72), size - 76),
+                                 (HiveField<uint16_t>(nk, 2) & kHiveKeyCompressedName) != 0, name)) {
+                found = child;
+                return false;
+            }
+            return true;
+        });
+        return found;
+    }
+
+    std::wstring KeyName(uint32_t key) const {
+        size_t size = 0;
+        const BYTE* nk = Cell(key, 76, "nk", &size);
+        if (!nk) {
+            return std::wstring();
+        }
+        size_t length = std::min<size_t>(HiveField<uint16_t>(nk, 72), size - 76);
+        if (HiveField<uint16_t>(nk, 2) & kHiveKeyCompressedName) {
+            return std::wstring(nk + 76, nk + 76 + length);
+        }
+        return HiveUtf16(nk + 76, length, true);
+    }
+
+    // Finds a value by name (ignoring case) and returns its type and data. The data points into the
+    // mapping, except for big data split over several "db" segments, which is gathered into scratch.
+    bool Value(uint32_t key, const wchar_t* name, DWORD& type, const BYTE*& data, size_t& size, std::vector<BYTE>& scratch) const {
+        const BYTE* nk = Cell(key, 76, "nk");
+        if (!nk) {
+            return false;
+        }
+        uint32_t count = HiveField<uint32_t>(nk, 36);
+        const BYTE* list = count ? Cell(HiveField<uint32_t>(nk, 40), size_t(count) * 4) : nullptr;
+        for (uint32_t i = 0; list && i < count; ++i) {
+            size_t vkSize = 0;
+            const BYTE* vk = Cell(HiveField<uint32_t>(list, 4 * i), 20, "vk", &vkSize);
+            if (!vk || !NameEquals(vk + 20, std::min<size_t>(HiveField<uint16_t>(vk, 2), vkSize - 20),
+                                   (HiveField<uint16_t>(vk, 16) & kHiveValueCompressedName) != 0, name)) {
+                continue;
+            }
+
+            type = HiveField<uint32_t>(vk, 12);
+            uint32_t length = HiveField<uint32_t>(vk, 4);
+            // Data of up to four bytes is stored in the offset field itself
+            if (length & 0x80000000) {
+                data = vk + 8;
+                size = std::min<size_t>(length & 0x7FFFFFFF, 4);
+                return true;
+            }
+            size_t cellSize = 0;
+            const BYTE* cell = Cell(HiveField<uint32_t>(vk, 8), 0, nullptr, &cellSize);
+            if (!cell) {
+                return false;
+            }
+            if (length <= cellSize) {
+                data = cell;
+                size = length;
+                return true;
+            }
+            if (cellSize < 8 || cell[0] != 'd' || cell[1] != 'b') {
+                return false;
+            }
+            uint16_t segments = HiveField<uint16_t>(cell, 2);
+            const BYTE* segmentList = Cell(HiveField<uint32_t>(cell, 4), size_t(segments) * 4);
+            if (!segmentList) {
+                return false;
+            }
+            scratch.clear();
+            for (uint16_t s = 0; s < segments && scratch.size() < length; ++s) {
+                size_t segmentSize = 0;
+                const BYTE* segment = Cell(HiveField<uint32_t>(segmentList, 4 * s), 0, nullptr, &segmentSize);
+                if (!segment) {
+                    return false;
+                }
+                size_t take = std::min({segmentSize, kHiveBigDataSegment, length - scratch.size()});
+                scratch.insert(scratch.end(), segment, segment + take);
+            }
+            data = scratch.data();
+            size = scratch.size();
+            return true;
+        }
+        return false;
+    }
+
+    bool Dword(uint32_t key, const wchar_t* name, DWORD& value) const {
+        DWORD type = 0;
+        const BYTE* data = nullptr;
+        size_t size = 0;
+        std::vector<BYTE> scratch;
+        if (!Value(key, name, type, data, size, scratch) || type != REG_DWORD || size < 4) {
+            return false;
+        }
+        value = HiveField<uint32_t>(data, 0);
+        return true;
+    }
+
+    // REG_SZ or REG_EXPAND_SZ; expandable strings are returned unexpanded, as QueryServiceConfigW does
+    std::wstring String(uint32_t key, const wchar_t* name) const {
+        DWORD type = 0;
+        const BYTE* data = nullptr;
+        size_t size = 0;
+        std::vector<BYTE> scratch;
+        if (!Value(key, name, type, data, size, scratch) || (type != REG_SZ && type != REG_EXPAND_SZ)) {
+            return std::wstring();
+        }
+        return HiveUtf16(data, size);
+    }
+
+    std::vector<std::wstring> MultiString(uint32_t key, const wchar_t* name) const {
+        DWORD type = 0;
+        const BYTE* data = nullptr;
+        size_t size = 0;
+        std::vector<BYTE> scratch;
+        std::vector<std::wstring> strings;
+        if (!Value(key, name, type, data, size, scratch) || (type != REG_MULTI_SZ && type != REG_SZ)) {
+            return strings;
+        }
+        std::wstringstream ss(HiveUtf16(data, size, true));
+        std::wstring entry;
+        while (std::getline(ss, entry, L'\0')) {
+            if (!entry.empty()) {
+                strings.push_back(entry);
+            }
+        }
+        return strings;
+    }
+
+private:
+    template <typename Fn>
+    bool WalkSubkeyList(uint32_t offset, Fn& fn, bool allowIndirect) const {
+        size_t size = 0;
+        const BYTE* list = Cell(offset, 4, nullptr, &size);
+        if (!list) {
+            return true;
+        }
+        bool indirect = list[0] == 'r' && list[1] == 'i';
+        bool hashed = (list[0] == 'l' && (list[1] == 'f' || list[1] == 'h'));
+        if (!hashed && !indirect && !(list[0] == 'l' && list[1] == 'i')) {
+            return true;
+        }
+        if (indirect && !allowIndirect) {
+            return true;
+        }
+        size_t stride = hashed ? 8 : 4;
+        size_t count = std::min<size_t>(HiveField<uint16_t>(list, 2), (size - 4) / stride);
+        for (size_t i = 0; i < count; ++i) {
+            uint32_t entry = HiveField<uint32_t>(list, 4 + i * stride);
+            if (!(indirect ? WalkSubkeyList(entry, fn, false) : fn(entry))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static bool NameEquals(const BYTE* raw, size_t bytes, bool compressed, const wchar_t* name) {
+        size_t units = compressed ? bytes : bytes / 2;
+        for (size_t i = 0; i < units; ++i, ++name) {
+            wchar_t c = compressed ? static_cast<wchar_t>(raw[i]) : static_cast<wchar_t>(HiveField<uint16_t>(raw, 2 * i));
+            if (!*name || FoldCase(c) != FoldCase(*name)) {
+                return false;
+            }
+        }
+        return *name == L'\0';
+    }
+
+    MappedFile file;
+    uint32_t root = kHiveNoCell;
+    bool dirty = false;
+};
+
+// Read-only ScmBackend over an offline SYSTEM hive (--offline). Like the SCM at boot, it takes every subkey
+// of <current control set>\Services that has a Type value as a service. Only the sorted name index is built
+// up front; each query decodes the values it needs straight from the mapping. A hive holds configuration
+// only, so every service reports STOPPED, anything that would change the hive fails with
+// ERROR_WRITE_PROTECT, and notifications are unavailable (callers fall back to polling).
+class OfflineHiveBackend : public ScmBackend {
+public:
+    DWORD Open(const std::wstring& path) {
+        DWORD error = hive.Open(path);
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+
+        // An offline hive has no CurrentControlSet link; Select\Current names the set that was in use
+        DWORD current = 1;
+        uint32_t select = hive.Subkey(hive.Root(), L"Select");
+        if (select != kHiveNoCell) {
+            hive.Dword(select, L"Current", current);
+        }
+        wchar_t setName[32];
+        std::swprintf(setName, 32, L"ControlSet%03u", static_cast<unsigned>(current));
+        uint32_t controlSet = hive.Subkey(hive.Root(), setName);
+        uint32_t servicesKey = controlSet == kHiveNoCell ? kHiveNoCell : hive.Subkey(controlSet, L"Services");
+        if (servicesKey == kHiveNoCell) {
+            return ERROR_BADDB;
+        }
+        controlSetName = setName;
+
+        hive.ForEachSubkey(servicesKey, [&](uint32_t key) {
+            DWORD type = 0;
+            if (hive.Dword(key, L"Type", type)) {
+                index.push_back(IndexEntry{ToLower(hive.KeyName(key)), key});
+            }
+            return true;
+        });
+        std::sort(index.begin(), index.end(), [](const IndexEntry& a, const IndexEntry& b) { return a.key < b.key; });
+        return ERROR_SUCCESS;
+    }
+
+    const std::wstring& ControlSet() const { return controlSetName; }
+    size_t ServiceCount() const { return index.size(); }
+    bool Dirty() const { return hive.Dirty(); }
+
+    SC_HANDLE OpenSCManagerW(LPCWSTR machineName, LPCWSTR, DWORD) override {
+        // The hive is the only machine there is
+        if (machineName && *machineName) {
+            SetLastError(RPC_S_SERVER_UNAVAILABLE);
+            return NULL;
+        }
+        return Issue(true, 0);
+    }
+
+    SC_HANDLE OpenServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, DWORD) override {
+        size_t unused = 0;
+        if (!Lookup(hSCManager, true, unused)) {
+            return NULL;
+        }
+        if (!serviceName || !*serviceName) {
+            SetLastError(ERROR_INVALID_NAME);
+            return NULL;
+        }
+        std::wstring key = ToLower(serviceName);
+        auto it = std::lower_bound(index.begin(), index.end(), key,
+                                   [](const IndexEntry& entry, const std::wstring& value) { return entry.key < value; });
+        if (it == index.end() || it->key != key) {
+            SetLastError(ERROR_SERVICE_DOES_NOT_EXIST);
+            return NULL;
+        }
+        return Issue(false, static_cast<size_t>(it - index.begin()));
+    }
+
+    SC_HANDLE CreateServiceW(SC_HANDLE, LPCWSTR, LPCWSTR, DWORD, DWORD, DWORD, DWORD, LPCWSTR, LPCWSTR, LPDWORD,
+                             LPCWSTR, LPCWSTR, LPCWSTR) override {
+        SetLastError(ERROR_WRITE_PROTECT);
+        return NULL;
+    }
+
+    BOOL CloseServiceHandle(SC_HANDLE hSCObject) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!handles.erase(hSCObject)) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    BOOL QueryServiceStatusEx(SC_HANDLE hService, SC_STATUS_TYPE infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        size_t entry = 0;
+        if (!Lookup(hService, false, entry)) {
+            return FALSE;
+        }
+        if (infoLevel != SC_STATUS_PROCESS_INFO) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        *bytesNeeded = sizeof(SERVICE_STATUS_PROCESS);
+        if (!buffer || bufSize < sizeof(SERVICE_STATUS_PROCESS)) {
+            SetLastError(ERROR_INSUFFICIENT_BUFFER);
+            return FALSE;
+        }
+        SERVICE_STATUS_PROCESS status = {};
+        hive.Dword(index[entry].cell, L"Type", status.dwServiceType);
+        status.dwCurrentState = SERVICE_STOPPED;
+        std::memcpy(buffer, &status, sizeof(status));
+        return TRUE;
+    }
+
+    BOOL StartServiceW(SC_HANDLE, DWORD, LPCWSTR*) override {
+        SetLastError(ERROR_WRITE_PROTECT);
+        return FALSE;
+    }
+
+    BOOL ControlService(SC_HANDLE, DWORD, LPSERVICE_STATUS) override {
+        SetLastError(ERROR_WRITE_PROTECT);
+        return FALSE;
+    }
+
+    BOOL DeleteService(SC_HANDLE) override {
+        SetLastError(ERROR_WRITE_PROTECT);
+        return FALSE;
+    }
+
+    BOOL QueryServiceConfigW(SC_HANDLE hService, LPQUERY_SERVICE_CONFIGW serviceConfig,
+                             DWORD bufSize, LPDWORD bytesNeeded) override {
+        size_t entry = 0;
+        if (!Lookup(hService, false, entry)) {
+            return FALSE;
+        }
+        MemoryService service;
+        DecodeBase(index[entry].cell, service);
+        return PackServiceConfig(service, serviceConfig, bufSize, bytesNeeded);
+    }
+
+    BOOL ChangeServiceConfigW(SC_HANDLE, DWORD, DWORD, DWORD, LPCWSTR, LPCWSTR, LPDWORD, LPCWSTR, LPCWSTR,
+                              LPCWSTR, LPCWSTR) override {
+        SetLastError(ERROR_WRITE_PROTECT);
+        return FALSE;
+    }
+
+    BOOL QueryServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        size_t entry = 0;
+        if (!Lookup(hService, false, entry)) {
+            return FALSE;
+        }
+        uint32_t key = index[entry].cell;
+        MemoryService service;
+        if (infoLevel == SERVICE_CONFIG_DESCRIPTION) {
+            service.description = hive.String(key, L"Description");
+        } else if (infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS) {
+            DecodeFailureActions(key, service);
+        } else if (infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS_FLAG) {
+            DWORD flag = 0;
+            hive.Dword(key, L"FailureActionsOnNonCrashFailures", flag);
+            service.failureActionsOnNonCrash = flag != 0;
+        }
+        return PackServiceConfig2(service, infoLevel, buffer, bufSize, bytesNeeded);
+    }
+
+    BOOL ChangeServiceConfig2W(SC_HANDLE, DWORD, LPVOID) override {
+        SetLastError(ERROR_WRITE_PROTECT);
+        return FALSE;
+    }
+
+    BOOL EnumServicesStatusExW(SC_HANDLE hSCManager, SC_ENUM_TYPE infoLevel, DWORD serviceType,
+                               DWORD serviceState, LPBYTE buffer, DWORD bufSize, LPDWORD bytesNeeded,
+                               LPDWORD servicesReturned, LPDWORD resumeHandle, LPCWSTR) override {
+        size_t unused = 0;
+        if (!Lookup(hSCManager, true, unused)) {
+            return FALSE;
+        }
+        if (infoLevel != SC_ENUM_PROCESS_INFO || !bytesNeeded || !servicesReturned ||
+            serviceState == 0 || (serviceState & ~SERVICE_STATE_ALL) != 0) {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+
+        // Everything in a hive is stopped, so an active-only enumeration is empty
+        size_t position = !(serviceState & SERVICE_INACTIVE) ? index.size() : resumeHandle ? *resumeHandle : 0;
+        ENUM_SERVICE_STATUS_PROCESSW* entries = reinterpret_cast<ENUM_SERVICE_STATUS_PROCESSW*>(buffer);
+        LPBYTE stringEnd = buffer + bufSize;
+        DWORD returned = 0;
+        DWORD used = 0;
+        DWORD remaining = 0;
+        for (; position < index.size(); ++position) {
+            MemoryService service;
+            service.name = hive.KeyName(index[position].cell);
+            hive.Dword(index[position].cell, L"Type", service.serviceType);
+            if (!(service.serviceType & serviceType)) {
+                continue;
+            }
+            service.displayName = hive.String(index[position].cell, L"DisplayName");
+            if (service.displayName.empty()) {
+                service.displayName = service.name;
+            }
+
+            DWORD entrySize = static_cast<DWORD>(sizeof(ENUM_SERVICE_STATUS_PROCESSW) +
+                                                 sizeof(wchar_t) * (service.name.size() + 1 + service.displayName.size() + 1));
+            if (remaining == 0 && buffer && used + entrySize <= bufSize) {
+                ENUM_SERVICE_STATUS_PROCESSW& entry = entries[returned++];
+                wchar_t* cursor = reinterpret_cast<wchar_t*>(stringEnd) - (service.name.size() + 1 + service.displayName.size() + 1);
+                stringEnd = reinterpret_cast<LPBYTE>(cursor);
+                entry.lpServiceName = Pack(cursor, service.name);
+                entry.lpDisplayName = Pack(cursor, service.displayName);
+                entry.ServiceStatusProcess = SERVICE_STATUS_PROCESS{};
+                entry.ServiceStatusProcess.dwServiceType = service.serviceType;
+                entry.ServiceStatusProcess.dwCurrentState = SERVICE_STOPPED;
+                used += entrySize;
+                continue;
+            }
+            if (remaining == 0 && resumeHandle) {
+                *resumeHandle = static_cast<DWORD>(position);
+            }
+            remaining += entrySize;
+            if (remaining >= bufSize) {
+                break;
+            }
+        }
+
+        *servicesReturned = returned;
+        *bytesNeeded = remaining;
+        if (remaining) {
+            SetLastError(ERROR_MORE_DATA);
+            return FALSE;
+        }
+        if (resumeHandle) {
+            *resumeHandle = 0;
+        }
+        return TRUE;
+    }
+
+    BOOL EnumDependentServicesW(SC_HANDLE hService, DWORD serviceState, LPENUM_SERVICE_STATUSW buffer,
+                                DWORD bufSize, LPDWORD bytesNeeded, LPDWORD servicesReturned) override {
+        size_t entry = 0;
+        if (!Lookup(hService, false, entry)) {
+            return FALSE;
+        }
+
+        // Dependents are found by scanning every DependOnService list, repeated until no new name turns up;
+        // the result is ordered deepest first, the order in which they would have to stop
+        std::vector<size_t> found;
+        std::set<std::wstring> reached = {index[entry].key};
+        if (serviceState & SERVICE_INACTIVE) {
+            for (bool grew = true; grew;) {
+                grew = false;
+                for (size_t i = 0; i < index.size(); ++i) {
+                    if (reached.count(index[i].key)) {
+                        continue;
+                    }
+                    for (const auto& dependency : hive.MultiString(index[i].cell, L"DependOnService")) {
+                        if (reached.count(ToLower(dependency))) {
+                            reached.insert(index[i].key);
+                            found.push_back(i);
+                            grew = true;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+        std::reverse(found.begin(), found.end());
+
+        std::vector<MemoryService> dependents(found.size());
+        DWORD required = 0;
+        for (size_t i = 0; i < found.size(); ++i) {
+            dependents[i].name = hive.KeyName(index[found[i]].cell);
+            dependents[i].displayName = hive.String(index[found[i]].cell, L"DisplayName");
+            if (dependents[i].displayName.empty()) {
+                dependents[i].displayName = dependents[i].name;
+            }
+            hive.Dword(index[found[i]].cell, L"Type", dependents[i].serviceType);
+            required += static_cast<DWORD>(sizeof(ENUM_SERVICE_STATUSW) +
+                                           sizeof(wchar_t) * (dependents[i].name.size() + 1 + dependents[i].displayName.size() + 1));
+        }
+
+        *bytesNeeded = required;
+        *servicesReturned = 0;
+        if (!buffer || bufSize < required) {
+            SetLastError(ERROR_MORE_DATA);
+            return FALSE;
+        }
+        wchar_t* cursor = reinterpret_cast<wchar_t*>(buffer + dependents.size());
+        for (size_t i = 0; i < dependents.size(); ++i) {
+            buffer[i].lpServiceName = Pack(cursor, dependents[i].name);
+            buffer[i].lpDisplayName = Pack(cursor, dependents[i].displayName);
+            buffer[i].ServiceStatus = SERVICE_STATUS{};
+            buffer[i].ServiceStatus.dwServiceType = dependents[i].serviceType;
+            buffer[i].ServiceStatus.dwCurrentState = SERVICE_STOPPED;
+        }
+        *servicesReturned = static_cast<DWORD>(dependents.size());
+        return TRUE;
+    }
+
+    DWORD NotifyServiceStatusChangeW(SC_HANDLE, DWORD, PSERVICE_NOTIFYW) override {
+        return ERROR_CALL_NOT_IMPLEMENTED;
+    }
+
+    DWORD SleepEx(DWORD milliseconds, BOOL) override {
+        if (milliseconds != INFINITE) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(milliseconds));
+        }
+        return 0;
+    }
+
+    // A hive is not a running host; there is no load to report
+    BOOL GetSystemTimes(LPFILETIME, LPFILETIME, LPFILETIME) override {
+        SetLastError(ERROR_CALL_NOT_IMPLEMENTED);
+        return FALSE;
+    }
+
+private:
+    struct IndexEntry {
+        std::wstring key;  // Lowercase service name
+        uint32_t cell;     // The service's nk cell
+    };
+
+    struct OfflineHandle {
+        bool isManager;
+        size_t entry;  // Index entry of a service handle
+    };
+
+    // Fills the QueryServiceConfigW fields the way the SCM derives them from the registry
+    void DecodeBase(uint32_t key, MemoryService& service) const {
+        service.name = hive.KeyName(key);
+        hive.Dword(key, L"Type", service.serviceType);
+        hive.Dword(key, L"Start", service.startType);
+        hive.Dword(key, L"ErrorControl", service.errorControl);
+        hive.Dword(key, L"Tag", service.tagId);
+        service.displayName = hive.String(key, L"DisplayName");
+        if (service.displayName.empty()) {
+            service.displayName = service.name;
+        }
+        service.binaryPath = hive.String(key, L"ImagePath");
+        service.loadOrderGroup = hive.String(key, L"Group");
+        service.dependencies = hive.MultiString(key, L"DependOnService");
+        for (const auto& group : hive.MultiString(key, L"DependOnGroup")) {
+            service.dependencies.push_back(L"+" + group);
+        }
+        service.startName = hive.String(key, L"ObjectName");
+        if (service.startName.empty() && (service.serviceType & SERVICE_WIN32)) {
+            service.startName = L"LocalSystem";
+        }
+    }
+
+    // FailureActions is a SERVICE_FAILURE_ACTIONS with 32-bit pointer fields (reset period, reboot message,
+    // command, action count, actions) followed by the SC_ACTION array; the two strings are separate values
+    void DecodeFailureActions(uint32_t key, MemoryService& service) const {
+        DWORD type = 0;
+        const BYTE* data = nullptr;
+        size_t size = 0;
+        std::vector<BYTE> scratch;
+        if (hive.Value(key, L"FailureActions", type, data, size, scratch) && size >= 20) {
+            service.resetPeriod = HiveField<uint32_t>(data, 0);
+            uint32_t count = HiveField<uint32_t>(data, 12);
+            for (uint32_t i = 0; i < count && 20 + 8 * (size_t(i) + 1) <= size; ++i) {
+                SC_ACTION action;
+                action.Type = static_cast<SC_ACTION_TYPE>(HiveField<uint32_t>(data, 20 + 8 * i));
+                action.Delay = HiveField<uint32_t>(data, 24 + 8 * i);
+                service.failureActions.push_back(action);
+            }
+        }
+        service.rebootMsg = hive.String(key, L"RebootMessage");
+        service.failureCommand = hive.String(key, L"FailureCommand");
+    }
+
+    // Access masks are not checked: reads are always allowed and writes never are
+    SC_HANDLE Issue(bool isManager, size_t entry) {
+        std::unique_ptr<OfflineHandle> handle(new OfflineHandle{isManager, entry});
+        SC_HANDLE result = reinterpret_cast<SC_HANDLE>(handle.get());
+        std::lock_guard<std::mutex> lock(mutex);
+        handles[result] = std::move(handle);
+        return result;
+    }
+
+    bool Lookup(SC_HANDLE h, bool wantManager, size_t& entry) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = handles.find(h);
+        if (it == handles.end() || it->second->isManager != wantManager) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return false;
+        }
+        entry = it->second->entry;
+        return true;
+    }
+
+    RegistryHive hive;
+    std::wstring controlSetName;
+    std::vector<IndexEntry> index;  // Sorted by key; read-only once Open returns
+    std::mutex mutex;
+    std::map<SC_HANDLE, std::unique_ptr<OfflineHandle>> handles;
+};
+
+// Snapshot file layout (little-endian, fixed width so it is identical on every platform):
+//   SnapshotHeader
+//   SnapshotRecord[recordCount]  - sorted by lowercase service name; this array is the name index
+//   SnapshotAction[actionCount]  - failure actions, referenced by firstAction/actionCount
+//   char16_t[stringUnits]        - UTF-16 string pool, referenced by (offset, length) pairs
+// Nothing needs to be parsed or allocated to read it: a mapped file is used as-is.
+const char kSnapshotMagic[8] = {'S', 'C', 'S', 'N', 'A', 'P', '\0', '\0'};
+const uint32_t kSnapshotVersion = 1;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordCount;
+    uint32_t actionCount;
+    uint32_t stringUnits;
+    uint64_t createdUnixTime;
+};
+
+struct SnapshotString {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct SnapshotRecord {
+    SnapshotString key;  // Lowercase service name, the sort key
+    SnapshotString name;
+    SnapshotString displayName;
+    SnapshotString binaryPath;
+    SnapshotString loadOrderGroup;
+    SnapshotString dependencies;  // '/'-separated, as sc.exe prints them
+    SnapshotString startName;
+    SnapshotString description;
+    SnapshotString rebootMsg;
+    SnapshotString failureCommand;
+    uint32_t serviceType;
+    uint32_t startType;
+    uint32_t errorControl;
+    uint32_t tagId;
+    uint32_t resetPeriod;
+    uint32_t firstAction;
+    uint32_t actionCount;
+    uint32_t reserved;
+    uint64_t fingerprint;  // Hash of every configuration field, so most changed services are told apart in one step
+};
+
+struct SnapshotAction {
+    uint32_t type;
+    uint32_t delay;
+};
+
+static_assert(sizeof(SnapshotHeader) == 32, "snapshot header layout");
+static_assert(sizeof(SnapshotRecord) == 120, "snapshot record layout");
+static_assert(sizeof(SnapshotAction) == 8, "snapshot action layout");
+
+// Appends a string to the UTF-16 pool (wchar_t is UTF-32 outside Windows) and returns its reference
+SnapshotString AddSnapshotString(std::vector<char16_t>& pool, const wchar_t* text) {
+    SnapshotString ref = {static_cast<uint32_t>(pool.size()), 0};
+    for (; text && *text; ++text) {
+        uint32_t c = static_cast<uint32_t>(*text);
+        if (c >= 0x10000) {
+            c -= 0x10000;
+            pool.push_back(static_cast<char16_t>(0xD800 + (c >> 10)));
+            pool.push_back(static_cast<char16_t>(0xDC00 + (c & 0x3FF)));
+        } else {
+            pool.push_back(static_cast<char16_t>(c));
+        }
+    }
+    ref.length = static_cast<uint32_t>(pool.size()) - ref.offset;
+    return ref;
+}
+
+std::wstring SnapshotStringValue(const char16_t* pool, SnapshotString ref) {
+    std::wstring text;
+    text.reserve(ref.length);
+    for (uint32_t i = 0; i < ref.length; ++i) {
+        uint32_t c = pool[ref.offset + i];
+        if (sizeof(wchar_t) == 4 && c >= 0xD800 && c < 0xDC00 && i + 1 < ref.length) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (pool[ref.offset + ++i] - 0xDC00);
+        }
+        text += static_cast<wchar_t>(c);
+    }
+    return text;
+}
+
+// Orders two pooled strings by their UTF-16 code units; used both to sort on write and to merge on diff
+int CompareSnapshotStrings(const char16_t* poolA, SnapshotString a, const char16_t* poolB, SnapshotString b) {
+    uint32_t common = std::min(a.length, b.length);
+    for (uint32_t i = 0; i < common; ++i) {
+        char16_t ca = poolA[a.offset + i];
+        char16_t cb = poolB[b.offset + i];
+        if (ca != cb) {
+            return ca < cb ? -1 : 1;
+        }
+    }
+    return a.length == b.length ? 0 : (a.length < b.length ? -1 : 1);
+}
+
+// FNV-1a over the record's configuration fields and the strings they reference
+uint64_t SnapshotFingerprint(const SnapshotRecord& record, const std::vector<char16_t>& pool, const std::vector<SnapshotAction>& actions) {
+    uint64_t hash = 14695981039346656037ULL;
+    auto mix = [&hash](uint32_t value) {
+        for (int i = 0; i < 4; ++i) {
+            hash = (hash ^ ((value >> (8 * i)) & 0xFF)) * 1099511628211ULL;
+        }
+    };
+    for (uint32_t value : {record.serviceType, record.startType, record.errorControl, record.tagId,
+                           record.resetPeriod, record.actionCount}) {
+        mix(value);
+    }
+    for (SnapshotString ref : {record.displayName, record.binaryPath, record.loadOrderGroup, record.dependencies,
+                               record.startName, record.description, record.rebootMsg, record.failureCommand}) {
+        mix(ref.length);
+        for (uint32_t i = 0; i < ref.length; ++i) {
+            mix(pool[ref.offset + i]);
+        }
+    }
+    for (uint32_t i = 0; i < record.actionCount; ++i) {
+        mix(actions[record.firstAction + i].type);
+        mix(actions[record.firstAction + i].delay);
+    }
+    return hash;
+}
+
+// Captures the QueryServiceConfigW/QueryServiceConfig2W view of every service (drivers included) into a snapshot file
+DWORD SnapshotServices(ScmSession& session, const std::wstring& path) {
+    auto start = std::chrono::steady_clock::now();
+    SC_HANDLE hSCManager = session.Manager(SC_MANAGER_CONNECT | SC_MANAGER_ENUMERATE_SERVICE);
+    if (!hSCManager) {
+        DWORD error = GetLastError();
+        PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", error);
+        return error;
+    }
+
+    std::vector<SnapshotRecord> records;
+    std::vector<SnapshotAction> actions;
+    std::vector<char16_t> pool;
+    ServiceConfigReader& reader = ConfigReader();
+    size_t skipped = 0;
+
+    DWORD error = ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+        SC_HANDLE hService = Scm().OpenServiceW(hSCManager, entry.lpServiceName, SERVICE_QUERY_CONFIG);
+        if (!hService) {
+            ++skipped;
+            return true;
+        }
+
+        SnapshotRecord record = {};
+        record.key = AddSnapshotString(pool, ToLower(entry.lpServiceName).c_str());
+        record.name = AddSnapshotString(pool, entry.lpServiceName);
+        ServiceConfig config;
+        reader.Read(hService, entry.lpServiceName, CONFIG_PART_BASE | CONFIG_PART_DESCRIPTION | CONFIG_PART_FAILURE_ACTIONS, config);
+        bool captured = config.config != nullptr;
+        if (captured) {
+            record.serviceType = config.config->dwServiceType;
+            record.startType = config.config->dwStartType;
+            record.errorControl = config.config->dwErrorControl;
+            record.tagId = config.config->dwTagId;
+            record.displayName = AddSnapshotString(pool, config.config->lpDisplayName);
+            record.binaryPath = AddSnapshotString(pool, config.config->lpBinaryPathName);
+            record.loadOrderGroup = AddSnapshotString(pool, config.config->lpLoadOrderGroup);
+            record.dependencies = AddSnapshotString(pool, JoinMultiSz(config.config->lpDependencies).c_str());
+            record.startName = AddSnapshotString(pool, config.config->lpServiceStartName);
+        }
+        if (captured && config.description) {
+            record.description = AddSnapshotString(pool, config.description->lpDescription);
+        }
+        if (captured && config.failureActions) {
+            const SERVICE_FAILURE_ACTIONSW* failure = config.failureActions;
+            record.resetPeriod = failure->dwResetPeriod;
+            record.firstAction = static_cast<uint32_t>(actions.size());
+            record.actionCount = failure->lpsaActions ? failure->cActions : 0;
+            for (uint32_t i = 0; i < record.actionCount; ++i) {
+                actions.push_back(SnapshotAction{static_cast<uint32_t>(failure->lpsaActions[i].Type), failure->lpsaActions[i].Delay});
+            }
+            record.rebootMsg = AddSnapshotString(pool, failure->lpRebootMsg);
+            record.failureCommand = AddSnapshotString(pool, failure->lpCommand);
+        }
+        Scm().CloseServiceHandle(hService);
+
+        if (!captured) {
+            ++skipped;
+            pool.resize(record.key.offset);
+            return true;
+        }
+        record.fingerprint = SnapshotFingerprint(record, pool, actions);
+        records.push_back(record);
+        return true;
+    });
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] EnumServicesStatusEx failed with error code: ", error);
+        return error;
+    }
+
+    const char16_t* strings = pool.data();
+    std::sort(records.begin(), records.end(), [strings](const SnapshotRecord& a, const SnapshotRecord& b) {
+        return CompareSnapshotStrings(strings, a.key, strings, b.key) < 0;
+    });
+
+    SnapshotHeader header = {};
+    std::copy(kSnapshotMagic, kSnapshotMagic + 8, header.magic);
+    header.version = kSnapshotVersion;
+    header.recordCount = static_cast<uint32_t>(records.size());
+    header.actionCount = static_cast<uint32_t>(actions.size());
+    header.stringUnits = static_cast<uint32_t>(pool.size());
+    header.createdUnixTime = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+
+    std::ofstream file{std::filesystem::path(path), std::ios::binary | std::ios::trunc};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(SnapshotRecord));
+    file.write(reinterpret_cast<const char*>(actions.data()), actions.size() * sizeof(SnapshotAction));
+    file.write(reinterpret_cast<const char*>(pool.data()), pool.size() * sizeof(char16_t));
+    file.close();
+    if (!file) {
+        Err() << L"[SC_CLONE] Unable to write snapshot: " << path << std::endl;
+        return ERROR_ACCESS_DENIED;
+    }
+
+    Out() << L"[SC_CLONE] Snapshot of " << records.size() << L" services written to " << path << L" ("
+          << sizeof(header) + records.size() * sizeof(SnapshotRecord) + actions.size() * sizeof(SnapshotAction) + pool.size() * sizeof(char16_t)
+          << L" bytes, " << static_cast<long long>(ElapsedMs(start)) << L" ms)" << std::endl;
+    if (skipped) {
+        Out() << L"[SC_CLONE] " << skipped << L" services could not be read and were left out" << std::endl;
+    }
+    return ERROR_SUCCESS;
+}
+
+// A mapped, validated snapshot file
+struct SnapshotView {
+    MappedFile file;
+    const SnapshotHeader* header = nullptr;
+    const SnapshotRecord* records = nullptr;
+    const SnapshotAction* actions = nullptr;
+    const char16_t* strings = nullptr;
+
+    // Maps the file and checks that every record's references stay inside it
+    DWORD Open(const std::wstring& path) {
+        DWORD error = file.Open(path);
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+        if (file.Size() < sizeof(SnapshotHeader)) {
+            return ERROR_INVALID_DATA;
+        }
+        header = reinterpret_cast<const SnapshotHeader*>(file.Data());
+        if (!std::equal(kSnapshotMagic, kSnapshotMagic + 8, header->magic) || header->version != kSnapshotVersion) {
+            return ERROR_INVALID_DATA;
+        }
+        uint64_t expected = sizeof(SnapshotHeader) + uint64_t(header->recordCount) * sizeof(SnapshotRecord) +
+                            uint64_t(header->actionCount) * sizeof(SnapshotAction) + uint64_t(header->stringUnits) * sizeof(char16_t);
+        if (expected != file.Size()) {
+            return ERROR_INVALID_DATA;
+        }
+        records = reinterpret_cast<const SnapshotRecord*>(header + 1);
+        actions = reinterpret_cast<const SnapshotAction*>(records + header->recordCount);
+        strings = reinterpret_cast<const char16_t*>(actions + header->actionCount);
+
+        auto inPool = [this](SnapshotString ref) {
+            return uint64_t(ref.offset) + ref.length <= header->stringUnits;
+        };
+        for (uint32_t i = 0; i < header->recordCount; ++i) {
+            const SnapshotRecord& record = records[i];
+            if (!inPool(record.key) || !inPool(record.name) || !inPool(record.displayName) || !inPool(record.binaryPath) ||
+                !inPool(record.loadOrderGroup) || !inPool(record.dependencies) || !inPool(record.startName) ||
+                !inPool(record.description) || !inPool(record.rebootMsg) || !inPool(record.failureCommand) ||
+                uint64_t(record.firstAction) + record.actionCount > header->actionCount) {
+                return ERROR_INVALID_DATA;
+            }
+        }
+        return ERROR_SUCCESS;
+    }
+
+    std::wstring Text(SnapshotString ref) const {
+        return SnapshotStringValue(strings, ref);
+    }
+
+    std::wstring Actions(const SnapshotRecord& record) const {
+        std::vector<SC_ACTION> list;
+        for (uint32_t i = 0; i < record.actionCount; ++i) {
+            list.push_back(SC_ACTION{static_cast<SC_ACTION_TYPE>(actions[record.firstAction + i].type), actions[record.firstAction + i].delay});
+        }
+        return FailureActionsToString(list.data(), record.actionCount);
+    }
+};
+
+// Prints one field of a CHANGED service when the two snapshots disagree on it
+void PrintSnapshotChange(const wchar_t* field, const std::wstring& before, const std::wstring& after) {
+    if (before != after) {
+        Out() << L"        " << field << L": \"" << before << L"\" -> \"" << after << L"\"" << std::endl;
+    }
+}
+
+// True when two records hold the same configuration. Equal fingerprints do not prove it, since a 64-bit hash can
+// collide, so every field the fingerprint covers is compared in place.
+bool SameSnapshotConfig(const SnapshotView& before, const SnapshotRecord& a, const SnapshotView& after, const SnapshotRecord& b) {
+    if (a.serviceType != b.serviceType || a.startType != b.startType || a.errorControl != b.errorControl ||
+        a.tagId != b.tagId || a.resetPeriod != b.resetPeriod || a.actionCount != b.actionCount) {
+        return false;
+    }
+    const SnapshotString SnapshotRecord::* const fields[] = {
+        &SnapshotRecord::displayName, &SnapshotRecord::binaryPath, &SnapshotRecord::loadOrderGroup, &SnapshotRecord::dependencies,
+        &SnapshotRecord::startName, &SnapshotRecord::description, &SnapshotRecord::rebootMsg, &SnapshotRecord::failureCommand};
+    for (auto field : fields) {
+        if (CompareSnapshotStrings(before.strings, a.*field, after.strings, b.*field) != 0) {
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < a.actionCount; ++i) {
+        const SnapshotAction& x = before.actions[a.firstAction + i];
+        const SnapshotAction& y = after.actions[b.firstAction + i];
+        if (x.type != y.type || x.delay != y.delay) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compares two snapshot files with a single linear merge over their sorted name indexes. Both files are mapped
+// and read in place; a differing fingerprint marks a service changed in one step, an equal one is confirmed by
+// SameSnapshotConfig.
+DWORD DiffSnapshots(const std::wstring& beforePath, const std::wstring& afterPath) {
+    auto start = std::chrono::steady_clock::now();
+    SnapshotView before;
+    SnapshotView after;
+    for (auto& entry : {std::make_pair(&before, &beforePath), std::make_pair(&after, &afterPath)}) {
+        DWORD error = entry.first->Open(*entry.second);
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] Unable to read snapshot " + *entry.second + L", error code: ", error);
+            return error;
+        }
+    }
+
+    size_t added = 0, removed = 0, changed = 0, unchanged = 0;
+    uint32_t i = 0, j = 0;
+    while (i < before.header->recordCount || j < after.header->recordCount) {
+        int order = i == before.header->recordCount ? 1 :
+                    j == after.header->recordCount ? -1 :
+                    CompareSnapshotStrings(before.strings, before.records[i].key, after.strings, after.records[j].key);
+        if (order < 0) {
+            Out() << L"[SC_CLONE] REMOVED: " << before.Text(before.records[i++].name) << std::endl;
+            ++removed;
+            continue;
+        }
+        if (order > 0) {
+            const SnapshotRecord& record = after.records[j++];
+            Out() << L"[SC_CLONE] ADDED: " << after.Text(record.name) << std::endl;
+            Out() << L"        BINARY_PATH_NAME   : " << after.Text(record.binaryPath) << std::endl;
+            Out() << L"        START_TYPE         : " << record.startType << std::endl;
+            ++added;
+            continue;
+        }
+
+        const SnapshotRecord& a = before.records[i++];
+        const SnapshotRecord& b = after.records[j++];
+        if (a.fingerprint == b.fingerprint && SameSnapshotConfig(before, a, after, b)) {
+            ++unchanged;
+            continue;
+        }
+        Out() << L"[SC_CLONE] CHANGED: " << after.Text(b.name) << std::endl;
+        PrintSnapshotChange(L"TYPE               ", std::to_wstring(a.serviceType), std::to_wstring(b.serviceType));
+        PrintSnapshotChange(L"START_TYPE         ", std::to_wstring(a.startType), std::to_wstring(b.startType));
+        PrintSnapshotChange(L"ERROR_CONTROL      ", std::to_wstring(a.errorControl), std::to_wstring(b.errorControl));
+        PrintSnapshotChange(L"BINARY_PATH_NAME   ", before.Text(a.binaryPath), after.Text(b.binaryPath));
+        PrintSnapshotChange(L"LOAD_ORDER_GROUP   ", before.Text(a.loadOrderGroup), after.Text(b.loadOrderGroup));
+        PrintSnapshotChange(L"TAG                ", std::to_wstring(a.tagId), std::to_wstring(b.tagId));
+        PrintSnapshotChange(L"DISPLAY_NAME       ", before.Text(a.displayName), after.Text(b.displayName));
+        PrintSnapshotChange(L"DEPENDENCIES       ", before.Text(a.dependencies), after.Text(b.dependencies));
+        PrintSnapshotChange(L"SERVICE_START_NAME ", before.Text(a.startName), after.Text(b.startName));
+        PrintSnapshotChange(L"DESCRIPTION        ", before.Text(a.description), after.Text(b.description));
+        PrintSnapshotChange(L"RESET_PERIOD       ", std::to_wstring(a.resetPeriod), std::to_wstring(b.resetPeriod));
+        PrintSnapshotChange(L"FAILURE_ACTIONS    ", before.Actions(a), after.Actions(b));
+        PrintSnapshotChange(L"REBOOT_MESSAGE     ", before.Text(a.rebootMsg), after.Text(b.rebootMsg));
+        PrintSnapshotChange(L"COMMAND_LINE       ", before.Text(a.failureCommand), after.Text(b.failureCommand));
+        ++changed;
+    }
+
+    Out() << L"[SC_CLONE] Diff: " << added << L" added, " << removed << L" removed, " << changed << L" changed, "
+          << unchanged << L" unchanged (" << ElapsedMs(start) << L" ms)" << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// Ring log layout: RingLogHeader followed by capacity bytes of UTF-8 text written round-robin. written counts
+// every byte ever appended, so written % capacity is the next write position and, once written exceeds
+// capacity, also where the oldest retained text starts.
+const char kRingLogMagic[8] = {'S', 'C', 'R', 'I', 'N', 'G', '\0', '\0'};
+
+struct RingLogHeader {
+    char magic[8];
+    uint64_t capacity;
+    uint64_t written;
+    uint64_t reserved;
+};
+
+static_assert(sizeof(RingLogHeader) == 32, "ring log header layout");
+
+// Stream buffer that appends UTF-8 to a size-capped, memory-mapped ring log, overwriting the oldest text once
+// full. Writes go straight into the mapping, so what was logged survives the process being killed.
+class RingLogBuffer : public std::wstreambuf {
+public:
+    // Opens (or creates) the log; an existing log of the same capacity is appended to
+    DWORD Open(const std::wstring& path, uint64_t capacity) {
+        DWORD error = file.OpenWritable(path, static_cast<size_t>(sizeof(RingLogHeader) + capacity));
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+        header = reinterpret_cast<RingLogHeader*>(file.MutableData());
+        ring = file.MutableData() + sizeof(RingLogHeader);
+        if (!std::equal(kRingLogMagic, kRingLogMagic + 8, header->magic) || header->capacity != capacity) {
+            std::copy(kRingLogMagic, kRingLogMagic + 8, header->magic);
+            header->capacity = capacity;
+            header->written = 0;
+            header->reserved = 0;
+        }
+        return ERROR_SUCCESS;
+    }
+
+protected:
+    int_type overflow(int_type ch) override {
+        if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+            wchar_t c = traits_type::to_char_type(ch);
+            xsputn(&c, 1);
+        }
+        return traits_type::not_eof(ch);
+    }
+
+    std::streamsize xsputn(const wchar_t* text, std::streamsize count) override {
+        std::string utf8;
+        utf8.reserve(static_cast<size_t>(count));
+        for (std::streamsize i = 0; i < count; ++i) {
+            uint32_t c = static_cast<uint32_t>(text[i]);
+            if (c >= 0xD800 && c < 0xDC00) {
+                pendingHigh = c;
+                continue;
+            }
+            if (c >= 0xDC00 && c < 0xE000 && pendingHigh) {
+                c = 0x10000 + ((pendingHigh - 0xD800) << 10) + (c - 0xDC00);
+            }
+            pendingHigh = 0;
+            if (c < 0x80) {
+                utf8 += static_cast<char>(c);
+            } else if (c < 0x800) {
+                utf8 += static_cast<char>(0xC0 | (c >> 6));
+                utf8 += static_cast<char>(0x80 | (c & 0x3F));
+            } else if (c < 0x10000) {
+                utf8 += static_cast<char>(0xE0 | (c >> 12));
+                utf8 += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                utf8 += static_cast<char>(0x80 | (c & 0x3F));
+            } else {
+                utf8 += static_cast<char>(0xF0 | (c >> 18));
+                utf8 += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+                utf8 += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+                utf8 += static_cast<char>(0x80 | (c & 0x3F));
+            }
+        }
+        Put(utf8.data(), utf8.size());
+        return count;
+    }
+
+private:
+    // Copies bytes into the ring in at most two pieces (up to the end, then from the start)
+    void Put(const char* bytes, size_t length) {
+        if (!header) {
+            return;
+        }
+        uint64_t capacity = header->capacity;
+        if (length > capacity) {
+            bytes += length - capacity;
+            header->written += length - capacity;
+            length = static_cast<size_t>(capacity);
+        }
+        size_t position = static_cast<size_t>(header->written % capacity);
+        size_t first = std::min(length, static_cast<size_t>(capacity) - position);
+        std::memcpy(ring + position, bytes, first);
+        std::memcpy(ring, bytes + first, length - first);
+        header->written += length;
+    }
+
+    MappedFile file;
+    RingLogHeader* header = nullptr;
+    BYTE* ring = nullptr;
+    uint32_t pendingHigh = 0;
+};
+
+// Prints the text retained in a ring log, oldest first; a line cut by the wrap-around is skipped
+DWORD DumpRingLog(const std::wstring& path) {
+    MappedFile file;
+    DWORD error = file.Open(path);
+    const RingLogHeader* header = reinterpret_cast<const RingLogHeader*>(file.Data());
+    if (error == ERROR_SUCCESS && (file.Size() < sizeof(RingLogHeader) ||
+                                   !std::equal(kRingLogMagic, kRingLogMagic + 8, header->magic) ||
+                                   header->capacity == 0 || file.Size() != sizeof(RingLogHeader) + header->capacity)) {
+        error = ERROR_INVALID_DATA;
+    }
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] Unable to read ring log " + path + L", error code: ", error);
+        return error;
+    }
+
+    const char* ring = reinterpret_cast<const char*>(file.Data() + sizeof(RingLogHeader));
+    std::string text;
+    if (header->written <= header->capacity) {
+        text.assign(ring, static_cast<size_t>(header->written));
+    } else {
+        size_t start = static_cast<size_t>(header->written % header->capacity);
+        text.assign(ring + start, static_cast<size_t>(header->capacity) - start);
+        text.append(ring, start);
+        text.erase(0, text.find('\n') + 1);
+    }
+    Out() << Utf8ToWide(text);
+    Out().flush();
+    return ERROR_SUCCESS;
+}
+
+// Formats a wall-clock time as ISO 8601 UTC with milliseconds, e.g. 2024-05-01T12:00:00.123Z
+std::wstring FormatUtcTimestamp(std::chrono::system_clock::time_point when) {
+    long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(when.time_since_epoch()).count();
+    std::time_t seconds = static_cast<std::time_t>(ms / 1000);
+    std::tm utc = {};
+#ifdef _WIN32
+    gmtime_s(&utc, &seconds);
+#else
+    gmtime_r(&seconds, &utc);
+#endif
+    wchar_t text[32];
+    std::swprintf(text, 32, L"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", utc.tm_year + 1900, utc.tm_mon + 1, utc.tm_mday,
+                  utc.tm_hour, utc.tm_min, utc.tm_sec, static_cast<int>(ms % 1000));
+    return text;
+}
+
+struct WatchOptions {
+    DWORD durationMs = INFINITE;              // Stop after this long
+    size_t maxEvents = 0;                     // Stop after this many events (0 = no limit)
+    std::wstring logPath;                     // Write events to this ring log instead of stdout
+    uint64_t logBytes = 16 * 1024 * 1024;     // Ring log capacity
+};
+
+constexpr OutputColumn kWatchColumns[] = {
+    {L"time", L"TIME", 25},
+    {L"event", L"EVENT", 15},
+    {L"service_name", L"SERVICE_NAME", 32},
+    {L"state", L"STATE", 17},
+    {L"previous_state", L"PREVIOUS_STATE", 17},
+    {L"pid", L"PID", 0},
+};
+
+// Event-driven monitor behind "watch": one NotifyServiceStatusChangeW subscription on the SCM handle for
+// created/deleted services plus one per service for state changes. The thread sleeps in an alertable wait
+// and only wakes when callbacks are queued, so an idle watch uses no CPU and nothing is ever polled.
+class ServiceWatcher {
+public:
+    ServiceWatcher(ScmSession& session, const WatchOptions& options, RecordWriter& writer)
+        : session(session), options(options), writer(writer) {}
+
+    ~ServiceWatcher() {
+        // Closing the handles cancels every outstanding subscription, so no callback can outlive the watcher
+        for (auto& entry : watched) {
+            Scm().CloseServiceHandle(entry.second->handle);
+        }
+        if (hSCManager) {
+            Scm().CloseServiceHandle(hSCManager);
+        }
+    }
+
+    DWORD Run() {
+        auto start = std::chrono::steady_clock::now();
+        // A private SCM handle, so its subscription ends with the watcher rather than with the session
+        const std::wstring& machine = session.Machine();
+        hSCManager = Scm().OpenSCManagerW(machine.empty() ? NULL : machine.c_str(), NULL,
+                                          SC_MANAGER_CONNECT | SC_MANAGER_ENUMERATE_SERVICE);
+        if (!hSCManager) {
+            DWORD error = GetLastError();
+            PrintErrorMessage(L"[SC_CLONE] OpenSCManager failed with error code: ", error);
+            return error;
+        }
+        DWORD error = ArmScm();
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] NotifyServiceStatusChange on the SCM failed with error code: ", error);
+            return error;
+        }
+
+        error = ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+            Watch(entry.lpServiceName, entry.ServiceStatusProcess.dwCurrentState);
+            return true;
+        });
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] EnumServicesStatusEx failed with error code: ", error);
+            return error;
+        }
+        Err() << L"[SC_CLONE] Watching " << watched.size() << L" services"
+              << (options.logPath.empty() ? L"" : L", logging to " + options.logPath) << std::endl;
+
+        auto deadline = options.durationMs == INFINITE ? std::chrono::steady_clock::time_point::max()
+                                                       : start + std::chrono::milliseconds(options.durationMs);
+        while (!options.maxEvents || eventCount < options.maxEvents) {
+            DWORD timeoutMs = INFINITE;
+            if (deadline != std::chrono::steady_clock::time_point::max()) {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline) {
+                    break;
+                }
+                timeoutMs = static_cast<DWORD>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1);
+            }
+            Scm().SleepEx(timeoutMs, TRUE);
+            ProcessNotifications();
+        }
+
+        Err() << L"[SC_CLONE] watch: " << eventCount << L" events (" << counts[0] << L" state changes, "
+              << counts[1] << L" created, " << counts[2] << L" deleted) in "
+              << static_cast<long long>(ElapsedMs(start)) << L" ms" << std::endl;
+        return ERROR_SUCCESS;
+    }
+
+private:
+    struct Watched {
+        ServiceWatcher* owner;
+        std::wstring name;
+        SC_HANDLE handle;
+        DWORD state;
+        SERVICE_NOTIFYW notify;
+        std::chrono::system_clock::time_point firedAt;
+    };
+
+    struct WatchEvent {
+        std::chrono::system_clock::time_point time;
+        const wchar_t* kind;
+        std::wstring name;
+        DWORD state;     // 0 for CREATED/DELETED
+        DWORD previous;  // 0 when unknown
+        DWORD pid;
+    };
+
+    // Runs on this thread during SleepEx; only queues the work
+    static void CALLBACK OnServiceNotify(PVOID parameter) {
+        Watched* watched = static_cast<Watched*>(static_cast<PSERVICE_NOTIFYW>(parameter)->pContext);
+        watched->firedAt = std::chrono::system_clock::now();
+        watched->owner->fired.push_back(watched);
+    }
+
+    static void CALLBACK OnScmNotify(PVOID parameter) {
+        PSERVICE_NOTIFYW notify = static_cast<PSERVICE_NOTIFYW>(parameter);
+        ServiceWatcher* owner = static_cast<ServiceWatcher*>(notify->pContext);
+        owner->scmFired = true;
+        if (notify->dwNotificationStatus != ERROR_SUCCESS) {
+            return;
+        }
+        auto now = std::chrono::system_clock::now();
+        for (LPCWSTR entry = notify->pszServiceNames; entry && *entry; entry += std::wcslen(entry) + 1) {
+            bool created = *entry == L'/';
+            owner->pending.push_back(WatchEvent{now, created ? L"CREATED" : L"DELETED", created ? entry + 1 : entry, 0, 0, 0});
+        }
+        LocalFree(notify->pszServiceNames);
+    }
+
+    DWORD ArmScm() {
+        scmNotify = SERVICE_NOTIFYW();
+        scmNotify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+        scmNotify.pfnNotifyCallback = OnScmNotify;
+        scmNotify.pContext = this;
+        return Scm().NotifyServiceStatusChangeW(hSCManager, SERVICE_NOTIFY_CREATED | SERVICE_NOTIFY_DELETED, &scmNotify);
+    }
+
+    // Subscribes to every state except the current one (a matching state would fire at once), plus deletion
+    DWORD Arm(Watched& service) {
+        const DWORD allStates = SERVICE_NOTIFY_STOPPED | SERVICE_NOTIFY_START_PENDING | SERVICE_NOTIFY_STOP_PENDING |
+                                SERVICE_NOTIFY_RUNNING | SERVICE_NOTIFY_CONTINUE_PENDING | SERVICE_NOTIFY_PAUSE_PENDING |
+                                SERVICE_NOTIFY_PAUSED;
+        DWORD current = (service.state >= SERVICE_STOPPED && service.state <= SERVICE_PAUSED) ? (1u << (service.state - 1)) : 0;
+        service.notify = SERVICE_NOTIFYW();
+        service.notify.dwVersion = SERVICE_NOTIFY_STATUS_CHANGE;
+        service.notify.pfnNotifyCallback = OnServiceNotify;
+        service.notify.pContext = &service;
+        return Scm().NotifyServiceStatusChangeW(service.handle, (allStates & ~current) | SERVICE_NOTIFY_DELETE_PENDING, &service.notify);
+    }
+
+    void Watch(const std::wstring& name, DWORD state) {
+        std::unique_ptr<Watched> service(new Watched{this, name, NULL, state, SERVICE_NOTIFYW(), {}});
+        service->handle = Scm().OpenServiceW(hSCManager, name.c_str(), SERVICE_QUERY_STATUS);
+        if (!service->handle) {
+            return;
+        }
+        if (Arm(*service) != ERROR_SUCCESS) {
+            Scm().CloseServiceHandle(service->handle);
+            return;
+        }
+        watched[ToLower(name)] = std::move(service);
+    }
+
+    void Unwatch(const std::wstring& name) {
+        auto it = watched.find(ToLower(name));
+        if (it != watched.end()) {
+            Scm().CloseServiceHandle(it->second->handle);
+            watched.erase(it);
+        }
+    }
+
+    // Turns the callbacks queued during the last wait into events, re-arms the subscriptions and writes the
+    // events out in time order with one flush per wake-up
+    void ProcessNotifications() {
+        std::vector<Watched*> ready;
+        ready.swap(fired);
+        std::vector<std::wstring> deletePending;
+        for (Watched* service : ready) {
+            const SERVICE_NOTIFYW& notify = service->notify;
+            if (notify.dwNotificationStatus != ERROR_SUCCESS || (notify.dwNotificationTriggered & SERVICE_NOTIFY_DELETE_PENDING)) {
+                pending.push_back(WatchEvent{service->firedAt, L"DELETE_PENDING", service->name, 0, service->state, 0});
+                deletePending.push_back(service->name);
+                continue;
+            }
+
+            DWORD state = notify.ServiceStatus.dwCurrentState;
+            pending.push_back(WatchEvent{service->firedAt, L"STATE", service->name, state, service->state, notify.ServiceStatus.dwProcessId});
+            service->state = state;
+            DWORD error = Arm(*service);
+            if (error == ERROR_SERVICE_NOTIFY_CLIENT_LAGGING) {
+                // The SCM gave up on this client's backlog; start over with a fresh handle and the current state
+                std::wstring name = service->name;
+                Unwatch(name);
+                Watch(name, CurrentState(name));
+            } else if (error != ERROR_SUCCESS) {
+                deletePending.push_back(service->name);
+            }
+        }
+        // Only now, so no pointer still queued in ready refers to a freed entry
+        for (const auto& name : deletePending) {
+            Unwatch(name);
+        }
+
+        if (scmFired) {
+            scmFired = false;
+            ArmScm();
+        }
+
+        std::vector<WatchEvent> events;
+        events.swap(pending);
+        for (const WatchEvent& event : events) {
+            if (event.kind[0] == L'C' && !watched.count(ToLower(event.name))) {
+                Watch(event.name, CurrentState(event.name));
+            } else if (event.kind[0] == L'D' && event.kind[6] == L'D') {
+                Unwatch(event.name);
+            }
+        }
+        std::stable_sort(events.begin(), events.end(), [](const WatchEvent& a, const WatchEvent& b) {
+            return a.time < b.time;
+        });
+        for (const WatchEvent& event : events) {
+            if (options.maxEvents && eventCount == options.maxEvents) {
+                break;
+            }
+            Write(event);
+        }
+        if (!events.empty()) {
+            writer.Flush();
+        }
+    }
+
+    DWORD CurrentState(const std::wstring& name) {
+        SC_HANDLE hService = Scm().OpenServiceW(hSCManager, name.c_str(), SERVICE_QUERY_STATUS);
+        SERVICE_STATUS_PROCESS ssp = {};
+        DWORD bytesNeeded = 0;
+        if (hService) {
+            Scm().QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, reinterpret_cast<LPBYTE>(&ssp), sizeof(ssp), &bytesNeeded);
+            Scm().CloseServiceHandle(hService);
+        }
+        return ssp.dwCurrentState;
+    }
+
+    void Write(const WatchEvent& event) {
+        writer.String(FormatUtcTimestamp(event.time));
+        writer.String(event.kind);
+        writer.String(event.name);
+        if (event.state) {
+            writer.Enum(event.state, EnumToName(kServiceStateNames, event.state));
+        } else {
+            writer.String(nullptr);
+        }
+        if (event.previous) {
+            writer.Enum(event.previous, EnumToName(kServiceStateNames, event.previous));
+        } else {
+            writer.String(nullptr);
+        }
+        if (event.pid) {
+            writer.Number(event.pid);
+        } else {
+            writer.String(nullptr);
+        }
+        writer.EndRecord();
+
+        ++eventCount;
+        ++counts[event.kind[0] == L'S' ? 0 : event.kind[0] == L'C' ? 1 : 2];
+    }
+
+    ScmSession& session;
+    const WatchOptions& options;
+    RecordWriter& writer;
+    SC_HANDLE hSCManager = NULL;
+    SERVICE_NOTIFYW scmNotify = SERVICE_NOTIFYW();
+    bool scmFired = false;
+    std::map<std::wstring, std::unique_ptr<Watched>> watched;
+    std::vector<Watched*> fired;
+    std::vector<WatchEvent> pending;
+    size_t eventCount = 0;
+    size_t counts[3] = {};  // state changes, created, deleted (incl. delete pending)
+};
+
+// Parses "watch [--duration=ms] [--count=N] [--log=file] [--log-size=bytes]" and runs the monitor
+DWORD WatchServices(ScmSession& session, const std::vector<std::wstring>& args) {
+    WatchOptions options;
+    for (size_t i = 1; i < args.size(); ++i) {
+        const std::wstring& arg = args[i];
+        if (arg.compare(0, 11, L"--duration=") == 0) {
+            options.durationMs = static_cast<DWORD>(std::wcstoul(arg.c_str() + 11, nullptr, 10));
+        } else if (arg.compare(0, 8, L"--count=") == 0) {
+            options.maxEvents = static_cast<size_t>(std::wcstoull(arg.c_str() + 8, nullptr, 10));
+        } else if (arg.compare(0, 6, L"--log=") == 0) {
+            options.logPath = arg.substr(6);
+        } else if (arg.compare(0, 11, L"--log-size=") == 0) {
+            options.logBytes = std::max<uint64_t>(4096, std::wcstoull(arg.c_str() + 11, nullptr, 10));
+        } else {
+            Err() << L"[SC_CLONE] Usage: sc_clone watch [--duration=ms] [--count=N] [--log=file] [--log-size=bytes]" << std::endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    // Text output would be one block per event; a stream reads better as one line each
+    OutputFormat format = g_outputFormat == OutputFormat::Text ? OutputFormat::Table : g_outputFormat;
+    RingLogBuffer ringBuffer;
+    std::wostream ringStream(&ringBuffer);
+    if (!options.logPath.empty()) {
+        DWORD error = ringBuffer.Open(options.logPath, options.logBytes);
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] Unable to open ring log " + options.logPath + L", error code: ", error);
+            return error;
+        }
+    }
+    RecordWriter writer(kWatchColumns, sizeof(kWatchColumns) / sizeof(kWatchColumns[0]), format,
+                        options.logPath.empty() ? nullptr : &ringStream);
+    ServiceWatcher watcher(session, options, writer);
+    return watcher.Run();
+}
+
+// Shared-memory status cache. A refresher ("statuscache") keeps a file-backed table of SERVICE_STATUS_PROCESS,
+// one slot per service, up to date with one EnumServicesStatusExW pass per interval; "query <name> --cached"
+// reads its slot without taking a lock or touching the SCM. Slots are seqlocks: the writer makes the sequence
+// odd, writes, and makes it even again, and a reader retries until it sees the same even sequence before and
+// after copying (a bounded number of times, then it makes the live call). A slot's generation is the last pass
+// that saw the service, so a deleted service drops out after one pass; the header's pass time bounds how stale
+// any answer can be.
+const char kStatusCacheMagic[8] = {'S', 'C', 'S', 'T', 'A', 'T', '1', '\0'};
+const size_t kStatusCacheNameLength = 256;  // Longest service name the SCM accepts
+const int kStatusCacheReadAttempts = 4096;  // Reader retries of a slot being written before going live
+
+struct StatusCacheHeader {
+    char magic[8];
+    uint32_t slotCount;               // Power of two
+    uint32_t intervalMs;
+    std::atomic<uint64_t> generation;  // Passes completed
+    std::atomic<uint64_t> passTimeMs;  // Wall clock at the end of the last pass, ms since 1970
+    std::atomic<uint32_t> retired;     // Set when a larger table replaced this one; readers reopen
+    uint32_t reserved;
+};
+
+struct StatusCacheSlot {
+    std::atomic<uint32_t> sequence;  // Odd while the slot is being written
+    std::atomic<uint32_t> nameHash;  // 0 while the slot is free
+    std::atomic<uint64_t> generation;
+    SERVICE_STATUS_PROCESS status;
+    uint32_t reserved;
+    char16_t name[kStatusCacheNameLength + 1];  // Lower-cased, NUL-terminated
+    char16_t padding[3];
+};
+
+static_assert(sizeof(StatusCacheHeader) == 40, "status cache header layout");
+static_assert(sizeof(StatusCacheSlot) == 576, "status cache slot layout");
+static_assert(std::atomic<uint32_t>::is_always_lock_free && std::atomic<uint64_t>::is_always_lock_free,
+              "status cache slots are shared between processes");
+
+// FNV-1a over the folded name; never 0, which marks a free slot
+uint32_t StatusCacheHash(const wchar_t* name) {
+    uint32_t hash = 2166136261u;
+    for (; *name; ++name) {
+        hash = (hash ^ static_cast<uint16_t>(FoldCase(*name))) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
+
+uint64_t WallClockMs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+std::wstring DefaultStatusCachePath() {
+#ifndef _WIN32
+    // tmpfs: the table lives in memory and is never written back to disk
+    std::error_code error;
+    if (std::filesystem::is_directory("/dev/shm", error)) {
+        return L"/dev/shm/sc_clone_status";
+    }
+#endif
+    return (std::filesystem::temp_directory_path() / "sc_clone_status").wstring();
+}
+
+// Reader side: maps the table and looks services up. Open and Lookup only read shared memory.
+class StatusCacheReader {
+public:
+    bool Open(const std::wstring& path) {
+        if (file.Open(path) != ERROR_SUCCESS || file.Size() < sizeof(StatusCacheHeader)) {
+            return false;
+        }
+        header = reinterpret_cast<const StatusCacheHeader*>(file.Data());
+        slots = reinterpret_cast<const StatusCacheSlot*>(file.Data() + sizeof(StatusCacheHeader));
+        return std::equal(kStatusCacheMagic, kStatusCacheMagic + 8, header->magic) && header->slotCount &&
+               (header->slotCount & (header->slotCount - 1)) == 0 &&
+               file.Size() >= sizeof(StatusCacheHeader) + size_t(header->slotCount) * sizeof(StatusCacheSlot);
+    }
+
+    // Copies the service's status if the table has it and the last pass is at most maxAgeMs old
+    bool Lookup(const std::wstring& serviceName, uint64_t maxAgeMs, SERVICE_STATUS_PROCESS& status) const {
+        if (!header || header->retired.load(std::memory_order_acquire) || serviceName.size() > kStatusCacheNameLength) {
+            return false;
+        }
+        uint64_t generation = header->generation.load(std::memory_order_acquire);
+        uint64_t passTime = header->passTimeMs.load(std::memory_order_acquire);
+        uint64_t now = WallClockMs();
+        if (generation == 0 || now > passTime + maxAgeMs) {
+            return false;
+        }
+
+        uint32_t hash = StatusCacheHash(serviceName.c_str());
+        uint32_t mask = header->slotCount - 1;
+        for (uint32_t probe = 0; probe <= mask; ++probe) {
+            const StatusCacheSlot& slot = slots[(hash + probe) & mask];
+            // The name is written once, when the refresher claims the slot, before the hash publishes it
+            uint32_t slotHash = slot.nameHash.load(std::memory_order_acquire);
+            if (slotHash == 0) {
+                return false;
+            }
+            if (slotHash != hash || !SameName(slot, serviceName)) {
+                continue;
+            }
+            // A write takes well under a microsecond; a slot that stays odd belongs to a refresher that died
+            // mid-write, so give up after a bounded number of tries and let the caller make the live call
+            for (int attempt = 0; attempt < kStatusCacheReadAttempts; ++attempt) {
+                uint32_t before = slot.sequence.load(std::memory_order_acquire);
+                if (before & 1) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                std::memcpy(&status, &slot.status, sizeof(status));
+                uint64_t seen = slot.generation.load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (slot.sequence.load(std::memory_order_relaxed) == before) {
+                    // Not seen by the last completed pass (or the one in progress): deleted
+                    return seen >= generation;
+                }
+            }
+            return false;
+        }
+        return false;
+    }
+
+private:
+    static bool SameName(const StatusCacheSlot& slot, const std::wstring& name) {
+        for (size_t i = 0; i < name.size(); ++i) {
+            if (slot.name[i] != static_cast<char16_t>(FoldCase(name[i]))) {
+                return false;
+            }
+        }
+        return slot.name[name.size()] == 0;
+    }
+
+    MappedFile file;
+    const StatusCacheHeader* header = nullptr;
+    const StatusCacheSlot* slots = nullptr;
+};
+
+// Refresher side: owns the table and is its only writer
+class StatusCacheWriter {
+public:
+    // Creates a fresh table with room for at least `services` at a load factor of one half
+    DWORD Create(const std::wstring& tablePath, size_t services, DWORD intervalMs) {
+        path = tablePath;
+        interval = intervalMs;
+        uint32_t slotCount = 1024;
+        while (slotCount < services * 2) {
+            slotCount *= 2;
+        }
+        // Build under a temporary name and rename into place, so readers never map a half-initialised table
+        std::wstring building = path + L".new";
+        std::unique_ptr<MappedFile> next(new MappedFile());
+        DWORD error = next->OpenWritable(building, sizeof(StatusCacheHeader) + size_t(slotCount) * sizeof(StatusCacheSlot));
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+        std::memset(next->MutableData(), 0, next->Size());
+        StatusCacheHeader* nextHeader = reinterpret_cast<StatusCacheHeader*>(next->MutableData());
+        std::copy(kStatusCacheMagic, kStatusCacheMagic + 8, nextHeader->magic);
+        nextHeader->slotCount = slotCount;
+        nextHeader->intervalMs = interval;
+        std::error_code renameError;
+        std::filesystem::rename(std::filesystem::path(building), std::filesystem::path(path), renameError);
+        if (renameError) {
+            return ERROR_ACCESS_DENIED;
+        }
+        if (header) {
+            header->retired.store(1, std::memory_order_release);
+        }
+        file = std::move(next);
+        header = nextHeader;
+        slots = reinterpret_cast<StatusCacheSlot*>(file->MutableData() + sizeof(StatusCacheHeader));
+        used = 0;
+        return ERROR_SUCCESS;
+    }
+
+    // One refresh: a single enumeration returns every service's status. Unchanged slots only get their
+    // generation bumped, so readers are never made to retry for nothing.
+    DWORD Pass(ScmSession& session) {
+        uint64_t generation = header->generation.load(std::memory_order_relaxed) + 1;
+        size_t seen = 0;
+        bool full = false;
+        DWORD error = ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+            ++seen;
+            StatusCacheSlot* slot = Claim(entry.lpServiceName);
+            if (!slot) {
+                full = true;
+                return true;
+            }
+            if (std::memcmp(&slot->status, &entry.ServiceStatusProcess, sizeof(SERVICE_STATUS_PROCESS)) != 0) {
+                uint32_t sequence = slot->sequence.load(std::memory_order_relaxed);
+                slot->sequence.store(sequence + 1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                std::memcpy(&slot->status, &entry.ServiceStatusProcess, sizeof(SERVICE_STATUS_PROCESS));
+                slot->sequence.store(sequence + 2, std::memory_order_release);
+            }
+            slot->generation.store(generation, std::memory_order_release);
+            return true;
+        });
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+        header->generation.store(generation, std::memory_order_release);
+        header->passTimeMs.store(WallClockMs(), std::memory_order_release);
+        services = seen;
+        // Grow when the table fills up (deleted services keep their slots until then) and refill it at once.
+        // If the new table cannot replace the old one (on Windows, not while a reader has it mapped), the old
+        // one stays and services without a slot are answered live.
+        if ((full || used * 4 > size_t(header->slotCount) * 3) && !growFailed) {
+            DWORD growError = Create(path, seen, interval);
+            if (growError != ERROR_SUCCESS) {
+                growFailed = true;
+                PrintErrorMessage(L"[SC_CLONE] Unable to grow the status cache, error code: ", growError);
+                return ERROR_SUCCESS;
+            }
+            return Pass(session);
+        }
+        return ERROR_SUCCESS;
+    }
+
+    size_t Services() const { return services; }
+    uint32_t SlotCount() const { return header ? header->slotCount : 0; }
+
+private:
+    StatusCacheSlot* Claim(const wchar_t* serviceName) {
+        size_t length = std::wcslen(serviceName);
+        if (length > kStatusCacheNameLength) {
+            return nullptr;
+        }
+        uint32_t hash = StatusCacheHash(serviceName);
+        uint32_t mask = header->slotCount - 1;
+        for (uint32_t probe = 0; probe <= mask; ++probe) {
+            StatusCacheSlot& slot = slots[(hash + probe) & mask];
+            uint32_t slotHash = slot.nameHash.load(std::memory_order_relaxed);
+            if (slotHash == 0) {
+                // A new slot: the name goes in before the hash that makes it visible to readers
+                if (used * 4 >= size_t(header->slotCount) * 3) {
+                    return nullptr;
+                }
+                for (size_t i = 0; i < length; ++i) {
+                    slot.name[i] = static_cast<char16_t>(FoldCase(serviceName[i]));
+                }
+                slot.name[length] = 0;
+                slot.nameHash.store(hash, std::memory_order_release);
+                ++used;
+                return &slot;
+            }
+            if (slotHash == hash && std::char_traits<char16_t>::length(slot.name) == length &&
+                std::equal(slot.name, slot.name + length, serviceName, [](char16_t a, wchar_t b) { return a == static_cast<char16_t>(FoldCase(b)); })) {
+                return &slot;
+            }
+        }
+        return nullptr;
+    }
+
+    std::wstring path;
+    DWORD interval = 0;
+    std::unique_ptr<MappedFile> file;
+    StatusCacheHeader* header = nullptr;
+    StatusCacheSlot* slots = nullptr;
+    size_t used = 0;
+    size_t services = 0;
+    bool growFailed = false;
+};
+
+// Runs the refresher: "statuscache [--file=<path>] [--interval=ms] [--duration=ms]"
+DWORD RunStatusCache(ScmSession& session, const std::vector<std::wstring>& args) {
+    std::wstring path = DefaultStatusCachePath();
+    DWORD intervalMs = 500;
+    DWORD durationMs = INFINITE;
+    for (size_t i = 1; i < args.size(); ++i) {
+        const std::wstring& arg = args[i];
+        if (arg.compare(0, 7, L"--file=") == 0) {
+            path = arg.substr(7);
+        } else if (arg.compare(0, 11, L"--interval=") == 0) {
+            intervalMs = std::max<DWORD>(10, static_cast<DWORD>(std::wcstoul(arg.c_str() + 11, nullptr, 10)));
+        } else if (arg.compare(0, 11, L"--duration=") == 0) {
+            durationMs = static_cast<DWORD>(std::wcstoul(arg.c_str() + 11, nullptr, 10));
+        } else {
+            Err() << L"[SC_CLONE] Usage: sc_clone statuscache [--file=<path>] [--interval=ms] [--duration=ms]" << std::endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+
+    StatusCacheWriter writer;
+    DWORD error = writer.Create(path, 0, intervalMs);
+    if (error == ERROR_SUCCESS) {
+        error = writer.Pass(session);
+    }
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] Unable to build status cache " + path + L", error code: ", error);
+        return error;
+    }
+    Out() << L"[SC_CLONE] Status cache " << path << L": " << writer.Services() << L" services in " << writer.SlotCount()
+          << L" slots, refreshed every " << intervalMs << L" ms" << std::endl;
+
+    // Passes are paced from their start, so the pass time readers check advances by one interval each time
+    auto start = std::chrono::steady_clock::now();
+    for (auto next = start + std::chrono::milliseconds(intervalMs);; next += std::chrono::milliseconds(intervalMs)) {
+        if (durationMs != INFINITE && next - start > std::chrono::milliseconds(durationMs)) {
+            break;
+        }
+        std::this_thread::sleep_until(next);
+        error = writer.Pass(session);
+        if (error != ERROR_SUCCESS) {
+            // Readers fall back to live calls once the table goes stale; keep trying
+            PrintErrorMessage(L"[SC_CLONE] Status cache refresh failed with error code: ", error);
+            session.Reset();
+        }
+    }
+    return ERROR_SUCCESS;
+}
+
+// query/queryex with --cached[=max age ms]: answered from the status cache when it is fresh, else live
+DWORD QueryCachedServiceStatus(ScmSession& session, const std::wstring& serviceName, bool extended,
+                               uint64_t maxAgeMs, const std::wstring& path) {
+    StatusCacheReader reader;
+    SERVICE_STATUS_PROCESS ssp;
+    if (reader.Open(path) && reader.Lookup(serviceName, maxAgeMs, ssp)) {
+        RecordWriter writer(kStatusColumns, extended ? 6 : 4);
+        WriteServiceStatus(writer, serviceName.c_str(), nullptr, ssp, extended);
+        return ERROR_SUCCESS;
+    }
+    return QueryServiceStatus(session, serviceName, extended);
+}
+
+// EVTX event log reader behind "events". An .evtx file is a 4 KB header followed by 64 KB chunks. Each chunk
+// holds event records whose XML is stored as binary XML: a record names a template (defined once per chunk)
+// and supplies only the values substituted into it. Chunks are self-contained, so they are parsed in
+// parallel straight from the mapped file. A template is walked once per chunk to learn which substitution
+// carries the EventID and which ones fill EventData; after that a record of an unwanted event costs a few
+// header reads, and only matching records have their values decoded.
+const size_t kEvtxHeaderSize = 4096;
+const size_t kEvtxChunkSize = 65536;
+const size_t kEvtxChunkHeaderSize = 512;
+
+// Binary XML tokens; the 0x40 bit ("more data follows") is masked off before comparing
+enum EvtxToken : BYTE {
+    EVTX_TOKEN_EOF = 0x00,
+    EVTX_TOKEN_OPEN_START_ELEMENT = 0x01,
+    EVTX_TOKEN_CLOSE_START_ELEMENT = 0x02,
+    EVTX_TOKEN_CLOSE_EMPTY_ELEMENT = 0x03,
+    EVTX_TOKEN_END_ELEMENT = 0x04,
+    EVTX_TOKEN_VALUE = 0x05,
+    EVTX_TOKEN_ATTRIBUTE = 0x06,
+    EVTX_TOKEN_CDATA = 0x07,
+    EVTX_TOKEN_CHAR_REF = 0x08,
+    EVTX_TOKEN_ENTITY_REF = 0x09,
+    EVTX_TOKEN_PI_TARGET = 0x0A,
+    EVTX_TOKEN_PI_DATA = 0x0B,
+    EVTX_TOKEN_TEMPLATE_INSTANCE = 0x0C,
+    EVTX_TOKEN_NORMAL_SUBSTITUTION = 0x0D,
+    EVTX_TOKEN_OPTIONAL_SUBSTITUTION = 0x0E,
+    EVTX_TOKEN_FRAGMENT_HEADER = 0x0F,
+};
+
+// Substitution value types used here
+enum EvtxValueType : BYTE {
+    EVTX_VALUE_NULL = 0x00,
+    EVTX_VALUE_STRING = 0x01,
+    EVTX_VALUE_ANSI_STRING = 0x02,
+    EVTX_VALUE_BOOL = 0x0D,
+    EVTX_VALUE_BINARY = 0x0E,
+    EVTX_VALUE_GUID = 0x0F,
+    EVTX_VALUE_FILETIME = 0x11,
+    EVTX_VALUE_SID = 0x13,
+    EVTX_VALUE_HEX32 = 0x14,
+    EVTX_VALUE_HEX64 = 0x15,
+    EVTX_VALUE_BINXML = 0x21,
+    EVTX_VALUE_STRING_ARRAY = 0x81,
+};
+
+// The events the timeline is built from, with the provider that logs them and the EventData field naming
+// the service. 7036/7040 name it by display name and carry the service name in a second field
+// (7036 as "<service name>/<n>" in its Binary data).
+struct ServiceEventKind {
+    DWORD eventId;
+    const wchar_t* label;
+    const wchar_t* provider;
+    const wchar_t* serviceField;
+    const wchar_t* keyField;
+};
+
+constexpr ServiceEventKind kServiceEventKinds[] = {
+    {7045, L"INSTALLED", L"Service Control Manager", L"ServiceName", nullptr},
+    {4697, L"INSTALLED", L"Microsoft-Windows-Security-Auditing", L"ServiceName", nullptr},
+    {7036, L"STATE_CHANGE", L"Service Control Manager", L"param1", L"Binary"},
+    {7040, L"START_TYPE_CHANGE", L"Service Control Manager", L"param1", L"param4"},
+};
+
+constexpr OutputColumn kEventColumns[] = {
+    {L"service_name", L"SERVICE_NAME", 24},
+    {L"time", L"TIME", 25},
+    {L"event_id", L"EVENT_ID", 9},
+    {L"event", L"EVENT", 18},
+    {L"record_id", L"RECORD_ID", 10},
+    {L"logged_name", L"LOGGED_NAME", 24},
+    {L"detail", L"DETAIL", 0},
+};
+
+// A matching event, reduced to what the timeline shows
+struct ServiceEvent {
+    uint64_t fileTime = 0;
+    uint64_t recordId = 0;
+    DWORD eventId = 0;
+    const wchar_t* label = L"EVENT";
+    std::wstring loggedName;  // The service as the event names it: a service name or a display name
+    std::wstring keyName;     // Service name decoded from the Binary data, when the event carries one
+    std::wstring detail;      // The other EventData fields, "Name=value, ..."
+};
+
+struct EventQuery {
+    std::vector<DWORD> eventIds;
+    size_t workers = 0;
+    ServiceSelector serviceFilter;
+    bool filtered = false;
+};
+
+std::chrono::system_clock::time_point FileTimeToTimePoint(uint64_t fileTime) {
+    // FILETIME counts 100 ns intervals since 1601-01-01; a corrupt one is clamped to what system_clock can hold
+    // (about 1678 to 2262 with nanosecond ticks)
+    const int64_t kUnixEpoch = 116444736000000000LL;
+    const int64_t kLimit = 90000000000000000LL;
+    int64_t since = static_cast<int64_t>(std::min<uint64_t>(fileTime, INT64_MAX)) - kUnixEpoch;
+    int64_t micros = std::max(-kLimit, std::min(kLimit, since)) / 10;
+    return std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(
+        std::chrono::microseconds(micros)));
+}
+
+// What a template says about the records built from it
+struct EvtxTemplate {
+    struct Field {
+        std::wstring name;    // Data Name attribute, or "Binary"
+        int index;            // Substitution index, or -1 when the template holds the text itself
+        std::wstring literal;
+    };
+    bool valid = false;
+    int eventIdIndex = -1;
+    DWORD eventIdLiteral = 0;
+    int providerIndex = -1;
+    std::wstring provider;
+    std::vector<Field> fields;
+};
+
+// A substitution value: its chunk-relative offset, size and type
+struct EvtxValue {
+    uint32_t offset;
+    uint16_t size;
+    BYTE type;
+};
+
+// Parses the records of one chunk. Offsets are relative to the chunk start and checked against its end.
+class EvtxChunkReader {
+public:
+    EvtxChunkReader(const BYTE* chunk, const EventQuery& query, std::vector<ServiceEvent>& events)
+        : chunk(chunk), query(query), events(events) {}
+
+    // Returns the number of records seen
+    size_t Run() {
+        if (std::memcmp(chunk, "ElfChnk", 8) != 0) {
+            return 0;
+        }
+        // The free-space offset ends the records; past it lies whatever the chunk held before it was reused
+        size_t end = HiveField<uint32_t>(chunk, 48);
+        if (end <= kEvtxChunkHeaderSize || end > kEvtxChunkSize) {
+            end = kEvtxChunkSize;
+        }
+        size_t records = 0;
+        for (size_t pos = kEvtxChunkHeaderSize; pos + 28 <= end; ++records) {
+            uint32_t size = HiveField<uint32_t>(chunk, pos + 4);
+            if (std::memcmp(chunk + pos, "**\0\0", 4) != 0 || size < 28 || size > end - pos) {
+                break;
+            }
+            ReadRecord(static_cast<uint32_t>(pos), size);
+            pos += size;
+        }
+        return records;
+    }
+
+private:
+    void ReadRecord(uint32_t pos, uint32_t size) {
+        const EvtxTemplate* tmpl = nullptr;
+        if (!ReadInstance(pos + 24, pos + size - 4, tmpl, values)) {
+            return;
+        }
+
+        DWORD eventId = tmpl->eventIdLiteral;
+        if (tmpl->eventIdIndex >= 0) {
+            if (static_cast<size_t>(tmpl->eventIdIndex) >= values.size()) {
+                return;
+            }
+            eventId = static_cast<DWORD>(Integer(values[tmpl->eventIdIndex]));
+        }
+        if (std::find(query.eventIds.begin(), query.eventIds.end(), eventId) == query.eventIds.end()) {
+            return;
+        }
+
+        const ServiceEventKind* kind = nullptr;
+        for (const auto& candidate : kServiceEventKinds) {
+            if (candidate.eventId == eventId) {
+                kind = &candidate;
+            }
+        }
+        // Other providers reuse these numbers; a record that names a different provider is not ours
+        if (kind) {
+            std::wstring provider = tmpl->providerIndex >= 0 && static_cast<size_t>(tmpl->providerIndex) < values.size()
+                                        ? Text(values[tmpl->providerIndex]) : tmpl->provider;
+            if (!provider.empty() && provider != kind->provider) {
+                return;
+            }
+        }
+
+        std::vector<std::pair<std::wstring, std::wstring>> fields;
+        CollectFields(*tmpl, values, fields);
+        // Events logged through the classic API carry their EventData as a nested binary XML value
+        for (const auto& value : values) {
+            const EvtxTemplate* nested = nullptr;
+            std::vector<EvtxValue> nestedValues;
+            if (value.type == EVTX_VALUE_BINXML && ReadInstance(value.offset, value.offset + value.size, nested, nestedValues)) {
+                CollectFields(*nested, nestedValues, fields);
+            }
+        }
+
+        ServiceEvent event;
+        event.fileTime = HiveField<uint64_t>(chunk, pos + 16);
+        event.recordId = HiveField<uint64_t>(chunk, pos + 8);
+        event.eventId = eventId;
+        const wchar_t* serviceField = kind ? kind->serviceField : L"ServiceName";
+        for (const auto& field : fields) {
+            if (field.first == serviceField || (!kind && event.loggedName.empty() && field.first == L"param1")) {
+                event.loggedName = field.second;
+            } else if (kind && kind->keyField && field.first == kind->keyField) {
+                event.keyName = field.second.substr(0, field.second.find(L'/'));
+            } else if (!field.second.empty() && field.first != L"Binary") {
+                event.detail += (event.detail.empty() ? L"" : L", ") + field.first + L"=" + field.second;
+            }
+        }
+        if (kind) {
+            event.label = kind->label;
+        }
+        events.push_back(std::move(event));
+    }
+
+    // Reads a template instance (optionally after a fragment header) and the substitution values following it
+    bool ReadInstance(uint32_t pos, uint32_t end, const EvtxTemplate*& tmpl, std::vector<EvtxValue>& out) {
+        if (pos + 4 <= end && chunk[pos] == EVTX_TOKEN_FRAGMENT_HEADER) {
+            pos += 4;
+        }
+        if (pos + 10 > end || (chunk[pos] & ~0x40) != EVTX_TOKEN_TEMPLATE_INSTANCE) {
+            return false;
+        }
+        uint32_t node = pos;
+        uint32_t definition = HiveField<uint32_t>(chunk, pos + 6);
+        pos += 10;
+        // Offsets come from the file, so the sums below are taken in 64 bits where they cannot wrap
+        if (definition >= kEvtxChunkSize) {
+            return false;
+        }
+        // A template used for the first time in the chunk is defined right here
+        if (definition > node) {
+            if (uint64_t(definition) + 24 > end) {
+                return false;
+            }
+            uint64_t next = uint64_t(definition) + 24 + HiveField<uint32_t>(chunk, definition + 20);
+            if (next > end) {
+                return false;
+            }
+            pos = static_cast<uint32_t>(next);
+        }
+        tmpl = &Template(definition);
+        if (!tmpl->valid) {
+            return false;
+        }
+        return ReadValues(pos, end, out);
+    }
+
+    bool ReadValues(uint32_t pos, uint32_t end, std::vector<EvtxValue>& out) {
+        out.clear();
+        if (uint64_t(pos) + 4 > end) {
+            return false;
+        }
+        uint32_t count = HiveField<uint32_t>(chunk, pos);
+        if (count > (end - pos - 4) / 4) {
+            return false;
+        }
+        uint32_t data = pos + 4 + 4 * count;
+        for (uint32_t i = 0; i < count; ++i) {
+            uint16_t size = HiveField<uint16_t>(chunk, pos + 4 + 4 * i);
+            if (size > end - data) {
+                return false;
+            }
+            out.push_back(EvtxValue{data, size, chunk[pos + 6 + 4 * i]});
+            data += size;
+        }
+        return true;
+    }
+
+    const EvtxTemplate& Template(uint32_t definition) {
+        auto it = templates.find(definition);
+        if (it != templates.end()) {
+            return it->second;
+        }
+        EvtxTemplate& tmpl = templates[definition];
+        if (uint64_t(definition) + 24 <= kEvtxChunkSize) {
+            uint64_t end = uint64_t(definition) + 24 + HiveField<uint32_t>(chunk, definition + 20);
+            if (end <= kEvtxChunkSize) {
+                tmpl.valid = WalkTemplate(definition + 24, static_cast<uint32_t>(end), tmpl);
+            }
+        }
+        return tmpl;
+    }
+
+    // Walks a template's binary XML, noting where the EventID, the provider name and the EventData values come from
+    bool WalkTemplate(uint32_t pos, uint32_t end, EvtxTemplate& tmpl) {
+        std::vector<uint32_t> elements;
+        uint32_t attribute = kHiveNoCell;
+        std::wstring dataName;
+        auto inElement = [&](const char* name) { return !elements.empty() && NameIs(elements.back(), name); };
+        auto inAttribute = [&](const char* name) { return attribute != kHiveNoCell && NameIs(attribute, name); };
+
+        while (pos < end) {
+            uint32_t node = pos;
+            BYTE token = chunk[pos] & ~0x40;
+            switch (token) {
+            case EVTX_TOKEN_EOF:
+                return true;
+            case EVTX_TOKEN_FRAGMENT_HEADER:
+                pos += 4;
+                break;
+            case EVTX_TOKEN_OPEN_START_ELEMENT: {
+                if (pos + 11 > end) {
+                    return false;
+                }
+                uint32_t name = HiveField<uint32_t>(chunk, pos + 7);
+                pos += (chunk[node] & 0x40) ? 15 : 11;
+                if (!SkipInlineName(node, name, pos, end)) {
+                    return false;
+                }
+                elements.push_back(name);
+                attribute = kHiveNoCell;
+                if (NameIs(name, "Data")) {
+                    dataName.clear();
+                }
+                break;
+            }
+            case EVTX_TOKEN_CLOSE_START_ELEMENT:
+                attribute = kHiveNoCell;
+                pos += 1;
+                break;
+            case EVTX_TOKEN_CLOSE_EMPTY_ELEMENT:
+            case EVTX_TOKEN_END_ELEMENT:
+                attribute = kHiveNoCell;
+                if (!elements.empty()) {
+                    elements.pop_back();
+                }
+                pos += 1;
+                break;
+            case EVTX_TOKEN_ATTRIBUTE: {
+                if (pos + 5 > end) {
+                    return false;
+                }
+                attribute = HiveField<uint32_t>(chunk, pos + 1);
+                pos += 5;
+                if (!SkipInlineName(node, attribute, pos, end)) {
+                    return false;
+                }
+                break;
+            }
+            case EVTX_TOKEN_VALUE: {
+                if (pos + 4 > end || chunk[pos + 1] != EVTX_VALUE_STRING) {
+                    return false;
+                }
+                uint32_t bytes = 2u * HiveField<uint16_t>(chunk, pos + 2);
+                if (pos + 4 + bytes > end) {
+                    return false;
+                }
+                std::wstring text = HiveUtf16(chunk + pos + 4, bytes);
+                pos += 4 + bytes;
+                if (attribute != kHiveNoCell) {
+                    if (inAttribute("Name") && inElement("Data")) {
+                        dataName = text;
+                    } else if (inAttribute("Name") && inElement("Provider")) {
+                        tmpl.provider = text;
+                    }
+                } else if (inElement("EventID")) {
+                    tmpl.eventIdLiteral = static_cast<DWORD>(std::wcstoul(text.c_str(), nullptr, 10));
+                } else if (inElement("Data")) {
+                    tmpl.fields.push_back(EvtxTemplate::Field{DataName(dataName, tmpl), -1, text});
+                }
+                break;
+            }
+            case EVTX_TOKEN_NORMAL_SUBSTITUTION:
+            case EVTX_TOKEN_OPTIONAL_SUBSTITUTION: {
+                if (pos + 4 > end) {
+                    return false;
+                }
+                int index = HiveField<uint16_t>(chunk, pos + 1);
+                pos += 4;
+                if (attribute != kHiveNoCell) {
+                    if (inAttribute("Name") && inElement("Provider")) {
+                        tmpl.providerIndex = index;
+                    }
+                } else if (inElement("EventID")) {
+                    tmpl.eventIdIndex = index;
+                } else if (inElement("Data")) {
+                    tmpl.fields.push_back(EvtxTemplate::Field{DataName(dataName, tmpl), index, L""});
+                } else if (inElement("Binary")) {
+                    tmpl.fields.push_back(EvtxTemplate::Field{L"Binary", index, L""});
+                }
+                break;
+            }
+            case EVTX_TOKEN_CDATA:
+            case EVTX_TOKEN_PI_DATA:
+                if (pos + 3 > end) {
+                    return false;
+                }
+                pos += 3 + 2u * HiveField<uint16_t>(chunk, pos + 1);
+                break;
+            case EVTX_TOKEN_CHAR_REF:
+                pos += 3;
+                break;
+            case EVTX_TOKEN_ENTITY_REF:
+            case EVTX_TOKEN_PI_TARGET: {
+                if (pos + 5 > end) {
+                    return false;
+                }
+                uint32_t name = HiveField<uint32_t>(chunk, pos + 1);
+                pos += 5;
+                if (!SkipInlineName(node, name, pos, end)) {
+                    return false;
+                }
+                break;
+            }
+            default:
+                return false;
+            }
+        }
+        return false;
+    }
+
+    // A name defined after the token that uses it is stored inline, right there: next offset, hash, length, text
+    bool SkipInlineName(uint32_t node, uint32_t name, uint32_t& pos, uint32_t end) const {
+        if (name <= node) {
+            return uint64_t(name) + 8 <= kEvtxChunkSize;
+        }
+        if (uint64_t(name) + 8 > end) {
+            return false;
+        }
+        pos = name + 8 + 2u * (HiveField<uint16_t>(chunk, name + 6) + 1u);
+        return pos <= end;
+    }
+
+    // Classic events leave their Data elements unnamed; they are shown the way Event Viewer numbers them
+    static std::wstring DataName(const std::wstring& name, const EvtxTemplate& tmpl) {
+        return name.empty() ? L"param" + std::to_wstring(tmpl.fields.size() + 1) : name;
+    }
+
+    bool NameIs(uint32_t name, const char* ascii) const {
+        if (uint64_t(name) + 8 > kEvtxChunkSize) {
+            return false;
+        }
+        size_t length = HiveField<uint16_t>(chunk, name + 6);
+        if (length != std::strlen(ascii) || uint64_t(name) + 8 + 2 * length > kEvtxChunkSize) {
+            return false;
+        }
+        for (size_t i = 0; i < length; ++i) {
+            if (HiveField<uint16_t>(chunk, name + 8 + 2 * i) != static_cast<BYTE>(ascii[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void CollectFields(const EvtxTemplate& tmpl, const std::vector<EvtxValue>& from,
+                       std::vector<std::pair<std::wstring, std::wstring>>& fields) const {
+        for (const auto& field : tmpl.fields) {
+            if (field.index < 0) {
+                fields.emplace_back(field.name, field.literal);
+            } else if (static_cast<size_t>(field.index) < from.size() && from[field.index].type != EVTX_VALUE_BINXML) {
+                const EvtxValue& value = from[field.index];
+                // Binary data of the SCM events is the service name in UTF-16
+                fields.emplace_back(field.name, field.name == L"Binary" && value.type == EVTX_VALUE_BINARY
+                                                    ? HiveUtf16(chunk + value.offset, value.size) : Text(value));
+            }
+        }
+    }
+
+    uint64_t Integer(const EvtxValue& value) const {
+        uint64_t result = 0;
+        std::memcpy(&result, chunk + value.offset, std::min<size_t>(value.size, 8));
+        return result;
+    }
+
+    // Renders a substitution value the way Event Viewer's XML view shows it
+    std::wstring Text(const EvtxValue& value) const {
+        const BYTE* data = chunk + value.offset;
+        wchar_t text[64];
+        switch (value.type) {
+        case EVTX_VALUE_NULL:
+            return std::wstring();
+        case EVTX_VALUE_STRING:
+            return HiveUtf16(data, value.size);
+        case EVTX_VALUE_STRING_ARRAY: {
+            std::wstring joined = HiveUtf16(data, value.size, true);
+            while (!joined.empty() && joined.back() == L'\0') {
+                joined.pop_back();
+            }
+            std::replace(joined.begin(), joined.end(), L'\0', L';');
+            return joined;
+        }
+        case EVTX_VALUE_ANSI_STRING:
+            return std::wstring(data, std::find(data, data + value.size, 0));
+        case EVTX_VALUE_BOOL:
+            return Integer(value) ? L"true" : L"false";
+        case EVTX_VALUE_HEX32:
+        case EVTX_VALUE_HEX64:
+            std::swprintf(text, 64, L"0x%llx", static_cast<unsigned long long>(Integer(value)));
+            return text;
+        case EVTX_VALUE_FILETIME:
+            return FormatUtcTimestamp(FileTimeToTimePoint(Integer(value)));
+        case EVTX_VALUE_GUID:
+            if (value.size == 16) {
+                std::swprintf(text, 64, L"{%08X-%04X-%04X-%02X%02X-%02X%02X%02X%02X%02X%02X}", HiveField<uint32_t>(data, 0),
+                              HiveField<uint16_t>(data, 4), HiveField<uint16_t>(data, 6), data[8], data[9], data[10],
+                              data[11], data[12], data[13], data[14], data[15]);
+                return text;
+            }
+            break;
+        case EVTX_VALUE_SID:
+            if (value.size >= 8 && value.size >= 8u + 4u * data[1]) {
+                uint64_t authority = 0;
+                for (int i = 2; i < 8; ++i) {
+                    authority = (authority << 8) | data[i];
+                }
+                std::wstring sid = L"S-" + std::to_wstring(data[0]) + L"-" + std::to_wstring(authority);
+                for (BYTE i = 0; i < data[1]; ++i) {
+                    sid += L"-" + std::to_wstring(HiveField<uint32_t>(data, 8 + 4 * i));
+                }
+                return sid;
+            }
+            break;
+        default:
+            // Signed and unsigned integers of 1 to 8 bytes
+            if (value.type >= 0x03 && value.type <= 0x0A) {
+                bool isSigned = value.type % 2 == 1;
+                uint64_t raw = Integer(value);
+                if (isSigned && value.size < 8 && (raw >> (8 * value.size - 1)) & 1) {
+                    raw |= ~0ULL << (8 * value.size);
+                }
+                return isSigned ? std::to_wstring(static_cast<int64_t>(raw)) : std::to_wstring(raw);
+            }
+            break;
+        }
+        std::wstring hex;
+        for (uint16_t i = 0; i < value.size; ++i) {
+            std::swprintf(text, 64, L"%02X", data[i]);
+            hex += text;
+        }
+        return hex;
+    }
+
+    const BYTE* chunk;
+    const EventQuery& query;
+    std::vector<ServiceEvent>& events;
+    std::unordered_map<uint32_t, EvtxTemplate> templates;  // By definition offset; valid for this chunk only
+    std::vector<EvtxValue> values;
+};
+
+// Reads service events from .evtx files into a per-service timeline:
+//   events <file.evtx>... [--id=7045,7036,...] [--service=<name|selector>] [--parallel=N]
+// Services are joined on their name: display names logged by 7036/7040 are mapped back to service names
+// through the Binary data of those events and through the service database of the current backend
+// (the live SCM, or the image's own with --offline).
+DWORD ReadServiceEvents(ScmSession& session, const std::vector<std::wstring>& args) {
+    EventQuery query;
+    std::vector<std::wstring> paths;
+    for (size_t i = 1; i < args.size(); ++i) {
+        const std::wstring& arg = args[i];
+        if (arg.compare(0, 5, L"--id=") == 0) {
+            std::wstringstream ss(arg.substr(5));
+            std::wstring id;
+            while (std::getline(ss, id, L',')) {
+                query.eventIds.push_back(static_cast<DWORD>(std::wcstoul(id.c_str(), nullptr, 10)));
+            }
+        } else if (arg.compare(0, 10, L"--service=") == 0) {
+            // A plain name compiles to a glob without wildcards, i.e. an exact case-insensitive match
+            query.filtered = true;
+            if (arg.size() == 10 || !query.serviceFilter.Compile(arg.substr(10))) {
+                return ERROR_INVALID_PARAMETER;
+            }
+        } else if (arg.compare(0, 11, L"--parallel=") == 0) {
+            query.workers = static_cast<size_t>(std::wcstoull(arg.c_str() + 11, nullptr, 10));
+        } else if (arg.compare(0, 2, L"--") != 0) {
+            paths.push_back(arg);
+        } else {
+            paths.clear();
+            break;
+        }
+    }
+    if (paths.empty()) {
+        Err() << L"[SC_CLONE] Usage: sc_clone events <file.evtx>... [--id=7045,7036,...] [--service=<name|selector>] [--parallel=N]" << std::endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    if (query.eventIds.empty()) {
+        for (const auto& kind : kServiceEventKinds) {
+            query.eventIds.push_back(kind.eventId);
+        }
+    }
+    if (query.workers == 0) {
+        query.workers = std::max<size_t>(1, std::thread::hardware_concurrency());
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::unique_ptr<MappedFile>> files;
+    std::vector<const BYTE*> chunks;
+    for (const auto& path : paths) {
+        std::unique_ptr<MappedFile> file(new MappedFile());
+        DWORD error = file->Open(path);
+        if (error == ERROR_SUCCESS && (file->Size() < kEvtxHeaderSize || std::memcmp(file->Data(), "ElfFile", 8) != 0)) {
+            error = ERROR_INVALID_DATA;
+        }
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] Unable to read event log " + path + L", error code: ", error);
+            return error;
+        }
+        // The header's chunk count lags behind a log that was not closed cleanly, so go by the file size
+        for (size_t offset = kEvtxHeaderSize; offset + kEvtxChunkSize <= file->Size(); offset += kEvtxChunkSize) {
+            chunks.push_back(file->Data() + offset);
+        }
+        files.push_back(std::move(file));
+    }
+
+    std::vector<std::vector<ServiceEvent>> perChunk(chunks.size());
+    std::atomic<size_t> records(0);
+    ParallelFor(chunks.size(), query.workers, [&](size_t i) {
+        records += EvtxChunkReader(chunks[i], query, perChunk[i]).Run();
+    });
+    double parseMs = ElapsedMs(start);
+
+    // Name resolution: service names first, then display names learned from the events, then from the database
+    std::unordered_map<std::wstring, std::wstring> serviceNames;
+    std::unordered_map<std::wstring, std::wstring> displayNames;
+    ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+        serviceNames.emplace(ToLower(entry.lpServiceName), entry.lpServiceName);
+        displayNames.emplace(ToLower(entry.lpDisplayName), entry.lpServiceName);
+        return true;
+    });
+    std::vector<ServiceEvent> events;
+    for (auto& chunkEvents : perChunk) {
+        for (auto& event : chunkEvents) {
+            if (!event.keyName.empty()) {
+                serviceNames.emplace(ToLower(event.keyName), event.keyName);
+                displayNames[ToLower(event.loggedName)] = event.keyName;
+            }
+            events.push_back(std::move(event));
+        }
+    }
+    struct TimelineEntry {
+        std::wstring sortKey;
+        std::wstring service;
+        size_t event;
+    };
+    std::vector<TimelineEntry> timeline;
+    for (size_t i = 0; i < events.size(); ++i) {
+        std::wstring service = events[i].keyName;
+        if (service.empty()) {
+            std::wstring key = ToLower(events[i].loggedName);
+            auto byName = serviceNames.find(key);
+            auto byDisplay = displayNames.find(key);
+            service = byName != serviceNames.end() ? byName->second :
+                      byDisplay != displayNames.end() ? byDisplay->second : events[i].loggedName;
+        }
+        if (!query.filtered || query.serviceFilter.Matches(service.c_str(), events[i].loggedName.c_str())) {
+            timeline.push_back(TimelineEntry{ToLower(service), service, i});
+        }
+    }
+    std::sort(timeline.begin(), timeline.end(), [&](const TimelineEntry& a, const TimelineEntry& b) {
+        if (a.sortKey != b.sortKey) {
+            return a.sortKey < b.sortKey;
+        }
+        const ServiceEvent& x = events[a.event];
+        const ServiceEvent& y = events[b.event];
+        return x.fileTime != y.fileTime ? x.fileTime < y.fileTime : x.recordId < y.recordId;
+    });
+
+    // One line per event reads better than a block per event, as with watch
+    OutputFormat format = g_outputFormat == OutputFormat::Text ? OutputFormat::Table : g_outputFormat;
+    {
+        RecordWriter writer(kEventColumns, sizeof(kEventColumns) / sizeof(kEventColumns[0]), format);
+        for (const auto& entry : timeline) {
+            const ServiceEvent& event = events[entry.event];
+            writer.String(entry.service);
+            writer.String(FormatUtcTimestamp(FileTimeToTimePoint(event.fileTime)));
+            writer.Number(event.eventId);
+            writer.String(event.label);
+            writer.String(std::to_wstring(event.recordId));
+            writer.String(event.loggedName);
+            writer.String(event.detail);
+            writer.EndRecord();
+        }
+    }
+    // The summary goes to stderr so it never mixes with JSON or CSV on stdout
+    Err() << L"[SC_CLONE] " << timeline.size() << L" service events from " << records.load() << L" records in "
+          << chunks.size() << L" chunks (" << static_cast<long long>(parseMs) << L" ms to parse)" << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// SHA-256 (FIPS 180-4). Kept portable so verify gives the same answers on Linux as on Windows.
+class Sha256 {
+public:
+    Sha256() {
+        static const uint32_t kInitial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        std::copy(kInitial, kInitial + 8, state);
+    }
+
+    void Update(const BYTE* data, size_t size) {
+        length += size;
+        if (used) {
+            size_t take = std::min(size, sizeof(buffer) - used);
+            std::memcpy(buffer + used, data, take);
+            used += take;
+            data += take;
+            size -= take;
+            if (used < sizeof(buffer)) {
+                return;
+            }
+            Block(buffer);
+            used = 0;
+        }
+        for (; size >= 64; data += 64, size -= 64) {
+            Block(data);
+        }
+        std::memcpy(buffer, data, size);
+        used = size;
+    }
+
+    // Lower-case hex digest; the object is spent afterwards
+    std::wstring Final() {
+        uint64_t bits = length * 8;
+        BYTE padding[72] = {0x80};
+        size_t padLength = (used < 56 ? 56 : 120) - used;
+        for (int i = 0; i < 8; ++i) {
+            padding[padLength + i] = static_cast<BYTE>(bits >> (56 - 8 * i));
+        }
+        Update(padding, padLength + 8);
+
+        std::wstring hex;
+        wchar_t digits[9];
+        for (uint32_t word : state) {
+            std::swprintf(digits, 9, L"%08x", word);
+            hex += digits;
+        }
+        return hex;
+    }
+
+private:
+    static uint32_t Rotate(uint32_t value, int bits) {
+        return (value >> bits) | (value << (32 - bits));
+    }
+
+    void Block(const BYTE* block) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i) {
+            w[i] = (uint32_t(block[4 * i]) << 24) | (uint32_t(block[4 * i + 1]) << 16) | (uint32_t(block[4 * i + 2]) << 8) | block[4 * i + 3];
+        }
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = Rotate(w[i - 15], 7) ^ Rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = Rotate(w[i - 2], 17) ^ Rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (Rotate(e, 6) ^ Rotate(e, 11) ^ Rotate(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (Rotate(a, 2) ^ Rotate(a, 13) ^ Rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    uint32_t state[8];
+    uint64_t length = 0;
+    BYTE buffer[64];
+    size_t used = 0;
+};
+
+// Hashes a whole file through a read-only mapping
+DWORD HashFile(const std::filesystem::path& path, uint64_t size, std::wstring& digest) {
+    Sha256 sha;
+    // MappedFile refuses empty files, which have nothing to map anyway
+    if (size > 0) {
+        MappedFile file;
+        DWORD error = file.Open(path.wstring());
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+        sha.Update(file.Data(), file.Size());
+    }
+    digest = sha.Final();
+    return ERROR_SUCCESS;
+}
+
+// Where a service's ImagePath points, resolved the way the SCM launches it
+struct ServiceImage {
+    std::wstring binary;             // Windows path of the executable or driver, environment variables expanded
+    std::wstring arguments;
+    std::filesystem::path hostPath;  // Where that file is read from here; empty when it was not found
+    std::wstring note;               // Why the path is risky, when it is: unquoted with spaces
+};
+
+// Resolves ImagePath values to files. With a root directory (a mounted or extracted image, on any OS) Windows paths
+// are looked up below it, ignoring the drive letter and case; without one they are used as they are.
+class ImageLocator {
+public:
+    explicit ImageLocator(const std::wstring& root) : root(root) {}
+
+    ServiceImage Locate(const std::wstring& imagePath, DWORD serviceType) {
+        ServiceImage image;
+        size_t begin = imagePath.find_first_not_of(L" \t");
+        std::wstring text = begin == std::wstring::npos ? L"" : imagePath.substr(begin);
+
+        if (!text.empty() && text[0] == L'"') {
+            size_t close = text.find(L'"', 1);
+            image.binary = Normalize(text.substr(1, close == std::wstring::npos ? std::wstring::npos : close - 1), serviceType);
+            image.arguments = close == std::wstring::npos ? L"" : Trim(text.substr(close + 1));
+            image.hostPath = Find(image.binary);
+            return image;
+        }
+
+        // Drivers are loaded by exact path and take no arguments
+        if (serviceType & SERVICE_DRIVER) {
+            image.binary = Normalize(text, serviceType);
+            image.hostPath = Find(image.binary);
+            return image;
+        }
+
+        // Unquoted: like CreateProcess, try each prefix ending at a space, shortest first, with ".exe" implied,
+        // and take the first that exists. A longer prefix that also exists is the binary that was meant to run.
+        for (size_t end = text.find(L' '); ; end = text.find(L' ', end + 1)) {
+            std::wstring candidate = Normalize(text.substr(0, end), serviceType);
+            std::filesystem::path found = Find(candidate);
+            if (found.empty() && candidate.find(L'.', candidate.find_last_of(L"\\/") + 1) == std::wstring::npos) {
+                candidate += L".exe";
+                found = Find(candidate);
+            }
+            if (!found.empty() && image.hostPath.empty()) {
+                image.binary = candidate;
+                image.hostPath = found;
+                image.arguments = end == std::wstring::npos ? L"" : Trim(text.substr(end + 1));
+                if (candidate.find(L' ') != std::wstring::npos) {
+                    image.note = L"unquoted path with spaces";
+                }
+            } else if (!found.empty()) {
+                image.note = L"unquoted path: runs instead of " + candidate;
+                break;
+            }
+            if (end == std::wstring::npos) {
+                break;
+            }
+        }
+        if (image.hostPath.empty()) {
+            size_t space = text.find(L' ');
+            image.binary = Normalize(text.substr(0, space), serviceType);
+            image.arguments = space == std::wstring::npos ? L"" : Trim(text.substr(space + 1));
+        }
+        return image;
+    }
+
+private:
+    static std::wstring Trim(const std::wstring& text) {
+        size_t begin = text.find_first_not_of(L" \t");
+        return begin == std::wstring::npos ? L"" : text.substr(begin, text.find_last_not_of(L" \t") + 1 - begin);
+    }
+
+    // Expands %VARIABLES% and the NT forms the SCM accepts: \??\C:\..., \SystemRoot\... and, for drivers,
+    // paths relative to the system root (System32\drivers\x.sys)
+    std::wstring Normalize(const std::wstring& path, DWORD serviceType) const {
+        std::wstring result;
+        for (size_t i = 0; i < path.size(); ++i) {
+            size_t close = path[i] == L'%' ? path.find(L'%', i + 1) : std::wstring::npos;
+            std::wstring value = close == std::wstring::npos ? L"" : Variable(path.substr(i + 1, close - i - 1));
+            if (!value.empty()) {
+                result += value;
+                i = close;
+            } else {
+                result += path[i];
+            }
+        }
+        if (result.compare(0, 4, L"\\??\\") == 0 || result.compare(0, 4, L"\\\\?\\") == 0) {
+            result.erase(0, 4);
+        }
+        if (ToLower(result.substr(0, 12)) == L"\\systemroot\\") {
+            result = Variable(L"SystemRoot") + result.substr(11);
+        } else if ((serviceType & SERVICE_DRIVER) && !result.empty() && result[0] != L'\\' && result[0] != L'/' &&
+                   result.find(L':') == std::wstring::npos) {
+            result = Variable(L"SystemRoot") + L"\\" + result;
+        }
+        return result;
+    }
+
+    // Environment of the machine the image came from: the live environment on Windows, the stock values otherwise
+    std::wstring Variable(const std::wstring& name) const {
+#ifdef _WIN32
+        if (root.empty()) {
+            const wchar_t* value = _wgetenv(name.c_str());
+            if (value) {
+                return value;
+            }
+        }
+#endif
+        static const std::pair<const wchar_t*, const wchar_t*> kDefaults[] = {
+            {L"systemroot", L"C:\\Windows"}, {L"windir", L"C:\\Windows"}, {L"systemdrive", L"C:"},
+            {L"programfiles", L"C:\\Program Files"}, {L"programfiles(x86)", L"C:\\Program Files (x86)"},
+            {L"programdata", L"C:\\ProgramData"}, {L"commonprogramfiles", L"C:\\Program Files\\Common Files"},
+        };
+        std::wstring key = ToLower(name);
+        for (const auto& entry : kDefaults) {
+            if (key == entry.first) {
+                return entry.second;
+            }
+        }
+        return L"";
+    }
+
+    // The file a Windows path refers to here, or an empty path
+    std::filesystem::path Find(const std::wstring& windowsPath) {
+        if (windowsPath.empty()) {
+            return {};
+        }
+        std::error_code error;
+        if (root.empty()) {
+            std::filesystem::path path(windowsPath);
+            return std::filesystem::is_regular_file(path, error) ? path : std::filesystem::path();
+        }
+
+        std::wstring relative = windowsPath.size() > 1 && windowsPath[1] == L':' ? windowsPath.substr(2) : windowsPath;
+        std::filesystem::path path(root);
+        std::wstringstream parts(relative);
+        std::wstring part;
+        while (std::getline(parts, part, L'\\')) {
+            if (part.empty() || part == L".") {
+                continue;
+            }
+            std::filesystem::path next = path / part;
+            if (!std::filesystem::exists(next, error)) {
+                next = MatchCase(path, part);
+                if (next.empty()) {
+                    return {};
+                }
+            }
+            path = next;
+        }
+        return std::filesystem::is_regular_file(path, error) ? path : std::filesystem::path();
+    }
+
+    // NTFS names are case-insensitive but a copy on another file system may not be; directory listings are kept
+    std::filesystem::path MatchCase(const std::filesystem::path& directory, const std::wstring& name) {
+        auto it = listings.find(directory.wstring());
+        if (it == listings.end()) {
+            std::unordered_map<std::wstring, std::wstring> entries;
+            std::error_code error;
+            for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+                std::wstring entryName = entry.path().filename().wstring();
+                entries.emplace(ToLower(entryName), entryName);
+            }
+            it = listings.emplace(directory.wstring(), std::move(entries)).first;
+        }
+        auto match = it->second.find(ToLower(name));
+        return match == it->second.end() ? std::filesystem::path() : directory / match->second;
+    }
+
+    std::wstring root;
+    std::unordered_map<std::wstring, std::unordered_map<std::wstring, std::wstring>> listings;
+};
+
+// Digests of files already hashed, keyed by path, size and modification time, one per line:
+//   <sha256> <size> <mtime> <path>
+// A file whose size and mtime still match is not read again. Saved with a rename, so readers never see half a file.
+class HashCache {
+public:
+    void Load(const std::wstring& file) {
+        path = file;
+        std::ifstream input(std::filesystem::path(path), std::ios::binary);
+        std::string line;
+        while (std::getline(input, line)) {
+            std::istringstream fields(line);
+            std::string digest;
+            Entry entry;
+            if (fields >> digest >> entry.size >> entry.mtime && digest.size() == 64 && fields.get() == ' ') {
+                std::string filePath;
+                std::getline(fields, filePath);
+                entry.digest = Utf8ToWide(digest);
+                entries[Utf8ToWide(filePath)] = entry;
+            }
+        }
+    }
+
+    bool Find(const std::wstring& file, uint64_t size, int64_t mtime, std::wstring& digest) const {
+        auto it = entries.find(file);
+        if (it == entries.end() || it->second.size != size || it->second.mtime != mtime) {
+            return false;
+        }
+        digest = it->second.digest;
+        return true;
+    }
+
+    void Store(const std::wstring& file, uint64_t size, int64_t mtime, const std::wstring& digest) {
+        entries[file] = Entry{size, mtime, digest};
+        changed = true;
+    }
+
+    DWORD Save() {
+        if (!changed || path.empty()) {
+            return ERROR_SUCCESS;
+        }
+        std::error_code error;
+        std::filesystem::path target(path);
+        if (target.has_parent_path()) {
+            std::filesystem::create_directories(target.parent_path(), error);
+        }
+        std::filesystem::path temporary = target;
+        temporary += ".tmp";
+        {
+            std::ofstream output(temporary, std::ios::binary | std::ios::trunc);
+            for (const auto& entry : entries) {
+                output << WideToUtf8(entry.second.digest) << ' ' << entry.second.size << ' ' << entry.second.mtime << ' '
+                       << WideToUtf8(entry.first) << '\n';
+            }
+            if (!output) {
+                return ERROR_WRITE_FAULT;
+            }
+        }
+        std::filesystem::rename(temporary, target, error);
+        return error ? ERROR_WRITE_FAULT : ERROR_SUCCESS;
+    }
+
+private:
+    struct Entry {
+        uint64_t size;
+        int64_t mtime;
+        std::wstring digest;
+    };
+    std::wstring path;
+    std::unordered_map<std::wstring, Entry> entries;
+    bool changed = false;
+};
+
+// Known-good digests, one per line: "<sha256>" allows that content anywhere, "<sha256> <path>" pins the binary at
+// that path (case-insensitive, as written in ImagePath after expansion). '#' starts a comment.
+struct HashAllowlist {
+    std::set<std::wstring> digests;
+    std::unordered_map<std::wstring, std::set<std::wstring>> pinned;
+
+    bool Load(const std::wstring& file) {
+        std::wifstream input{std::filesystem::path(file)};
+        if (!input) {
+            return false;
+        }
+        std::wstring line;
+        while (std::getline(input, line)) {
+            line = line.substr(0, line.find(L'#'));
+            std::wstringstream fields(line);
+            std::wstring digest;
+            if (!(fields >> digest)) {
+                continue;
+            }
+            digest = ToLower(digest);
+            std::wstring binary;
+            std::getline(fields >> std::ws, binary);
+            while (!binary.empty() && (binary.back() == L' ' || binary.back() == L'\r' || binary.back() == L'\t')) {
+                binary.pop_back();
+            }
+            (binary.empty() ? digests : pinned[ToLower(binary)]).insert(digest);
+        }
+        return true;
+    }
+};
+
+constexpr OutputColumn kVerifyColumns[] = {
+    {L"service_name", L"SERVICE_NAME", 24},
+    {L"status", L"STATUS", 10},
+    {L"sha256", L"SHA256", 66},
+    {L"size", L"SIZE", 11},
+    {L"binary", L"BINARY", 48},
+    {L"arguments", L"ARGUMENTS", 24},
+    {L"note", L"NOTE", 0},
+};
+
+// Per-user cache location of one of sc_clone's files (the verify hash cache, the search index)
+std::wstring DefaultCachePath(const std::wstring& fileName) {
+#ifdef _WIN32
+    const wchar_t* base = _wgetenv(L"LOCALAPPDATA");
+    return base ? std::wstring(base) + L"\\sc_clone\\" + fileName : L"";
+#else
+    const char* cache = std::getenv("XDG_CACHE_HOME");
+    const char* home = std::getenv("HOME");
+    std::string base = cache && *cache ? cache : home ? std::string(home) + "/.cache" : "";
+    return base.empty() ? L"" : Utf8ToWide(base + "/sc_clone/") + fileName;
+#endif
+}
+
+// Hashes the binaries services run:
+//   verify [<name|selector>] [--root=<dir>] [--allowlist=<file>] [--cache=<file>|--no-cache] [--parallel=N]
+// Each distinct file is hashed once, on a worker pool; files whose size and mtime match the cache are not read.
+// Status is HASHED without an allowlist, otherwise ALLOWED, UNLISTED or MISMATCH (a pinned path with another
+// digest); MISSING when the binary is not found. Any mismatch makes the command fail.
+DWORD VerifyServiceBinaries(ScmSession& session, const std::vector<std::wstring>& args) {
+    std::wstring selectorText;
+    std::wstring root;
+    std::wstring allowlistPath;
+    std::wstring cachePath = DefaultCachePath(L"verify.cache");
+    size_t workers = std::max<size_t>(1, std::thread::hardware_concurrency());
+    for (size_t i = 1; i < args.size(); ++i) {
+        const std::wstring& arg = args[i];
+        if (arg.compare(0, 7, L"--root=") == 0) {
+            root = arg.substr(7);
+        } else if (arg.compare(0, 12, L"--allowlist=") == 0) {
+            allowlistPath = arg.substr(12);
+        } else if (arg.compare(0, 8, L"--cache=") == 0) {
+            cachePath = arg.substr(8);
+        } else if (arg == L"--no-cache") {
+            cachePath.clear();
+        } else if (arg.compare(0, 11, L"--parallel=") == 0) {
+            workers = std::max<size_t>(1, static_cast<size_t>(std::wcstoull(arg.c_str() + 11, nullptr, 10)));
+        } else if (arg.compare(0, 2, L"--") != 0 && selectorText.empty()) {
+            selectorText = arg;
+        } else {
+            Err() << L"[SC_CLONE] Usage: sc_clone verify [<name|selector>] [--root=<dir>] [--allowlist=<file>] [--cache=<file>|--no-cache] [--parallel=N]" << std::endl;
+            return ERROR_INVALID_PARAMETER;
+        }
+    }
+    // A plain name compiles to a glob without wildcards, i.e. an exact case-insensitive match
+    ServiceSelector selector;
+    if (!selectorText.empty() && !selector.Compile(selectorText)) {
+        return ERROR_INVALID_PARAMETER;
+    }
+    HashAllowlist allowlist;
+    if (!allowlistPath.empty() && !allowlist.Load(allowlistPath)) {
+        PrintErrorMessage(L"[SC_CLONE] Unable to read allowlist " + allowlistPath + L", error code: ", ERROR_FILE_NOT_FOUND);
+        return ERROR_FILE_NOT_FOUND;
+    }
+    auto start = std::chrono::steady_clock::now();
+
+    struct Target {
+        std::wstring name;
+        ServiceImage image;
+        size_t file = SIZE_MAX;  // Index into files
+        DWORD error = ERROR_SUCCESS;
+    };
+    struct BinaryFile {
+        std::filesystem::path path;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        std::wstring digest;
+        DWORD error = ERROR_SUCCESS;
+        bool cached = false;
+    };
+    std::vector<Target> targets;
+    DWORD error = ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+        if (selectorText.empty() || selector.Matches(entry.lpServiceName, entry.lpDisplayName)) {
+            targets.push_back(Target{entry.lpServiceName, ServiceImage(), SIZE_MAX, ERROR_SUCCESS});
+        }
+        return true;
+    });
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] EnumServicesStatusEx failed with error code: ", error);
+        return error;
+    }
+    if (targets.empty() && !selectorText.empty()) {
+        PrintErrorMessage(L"[SC_CLONE] No service matches " + selectorText + L", error code: ", ERROR_SERVICE_DOES_NOT_EXIST);
+        return ERROR_SERVICE_DOES_NOT_EXIST;
+    }
+
+    // Resolve every ImagePath, then group services by the file they run (shared hosts such as svchost.exe)
+    ImageLocator locator(root);
+    std::vector<BinaryFile> files;
+    std::unordered_map<std::wstring, size_t> fileIndex;
+    for (auto& target : targets) {
+        ServiceConfig config;
+        target.error = ConfigReader().Read(session.Service(target.name, SERVICE_QUERY_CONFIG), target.name, CONFIG_PART_BASE, config);
+        if (!config.config) {
+            target.error = target.error == ERROR_SUCCESS ? GetLastError() : target.error;
+            continue;
+        }
+        target.image = locator.Locate(config.config->lpBinaryPathName ? config.config->lpBinaryPathName : L"",
+                                      config.config->dwServiceType);
+        if (target.image.hostPath.empty()) {
+            continue;
+        }
+        auto inserted = fileIndex.emplace(target.image.hostPath.wstring(), files.size());
+        if (inserted.second) {
+            files.push_back(BinaryFile());
+            files.back().path = target.image.hostPath;
+        }
+        target.file = inserted.first->second;
+    }
+
+    HashCache cache;
+    if (!cachePath.empty()) {
+        cache.Load(cachePath);
+    }
+    std::vector<size_t> pending;
+    for (size_t i = 0; i < files.size(); ++i) {
+        BinaryFile& file = files[i];
+        std::error_code statError;
+        file.size = std::filesystem::file_size(file.path, statError);
+        file.mtime = static_cast<int64_t>(std::filesystem::last_write_time(file.path, statError).time_since_epoch().count());
+        if (statError) {
+            file.error = ERROR_ACCESS_DENIED;
+        } else if (cache.Find(file.path.wstring(), file.size, file.mtime, file.digest)) {
+            file.cached = true;
+        } else {
+            pending.push_back(i);
+        }
+    }
+    uint64_t hashedBytes = 0;
+    for (size_t i : pending) {
+        hashedBytes += files[i].size;
+    }
+    ParallelFor(pending.size(), workers, [&](size_t i) {
+        BinaryFile& file = files[pending[i]];
+        file.error = HashFile(file.path, file.size, file.digest);
+    });
+    for (size_t i : pending) {
+        if (files[i].error == ERROR_SUCCESS) {
+            cache.Store(files[i].path.wstring(), files[i].size, files[i].mtime, files[i].digest);
+        }
+    }
+    DWORD cacheError = cache.Save();
+    if (cacheError != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] Unable to save hash cache " + cachePath + L", error code: ", cacheError);
+    }
+
+    size_t counts[4] = {};  // mismatched, unlisted, missing, failed
+    {
+        RecordWriter writer(kVerifyColumns, sizeof(kVerifyColumns) / sizeof(kVerifyColumns[0]));
+        for (const auto& target : targets) {
+            const BinaryFile* file = target.file == SIZE_MAX ? nullptr : &files[target.file];
+            const wchar_t* status = L"HASHED";
+            std::wstring note;
+            if (target.error != ERROR_SUCCESS && target.image.binary.empty()) {
+                status = L"ERROR";
+                note = L"configuration unreadable, error " + std::to_wstring(target.error);
+                ++counts[3];
+            } else if (!file) {
+                status = L"MISSING";
+                ++counts[2];
+            } else if (file->error != ERROR_SUCCESS) {
+                status = L"ERROR";
+                note = L"read failed, error " + std::to_wstring(file->error);
+                ++counts[3];
+            } else if (!allowlistPath.empty()) {
+                auto pinned = allowlist.pinned.find(ToLower(target.image.binary));
+                if (pinned != allowlist.pinned.end() && !pinned->second.count(file->digest)) {
+                    status = L"MISMATCH";
+                    ++counts[0];
+                } else if (pinned != allowlist.pinned.end() || allowlist.digests.count(file->digest)) {
+                    status = L"ALLOWED";
+                } else {
+                    status = L"UNLISTED";
+                    ++counts[1];
+                }
+            }
+            if (!target.image.note.empty()) {
+                note += (note.empty() ? L"" : L"; ") + target.image.note;
+            }
+            writer.String(target.name);
+            writer.String(status);
+            writer.String(file && file->error == ERROR_SUCCESS ? file->digest.c_str() : nullptr);
+            if (file && file->error == ERROR_SUCCESS) {
+                writer.String(std::to_wstring(file->size));
+            } else {
+                writer.String(nullptr);
+            }
+            writer.String(target.image.binary);
+            writer.String(target.image.arguments.empty() ? nullptr : target.image.arguments.c_str());
+            writer.String(note.empty() ? nullptr : note.c_str());
+            writer.EndRecord();
+        }
+    }
+
+    size_t cached = static_cast<size_t>(std::count_if(files.begin(), files.end(), [](const BinaryFile& file) { return file.cached; }));
+    Err() << L"[SC_CLONE] " << targets.size() << L" services, " << files.size() << L" binaries (" << pending.size()
+          << L" hashed, " << hashedBytes / (1024 * 1024) << L" MB; " << cached << L" from cache), " << counts[2] << L" missing";
+    if (!allowlistPath.empty()) {
+        Err() << L", " << counts[0] << L" mismatched, " << counts[1] << L" unlisted";
+    }
+    Err() << L" in " << static_cast<long long>(ElapsedMs(start)) << L" ms" << std::endl;
+    return counts[0] ? ERROR_INVALID_IMAGE_HASH : ERROR_SUCCESS;
+}
+
+// Record/replay of SCM traffic. --record=<trace> wraps the backend so every advapi32 call is appended to a compact
+// binary trace with its latency; --backend=replay:<trace> then serves the same calls from the trace instead of an
+// SCM. Results are stored by value (DWORDs and UTF-16 strings) rather than as raw buffers, so a trace recorded on
+// Windows replays on Linux, where wchar_t and pointers have other sizes.
+//
+// File layout:
+//   TraceHeader
+//   TraceRecord, then payloadBytes of payload, once per call in completion order
+// A payload is the key the call applied to (lower-cased service name, or "\\machine" for SCM handles) followed by
+// the call's outputs. Strings are a uint32 count of UTF-16 units (kTraceNullText for NULL) and the units.
+const char kTraceMagic[8] = {'S', 'C', 'T', 'R', 'A', 'C', 'E', '1'};
+const uint32_t kTraceNullText = 0xFFFFFFFF;
+
+enum class TraceCall : uint8_t {
+    OpenSCManager, OpenService, CreateService, CloseHandle, QueryStatus, Start, Control, Delete, QueryConfig,
+    ChangeConfig, QueryConfig2, ChangeConfig2, EnumServices, EnumDependents, Notify, Notified,
+};
+
+const wchar_t* const kTraceCallNames[] = {
+    L"OpenSCManagerW", L"OpenServiceW", L"CreateServiceW", L"CloseServiceHandle", L"QueryServiceStatusEx",
+    L"StartServiceW", L"ControlService", L"DeleteService", L"QueryServiceConfigW", L"ChangeServiceConfigW",
+    L"QueryServiceConfig2W", L"ChangeServiceConfig2W", L"EnumServicesStatusExW", L"EnumDependentServicesW",
+    L"NotifyServiceStatusChangeW", L"(notification)",
+};
+
+// TraceRecord flags
+const uint8_t kTraceSizing = 1;   // the call only reported the buffer size it needed; replay sizes buffers itself
+const uint8_t kTraceResumed = 2;  // an enumeration call that continued from a resume handle
+
+struct TraceHeader {
+    char magic[8];
+    uint64_t startedMs;  // wall clock (ms since the Unix epoch) when recording began
+};
+
+struct TraceRecord {
+    uint8_t call;             // TraceCall
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t argument;        // info level, control code, notify mask, or service type | state << 24 when enumerating
+    uint32_t result;          // BOOL or DWORD returned; 1 or 0 for calls that return a handle
+    uint32_t error;           // last error after the call
+    uint64_t offsetMicros;    // when the call started, relative to the start of the recording
+    uint32_t durationMicros;  // for a notification, the time from registering to delivery
+    uint32_t payloadBytes;
+};
+
+static_assert(sizeof(TraceHeader) == 16, "trace header layout");
+static_assert(sizeof(TraceRecord) == 32, "trace record layout");
+
+// Appends the values of one record's payload
+class TracePayload {
+public:
+    void Number(DWORD value) {
+        uint32_t raw = value;
+        Append(&raw, sizeof(raw));
+    }
+
+    // A multi-string (e.g. lpDependencies) keeps its inner NULs; the final empty string ends it
+    void Text(LPCWSTR text, bool multiString = false) {
+        if (!text) {
+            Number(kTraceNullText);
+            return;
+        }
+        units.clear();
+        if (multiString) {
+            for (LPCWSTR part = text; *part; part += std::wcslen(part) + 1) {
+                AddSnapshotString(units, part);
+                units.push_back(0);
+            }
+        } else {
+            AddSnapshotString(units, text);
+        }
+        Number(static_cast<DWORD>(units.size()));
+        Append(units.data(), units.size() * sizeof(char16_t));
+    }
+
+    void Status(const SERVICE_STATUS& status) {
+        for (DWORD value : {status.dwServiceType, status.dwCurrentState, status.dwControlsAccepted, status.dwWin32ExitCode,
+                            status.dwServiceSpecificExitCode, status.dwCheckPoint, status.dwWaitHint}) {
+            Number(value);
+        }
+    }
+
+    void Status(const SERVICE_STATUS_PROCESS& status) {
+        for (DWORD value : {status.dwServiceType, status.dwCurrentState, status.dwControlsAccepted, status.dwWin32ExitCode,
+                            status.dwServiceSpecificExitCode, status.dwCheckPoint, status.dwWaitHint, status.dwProcessId,
+                            status.dwServiceFlags}) {
+            Number(value);
+        }
+    }
+
+    const std::vector<char>& Bytes() const {
+        return bytes;
+    }
+
+private:
+    void Append(const void* data, size_t size) {
+        bytes.insert(bytes.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+    }
+
+    std::vector<char> bytes;
+    std::vector<char16_t> units;
+};
+
+// Reads the values of one record's payload back; reading past the end yields zeros and clears ok
+class TraceReader {
+public:
+    TraceReader(const char* data, size_t size) : data(data), size(size) {}
+
+    DWORD Number() {
+        uint32_t value = 0;
+        if (size - position < sizeof(value)) {
+            ok = false;
+            return 0;
+        }
+        std::memcpy(&value, data + position, sizeof(value));
+        position += sizeof(value);
+        return value;
+    }
+
+    // Returns false for a NULL string
+    bool Text(std::wstring& text) {
+        text.clear();
+        uint32_t length = Number();
+        if (length == kTraceNullText || !ok) {
+            return false;
+        }
+        if ((size - position) / sizeof(char16_t) < length) {
+            ok = false;
+            return false;
+        }
+        units.resize(length);
+        std::memcpy(units.data(), data + position, length * sizeof(char16_t));
+        position += length * sizeof(char16_t);
+        text = SnapshotStringValue(units.data(), SnapshotString{0, length});
+        return true;
+    }
+
+    void Status(SERVICE_STATUS& status) {
+        for (DWORD* value : {&status.dwServiceType, &status.dwCurrentState, &status.dwControlsAccepted, &status.dwWin32ExitCode,
+                             &status.dwServiceSpecificExitCode, &status.dwCheckPoint, &status.dwWaitHint}) {
+            *value = Number();
+        }
+    }
+
+    void Status(SERVICE_STATUS_PROCESS& status) {
+        for (DWORD* value : {&status.dwServiceType, &status.dwCurrentState, &status.dwControlsAccepted, &status.dwWin32ExitCode,
+                             &status.dwServiceSpecificExitCode, &status.dwCheckPoint, &status.dwWaitHint, &status.dwProcessId,
+                             &status.dwServiceFlags}) {
+            *value = Number();
+        }
+    }
+
+    bool AtEnd() const {
+        return position == size;
+    }
+
+    bool ok = true;
+
+private:
+    const char* data;
+    size_t size;
+    size_t position = 0;
+    std::vector<char16_t> units;
+};
+
+// Trace keys: calls on the same service (or SCM) share a key no matter which handle they went through
+std::wstring TraceServiceKey(LPCWSTR serviceName) {
+    return serviceName ? ToLower(serviceName) : L"";
+}
+
+std::wstring TraceMachineKey(LPCWSTR machineName) {
+    std::wstring machine = machineName ? ToLower(machineName) : L"";
+    size_t skip = machine.find_first_not_of(L'\\');
+    return L"\\\\" + (skip == std::wstring::npos ? std::wstring() : machine.substr(skip));
+}
+
+// Reads a whole trace and checks its header
+DWORD LoadTrace(const std::wstring& path, std::vector<char>& data) {
+    std::ifstream file(std::filesystem::path(path), std::ios::binary);
+    if (!file) {
+        return ERROR_FILE_NOT_FOUND;
+    }
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(TraceHeader) || std::memcmp(data.data(), kTraceMagic, sizeof(kTraceMagic)) != 0) {
+        return ERROR_INVALID_DATA;
+    }
+    return ERROR_SUCCESS;
+}
+
+// Calls fn(record, key, outputs) for each record of a loaded trace; stops at a truncated record
+template <typename Fn>
+size_t ForEachTraceRecord(const std::vector<char>& data, Fn fn) {
+    size_t count = 0;
+    size_t offset = sizeof(TraceHeader);
+    while (data.size() - offset >= sizeof(TraceRecord)) {
+        TraceRecord record;
+        std::memcpy(&record, data.data() + offset, sizeof(record));
+        offset += sizeof(record);
+        if (data.size() - offset < record.payloadBytes) {
+            break;
+        }
+        TraceReader reader(data.data() + offset, record.payloadBytes);
+        offset += record.payloadBytes;
+        std::wstring key;
+        reader.Text(key);
+        if (!reader.ok) {
+            break;
+        }
+        fn(record, key, reader);
+        ++count;
+    }
+    return count;
+}
+
+// Backend decorator that appends every call, its outputs, its last error and its latency to a trace file.
+// Notifications on service handles are intercepted on the way back, so the trace also holds when each one fired.
+class RecordingScmBackend : public ScmBackend {
+public:
+    explicit RecordingScmBackend(std::unique_ptr<ScmBackend> inner)
+        : inner(std::move(inner)), started(std::chrono::steady_clock::now()) {}
+
+    DWORD Open(const std::wstring& path) {
+        file.open(std::filesystem::path(path), std::ios::binary | std::ios::trunc);
+        TraceHeader header = {};
+        std::memcpy(header.magic, kTraceMagic, sizeof(kTraceMagic));
+        header.startedMs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        return file ? ERROR_SUCCESS : ERROR_WRITE_FAULT;
+    }
+
+    size_t Calls() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return calls;
+    }
+
+    SC_HANDLE OpenSCManagerW(LPCWSTR machineName, LPCWSTR databaseName, DWORD desiredAccess) override {
+        auto start = std::chrono::steady_clock::now();
+        SC_HANDLE handle = inner->OpenSCManagerW(machineName, databaseName, desiredAccess);
+        DWORD error = GetLastError();
+        Write(TraceCall::OpenSCManager, 0, 0, handle != NULL, error, start, TraceMachineKey(machineName), nullptr, handle);
+        return handle;
+    }
+
+    SC_HANDLE OpenServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, DWORD desiredAccess) override {
+        auto start = std::chrono::steady_clock::now();
+        SC_HANDLE handle = inner->OpenServiceW(hSCManager, serviceName, desiredAccess);
+        DWORD error = GetLastError();
+        Write(TraceCall::OpenService, 0, 0, handle != NULL, error, start, TraceServiceKey(serviceName), nullptr, handle);
+        return handle;
+    }
+
+    SC_HANDLE CreateServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, LPCWSTR displayName,
+                             DWORD desiredAccess, DWORD serviceType, DWORD startType, DWORD errorControl,
+                             LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                             LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password) override {
+        auto start = std::chrono::steady_clock::now();
+        SC_HANDLE handle = inner->CreateServiceW(hSCManager, serviceName, displayName, desiredAccess, serviceType, startType,
+                                                 errorControl, binaryPathName, loadOrderGroup, tagId, dependencies,
+                                                 serviceStartName, password);
+        DWORD error = GetLastError();
+        TracePayload outputs;
+        if (handle && tagId) {
+            outputs.Number(*tagId);
+        }
+        Write(TraceCall::CreateService, 0, 0, handle != NULL, error, start, TraceServiceKey(serviceName), &outputs, handle);
+        return handle;
+    }
+
+    BOOL CloseServiceHandle(SC_HANDLE hSCObject) override {
+        std::wstring key = KeyOf(hSCObject);
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->CloseServiceHandle(hSCObject);
+        DWORD error = GetLastError();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            keys.erase(hSCObject);
+        }
+        Write(TraceCall::CloseHandle, 0, 0, result, error, start, key);
+        return result;
+    }
+
+    BOOL QueryServiceStatusEx(SC_HANDLE hService, SC_STATUS_TYPE infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->QueryServiceStatusEx(hService, infoLevel, buffer, bufSize, bytesNeeded);
+        DWORD error = GetLastError();
+        TracePayload outputs;
+        if (result && infoLevel == SC_STATUS_PROCESS_INFO) {
+            outputs.Status(*reinterpret_cast<const SERVICE_STATUS_PROCESS*>(buffer));
+        }
+        Write(TraceCall::QueryStatus, SizingFlag(result, error), infoLevel, result, error, start, KeyOf(hService), &outputs);
+        return result;
+    }
+
+    BOOL StartServiceW(SC_HANDLE hService, DWORD numServiceArgs, LPCWSTR* serviceArgVectors) override {
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->StartServiceW(hService, numServiceArgs, serviceArgVectors);
+        DWORD error = GetLastError();
+        Write(TraceCall::Start, 0, 0, result, error, start, KeyOf(hService));
+        return result;
+    }
+
+    BOOL ControlService(SC_HANDLE hService, DWORD control, LPSERVICE_STATUS serviceStatus) override {
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->ControlService(hService, control, serviceStatus);
+        DWORD error = GetLastError();
+        TracePayload outputs;
+        if (serviceStatus) {
+            outputs.Status(*serviceStatus);
+        }
+        Write(TraceCall::Control, 0, control, result, error, start, KeyOf(hService), &outputs);
+        return result;
+    }
+
+    BOOL DeleteService(SC_HANDLE hService) override {
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->DeleteService(hService);
+        DWORD error = GetLastError();
+        Write(TraceCall::Delete, 0, 0, result, error, start, KeyOf(hService));
+        return result;
+    }
+
+    BOOL QueryServiceConfigW(SC_HANDLE hService, LPQUERY_SERVICE_CONFIGW serviceConfig,
+                             DWORD bufSize, LPDWORD bytesNeeded) override {
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->QueryServiceConfigW(hService, serviceConfig, bufSize, bytesNeeded);
+        DWORD error = GetLastError();
+        TracePayload outputs;
+        if (result) {
+            outputs.Number(serviceConfig->dwServiceType);
+            outputs.Number(serviceConfig->dwStartType);
+            outputs.Number(serviceConfig->dwErrorControl);
+            outputs.Number(serviceConfig->dwTagId);
+            outputs.Text(serviceConfig->lpBinaryPathName);
+            outputs.Text(serviceConfig->lpLoadOrderGroup);
+            outputs.Text(serviceConfig->lpDependencies, true);
+            outputs.Text(serviceConfig->lpServiceStartName);
+            outputs.Text(serviceConfig->lpDisplayName);
+        }
+        Write(TraceCall::QueryConfig, SizingFlag(result, error), 0, result, error, start, KeyOf(hService), &outputs);
+        return result;
+    }
+
+    BOOL ChangeServiceConfigW(SC_HANDLE hService, DWORD serviceType, DWORD startType, DWORD errorControl,
+                              LPCWSTR binaryPathName, LPCWSTR loadOrderGroup, LPDWORD tagId,
+                              LPCWSTR dependencies, LPCWSTR serviceStartName, LPCWSTR password,
+                              LPCWSTR displayName) override {
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->ChangeServiceConfigW(hService, serviceType, startType, errorControl, binaryPathName,
+                                                  loadOrderGroup, tagId, dependencies, serviceStartName, password,
+                                                  displayName);
+        DWORD error = GetLastError();
+        TracePayload outputs;
+        if (result && tagId) {
+            outputs.Number(*tagId);
+        }
+        Write(TraceCall::ChangeConfig, 0, 0, result, error, start, KeyOf(hService), &outputs);
+        return result;
+    }
+
+    BOOL QueryServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->QueryServiceConfig2W(hService, infoLevel, buffer, bufSize, bytesNeeded);
+        DWORD error = GetLastError();
+        TracePayload outputs;
+        if (result && infoLevel == SERVICE_CONFIG_DESCRIPTION) {
+            outputs.Text(reinterpret_cast<const SERVICE_DESCRIPTIONW*>(buffer)->lpDescription);
+        } else if (result && infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS) {
+            const SERVICE_FAILURE_ACTIONSW* info = reinterpret_cast<const SERVICE_FAILURE_ACTIONSW*>(buffer);
+            outputs.Number(info->dwResetPeriod);
+            outputs.Text(info->lpRebootMsg);
+            outputs.Text(info->lpCommand);
+            outputs.Number(info->lpsaActions ? info->cActions : 0);
+            for (DWORD i = 0; info->lpsaActions && i < info->cActions; ++i) {
+                outputs.Number(info->lpsaActions[i].Type);
+                outputs.Number(info->lpsaActions[i].Delay);
+            }
+        } else if (result && infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS_FLAG) {
+            outputs.Number(reinterpret_cast<const SERVICE_FAILURE_ACTIONS_FLAG*>(buffer)->fFailureActionsOnNonCrashFailures);
+        }
+        Write(TraceCall::QueryConfig2, SizingFlag(result, error), infoLevel, result, error, start, KeyOf(hService), &outputs);
+        return result;
+    }
+
+    BOOL ChangeServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPVOID info) override {
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->ChangeServiceConfig2W(hService, infoLevel, info);
+        DWORD error = GetLastError();
+        Write(TraceCall::ChangeConfig2, 0, infoLevel, result, error, start, KeyOf(hService));
+        return result;
+    }
+
+    BOOL EnumServicesStatusExW(SC_HANDLE hSCManager, SC_ENUM_TYPE infoLevel, DWORD serviceType,
+                               DWORD serviceState, LPBYTE services, DWORD bufSize, LPDWORD bytesNeeded,
+                               LPDWORD servicesReturned, LPDWORD resumeHandle, LPCWSTR groupName) override {
+        uint8_t flags = (resumeHandle && *resumeHandle) ? kTraceResumed : 0;
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->EnumServicesStatusExW(hSCManager, infoLevel, serviceType, serviceState, services, bufSize,
+                                                   bytesNeeded, servicesReturned, resumeHandle, groupName);
+        DWORD error = GetLastError();
+        TracePayload outputs;
+        if ((result || error == ERROR_MORE_DATA) && infoLevel == SC_ENUM_PROCESS_INFO && servicesReturned) {
+            const ENUM_SERVICE_STATUS_PROCESSW* entries = reinterpret_cast<const ENUM_SERVICE_STATUS_PROCESSW*>(services);
+            outputs.Number(*servicesReturned);
+            for (DWORD i = 0; i < *servicesReturned; ++i) {
+                outputs.Text(entries[i].lpServiceName);
+                outputs.Text(entries[i].lpDisplayName);
+                outputs.Status(entries[i].ServiceStatusProcess);
+            }
+            if (!result && *servicesReturned == 0) {
+                flags |= kTraceSizing;
+            }
+        }
+        Write(TraceCall::EnumServices, flags, serviceType | (serviceState << 24), result, error, start, KeyOf(hSCManager), &outputs);
+        return result;
+    }
+
+    BOOL EnumDependentServicesW(SC_HANDLE hService, DWORD serviceState, LPENUM_SERVICE_STATUSW services,
+                                DWORD bufSize, LPDWORD bytesNeeded, LPDWORD servicesReturned) override {
+        auto start = std::chrono::steady_clock::now();
+        BOOL result = inner->EnumDependentServicesW(hService, serviceState, services, bufSize, bytesNeeded, servicesReturned);
+        DWORD error = GetLastError();
+        TracePayload outputs;
+        if (result) {
+            outputs.Number(*servicesReturned);
+            for (DWORD i = 0; i < *servicesReturned; ++i) {
+                outputs.Text(services[i].lpServiceName);
+                outputs.Text(services[i].lpDisplayName);
+                outputs.Status(services[i].ServiceStatus);
+            }
+        }
+        Write(TraceCall::EnumDependents, SizingFlag(result, error), serviceState, result, error, start, KeyOf(hService), &outputs);
+        return result;
+    }
+
+    // Service notifications are routed through OnNotify, which records the delivered status before passing it on.
+    // SCM-level (created/deleted) notifications are recorded as registrations only.
+    DWORD NotifyServiceStatusChangeW(SC_HANDLE hService, DWORD notifyMask, PSERVICE_NOTIFYW notifyBuffer) override {
+        std::wstring key = KeyOf(hService);
+        bool hooked = notifyBuffer && key.compare(0, 2, L"\\\\") != 0;
+        NotifyHook* hook = nullptr;
+        if (hooked) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::unique_ptr<NotifyHook>& slot = hooks[notifyBuffer];
+            slot.reset(new NotifyHook{this, notifyBuffer->pfnNotifyCallback, notifyBuffer->pContext, key, notifyMask,
+                                      std::chrono::steady_clock::now()});
+            hook = slot.get();
+            notifyBuffer->pfnNotifyCallback = OnNotify;
+            notifyBuffer->pContext = hook;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        DWORD result = inner->NotifyServiceStatusChangeW(hService, notifyMask, notifyBuffer);
+        if (hooked && result != ERROR_SUCCESS) {
+            std::lock_guard<std::mutex> lock(mutex);
+            notifyBuffer->pfnNotifyCallback = hook->callback;
+            notifyBuffer->pContext = hook->context;
+            hooks.erase(notifyBuffer);
+        }
+        Write(TraceCall::Notify, 0, notifyMask, result, result, start, key);
+        return result;
+    }
+
+    // Waiting and host load are not SCM traffic, so they are not recorded
+    DWORD SleepEx(DWORD milliseconds, BOOL alertable) override {
+        return inner->SleepEx(milliseconds, alertable);
+    }
+
+    BOOL GetSystemTimes(LPFILETIME idleTime, LPFILETIME kernelTime, LPFILETIME userTime) override {
+        return inner->GetSystemTimes(idleTime, kernelTime, userTime);
+    }
+
+private:
+    struct NotifyHook {
+        RecordingScmBackend* backend;
+        PFN_SC_NOTIFY_CALLBACK callback;
+        PVOID context;
+        std::wstring key;
+        DWORD mask;
+        std::chrono::steady_clock::time_point registered;
+    };
+
+    // Runs in place of the caller's callback: restores the caller's buffer, records the delivery, then hands it on
+    static void CALLBACK OnNotify(PVOID parameter) {
+        PSERVICE_NOTIFYW notify = static_cast<PSERVICE_NOTIFYW>(parameter);
+        NotifyHook* hook = static_cast<NotifyHook*>(notify->pContext);
+        RecordingScmBackend* backend = hook->backend;
+        PFN_SC_NOTIFY_CALLBACK callback = hook->callback;
+        notify->pfnNotifyCallback = callback;
+        notify->pContext = hook->context;
+
+        TracePayload outputs;
+        outputs.Status(notify->ServiceStatus);
+        outputs.Number(notify->dwNotificationTriggered);
+        backend->Write(TraceCall::Notified, 0, hook->mask, notify->dwNotificationStatus, notify->dwNotificationStatus,
+                       hook->registered, hook->key, &outputs);
+        {
+            std::lock_guard<std::mutex> lock(backend->mutex);
+            backend->hooks.erase(notify);
+        }
+        callback(notify);
+    }
+
+    // A failed query that only reported the size it needs says nothing about the service
+    static uint8_t SizingFlag(BOOL result, DWORD error) {
+        return (!result && (error == ERROR_INSUFFICIENT_BUFFER || error == ERROR_MORE_DATA)) ? kTraceSizing : 0;
+    }
+
+    std::wstring KeyOf(SC_HANDLE handle) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = keys.find(handle);
+        return it != keys.end() ? it->second : L"";
+    }
+
+    // Appends one record and leaves the call's last error intact for the caller
+    void Write(TraceCall call, uint8_t flags, DWORD argument, DWORD result, DWORD error,
+               std::chrono::steady_clock::time_point start, const std::wstring& key,
+               const TracePayload* outputs = nullptr, SC_HANDLE opened = NULL) {
+        auto end = std::chrono::steady_clock::now();
+        TracePayload payload;
+        payload.Text(key.c_str());
+
+        TraceRecord record = {};
+        record.call = static_cast<uint8_t>(call);
+        record.flags = flags;
+        record.argument = argument;
+        record.result = result;
+        record.error = error;
+        record.offsetMicros = static_cast<uint64_t>(std::max<int64_t>(0,
+            std::chrono::duration_cast<std::chrono::microseconds>(start - started).count()));
+        record.durationMicros = static_cast<uint32_t>(std::min<int64_t>(UINT32_MAX,
+            std::chrono::duration_cast<std::chrono::microseconds>(end - start).count()));
+        record.payloadBytes = static_cast<uint32_t>(payload.Bytes().size() + (outputs ? outputs->Bytes().size() : 0));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (opened) {
+            keys[opened] = key;
+        }
+        file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        file.write(payload.Bytes().data(), payload.Bytes().size());
+        if (outputs) {
+            file.write(outputs->Bytes().data(), outputs->Bytes().size());
+        }
+        ++calls;
+        SetLastError(error);
+    }
+
+    std::unique_ptr<ScmBackend> inner;
+    std::chrono::steady_clock::time_point started;
+    std::mutex mutex;
+    std::ofstream file;
+    size_t calls = 0;
+    std::unordered_map<SC_HANDLE, std::wstring> keys;
+    std::unordered_map<PSERVICE_NOTIFYW, std::unique_ptr<NotifyHook>> hooks;
+};
+
+// Backend that serves SCM calls from a recorded trace. Each (call, key, argument) has its own queue of recorded
+// results, consumed in order and started over once exhausted, so the trace of one start/stop cycle can drive any
+// number of them and concurrent callers see each service's own sequence. Output buffers are laid out afresh, so
+// buffer sizing follows this build rather than the recording host. Latencies and waits (including the delay
+// before each recorded notification) are replayed divided by speed; a speed of 0 replays without any delay.
+class ReplayScmBackend : public ScmBackend {
+public:
+    explicit ReplayScmBackend(double speed) : speed(speed) {}
+
+    DWORD Open(const std::wstring& path) {
+        DWORD error = LoadTrace(path, data);
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+        std::unordered_map<std::wstring, size_t> openPasses;  // enumeration queue -> result still being extended
+        ForEachTraceRecord(data, [&](const TraceRecord& record, const std::wstring& key, TraceReader& outputs) {
+            ++recordCount;
+            if (record.flags & kTraceSizing) {
+                return;
+            }
+            std::wstring queueKey = QueueKey(static_cast<TraceCall>(record.call), record.argument, key);
+            if (static_cast<TraceCall>(record.call) != TraceCall::EnumServices) {
+                results.push_back(ReplayResult{record, outputs, {}, 1});
+                queues[queueKey].results.push_back(results.size() - 1);
+                return;
+            }
+
+            // The chunks of one enumeration pass become a single result that is re-chunked for the caller's buffer
+            auto pass = openPasses.find(queueKey);
+            if (!(record.flags & kTraceResumed) || pass == openPasses.end()) {
+                results.push_back(ReplayResult{record, TraceReader(nullptr, 0), {}, 1});
+                queues[queueKey].results.push_back(results.size() - 1);
+                pass = openPasses.insert_or_assign(queueKey, results.size() - 1).first;
+            } else {
+                ReplayResult& merged = results[pass->second];
+                merged.record.result = record.result;
+                merged.record.error = record.error;
+                merged.record.durationMicros += record.durationMicros;
+                ++merged.chunks;
+            }
+            DWORD count = outputs.Number();
+            ReplayResult& merged = results[pass->second];
+            for (DWORD i = 0; i < count && outputs.ok; ++i) {
+                ReplayService service;
+                outputs.Text(service.name);
+                outputs.Text(service.displayName);
+                outputs.Status(service.status);
+                merged.services.push_back(service);
+            }
+            if (record.result) {
+                openPasses.erase(pass);
+            }
+        });
+        return ERROR_SUCCESS;
+    }
+
+    size_t Calls() const {
+        return recordCount;
+    }
+
+    SC_HANDLE OpenSCManagerW(LPCWSTR machineName, LPCWSTR, DWORD) override {
+        return OpenHandle(TraceCall::OpenSCManager, TraceMachineKey(machineName), RPC_S_SERVER_UNAVAILABLE);
+    }
+
+    SC_HANDLE OpenServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, DWORD) override {
+        if (!Valid(hSCManager)) {
+            return NULL;
+        }
+        return OpenHandle(TraceCall::OpenService, TraceServiceKey(serviceName), ERROR_SERVICE_DOES_NOT_EXIST);
+    }
+
+    SC_HANDLE CreateServiceW(SC_HANDLE hSCManager, LPCWSTR serviceName, LPCWSTR, DWORD, DWORD, DWORD, DWORD,
+                             LPCWSTR, LPCWSTR, LPDWORD tagId, LPCWSTR, LPCWSTR, LPCWSTR) override {
+        if (!Valid(hSCManager)) {
+            return NULL;
+        }
+        TraceReader outputs(nullptr, 0);
+        SC_HANDLE handle = OpenHandle(TraceCall::CreateService, TraceServiceKey(serviceName), ERROR_CALL_NOT_IMPLEMENTED, &outputs);
+        if (handle && tagId) {
+            *tagId = outputs.Number();
+        }
+        return handle;
+    }
+
+    BOOL CloseServiceHandle(SC_HANDLE hSCObject) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto it = handles.find(hSCObject);
+        if (it == handles.end()) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return FALSE;
+        }
+        // Closing a handle cancels its outstanding notification requests
+        pending.erase(std::remove_if(pending.begin(), pending.end(), [&](const PendingNotify& notify) { return notify.handle == hSCObject; }),
+                      pending.end());
+        enumPasses.erase(hSCObject);
+        const ReplayResult* result = Take(QueueKey(TraceCall::CloseHandle, 0, it->second));
+        handles.erase(it);
+        return Finish(lock, result, TRUE);
+    }
+
+    BOOL QueryServiceStatusEx(SC_HANDLE hService, SC_STATUS_TYPE infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        const ReplayResult* result = Peek(TraceCall::QueryStatus, infoLevel, hService);
+        if (!result) {
+            return FALSE;
+        }
+        TraceReader outputs = result->outputs;
+        if (result->record.result) {
+            *bytesNeeded = sizeof(SERVICE_STATUS_PROCESS);
+            if (bufSize < sizeof(SERVICE_STATUS_PROCESS)) {
+                return Finish(lock, result, FALSE, ERROR_INSUFFICIENT_BUFFER);
+            }
+            outputs.Status(*reinterpret_cast<SERVICE_STATUS_PROCESS*>(buffer));
+        }
+        Consume(TraceCall::QueryStatus, infoLevel, hService);
+        return Finish(lock, result);
+    }
+
+    BOOL StartServiceW(SC_HANDLE hService, DWORD, LPCWSTR*) override {
+        return ServeAction(TraceCall::Start, 0, hService);
+    }
+
+    BOOL ControlService(SC_HANDLE hService, DWORD control, LPSERVICE_STATUS serviceStatus) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        const ReplayResult* result = Peek(TraceCall::Control, control, hService);
+        if (!result) {
+            return FALSE;
+        }
+        TraceReader outputs = result->outputs;
+        if (serviceStatus && !outputs.AtEnd()) {
+            outputs.Status(*serviceStatus);
+        }
+        Consume(TraceCall::Control, control, hService);
+        return Finish(lock, result);
+    }
+
+    BOOL DeleteService(SC_HANDLE hService) override {
+        return ServeAction(TraceCall::Delete, 0, hService);
+    }
+
+    BOOL QueryServiceConfigW(SC_HANDLE hService, LPQUERY_SERVICE_CONFIGW serviceConfig,
+                             DWORD bufSize, LPDWORD bytesNeeded) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        const ReplayResult* result = Peek(TraceCall::QueryConfig, 0, hService);
+        if (!result) {
+            return FALSE;
+        }
+        if (result->record.result) {
+            TraceReader outputs = result->outputs;
+            MemoryService service;
+            service.serviceType = outputs.Number();
+            service.startType = outputs.Number();
+            service.errorControl = outputs.Number();
+            service.tagId = outputs.Number();
+            std::wstring dependencies;
+            outputs.Text(service.binaryPath);
+            outputs.Text(service.loadOrderGroup);
+            outputs.Text(dependencies);
+            outputs.Text(service.startName);
+            outputs.Text(service.displayName);
+            for (size_t begin = 0, end; begin < dependencies.size(); begin = end + 1) {
+                end = dependencies.find(L'\0', begin);
+                end = end == std::wstring::npos ? dependencies.size() : end;
+                if (end > begin) {
+                    service.dependencies.push_back(dependencies.substr(begin, end - begin));
+                }
+            }
+            if (!PackServiceConfig(service, serviceConfig, bufSize, bytesNeeded)) {
+                return Finish(lock, result, FALSE, GetLastError());
+            }
+        }
+        Consume(TraceCall::QueryConfig, 0, hService);
+        return Finish(lock, result);
+    }
+
+    BOOL ChangeServiceConfigW(SC_HANDLE hService, DWORD, DWORD, DWORD, LPCWSTR, LPCWSTR, LPDWORD tagId,
+                              LPCWSTR, LPCWSTR, LPCWSTR, LPCWSTR) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        const ReplayResult* result = Peek(TraceCall::ChangeConfig, 0, hService);
+        if (!result) {
+            return FALSE;
+        }
+        TraceReader outputs = result->outputs;
+        if (tagId && !outputs.AtEnd()) {
+            *tagId = outputs.Number();
+        }
+        Consume(TraceCall::ChangeConfig, 0, hService);
+        return Finish(lock, result);
+    }
+
+    BOOL QueryServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPBYTE buffer,
+                              DWORD bufSize, LPDWORD bytesNeeded) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        const ReplayResult* result = Peek(TraceCall::QueryConfig2, infoLevel, hService);
+        if (!result) {
+            return FALSE;
+        }
+        if (result->record.result) {
+            TraceReader outputs = result->outputs;
+            MemoryService service;
+            if (infoLevel == SERVICE_CONFIG_DESCRIPTION) {
+                outputs.Text(service.description);
+            } else if (infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS) {
+                service.resetPeriod = outputs.Number();
+                outputs.Text(service.rebootMsg);
+                outputs.Text(service.failureCommand);
+                DWORD count = outputs.Number();
+                for (DWORD i = 0; i < count && outputs.ok; ++i) {
+                    SC_ACTION action;
+                    action.Type = static_cast<SC_ACTION_TYPE>(outputs.Number());
+                    action.Delay = outputs.Number();
+                    service.failureActions.push_back(action);
+                }
+            } else if (infoLevel == SERVICE_CONFIG_FAILURE_ACTIONS_FLAG) {
+                service.failureActionsOnNonCrash = outputs.Number();
+            }
+            if (!PackServiceConfig2(service, infoLevel, buffer, bufSize, bytesNeeded)) {
+                return Finish(lock, result, FALSE, GetLastError());
+            }
+        }
+        Consume(TraceCall::QueryConfig2, infoLevel, hService);
+        return Finish(lock, result);
+    }
+
+    BOOL ChangeServiceConfig2W(SC_HANDLE hService, DWORD infoLevel, LPVOID) override {
+        return ServeAction(TraceCall::ChangeConfig2, infoLevel, hService);
+    }
+
+    // A resume handle of 0 starts the next recorded pass; later calls continue it from the entry index they hold
+    BOOL EnumServicesStatusExW(SC_HANDLE hSCManager, SC_ENUM_TYPE, DWORD serviceType,
+                               DWORD serviceState, LPBYTE buffer, DWORD bufSize, LPDWORD bytesNeeded,
+                               LPDWORD servicesReturned, LPDWORD resumeHandle, LPCWSTR) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        DWORD argument = serviceType | (serviceState << 24);
+        DWORD position = resumeHandle ? *resumeHandle : 0;
+        const ReplayResult*& pass = enumPasses[hSCManager];
+        if (position == 0 || !pass) {
+            pass = Peek(TraceCall::EnumServices, argument, hSCManager);
+            if (!pass) {
+                enumPasses.erase(hSCManager);
+                return FALSE;
+            }
+            Consume(TraceCall::EnumServices, argument, hSCManager);
+        }
+        const ReplayResult* result = pass;
+        if (!result->record.result && result->record.error != ERROR_MORE_DATA) {
+            return Finish(lock, result);
+        }
+
+        ENUM_SERVICE_STATUS_PROCESSW* entries = reinterpret_cast<ENUM_SERVICE_STATUS_PROCESSW*>(buffer);
+        LPBYTE stringEnd = buffer + bufSize;
+        DWORD returned = 0;
+        DWORD used = 0;
+        DWORD remaining = 0;
+        for (; position < result->services.size(); ++position) {
+            const ReplayService& service = result->services[position];
+            DWORD entrySize = static_cast<DWORD>(sizeof(ENUM_SERVICE_STATUS_PROCESSW) +
+                                                 sizeof(wchar_t) * (service.name.size() + 1 + service.displayName.size() + 1));
+            if (buffer && used + entrySize <= bufSize) {
+                ENUM_SERVICE_STATUS_PROCESSW& entry = entries[returned++];
+                wchar_t* cursor = reinterpret_cast<wchar_t*>(stringEnd) - (service.name.size() + 1 + service.displayName.size() + 1);
+                stringEnd = reinterpret_cast<LPBYTE>(cursor);
+                entry.lpServiceName = Pack(cursor, service.name);
+                entry.lpDisplayName = Pack(cursor, service.displayName);
+                entry.ServiceStatusProcess = service.status;
+                used += entrySize;
+                continue;
+            }
+            for (size_t rest = position; rest < result->services.size(); ++rest) {
+                remaining += static_cast<DWORD>(sizeof(ENUM_SERVICE_STATUS_PROCESSW) + sizeof(wchar_t) *
+                             (result->services[rest].name.size() + 1 + result->services[rest].displayName.size() + 1));
+            }
+            break;
+        }
+
+        *servicesReturned = returned;
+        *bytesNeeded = remaining;
+        if (resumeHandle) {
+            *resumeHandle = remaining ? position : 0;
+        }
+        if (!remaining) {
+            enumPasses.erase(hSCManager);
+        }
+        return Finish(lock, result, remaining ? FALSE : TRUE, remaining ? ERROR_MORE_DATA : ERROR_SUCCESS, result->chunks);
+    }
+
+    BOOL EnumDependentServicesW(SC_HANDLE hService, DWORD serviceState, LPENUM_SERVICE_STATUSW buffer,
+                                DWORD bufSize, LPDWORD bytesNeeded, LPDWORD servicesReturned) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        const ReplayResult* result = Peek(TraceCall::EnumDependents, serviceState, hService);
+        if (!result) {
+            return FALSE;
+        }
+        if (result->record.result) {
+            TraceReader outputs = result->outputs;
+            std::vector<ReplayService> dependents(outputs.Number());
+            DWORD required = 0;
+            for (ReplayService& dependent : dependents) {
+                outputs.Text(dependent.name);
+                outputs.Text(dependent.displayName);
+                SERVICE_STATUS status;
+                outputs.Status(status);
+                std::memcpy(&dependent.status, &status, sizeof(status));
+                required += static_cast<DWORD>(sizeof(ENUM_SERVICE_STATUSW) +
+                                               sizeof(wchar_t) * (dependent.name.size() + 1 + dependent.displayName.size() + 1));
+            }
+            *bytesNeeded = required;
+            *servicesReturned = 0;
+            if (!buffer || bufSize < required) {
+                return Finish(lock, result, FALSE, ERROR_MORE_DATA);
+            }
+            wchar_t* cursor = reinterpret_cast<wchar_t*>(buffer + dependents.size());
+            for (size_t i = 0; i < dependents.size(); ++i) {
+                buffer[i].lpServiceName = Pack(cursor, dependents[i].name);
+                buffer[i].lpDisplayName = Pack(cursor, dependents[i].displayName);
+                std::memcpy(&buffer[i].ServiceStatus, &dependents[i].status, sizeof(SERVICE_STATUS));
+            }
+            *servicesReturned = static_cast<DWORD>(dependents.size());
+        }
+        Consume(TraceCall::EnumDependents, serviceState, hService);
+        return Finish(lock, result);
+    }
+
+    // Replays the registration's recorded result and schedules the notification recorded after it, which the
+    // registering thread receives in an alertable SleepEx once its recorded delay has passed
+    DWORD NotifyServiceStatusChangeW(SC_HANDLE hService, DWORD notifyMask, PSERVICE_NOTIFYW notifyBuffer) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto handle = handles.find(hService);
+        if (handle == handles.end()) {
+            return ERROR_INVALID_HANDLE;
+        }
+        // Only service notifications are recorded; SCM-level (created/deleted) ones are not replayed
+        if (handle->second.compare(0, 2, L"\\\\") == 0) {
+            return ERROR_CALL_NOT_IMPLEMENTED;
+        }
+        const ReplayResult* registration = Take(QueueKey(TraceCall::Notify, notifyMask, handle->second));
+        if (!registration || registration->record.result != ERROR_SUCCESS) {
+            DWORD error = registration ? registration->record.result : ERROR_CALL_NOT_IMPLEMENTED;
+            Finish(lock, registration, FALSE);
+            return error;
+        }
+        const ReplayResult* fired = Take(QueueKey(TraceCall::Notified, notifyMask, handle->second));
+        if (!fired) {
+            // Recorded but never delivered: the registration stands and nothing arrives, as it did then
+            Finish(lock, registration, TRUE);
+            return ERROR_SUCCESS;
+        }
+        auto due = std::chrono::steady_clock::now() + Scaled(fired->record.durationMicros);
+        pending.push_back(PendingNotify{hService, notifyBuffer, fired, due, std::this_thread::get_id()});
+        Finish(lock, registration, TRUE);
+        return ERROR_SUCCESS;
+    }
+
+    // Delivers this thread's due notifications when alertable; otherwise waits milliseconds / speed
+    DWORD SleepEx(DWORD milliseconds, BOOL alertable) override {
+        auto now = std::chrono::steady_clock::now();
+        auto deadline = milliseconds == INFINITE ? std::chrono::steady_clock::time_point::max()
+                                                 : now + Scaled(static_cast<double>(milliseconds) * 1000);
+        for (;;) {
+            auto wakeAt = deadline;
+            if (alertable) {
+                std::unique_lock<std::mutex> lock(mutex);
+                for (auto it = pending.begin(); it != pending.end(); ++it) {
+                    if (it->thread != std::this_thread::get_id()) {
+                        continue;
+                    }
+                    if (it->due <= now) {
+                        PendingNotify notify = *it;
+                        pending.erase(it);
+                        lock.unlock();
+                        TraceReader outputs = notify.fired->outputs;
+                        notify.buffer->dwNotificationStatus = notify.fired->record.result;
+                        outputs.Status(notify.buffer->ServiceStatus);
+                        notify.buffer->dwNotificationTriggered = outputs.Number();
+                        notify.buffer->pfnNotifyCallback(notify.buffer);
+                        return WAIT_IO_COMPLETION;
+                    }
+                    wakeAt = std::min(wakeAt, it->due);
+                }
+            }
+            if (now >= deadline) {
+                return 0;
+            }
+            if (wakeAt == std::chrono::steady_clock::time_point::max()) {
+                // Nothing will ever arrive; an infinite wait here would hang, so treat it as an empty wait
+                return 0;
+            }
+            std::this_thread::sleep_until(wakeAt);
+            now = std::chrono::steady_clock::now();
+        }
+    }
+
+    // The recorded host's load is not in the trace
+    BOOL GetSystemTimes(LPFILETIME, LPFILETIME, LPFILETIME) override {
+        SetLastError(ERROR_CALL_NOT_IMPLEMENTED);
+        return FALSE;
+    }
+
+private:
+    struct ReplayService {
+        std::wstring name;
+        std::wstring displayName;
+        SERVICE_STATUS_PROCESS status = {};
+    };
+
+    struct ReplayResult {
+        TraceRecord record;
+        TraceReader outputs;
+        std::vector<ReplayService> services;  // an enumeration pass, merged from its chunks
+        uint32_t chunks = 1;
+    };
+
+    struct ReplayQueue {
+        std::vector<size_t> results;
+        size_t next = 0;
+    };
+
+    struct PendingNotify {
+        SC_HANDLE handle;
+        PSERVICE_NOTIFYW buffer;
+        const ReplayResult* fired;
+        std::chrono::steady_clock::time_point due;
+        std::thread::id thread;
+    };
+
+    static std::wstring QueueKey(TraceCall call, DWORD argument, const std::wstring& key) {
+        return std::to_wstring(static_cast<int>(call)) + L':' + std::to_wstring(argument) + L':' + key;
+    }
+
+    std::chrono::steady_clock::duration Scaled(double micros) const {
+        if (speed <= 0) {
+            return std::chrono::steady_clock::duration::zero();
+        }
+        return std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::micro>(micros / speed));
+    }
+
+    bool Valid(SC_HANDLE handle) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (handles.count(handle)) {
+            return true;
+        }
+        SetLastError(ERROR_INVALID_HANDLE);
+        return false;
+    }
+
+    // The next recorded result for a queue, consumed; null when the trace has none
+    const ReplayResult* Take(const std::wstring& queueKey) {
+        auto it = queues.find(queueKey);
+        if (it == queues.end() || it->second.results.empty()) {
+            return nullptr;
+        }
+        ReplayQueue& queue = it->second;
+        const ReplayResult* result = &results[queue.results[queue.next]];
+        queue.next = (queue.next + 1) % queue.results.size();
+        return result;
+    }
+
+    // The next recorded result for a call on a handle, left in place until Consume so a caller whose buffer turns
+    // out too small gets the same result on its retry. Sets the last error when there is nothing to serve.
+    const ReplayResult* Peek(TraceCall call, DWORD argument, SC_HANDLE handle) {
+        auto it = handles.find(handle);
+        if (it == handles.end()) {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return nullptr;
+        }
+        auto queue = queues.find(QueueKey(call, argument, it->second));
+        if (queue == queues.end() || queue->second.results.empty()) {
+            SetLastError(ERROR_CALL_NOT_IMPLEMENTED);
+            return nullptr;
+        }
+        return &results[queue->second.results[queue->second.next]];
+    }
+
+    void Consume(TraceCall call, DWORD argument, SC_HANDLE handle) {
+        Take(QueueKey(call, argument, handles[handle]));
+    }
+
+    SC_HANDLE OpenHandle(TraceCall call, const std::wstring& key, DWORD missingError, TraceReader* outputs = nullptr) {
+        std::unique_lock<std::mutex> lock(mutex);
+        const ReplayResult* result = Take(QueueKey(call, 0, key));
+        if (!result) {
+            SetLastError(missingError);
+            return NULL;
+        }
+        SC_HANDLE handle = NULL;
+        if (result->record.result) {
+            handle = reinterpret_cast<SC_HANDLE>(++lastHandle);
+            handles[handle] = key;
+            if (outputs) {
+                *outputs = result->outputs;
+            }
+        }
+        Finish(lock, result);
+        return handle;
+    }
+
+    BOOL ServeAction(TraceCall call, DWORD argument, SC_HANDLE hService) {
+        std::unique_lock<std::mutex> lock(mutex);
+        const ReplayResult* result = Peek(call, argument, hService);
+        if (!result) {
+            return FALSE;
+        }
+        Consume(call, argument, hService);
+        return Finish(lock, result);
+    }
+
+    // Releases the lock, waits out the recorded latency (split over the chunks a pass is served in) and sets the
+    // recorded last error; returns the recorded result unless the caller overrides it
+    BOOL Finish(std::unique_lock<std::mutex>& lock, const ReplayResult* result, std::optional<BOOL> value = std::nullopt,
+                std::optional<DWORD> error = std::nullopt, uint32_t chunks = 1) {
+        lock.unlock();
+        if (!result) {
+            return value.value_or(FALSE);
+        }
+        auto delay = Scaled(static_cast<double>(result->record.durationMicros) / std::max<uint32_t>(chunks, 1));
+        if (delay > std::chrono::steady_clock::duration::zero()) {
+            std::this_thread::sleep_for(delay);
+        }
+        SetLastError(error.value_or(result->record.error));
+        return value.value_or(static_cast<BOOL>(result->record.result));
+    }
+
+    double speed;
+    std::vector<char> data;
+    std::vector<ReplayResult> results;
+    std::unordered_map<std::wstring, ReplayQueue> queues;
+    size_t recordCount = 0;
+    std::mutex mutex;
+    uintptr_t lastHandle = 0;
+    std::unordered_map<SC_HANDLE, std::wstring> handles;
+    std::unordered_map<SC_HANDLE, const ReplayResult*> enumPasses;
+    std::vector<PendingNotify> pending;
+};
+
+constexpr OutputColumn kTraceColumns[] = {
+    {L"offset_us", L"OFFSET_US", 12},
+    {L"call", L"CALL", 28},
+    {L"target", L"TARGET", 28},
+    {L"argument", L"ARGUMENT", 10},
+    {L"result", L"RESULT", 7},
+    {L"error", L"ERROR", 6},
+    {L"duration_us", L"DURATION_US", 0},
+};
+
+// Prints a recorded trace, one call per line
+DWORD DumpTrace(const std::wstring& path) {
+    std::vector<char> data;
+    DWORD error = LoadTrace(path, data);
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] Unable to read trace " + path + L", error code: ", error);
+        return error;
+    }
+
+    OutputFormat format = g_outputFormat == OutputFormat::Text ? OutputFormat::Table : g_outputFormat;
+    uint64_t lastOffset = 0;
+    size_t count = 0;
+    {
+        RecordWriter writer(kTraceColumns, sizeof(kTraceColumns) / sizeof(kTraceColumns[0]), format);
+        count = ForEachTraceRecord(data, [&](const TraceRecord& record, const std::wstring& key, TraceReader&) {
+            const wchar_t* name = record.call < sizeof(kTraceCallNames) / sizeof(kTraceCallNames[0]) ? kTraceCallNames[record.call] : L"?";
+            writer.String(std::to_wstring(record.offsetMicros));
+            writer.String((record.flags & kTraceSizing) ? std::wstring(name) + L" (size)" : std::wstring(name));
+            writer.String(key);
+            writer.Number(record.argument);
+            writer.Number(record.result);
+            writer.Number(record.error);
+            writer.Number(record.durationMicros);
+            writer.EndRecord();
+            lastOffset = std::max<uint64_t>(lastOffset, record.offsetMicros + record.durationMicros);
+        });
+    }
+    Err() << L"[SC_CLONE] " << count << L" calls over " << lastOffset / 1000 << L" ms, " << data.size() << L" bytes" << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// Substring search index over the text of every service, kept in a memory-mappable file:
+//   SearchIndexHeader              - with the source the services were read from, the first string of the pool
+//   SearchDocument[documentCount]  - one per service, sorted by lower-cased name
+//   SearchGram[gramCount]          - every case-folded trigram, sorted by key
+//   uint32_t[postingCount]         - for each trigram, the ascending documents containing it, each tagged with
+//                                    the fields it occurs in (top 5 bits)
+//   char16_t[stringUnits]          - UTF-16 string pool, referenced by (offset, length) pairs
+// Each field is indexed with two U+0001 units appended, so every position of a field starts a trigram and one- or
+// two-character terms become a key range. Terms up to three characters are answered from the postings alone;
+// longer ones are confirmed against the text of the fields that hold all of their trigrams.
+const char kSearchIndexMagic[8] = {'S', 'C', 'S', 'R', 'C', 'H', '2', '\0'};
+const uint64_t kSearchDefaultMaxAgeMs = 5 * 60 * 1000;
+const char16_t kSearchPad = 0x0001;
+const uint32_t kSearchDocumentBits = 27;
+const uint32_t kSearchDocumentMask = (1u << kSearchDocumentBits) - 1;
+
+enum SearchField {
+    SEARCH_NAME,
+    SEARCH_DISPLAY_NAME,
+    SEARCH_DESCRIPTION,
+    SEARCH_BINARY_PATH,
+    SEARCH_ACCOUNT,
+    SEARCH_FIELD_COUNT,
+};
+
+const wchar_t* const kSearchFieldNames[SEARCH_FIELD_COUNT] = {L"name", L"display", L"description", L"path", L"account"};
+
+struct SearchIndexHeader {
+    char magic[8];
+    uint64_t builtMs;  // wall clock of the last pass over the service database
+    uint32_t documentCount;
+    uint32_t gramCount;
+    uint32_t postingCount;
+    uint32_t stringUnits;
+    SnapshotString source;  // backend and machine, as SearchIndexSource gives them
+};
+
+struct SearchDocument {
+    SnapshotString fields[SEARCH_FIELD_COUNT];
+    uint64_t fingerprint;  // of the field texts; an update re-indexes only documents whose fingerprint moved
+};
+
+struct SearchGram {
+    uint64_t key;  // three folded UTF-16 units, first unit highest
+    uint32_t firstPosting;
+    uint32_t postingCount;
+};
+
+static_assert(sizeof(SearchIndexHeader) == 40, "search index header layout");
+static_assert(sizeof(SearchDocument) == 48, "search document layout");
+static_assert(sizeof(SearchGram) == 16, "search gram layout");
+static_assert(SEARCH_FIELD_COUNT <= 32 - kSearchDocumentBits, "field bits of a posting");
+
+// A service a search found, with the bitmask of fields that contain the term
+struct SearchMatch {
+    uint32_t document;
+    unsigned fields;
+};
+
+inline char16_t FoldUnit(char16_t unit) {
+    return (unit >= 0xD800 && unit < 0xE000) ? unit : static_cast<char16_t>(FoldCase(static_cast<wchar_t>(unit)));
+}
+
+uint64_t SearchGramKey(char16_t a, char16_t b, char16_t c) {
+    return (uint64_t(a) << 32) | (uint64_t(b) << 16) | uint64_t(c);
+}
+
+// Case-insensitive search for already-folded needle units in a pooled string
+bool ContainsFolded(const char16_t* text, uint32_t length, const std::vector<char16_t>& needle) {
+    if (needle.size() > length) {
+        return false;
+    }
+    for (uint32_t i = 0; i + needle.size() <= length; ++i) {
+        size_t j = 0;
+        while (j < needle.size() && FoldUnit(text[i + j]) == needle[j]) {
+            ++j;
+        }
+        if (j == needle.size()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<char16_t> FoldSearchTerm(const std::wstring& term) {
+    std::vector<char16_t> needle;
+    AddSnapshotString(needle, term.c_str());
+    for (char16_t& unit : needle) {
+        unit = FoldUnit(unit);
+    }
+    return needle;
+}
+
+// Mapped search index. Opening checks only the header and sizes; references are checked where they are used,
+// so a query touches just the trigrams and documents it needs.
+struct SearchIndexView {
+    MappedFile file;
+    const SearchIndexHeader* header = nullptr;
+    const SearchDocument* documents = nullptr;
+    const SearchGram* grams = nullptr;
+    const uint32_t* postings = nullptr;
+    const char16_t* strings = nullptr;
+
+    DWORD Open(const std::wstring& path) {
+        DWORD error = file.Open(path);
+        if (error != ERROR_SUCCESS) {
+            return error;
+        }
+        if (file.Size() < sizeof(SearchIndexHeader)) {
+            return ERROR_INVALID_DATA;
+        }
+        header = reinterpret_cast<const SearchIndexHeader*>(file.Data());
+        uint64_t expected = sizeof(SearchIndexHeader) + uint64_t(header->documentCount) * sizeof(SearchDocument) +
+                            uint64_t(header->gramCount) * sizeof(SearchGram) + uint64_t(header->postingCount) * sizeof(uint32_t) +
+                            uint64_t(header->stringUnits) * sizeof(char16_t);
+        if (!std::equal(kSearchIndexMagic, kSearchIndexMagic + 8, header->magic) || expected != file.Size()) {
+            return ERROR_INVALID_DATA;
+        }
+        documents = reinterpret_cast<const SearchDocument*>(header + 1);
+        grams = reinterpret_cast<const SearchGram*>(documents + header->documentCount);
+        postings = reinterpret_cast<const uint32_t*>(grams + header->gramCount);
+        strings = reinterpret_cast<const char16_t*>(postings + header->postingCount);
+        return ERROR_SUCCESS;
+    }
+
+    bool Valid(SnapshotString ref) const {
+        return uint64_t(ref.offset) + ref.length <= header->stringUnits;
+    }
+
+    std::wstring Text(uint32_t document, SearchField field) const {
+        SnapshotString ref = documents[document].fields[field];
+        return Valid(ref) ? SnapshotStringValue(strings, ref) : std::wstring();
+    }
+
+    std::wstring Source() const {
+        return Valid(header->source) ? SnapshotStringValue(strings, header->source) : std::wstring();
+    }
+
+    // Services (ascending) in which some selected field contains term, ignoring case, with the fields that do
+    std::vector<SearchMatch> Find(const std::wstring& term, unsigned fieldMask) const {
+        std::vector<char16_t> needle = FoldSearchTerm(term);
+        std::vector<SearchMatch> matches;
+        if (needle.empty() || header->documentCount == 0) {
+            return matches;
+        }
+
+        if (needle.size() <= 3) {
+            // Every trigram that starts with the term: a contiguous key range thanks to the padding. A trigram in
+            // a field's postings means that field contains it, so the fields need no further check.
+            uint64_t low = SearchGramKey(needle[0], needle.size() > 1 ? needle[1] : 0, needle.size() > 2 ? needle[2] : 0);
+            uint64_t high = SearchGramKey(needle[0], needle.size() > 1 ? needle[1] : 0xFFFF, needle.size() > 2 ? needle[2] : 0xFFFF);
+            std::vector<uint8_t> fields(header->documentCount);
+            const SearchGram* first = std::lower_bound(grams, grams + header->gramCount, low,
+                                                       [](const SearchGram& gram, uint64_t key) { return gram.key < key; });
+            for (const SearchGram* gram = first; gram != grams + header->gramCount && gram->key <= high; ++gram) {
+                const uint32_t* list = Postings(*gram);
+                for (uint32_t i = 0; list && i < gram->postingCount; ++i) {
+                    uint32_t document = list[i] & kSearchDocumentMask;
+                    if (document < header->documentCount) {
+                        fields[document] |= static_cast<uint8_t>(list[i] >> kSearchDocumentBits);
+                    }
+                }
+            }
+            for (uint32_t document = 0; document < header->documentCount; ++document) {
+                if (fields[document] & fieldMask) {
+                    matches.push_back(SearchMatch{document, fields[document] & fieldMask});
+                }
+            }
+            return matches;
+        }
+
+        // Intersect the posting lists of the term's trigrams, shortest first, narrowing the fields that could
+        // hold all of them
+        std::vector<const SearchGram*> lists;
+        for (size_t i = 0; i + 3 <= needle.size(); ++i) {
+            const SearchGram* gram = Lookup(SearchGramKey(needle[i], needle[i + 1], needle[i + 2]));
+            if (!gram || !Postings(*gram)) {
+                return matches;
+            }
+            lists.push_back(gram);
+        }
+        std::sort(lists.begin(), lists.end(), [](const SearchGram* a, const SearchGram* b) { return a->postingCount < b->postingCount; });
+        const uint32_t* shortest = Postings(*lists[0]);
+        for (uint32_t i = 0; i < lists[0]->postingCount; ++i) {
+            unsigned fields = (shortest[i] >> kSearchDocumentBits) & fieldMask;
+            if (fields) {
+                matches.push_back(SearchMatch{shortest[i] & kSearchDocumentMask, fields});
+            }
+        }
+        for (size_t i = 1; i < lists.size() && !matches.empty(); ++i) {
+            const uint32_t* list = Postings(*lists[i]);
+            const uint32_t* end = list + lists[i]->postingCount;
+            matches.erase(std::remove_if(matches.begin(), matches.end(), [&](SearchMatch& match) {
+                // Gallop: both sides ascend, and the candidates are usually far sparser than the list
+                size_t step = 1;
+                while (list + step < end && (list[step] & kSearchDocumentMask) < match.document) {
+                    list += step;
+                    step *= 2;
+                }
+                list = std::lower_bound(list, std::min(list + step + 1, end), match.document,
+                                        [](uint32_t posting, uint32_t document) { return (posting & kSearchDocumentMask) < document; });
+                if (list == end || (*list & kSearchDocumentMask) != match.document) {
+                    return true;
+                }
+                match.fields &= *list >> kSearchDocumentBits;
+                return match.fields == 0;
+            }), matches.end());
+        }
+
+        // The trigrams may sit apart in the field; confirm the term against the text of the remaining fields
+        matches.erase(std::remove_if(matches.begin(), matches.end(), [&](SearchMatch& match) {
+            match.fields = match.document < header->documentCount ? MatchedFields(match.document, needle, match.fields) : 0;
+            return match.fields == 0;
+        }), matches.end());
+        return matches;
+    }
+
+    // Bitmask of the selected fields of a document that contain the folded needle
+    unsigned MatchedFields(uint32_t document, const std::vector<char16_t>& needle, unsigned fieldMask) const {
+        unsigned matched = 0;
+        for (int field = 0; field < SEARCH_FIELD_COUNT; ++field) {
+            SnapshotString ref = documents[document].fields[field];
+            if ((fieldMask & (1u << field)) && Valid(ref) && ContainsFolded(strings + ref.offset, ref.length, needle)) {
+                matched |= 1u << field;
+            }
+        }
+        return matched;
+    }
+
+    const uint32_t* Postings(const SearchGram& gram) const {
+        return uint64_t(gram.firstPosting) + gram.postingCount <= header->postingCount ? postings + gram.firstPosting : nullptr;
+    }
+
+private:
+    const SearchGram* Lookup(uint64_t key) const {
+        const SearchGram* gram = std::lower_bound(grams, grams + header->gramCount, key,
+                                                  [](const SearchGram& entry, uint64_t value) { return entry.key < value; });
+        return (gram != grams + header->gramCount && gram->key == key) ? gram : nullptr;
+    }
+};
+
+// What the index holds for one service
+struct SearchEntry {
+    std::wstring fields[SEARCH_FIELD_COUNT];
+    uint64_t fingerprint = 0;
+};
+
+uint64_t SearchFingerprint(const SearchEntry& entry) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (const auto& field : entry.fields) {
+        for (wchar_t ch : field) {
+            hash = (hash ^ static_cast<uint32_t>(ch)) * 1099511628211ULL;
+        }
+        hash = (hash ^ 0xFFFF) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// FNV-1a of a source, naming its default index file
+uint64_t SearchSourceHash(const std::wstring& source) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (wchar_t ch : ToLower(source)) {
+        hash = (hash ^ static_cast<uint32_t>(ch)) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Outcome of a pass over the service database
+struct SearchIndexUpdate {
+    size_t services = 0;
+    size_t added = 0;
+    size_t changed = 0;
+    size_t removed = 0;
+    size_t grams = 0;
+    bool rewritten = false;
+};
+
+// Reads every service once (enumeration, then base config and description on a worker pool) and writes the index.
+// With a previous index, documents whose text has not changed keep their place and only the differences are
+// counted; when nothing changed at all the file is left as it is apart from its timestamp. An index read from
+// another source is not reused.
+DWORD UpdateSearchIndex(ScmSession& session, const std::wstring& path, const std::wstring& source, size_t workers,
+                        SearchIndexUpdate& update) {
+    SC_HANDLE hSCManager = session.Manager(SC_MANAGER_CONNECT | SC_MANAGER_ENUMERATE_SERVICE);
+    if (!hSCManager) {
+        return GetLastError();
+    }
+    std::vector<SearchEntry> entries;
+    DWORD error = ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+        entries.emplace_back();
+        entries.back().fields[SEARCH_NAME] = entry.lpServiceName;
+        entries.back().fields[SEARCH_DISPLAY_NAME] = entry.lpDisplayName ? entry.lpDisplayName : L"";
+        return true;
+    });
+    if (error != ERROR_SUCCESS) {
+        return error;
+    }
+
+    ParallelFor(entries.size(), workers, [&](size_t i) {
+        SearchEntry& entry = entries[i];
+        SC_HANDLE hService = Scm().OpenServiceW(hSCManager, entry.fields[SEARCH_NAME].c_str(), SERVICE_QUERY_CONFIG);
+        if (hService) {
+            ServiceConfig config;
+            ConfigReader().Read(hService, entry.fields[SEARCH_NAME], CONFIG_PART_BASE | CONFIG_PART_DESCRIPTION, config);
+            if (config.config) {
+                entry.fields[SEARCH_BINARY_PATH] = config.config->lpBinaryPathName ? config.config->lpBinaryPathName : L"";
+                entry.fields[SEARCH_ACCOUNT] = config.config->lpServiceStartName ? config.config->lpServiceStartName : L"";
+            }
+            if (config.description && config.description->lpDescription) {
+                entry.fields[SEARCH_DESCRIPTION] = config.description->lpDescription;
+            }
+            Scm().CloseServiceHandle(hService);
+        }
+        entry.fingerprint = SearchFingerprint(entry);
+    });
+
+    std::vector<std::wstring> keys(entries.size());
+    std::vector<size_t> order(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        keys[i] = ToLower(entries[i].fields[SEARCH_NAME]);
+        order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] < keys[b]; });
+    order.erase(std::unique(order.begin(), order.end(), [&](size_t a, size_t b) { return keys[a] == keys[b]; }), order.end());
+    update.services = order.size();
+
+    // Diff against the previous index by name; both sides are in the same order. An unchanged service keeps its
+    // postings, renumbered to its new place.
+    auto previous = std::make_unique<SearchIndexView>();
+    bool hadIndex = previous->Open(path) == ERROR_SUCCESS && previous->Source() == source;
+    std::vector<uint32_t> renumber;
+    std::vector<bool> reused(order.size());
+    if (hadIndex) {
+        renumber.assign(previous->header->documentCount, UINT32_MAX);
+        uint32_t old = 0;
+        for (uint32_t document = 0; document < order.size(); ++document) {
+            const std::wstring& key = keys[order[document]];
+            while (old < previous->header->documentCount && ToLower(previous->Text(old, SEARCH_NAME)) < key) {
+                ++update.removed;
+                ++old;
+            }
+            if (old < previous->header->documentCount && ToLower(previous->Text(old, SEARCH_NAME)) == key) {
+                if (previous->documents[old].fingerprint == entries[order[document]].fingerprint) {
+                    renumber[old] = document;
+                    reused[document] = true;
+                } else {
+                    ++update.changed;
+                }
+                ++old;
+            } else {
+                ++update.added;
+            }
+        }
+        update.removed += previous->header->documentCount - old;
+    } else {
+        update.added = order.size();
+    }
+    uint64_t nowMs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    if (hadIndex && !update.added && !update.changed && !update.removed) {
+        update.grams = previous->header->gramCount;
+        previous.reset();
+        std::fstream stamp(std::filesystem::path(path), std::ios::binary | std::ios::in | std::ios::out);
+        stamp.seekp(sizeof(SearchIndexHeader::magic));
+        stamp.write(reinterpret_cast<const char*>(&nowMs), sizeof(nowMs));
+        return stamp ? ERROR_SUCCESS : ERROR_WRITE_FAULT;
+    }
+    if (order.size() > kSearchDocumentMask) {
+        return ERROR_INVALID_DATA;
+    }
+
+    // Trigram postings. Carried-over entries keep their relative order, and new or changed services are visited
+    // in order, so each list is two sorted runs to merge.
+    std::unordered_map<uint64_t, std::vector<uint32_t>> lists;
+    std::unordered_map<uint64_t, size_t> freshFrom;
+    if (hadIndex) {
+        for (uint32_t gram = 0; gram < previous->header->gramCount; ++gram) {
+            const uint32_t* list = previous->Postings(previous->grams[gram]);
+            std::vector<uint32_t>* carried = nullptr;
+            for (uint32_t i = 0; list && i < previous->grams[gram].postingCount; ++i) {
+                uint32_t old = list[i] & kSearchDocumentMask;
+                if (old < renumber.size() && renumber[old] != UINT32_MAX) {
+                    if (!carried) {
+                        carried = &lists[previous->grams[gram].key];
+                    }
+                    carried->push_back(renumber[old] | (list[i] & ~kSearchDocumentMask));
+                }
+            }
+        }
+    }
+    previous.reset();
+
+    std::vector<SearchDocument> documents(order.size());
+    std::vector<char16_t> pool;
+    SnapshotString sourceRef = AddSnapshotString(pool, source.c_str());
+    std::vector<char16_t> units;
+    std::vector<std::pair<uint64_t, uint32_t>> documentGrams;
+    for (uint32_t document = 0; document < order.size(); ++document) {
+        const SearchEntry& entry = entries[order[document]];
+        documentGrams.clear();
+        for (int field = 0; field < SEARCH_FIELD_COUNT; ++field) {
+            documents[document].fields[field] = AddSnapshotString(pool, entry.fields[field].c_str());
+            SnapshotString ref = documents[document].fields[field];
+            if (ref.length == 0 || reused[document]) {
+                continue;
+            }
+            units.assign(pool.begin() + ref.offset, pool.begin() + ref.offset + ref.length);
+            for (char16_t& unit : units) {
+                unit = FoldUnit(unit);
+            }
+            units.push_back(kSearchPad);
+            units.push_back(kSearchPad);
+            for (size_t i = 0; i + 3 <= units.size(); ++i) {
+                documentGrams.emplace_back(SearchGramKey(units[i], units[i + 1], units[i + 2]), 1u << field);
+            }
+        }
+        documents[document].fingerprint = entry.fingerprint;
+        std::sort(documentGrams.begin(), documentGrams.end());
+        for (size_t i = 0; i < documentGrams.size();) {
+            uint64_t key = documentGrams[i].first;
+            uint32_t fields = 0;
+            for (; i < documentGrams.size() && documentGrams[i].first == key; ++i) {
+                fields |= documentGrams[i].second;
+            }
+            std::vector<uint32_t>& list = lists[key];
+            freshFrom.emplace(key, list.size());
+            list.push_back(document | (fields << kSearchDocumentBits));
+        }
+    }
+    for (const auto& fresh : freshFrom) {
+        std::vector<uint32_t>& list = lists[fresh.first];
+        std::inplace_merge(list.begin(), list.begin() + fresh.second, list.end(), [](uint32_t a, uint32_t b) {
+            return (a & kSearchDocumentMask) < (b & kSearchDocumentMask);
+        });
+    }
+
+    std::vector<SearchGram> grams;
+    grams.reserve(lists.size());
+    for (const auto& list : lists) {
+        grams.push_back(SearchGram{list.first, 0, static_cast<uint32_t>(list.second.size())});
+    }
+    std::sort(grams.begin(), grams.end(), [](const SearchGram& a, const SearchGram& b) { return a.key < b.key; });
+    std::vector<uint32_t> postings;
+    for (SearchGram& gram : grams) {
+        const std::vector<uint32_t>& list = lists[gram.key];
+        gram.firstPosting = static_cast<uint32_t>(postings.size());
+        postings.insert(postings.end(), list.begin(), list.end());
+    }
+    update.grams = grams.size();
+
+    SearchIndexHeader header = {};
+    std::copy(kSearchIndexMagic, kSearchIndexMagic + 8, header.magic);
+    header.builtMs = nowMs;
+    header.documentCount = static_cast<uint32_t>(documents.size());
+    header.gramCount = static_cast<uint32_t>(grams.size());
+    header.postingCount = static_cast<uint32_t>(postings.size());
+    header.stringUnits = static_cast<uint32_t>(pool.size());
+    header.source = sourceRef;
+
+    // Written beside the old index and renamed over it, so a concurrent search sees one or the other
+    std::error_code fsError;
+    std::filesystem::path target(path);
+    if (target.has_parent_path()) {
+        std::filesystem::create_directories(target.parent_path(), fsError);
+    }
+    std::filesystem::path temporary = target;
+    temporary += ".tmp";
+    {
+        std::ofstream output(temporary, std::ios::binary | std::ios::trunc);
+        output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        output.write(reinterpret_cast<const char*>(documents.data()), documents.size() * sizeof(SearchDocument));
+        output.write(reinterpret_cast<const char*>(grams.data()), grams.size() * sizeof(SearchGram));
+        output.write(reinterpret_cast<const char*>(postings.data()), postings.size() * sizeof(uint32_t));
+        output.write(reinterpret_cast<const char*>(pool.data()), pool.size() * sizeof(char16_t));
+        if (!output) {
+            return ERROR_WRITE_FAULT;
+        }
+    }
+    std::filesystem::rename(temporary, target, fsError);
+    update.rewritten = !fsError;
+    return fsError ? ERROR_WRITE_FAULT : ERROR_SUCCESS;
+}
+
+constexpr OutputColumn kSearchColumns[] = {
+    {L"service_name", L"SERVICE_NAME", 28},
+    {L"matched", L"MATCHED", 20},
+    {L"display_name", L"DISPLAY_NAME", 32},
+    {L"binary_path_name", L"BINARY_PATH_NAME", 48},
+    {L"service_start_name", L"SERVICE_START_NAME", 24},
+    {L"description", L"DESCRIPTION", 0},
+};
+
+// Backend and machine a session reads services from; each gets its own default index
+std::wstring SearchIndexSource(const ScmSession& session) {
+    return g_backendSource + (session.Machine().empty() ? L"" : L"@" + ToLower(session.Machine()));
+}
+
+// Finds services whose name, display name, description, binary path or account contains a term:
+//   search <term> [--in=name,display,description,path,account] [--index=<file>] [--update] [--max-age=ms] [--parallel=N]
+//   search --update
+// The index is built on first use; --update, an index older than --max-age (5 minutes by default) or one built
+// from another backend or machine is refreshed from the SCM first.
+DWORD SearchServices(ScmSession& session, const std::vector<std::wstring>& args) {
+    std::wstring term;
+    std::wstring source = SearchIndexSource(session);
+    wchar_t sourceHash[17];
+    std::swprintf(sourceHash, 17, L"%016llx", static_cast<unsigned long long>(SearchSourceHash(source)));
+    std::wstring indexPath = DefaultCachePath(L"search-" + std::wstring(sourceHash) + L".index");
+    unsigned fieldMask = (1u << SEARCH_FIELD_COUNT) - 1;
+    bool update = false;
+    uint64_t maxAgeMs = kSearchDefaultMaxAgeMs;
+    size_t workers = 8;
+    for (size_t i = 1; i < args.size(); ++i) {
+        const std::wstring& arg = args[i];
+        if (arg.compare(0, 5, L"--in=") == 0) {
+            fieldMask = 0;
+            std::wstringstream list(arg.substr(5));
+            std::wstring name;
+            while (std::getline(list, name, L',')) {
+                auto match = std::find_if(std::begin(kSearchFieldNames), std::end(kSearchFieldNames),
+                                          [&](const wchar_t* field) { return name == field; });
+                if (match == std::end(kSearchFieldNames)) {
+                    Err() << L"[SC_CLONE] Unknown search field: " << name << L" (use name, display, description, path or account)" << std::endl;
+                    return ERROR_INVALID_PARAMETER;
+                }
+                fieldMask |= 1u << (match - std::begin(kSearchFieldNames));
+            }
+        } else if (arg.compare(0, 8, L"--index=") == 0) {
+            indexPath = arg.substr(8);
+        } else if (arg == L"--update") {
+            update = true;
+        } else if (arg.compare(0, 10, L"--max-age=") == 0) {
+            maxAgeMs = std::wcstoull(arg.c_str() + 10, nullptr, 10);
+        } else if (arg.compare(0, 11, L"--parallel=") == 0) {
+            workers = std::max<size_t>(1, std::wcstoul(arg.c_str() + 11, nullptr, 10));
+        } else if (arg.compare(0, 2, L"--") == 0) {
+            Err() << L"[SC_CLONE] Unknown option: " << arg << std::endl;
+            return ERROR_INVALID_PARAMETER;
+        } else if (term.empty()) {
+            term = arg;
+        }
+    }
+    if ((term.empty() && !update) || indexPath.empty() || fieldMask == 0) {
+        Err() << L"[SC_CLONE] Usage: sc_clone search <term> [--in=name,display,description,path,account] [--index=<file>] [--update] [--max-age=ms]" << std::endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    auto index = std::make_unique<SearchIndexView>();
+    DWORD error = index->Open(indexPath);
+    if (error == ERROR_SUCCESS) {
+        uint64_t nowMs = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count());
+        update = update || nowMs - std::min(nowMs, index->header->builtMs) > maxAgeMs || index->Source() != source;
+    }
+    if (error != ERROR_SUCCESS || update) {
+        index.reset();
+        auto start = std::chrono::steady_clock::now();
+        SearchIndexUpdate result;
+        error = UpdateSearchIndex(session, indexPath, source, workers, result);
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] Updating the search index " + indexPath + L" failed with error code: ", error);
+            return error;
+        }
+        Err() << L"[SC_CLONE] Search index: " << result.services << L" services (" << result.added << L" added, "
+              << result.changed << L" changed, " << result.removed << L" removed), " << result.grams << L" trigrams, "
+              << (result.rewritten ? L"rewritten" : L"unchanged") << L" in " << static_cast<long long>(ElapsedMs(start)) << L" ms" << std::endl;
+        if (term.empty()) {
+            return ERROR_SUCCESS;
+        }
+        index = std::make_unique<SearchIndexView>();
+        error = index->Open(indexPath);
+    }
+    if (error != ERROR_SUCCESS) {
+        PrintErrorMessage(L"[SC_CLONE] Unable to read search index " + indexPath + L", error code: ", error);
+        return error;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<SearchMatch> matches = index->Find(term, fieldMask);
+    double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    OutputFormat format = g_outputFormat == OutputFormat::Text ? OutputFormat::Table : g_outputFormat;
+    {
+        RecordWriter writer(kSearchColumns, sizeof(kSearchColumns) / sizeof(kSearchColumns[0]), format);
+        for (const SearchMatch& match : matches) {
+            uint32_t document = match.document;
+            std::wstring fields;
+            for (int field = 0; field < SEARCH_FIELD_COUNT; ++field) {
+                if (match.fields & (1u << field)) {
+                    fields += (fields.empty() ? L"" : L",") + std::wstring(kSearchFieldNames[field]);
+                }
+            }
+            std::wstring description = index->Text(document, SEARCH_DESCRIPTION);
+            writer.String(index->Text(document, SEARCH_NAME));
+            writer.String(fields);
+            writer.String(index->Text(document, SEARCH_DISPLAY_NAME));
+            writer.String(index->Text(document, SEARCH_BINARY_PATH));
+            writer.String(index->Text(document, SEARCH_ACCOUNT));
+            writer.String(description.empty() ? nullptr : description.c_str());
+            writer.EndRecord();
+        }
+    }
+    Err() << L"[SC_CLONE] " << matches.size() << L" of " << index->header->documentCount << L" services match (" << micros
+          << L" us)" << std::endl;
+    return ERROR_SUCCESS;
+}
+
+// Parses one command (args[0] = command, args[1] = service name) and invokes the corresponding handler
+DWORD DispatchCommand(ScmSession& session, const std::vector<std::wstring>& args, bool resolveSelectors = true) {
+    if (args.empty()) {
+        Err() << L"[SC_CLONE] Usage: sc_clone <command> <service_name> [options]" << std::endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    const std::wstring& command = args[0];
+
+    // Glob and /regex/ selectors in a service-name position stand for every service they match
+    if (resolveSelectors && args.size() > 1) {
+        static const std::set<std::wstring> kPerServiceCommands = {L"delete", L"config", L"qdescription", L"failure"};
+        if ((command == L"query" || command == L"queryex") && ServiceSelector::IsSelector(args[1])) {
+            return QuerySelectedServices(session, args[1], command == L"queryex");
+        }
+        if (command == L"start" || command == L"stop") {
+            std::vector<std::wstring> names;
+            std::vector<std::wstring> options;
+            for (size_t i = 1; i < args.size(); ++i) {
+                (args[i].compare(0, 2, L"--") == 0 ? options : names).push_back(args[i]);
+            }
+            if (std::any_of(names.begin(), names.end(), ServiceSelector::IsSelector)) {
+                std::vector<std::wstring> expanded(1, command);
+                DWORD error = ExpandServiceSelectors(session, names, expanded);
+                if (error != ERROR_SUCCESS) {
+                    return error;
+                }
+                expanded.insert(expanded.end(), options.begin(), options.end());
+                return DispatchCommand(session, expanded, false);
+            }
+        }
+        if (kPerServiceCommands.count(command) && ServiceSelector::IsSelector(args[1])) {
+            std::vector<std::wstring> matched;
+            DWORD error = ExpandServiceSelectors(session, {args[1]}, matched);
+            std::vector<std::wstring> serviceArgs = args;
+            for (const auto& name : matched) {
+                serviceArgs[1] = name;
+                DWORD result = DispatchCommand(session, serviceArgs, false);
+                error = error == ERROR_SUCCESS ? result : error;
+            }
+            return error;
+        }
+    }
+
+    // Without a service name (or with only filters), query/queryex enumerate every matching service
+    if ((command == L"query" || command == L"queryex") &&
+        (args.size() == 1 || args[1].find(L'=') != std::wstring::npos)) {
+        return EnumerateServices(session, args, 1, command == L"queryex");
+    }
+
+    if (command == L"watch") {
+        return WatchServices(session, args);
+    }
+    if (command == L"events") {
+        return ReadServiceEvents(session, args);
+    }
+    if (command == L"verify") {
+        return VerifyServiceBinaries(session, args);
+    }
+    if (command == L"statuscache") {
+        return RunStatusCache(session, args);
+    }
+    if (command == L"search") {
+        return SearchServices(session, args);
+    }
+
+    if (args.size() < 2) {
+        Err() << L"[SC_CLONE] Usage: sc_clone <command> <service_name> [options]" << std::endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+
+    const std::wstring& serviceName = args[1];
+
+    if (command == L"query" || command == L"queryex") {
+        // --cached[=ms] reads the status cache, accepting an answer up to that old (default 2000 ms)
+        std::optional<uint64_t> maxAgeMs;
+        std::wstring cachePath = DefaultStatusCachePath();
+        for (size_t i = 2; i < args.size(); ++i) {
+            if (args[i] == L"--cached") {
+                maxAgeMs = 2000;
+            } else if (args[i].compare(0, 9, L"--cached=") == 0) {
+                maxAgeMs = std::wcstoull(args[i].c_str() + 9, nullptr, 10);
+            } else if (args[i].compare(0, 13, L"--cache-file=") == 0) {
+                cachePath = args[i].substr(13);
+            }
+        }
+        if (maxAgeMs) {
+            return QueryCachedServiceStatus(session, serviceName, command == L"queryex", *maxAgeMs, cachePath);
+        }
+        return QueryServiceStatus(session, serviceName, command == L"queryex");
+    } else if (command == L"create" && args.size() > 2) {
+        // "create <name> <path>" keeps its original meaning (auto start); options follow sc.exe
+        ServiceSpec spec;
+        spec.name = serviceName;
+        if (args.size() == 3 && args[2].find(L'=') == std::wstring::npos) {
+            spec.binaryPath = args[2];
+            spec.startType = SERVICE_AUTO_START;
+        } else if (!ParseServiceSpecArgs(args, 2, spec)) {
+            return ERROR_INVALID_PARAMETER;
+        }
+        return CreateServiceEntry(session, spec);
+    } else if (command == L"start" || command == L"stop") {
+        // Several services, --with-dependents or an admission limit switch to the dependency-aware wave planner
+        bool starting = command == L"start";
+        if (args.size() > 2) {
+            std::vector<std::wstring> names;
+            TransitionOptions options;
+            if (!ParseTransitionArgs(args, names, options)) {
+                Err() << L"[SC_CLONE] Usage: sc_clone " << command << L" <service_name>... [--wait[=ms]] [--with-dependents] [--parallel=N] [--timeout=ms]"
+                      << L" [--max-concurrent=N] [--adaptive] [--retries=N] [--backoff=ms]" << std::endl;
+                return ERROR_INVALID_PARAMETER;
+            }
+            if (names.size() == 1 && !options.withDependents && !options.maxConcurrent && !options.adaptive) {
+                if (options.wait) {
+                    return TransitionAndWait(session, names[0], starting, options.timeoutMs);
+                }
+                return starting ? StartServiceEntry(session, names[0]) : StopServiceEntry(session, names[0]);
+            }
+            return TransitionServices(session, names, starting, options);
+        }
+        return starting ? StartServiceEntry(session, serviceName) : StopServiceEntry(session, serviceName);
+    } else if (command == L"delete") {
+        return DeleteServiceEntry(session, serviceName);
+    } else if (command == L"config") {
+        if (args.size() > 2 && (args.size() > 3 || args[2].find(L'=') != std::wstring::npos)) {
+            return ReconfigureService(session, serviceName, args);
+        }
+        if (args.size() > 2) {
+            return ConfigureService(session, serviceName, args[2]);
+        }
+        return ConfigureService(session, serviceName);
+    } else if (command == L"qdescription") {
+        return QueryServiceDescription(session, serviceName);
+    } else if (command == L"failure") {
+        std::vector<std::wstring> failureArgs(args.begin() + 2, args.end());
+        return ConfigureServiceFailure(session, serviceName, failureArgs);
+    } else if (command == L"apply") {
+        return ApplyManifest(session, args);
+    } else if (command == L"snapshot") {
+        return SnapshotServices(session, args[1]);
+    } else if (command == L"diff" && args.size() == 3) {
+        return DiffSnapshots(args[1], args[2]);
+    } else if (command == L"logdump") {
+        return DumpRingLog(args[1]);
+    } else if (command == L"trace") {
+        return DumpTrace(args[1]);
+    }
+
+    Err() << L"[SC_CLONE] Unsupported or incorrect command usage." << std::endl;
+    return ERROR_INVALID_PARAMETER;
+}
+
+// Runs one command; with --timings, also records its total time and the part spent outside SCM calls
+// (argument parsing and output). Calls made on worker threads (parallel start/stop) are not subtracted.
+DWORD RunCommand(ScmSession& session, const std::vector<std::wstring>& args) {
+    if (!g_timings || args.empty()) {
+        return DispatchCommand(session, args);
+    }
+
+    double scmBefore = t_scmMicros;
+    auto start = std::chrono::steady_clock::now();
+    DWORD result = DispatchCommand(session, args);
+    double micros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    g_timings->Record(L"command " + args[0], micros);
+    g_timings->Record(L"command " + args[0] + L" (non-SCM)", std::max(0.0, micros - (t_scmMicros - scmBefore)));
+    return result;
+}
+
+// Runs commands read line by line over a single SCM session.
+// Blank lines and lines starting with '#' are skipped; each command line gets a result line.
+int RunBatchStream(ScmSession& session, std::istream& input, DWORD* lastError = nullptr) {
+    size_t lineNumber = 0;
+    size_t failures = 0;
+    std::string rawLine;
+    while (std::getline(input, rawLine)) {
+        ++lineNumber;
+        // Skip a UTF-8 byte order mark on the first line
+        if (lineNumber == 1 && rawLine.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+            rawLine.erase(0, 3);
+        }
+
+        std::vector<std::wstring> args = SplitCommandLine(Utf8ToWide(rawLine));
+        if (args.empty() || args[0][0] == L'#') {
+            continue;
+        }
+
+        DWORD result = (args[0] == L"batch") ? ERROR_INVALID_PARAMETER : RunCommand(session, args);
+        if (result == ERROR_SUCCESS) {
+            Out() << L"[SC_CLONE] [line " << lineNumber << L"] " << args[0] << L" SUCCESS" << std::endl;
+        } else {
+            ++failures;
+            if (lastError) {
+                *lastError = result;
+            }
+            Out() << L"[SC_CLONE] [line " << lineNumber << L"] " << args[0] << L" FAILED " << result << std::endl;
+        }
+    }
+
+    Out() << L"[SC_CLONE] Batch complete: " << lineNumber << L" lines, " << failures << L" failed." << std::endl;
+    return failures ? 1 : 0;
+}
+
+// Opens a batch source: a file path, or stdin for "-"
+std::istream* OpenBatchSource(const std::wstring& source, std::ifstream& file) {
+    if (source == L"-") {
+        return &std::cin;
+    }
+    file.open(std::filesystem::path(source));
+    if (!file) {
+        Err() << L"[SC_CLONE] Unable to open batch file: " << source << std::endl;
+        return nullptr;
+    }
+    return &file;
+}
+
+// Runs a batch file (or stdin for "-") over a fresh session for the local SCM
+int RunBatch(const std::wstring& source) {
+    std::ifstream file;
+    std::istream* input = OpenBatchSource(source, file);
+    if (!input) {
+        return 1;
+    }
+
+    ScmSession session;
+    return RunBatchStream(session, *input);
+}
+
+// Byte stream that serve reads request frames from and writes response frames to
+class FrameChannel {
+public:
+    virtual ~FrameChannel() {}
+    // Reads exactly length bytes; false on end of stream or error
+    virtual bool Read(char* data, size_t length) = 0;
+    virtual bool Write(const char* data, size_t length) = 0;
+};
+
+// stdin/stdout, switched to binary so frame lengths are exact
+class StdioFrameChannel : public FrameChannel {
+public:
+    StdioFrameChannel() {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    }
+
+    bool Read(char* data, size_t length) override {
+        return std::fread(data, 1, length, stdin) == length;
+    }
+
+    bool Write(const char* data, size_t length) override {
+        return std::fwrite(data, 1, length, stdout) == length && std::fflush(stdout) == 0;
+    }
+};
+
+// One connected client of the local pipe: a named pipe instance on Windows, a Unix domain socket elsewhere
+class PipeFrameChannel : public FrameChannel {
+public:
+#ifdef _WIN32
+    explicit PipeFrameChannel(HANDLE pipe) : pipe(pipe) {}
+
+    bool Read(char* data, size_t length) override {
+        while (length) {
+            DWORD read = 0;
+            if (!ReadFile(pipe, data, static_cast<DWORD>(std::min<size_t>(length, 65536)), &read, NULL) || !read) {
+                return false;
+            }
+            data += read;
+            length -= read;
+        }
+        return true;
+    }
+
+    bool Write(const char* data, size_t length) override {
+        while (length) {
+            DWORD written = 0;
+            if (!WriteFile(pipe, data, static_cast<DWORD>(std::min<size_t>(length, 65536)), &written, NULL)) {
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+private:
+    HANDLE pipe;
+#else
+    explicit PipeFrameChannel(int socket) : socket(socket) {}
+
+    bool Read(char* data, size_t length) override {
+        while (length) {
+            ssize_t read = ::recv(socket, data, length, 0);
+            if (read < 0 && errno == EINTR) {
+                continue;
+            }
+            if (read <= 0) {
+                return false;
+            }
+            data += read;
+            length -= static_cast<size_t>(read);
+        }
+        return true;
+    }
+
+    bool Write(const char* data, size_t length) override {
+        while (length) {
+            // MSG_NOSIGNAL: a client that hung up must not kill the server with SIGPIPE
+            ssize_t written = ::send(socket, data, length, MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            data += written;
+            length -= static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+private:
+    int socket;
+#endif
+};
+
+// Largest request frame serve accepts
+const size_t kMaxRequestFrame = 1024 * 1024;
+
+struct ServeOptions {
+    std::wstring pipeName;     // Listen on this local pipe instead of stdin/stdout
+    size_t cacheSize = 256;    // Service handles kept open (least recently used are closed first)
+};
+
+// True for a request that acts on the one service named in args[1] through a single handle, so a stale-handle
+// failure means its first call failed and nothing was changed
+bool IsSingleServiceRequest(const std::vector<std::wstring>& args) {
+    static const std::set<std::wstring> kSingleService = {L"query", L"queryex", L"create", L"start", L"stop",
+                                                          L"delete", L"config", L"qdescription", L"failure"};
+    if (args.size() < 2 || !kSingleService.count(args[0]) || ServiceSelector::IsSelector(args[1]) ||
+        args[1].compare(0, 2, L"--") == 0) {
+        return false;
+    }
+    if (args[0] == L"start" || args[0] == L"stop") {
+        // Another name or a planner option brings in more services
+        return std::all_of(args.begin() + 2, args.end(), [](const std::wstring& arg) {
+            return arg.compare(0, 6, L"--wait") == 0 || arg.compare(0, 10, L"--timeout=") == 0;
+        });
+    }
+    return true;
+}
+
+// Runs one served request with its output captured. A cached handle can go stale: the service may have been
+// deleted by someone else (our open handle then keeps it in the marked-for-delete state, so even re-creating
+// it fails) or the SCM may have restarted. Such a failure drops the stale handles; a single-service request
+// then runs once more on a fresh handle, while one that touched several services is not run again, since
+// part of it may have been applied. Between requests the handle cache is trimmed to its capacity.
+DWORD ServeRequest(ScmSession& session, const std::vector<std::wstring>& args, std::wostringstream& output) {
+    static const std::set<std::wstring> kUnavailable = {L"batch", L"serve", L"watch", L"bench"};
+    std::wostream* out = t_out;
+    std::wostream* err = t_err;
+    t_out = &output;
+    t_err = &output;
+
+    std::vector<std::wstring> commandArgs;
+    OutputFormat format = g_outputFormat;
+    OutputFormat requestFormat = g_outputFormat;
+    DWORD result = ERROR_SUCCESS;
+    for (const auto& arg : args) {
+        if (arg.compare(0, 9, L"--format=") == 0 && commandArgs.empty()) {
+            if (!ParseOutputFormat(arg.substr(9), requestFormat)) {
+                Err() << L"[SC_CLONE] Unknown format: " << arg.substr(9) << std::endl;
+                result = ERROR_INVALID_PARAMETER;
+            }
+        } else {
+            commandArgs.push_back(arg);
+        }
+    }
+
+    if (result == ERROR_SUCCESS && !commandArgs.empty() && kUnavailable.count(commandArgs[0])) {
+        Err() << L"[SC_CLONE] " << commandArgs[0] << L" is not available in serve mode." << std::endl;
+        result = ERROR_INVALID_PARAMETER;
+    } else if (result == ERROR_SUCCESS) {
+        g_outputFormat = requestFormat;
+        result = RunCommand(session, commandArgs);
+        if (result == ERROR_SERVICE_MARKED_FOR_DELETE || result == ERROR_INVALID_HANDLE) {
+            bool single = IsSingleServiceRequest(commandArgs);
+            if (single && result == ERROR_SERVICE_MARKED_FOR_DELETE) {
+                session.Forget(commandArgs[1]);
+            } else {
+                session.Reset();
+            }
+            if (single) {
+                output.str(L"");
+                result = RunCommand(session, commandArgs);
+            }
+        }
+        g_outputFormat = format;
+    }
+    session.Trim();
+
+    t_out = out;
+    t_err = err;
+    return result;
+}
+
+// Serves request frames from one client until it disconnects or sends "exit" (which sets stop).
+// Request:  "<length>\n" followed by length bytes of UTF-8 command line, e.g. "13\nquery Spooler"
+// Response: "<result> <length>\n" followed by length bytes of UTF-8 output
+void ServeChannel(ScmSession& session, FrameChannel& channel, bool& stop) {
+    for (;;) {
+        std::string header;
+        char ch = 0;
+        while (header.size() <= 20 && channel.Read(&ch, 1) && ch != '\n') {
+            header += ch;
+        }
+        if (ch != '\n') {
+            return;  // Disconnected (or a header too long to be one)
+        }
+        if (!header.empty() && header.back() == '\r') {
+            header.pop_back();
+        }
+
+        char* end = nullptr;
+        unsigned long long length = std::strtoull(header.c_str(), &end, 10);
+        std::string response;
+        if (header.empty() || *end || length > kMaxRequestFrame) {
+            response = "Malformed request frame";
+            std::string frame = std::to_string(ERROR_INVALID_PARAMETER) + " " + std::to_string(response.size()) + "\n" + response;
+            channel.Write(frame.data(), frame.size());
+            return;
+        }
+        std::string request(static_cast<size_t>(length), '\0');
+        if (length && !channel.Read(&request[0], request.size())) {
+            return;
+        }
+
+        std::vector<std::wstring> args = SplitCommandLine(Utf8ToWide(request));
+        DWORD result = ERROR_SUCCESS;
+        if (args.size() == 1 && args[0] == L"exit") {
+            stop = true;
+        } else if (!args.empty()) {
+            std::wostringstream output;
+            result = ServeRequest(session, args, output);
+            response = WideToUtf8(output.str());
+        }
+
+        std::string frame = std::to_string(result) + " " + std::to_string(response.size()) + "\n";
+        frame += response;
+        if (!channel.Write(frame.data(), frame.size()) || stop) {
+            return;
+        }
+    }
+}
+
+// Accepts clients on a local pipe one after another, all sharing one session, until one sends "exit"
+DWORD ServePipe(ScmSession& session, const std::wstring& name) {
+    bool stop = false;
+#ifdef _WIN32
+    std::wstring path = name.compare(0, 2, L"\\\\") == 0 ? name : L"\\\\.\\pipe\\" + name;
+    Err() << L"[SC_CLONE] Serving on " << path << std::endl;
+    while (!stop) {
+        HANDLE pipe = CreateNamedPipeW(path.c_str(), PIPE_ACCESS_DUPLEX,
+                                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                       1, 65536, 65536, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            DWORD error = GetLastError();
+            PrintErrorMessage(L"[SC_CLONE] CreateNamedPipe failed with error code: ", error);
+            return error;
+        }
+        if (ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED) {
+            PipeFrameChannel channel(pipe);
+            ServeChannel(session, channel, stop);
+            FlushFileBuffers(pipe);
+            DisconnectNamedPipe(pipe);
+        }
+        CloseHandle(pipe);
+    }
+#else
+    std::string path = WideToUtf8(name);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        Err() << L"[SC_CLONE] Invalid pipe path: " << name << std::endl;
+        return ERROR_INVALID_PARAMETER;
+    }
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    ::unlink(path.c_str());
+    if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(listener, 16) != 0) {
+        DWORD error = static_cast<DWORD>(errno);
+        PrintErrorMessage(L"[SC_CLONE] Unable to listen on " + name + L", error code: ", error);
+        if (listener >= 0) {
+            ::close(listener);
+        }
+        return error;
+    }
+    Err() << L"[SC_CLONE] Serving on " << name << std::endl;
+    while (!stop) {
+        int client = ::accept(listener, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        PipeFrameChannel channel(client);
+        ServeChannel(session, channel, stop);
+        ::close(client);
+    }
+    ::close(listener);
+    ::unlink(path.c_str());
+#endif
+    return ERROR_SUCCESS;
+}
+
+// Parses "serve [--pipe=name] [--cache=N]" and serves requests over one long-lived session
+int ServeCommands(const std::vector<std::wstring>& args) {
+    ServeOptions options;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i].compare(0, 7, L"--pipe=") == 0) {
+            options.pipeName = args[i].substr(7);
+        } else if (args[i].compare(0, 8, L"--cache=") == 0) {
+            options.cacheSize = std::max<size_t>(1, std::wcstoul(args[i].c_str() + 8, nullptr, 10));
+        } else {
+            Err() << L"[SC_CLONE] Usage: sc_clone serve [--pipe=name] [--cache=N]" << std::endl;
+            return 1;
+        }
+    }
+
+    ScmSession session;
+    session.SetCapacity(options.cacheSize);
+    if (!options.pipeName.empty()) {
+        return ServePipe(session, options.pipeName) == ERROR_SUCCESS ? 0 : 1;
+    }
+    StdioFrameChannel channel;
+    bool stop = false;
+    ServeChannel(session, channel, stop);
+    return 0;
+}
+
+// Settings for running one command (or batch) across many machines
+struct FanOutOptions {
+    std::vector<std::wstring> hosts;
+    size_t maxInFlight = 16;
+    DWORD hostTimeoutMs = 30000;
+};
+
+// Reads a --hosts value: a comma-separated list, or "@file" with one host per line
+bool ParseHostList(const std::wstring& spec, std::vector<std::wstring>& hosts) {
+    if (!spec.empty() && spec[0] == L'@') {
+        std::ifstream file{std::filesystem::path(spec.substr(1))};
+        if (!file) {
+            Err() << L"[SC_CLONE] Unable to open host list: " << spec.substr(1) << std::endl;
+            return false;
+        }
+        std::string rawLine;
+        while (std::getline(file, rawLine)) {
+            std::vector<std::wstring> fields = SplitCommandLine(Utf8ToWide(rawLine));
+            if (!fields.empty() && fields[0][0] != L'#') {
+                hosts.push_back(fields[0]);
+            }
+        }
+    } else {
+        std::wstringstream ss(spec);
+        std::wstring host;
+        while (std::getline(ss, host, L',')) {
+            if (!host.empty()) {
+                hosts.push_back(host);
+            }
+        }
+    }
+    return !hosts.empty();
+}
+
+// One host's run: its captured output and outcome
+struct HostRun {
+    std::wstring host;
+    std::wostringstream output;
+    DWORD result = ERROR_SUCCESS;
+    bool done = false;
+    std::chrono::steady_clock::time_point started;
+};
+
+// Shared by the coordinator and the host threads; a thread abandoned after a timeout may outlive the coordinator
+struct FanOutState {
+    std::mutex mutex;
+    std::condition_variable finished;
+    size_t running = 0;  // host threads not yet finished, abandoned ones included
+};
+
+// Runs the command (or the batch script, when args[0] is "batch") against every host with one SCM session per
+// host. A host that does not finish within hostTimeoutMs is reported as TIMEOUT and abandoned, so slow or
+// unreachable machines never hold up the rest. Its thread keeps its slot until the call it is blocked in
+// returns, so at most maxInFlight threads exist at any time, and what it still does is reported as finishing
+// late; a host that has not finished when the run ends may have been partly changed. Each host's output is
+// captured and printed as one block when it finishes.
+int RunOnHosts(const FanOutOptions& options, const std::vector<std::wstring>& args, const std::string& batchScript) {
+    auto state = std::make_shared<FanOutState>();
+    auto fanOutStart = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<HostRun>> inflight;
+    std::vector<std::shared_ptr<HostRun>> abandoned;
+    size_t next = 0;
+    size_t succeeded = 0;
+    size_t failed = 0;
+    size_t timedOut = 0;
+
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (next < options.hosts.size() || !inflight.empty()) {
+        while (state->running < options.maxInFlight && next < options.hosts.size()) {
+            auto run = std::make_shared<HostRun>();
+            run->host = options.hosts[next++];
+            run->started = std::chrono::steady_clock::now();
+            inflight.push_back(run);
+            ++state->running;
+
+            std::thread([state, run, args, batchScript]() {
+                t_out = &run->output;
+                t_err = &run->output;
+                DWORD result = ERROR_SUCCESS;
+                {
+                    ScmSession session(run->host);
+                    if (args[0] == L"batch") {
+                        std::istringstream script(batchScript);
+                        RunBatchStream(session, script, &result);
+                    } else {
+                        result = RunCommand(session, args);
+                    }
+                }
+                std::lock_guard<std::mutex> done(state->mutex);
+                run->result = result;
+                run->done = true;
+                --state->running;
+                state->finished.notify_all();
+            }).detach();
+        }
+
+        auto deadline = std::chrono::steady_clock::time_point::max();
+        for (const auto& run : inflight) {
+            deadline = std::min(deadline, run->started + std::chrono::milliseconds(options.hostTimeoutMs));
+        }
+        // Also wakes when an abandoned thread finishes, which frees its slot
+        auto isDone = [](const std::shared_ptr<HostRun>& run) { return run->done; };
+        state->finished.wait_until(lock, deadline, [&]() {
+            return std::any_of(inflight.begin(), inflight.end(), isDone) || std::any_of(abandoned.begin(), abandoned.end(), isDone);
+        });
+
+        for (auto it = abandoned.begin(); it != abandoned.end();) {
+            HostRun& run = **it;
+            if (!run.done) {
+                ++it;
+                continue;
+            }
+            Out() << L"[SC_CLONE] ==== HOST " << run.host << L": finished after its TIMEOUT, "
+                  << (run.result == ERROR_SUCCESS ? L"SUCCESS" : L"FAILED " + std::to_wstring(run.result))
+                  << L" (" << static_cast<long long>(ElapsedMs(run.started)) << L" ms) ====" << std::endl;
+            Out() << run.output.str();
+            it = abandoned.erase(it);
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        for (auto it = inflight.begin(); it != inflight.end();) {
+            HostRun& run = **it;
+            if (run.done) {
+                Out() << L"[SC_CLONE] ==== HOST " << run.host << L": "
+                      << (run.result == ERROR_SUCCESS ? L"SUCCESS" : L"FAILED " + std::to_wstring(run.result))
+                      << L" (" << static_cast<long long>(ElapsedMs(run.started)) << L" ms) ====" << std::endl;
+                Out() << run.output.str();
+                ++(run.result == ERROR_SUCCESS ? succeeded : failed);
+            } else if (now >= run.started + std::chrono::milliseconds(options.hostTimeoutMs)) {
+                Out() << L"[SC_CLONE] ==== HOST " << run.host << L": TIMEOUT after " << options.hostTimeoutMs
+                      << L" ms, still running; changes may be partly applied ====" << std::endl;
+                abandoned.push_back(*it);
+                ++timedOut;
+            } else {
+                ++it;
+                continue;
+            }
+            it = inflight.erase(it);
+        }
+    }
+    size_t stillRunning = abandoned.size();
+    lock.unlock();
+
+    Out() << L"[SC_CLONE] Hosts: " << options.hosts.size() << L" total, " << succeeded << L" succeeded, "
+          << failed << L" failed, " << timedOut << L" timed out, " << static_cast<long long>(ElapsedMs(fanOutStart))
+          << L" ms" << std::endl;
+    if (stillRunning) {
+        Out() << L"[SC_CLONE] " << stillRunning << L" timed-out hosts were still running at exit and may be partly changed"
+              << std::endl;
+    }
+
+    int exitCode = (failed || timedOut) ? 1 : 0;
+    if (timedOut) {
+        // Abandoned host threads may still be blocked inside an SCM call; leave without running static destructors
+        Out().flush();
+        Err().flush();
+        std::_Exit(exitCode);
+    }
+    return exitCode;
+}
+
+// Stream buffer that discards everything written to it; lets benchmarks time formatting without terminal I/O
+class NullWideBuffer : public std::wstreambuf {
+protected:
+    int_type overflow(int_type ch) override {
+        return traits_type::not_eof(ch);
+    }
+    std::streamsize xsputn(const wchar_t*, std::streamsize count) override {
+        return count;
+    }
+};
+
+// Builds a SYSTEM hive for bench offline: ROOT\Select and ROOT\ControlSet001\Services with count services
+// (every value the offline backend decodes), placed behind a first hive bin of padBytes free space the
+// way a large hive's Services key sits among unrelated data. The padding is left as a sparse hole.
+bool WriteSyntheticHive(const std::wstring& path, size_t count, uint32_t padBytes) {
+    padBytes = (padBytes + 4095) / 4096 * 4096;
+    std::vector<BYTE> bin(32);
+    auto put32 = [&](size_t at, uint32_t value) { std::memcpy(&bin[at], &value, 4); };
+    // Cells are addressed from the first bin, so this one's cells start at padBytes
+    auto alloc = [&](const std::vector<BYTE>& data) {
+        size_t cellSize = (data.size() + 4 + 7) / 8 * 8;
+        uint32_t offset = padBytes + static_cast<uint32_t>(bin.size());
+        bin.resize(bin.size() + cellSize);
+        put32(offset - padBytes, static_cast<uint32_t>(-static_cast<int32_t>(cellSize)));
+        std::copy(data.begin(), data.end(), bin.begin() + (offset - padBytes) + 4);
+        return offset;
+    };
+    auto append = [](std::vector<BYTE>& data, const void* field, size_t size) {
+        data.insert(data.end(), static_cast<const BYTE*>(field), static_cast<const BYTE*>(field) + size);
+    };
+    auto bytes = [&](std::initializer_list<uint32_t> fields) {
+        std::vector<BYTE> data;
+        for (uint32_t field : fields) {
+            append(data, &field, 4);
+        }
+        return data;
+    };
+    auto utf16 = [](const std::vector<std::wstring>& strings, bool multi = false) {
+        std::vector<char16_t> pool;
+        for (const auto& text : strings) {
+            AddSnapshotString(pool, text.c_str());
+            pool.push_back(0);
+        }
+        if (multi) {
+            pool.push_back(0);
+        }
+        const BYTE* raw = reinterpret_cast<const BYTE*>(pool.data());
+        return std::vector<BYTE>(raw, raw + pool.size() * 2);
+    };
+    auto value = [&](const std::string& name, uint32_t type, const std::vector<BYTE>& data) {
+        uint32_t length = static_cast<uint32_t>(data.size());
+        uint32_t dataOffset = 0;
+        if (length <= 4) {
+            std::memcpy(&dataOffset, data.data(), length);
+            length |= 0x80000000;
+        } else {
+            dataOffset = alloc(data);
+        }
+        std::vector<BYTE> vk = {'v', 'k'};
+        uint16_t nameLength = static_cast<uint16_t>(name.size());
+        append(vk, &nameLength, 2);
+        std::vector<BYTE> fields = bytes({length, dataOffset, type, kHiveValueCompressedName});
+        vk.insert(vk.end(), fields.begin(), fields.end());
+        vk.insert(vk.end(), name.begin(), name.end());
+        return alloc(vk);
+    };
+    auto key = [&](const std::string& name, const std::vector<uint32_t>& subkeys, const std::vector<uint32_t>& values) {
+        uint32_t subkeyList = kHiveNoCell;
+        if (!subkeys.empty()) {
+            std::vector<BYTE> lf = {'l', 'f'};
+            uint16_t subkeyCount = static_cast<uint16_t>(subkeys.size());
+            append(lf, &subkeyCount, 2);
+            for (uint32_t subkey : subkeys) {
+                std::vector<BYTE> entry = bytes({subkey, 0});
+                lf.insert(lf.end(), entry.begin(), entry.end());
+            }
+            subkeyList = alloc(lf);
+        }
+        uint32_t valueList = kHiveNoCell;
+        if (!values.empty()) {
+            std::vector<BYTE> list;
+            for (uint32_t v : values) {
+                append(list, &v, 4);
+            }
+            valueList = alloc(list);
+        }
+        std::vector<BYTE> nk = {'n', 'k', kHiveKeyCompressedName, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+        std::vector<BYTE> fields = bytes({0, 0, uint32_t(subkeys.size()), 0, subkeyList, kHiveNoCell, uint32_t(values.size()),
+                                          valueList, kHiveNoCell, kHiveNoCell, 0, 0, 0, 0, 0});
+        nk.insert(nk.end(), fields.begin(), fields.end());
+        uint16_t lengths[2] = {static_cast<uint16_t>(name.size()), 0};
+        append(nk, lengths, 4);
+        nk.insert(nk.end(), name.begin(), name.end());
+        return alloc(nk);
+    };
+
+    std::vector<uint32_t> services;
+    for (size_t i = 1; i <= count; ++i) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "svc%06zu", i);
+        std::wstring wideName = Utf8ToWide(name);
+        bool driver = i % 5 == 0;
+        std::vector<uint32_t> values = {
+            value("Type", REG_DWORD, bytes({uint32_t(driver ? SERVICE_KERNEL_DRIVER : SERVICE_WIN32_OWN_PROCESS)})),
+            value("Start", REG_DWORD, bytes({uint32_t(i % 2 ? SERVICE_DEMAND_START : SERVICE_AUTO_START)})),
+            value("ErrorControl", REG_DWORD, bytes({SERVICE_ERROR_NORMAL})),
+            value("ImagePath", REG_EXPAND_SZ, utf16({driver ? L"System32\\drivers\\" + wideName + L".sys"
+                                                           : L"\"%ProgramFiles%\\Vendor\\" + wideName + L".exe\" -service"})),
+            value("DisplayName", REG_SZ, utf16({L"Synthetic Service " + wideName})),
+            value("Description", REG_SZ, utf16({L"Provides the synthetic " + wideName + L" feature for offline benchmarking."})),
+        };
+        if (!driver) {
+            values.push_back(value("ObjectName", REG_SZ, utf16({i % 3 ? L"LocalSystem" : L"NT AUTHORITY\\LocalService"})));
+            values.push_back(value("FailureActions", REG_BINARY, bytes({86400, 0, 0, 2, 0, SC_ACTION_RESTART, 60000, SC_ACTION_NONE, 0})));
+        }
+        if (i > 1 && i % 7 == 0) {
+            char dependency[32];
+            std::snprintf(dependency, sizeof(dependency), "svc%06zu", i - 1);
+            values.push_back(value("DependOnService", REG_MULTI_SZ, utf16({Utf8ToWide(dependency), L"RpcSs"}, true)));
+        }
+        services.push_back(key(name, {}, values));
+    }
+    uint32_t servicesKey = key("Services", services, {});
+    uint32_t controlSet = key("ControlSet001", {servicesKey}, {});
+    uint32_t select = key("Select", {}, {value("Current", REG_DWORD, bytes({1})), value("Default", REG_DWORD, bytes({1}))});
+    uint32_t root = key("ROOT", {controlSet, select}, {});
+
+    bin.resize((bin.size() + 4095) / 4096 * 4096);
+    std::memcpy(&bin[0], "hbin", 4);
+    put32(4, padBytes);
+    put32(8, static_cast<uint32_t>(bin.size()));
+
+    std::vector<BYTE> baseBlock(kHiveBinsStart);
+    std::memcpy(&baseBlock[0], "regf", 4);
+    std::vector<BYTE> header = bytes({1, 1, 0, 0, 1, 5, 0, 1, root, padBytes + static_cast<uint32_t>(bin.size()), 1});
+    std::copy(header.begin(), header.end(), baseBlock.begin() + 4);
+    uint32_t checksum = 0;
+    for (size_t i = 0; i < 0x1FC; i += 4) {
+        checksum ^= HiveField<uint32_t>(baseBlock.data(), i);
+    }
+    std::memcpy(&baseBlock[0x1FC], &checksum, 4);
+
+    std::ofstream file(std::filesystem::path(path), std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(baseBlock.data()), baseBlock.size());
+    if (padBytes) {
+        // One bin holding a single free cell (positive size) over the whole padding
+        std::vector<BYTE> padHeader = bytes({0x6E696268, 0, padBytes, 0, 0, 0, 0, 0, padBytes - 32});
+        file.write(reinterpret_cast<const char*>(padHeader.data()), padHeader.size());
+        file.seekp(static_cast<std::streamoff>(kHiveBinsStart) + padBytes);
+    }
+    file.write(reinterpret_cast<const char*>(bin.data()), bin.size());
+    return static_cast<bool>(file);
+}
+
+// Builds an .evtx file for bench events: count records in 64 KB chunks, one in every hundred a service event
+// (7045, 7036 and 4697 in turn) among Security logon events. Each chunk defines a template the first time a
+// record uses it and refers back to it afterwards, and names are shared the same way, as the event log
+// service writes them.
+bool WriteSyntheticEventLog(const std::wstring& path, size_t count) {
+    struct TemplateSpec {
+        uint16_t eventId;
+        const wchar_t* provider;
+        std::vector<std::pair<std::wstring, BYTE>> fields;
+    };
+    const BYTE kUInt32 = 0x08;
+    const TemplateSpec specs[] = {
+        {4624, L"Microsoft-Windows-Security-Auditing",
+         {{L"SubjectUserSid", EVTX_VALUE_SID}, {L"TargetUserName", EVTX_VALUE_STRING}, {L"LogonType", kUInt32}, {L"IpAddress", EVTX_VALUE_STRING}}},
+        {7045, L"Service Control Manager",
+         {{L"ServiceName", EVTX_VALUE_STRING}, {L"ImagePath", EVTX_VALUE_STRING}, {L"ServiceType", EVTX_VALUE_STRING},
+          {L"StartType", EVTX_VALUE_STRING}, {L"AccountName", EVTX_VALUE_STRING}}},
+        {7036, L"Service Control Manager",
+         {{L"param1", EVTX_VALUE_STRING}, {L"param2", EVTX_VALUE_STRING}, {L"Binary", EVTX_VALUE_BINARY}}},
+        {4697, L"Microsoft-Windows-Security-Auditing",
+         {{L"SubjectUserSid", EVTX_VALUE_SID}, {L"SubjectUserName", EVTX_VALUE_STRING}, {L"ServiceName", EVTX_VALUE_STRING},
+          {L"ServiceFileName", EVTX_VALUE_STRING}, {L"ServiceType", EVTX_VALUE_HEX32}, {L"ServiceStartType", kUInt32},
+          {L"ServiceAccount", EVTX_VALUE_STRING}}},
+    };
+
+    std::ofstream file(std::filesystem::path(path), std::ios::binary | std::ios::trunc);
+    std::vector<BYTE> chunk(kEvtxChunkSize);
+    size_t pos = kEvtxChunkHeaderSize;
+    std::map<std::wstring, uint32_t> names;
+    uint32_t templates[4] = {};
+    uint64_t firstRecord = 1;
+    uint64_t lastRecordOffset = 0;
+    uint16_t chunkCount = 0;
+
+    auto put = [&](const void* field, size_t size) {
+        std::memcpy(&chunk[pos], field, size);
+        pos += size;
+    };
+    auto put8 = [&](BYTE value) { put(&value, 1); };
+    auto put16 = [&](uint16_t value) { put(&value, 2); };
+    auto put32 = [&](uint32_t value) { put(&value, 4); };
+    auto put64 = [&](uint64_t value) { put(&value, 8); };
+    auto putAt32 = [&](size_t at, uint32_t value) { std::memcpy(&chunk[at], &value, 4); };
+    auto putAt64 = [&](size_t at, uint64_t value) { std::memcpy(&chunk[at], &value, 8); };
+    auto putUtf16 = [&](const std::wstring& text) {
+        for (wchar_t ch : text) {
+            put16(static_cast<uint16_t>(ch));
+        }
+    };
+    // Name offset field, followed by the name itself unless the chunk already holds it
+    auto name = [&](size_t field, const std::wstring& text) {
+        auto it = names.find(text);
+        if (it != names.end()) {
+            putAt32(field, it->second);
+            return;
+        }
+        names[text] = static_cast<uint32_t>(pos);
+        putAt32(field, static_cast<uint32_t>(pos));
+        put32(0);
+        put16(0);
+        put16(static_cast<uint16_t>(text.size()));
+        putUtf16(text);
+        put16(0);
+    };
+    std::vector<size_t> open;
+    auto startElement = [&](const std::wstring& element, bool attributes) {
+        size_t node = pos;
+        put8(attributes ? 0x41 : EVTX_TOKEN_OPEN_START_ELEMENT);
+        put16(0xFFFF);
+        put32(0);
+        put32(0);
+        if (attributes) {
+            put32(0);
+        }
+        name(node + 7, element);
+        open.push_back(node);
+    };
+    auto endElement = [&](BYTE token) {
+        put8(token);
+        putAt32(open.back() + 3, static_cast<uint32_t>(pos - open.back() - 7));
+        open.pop_back();
+    };
+    auto attribute = [&](const std::wstring& attributeName, const std::wstring& value) {
+        size_t node = pos;
+        put8(EVTX_TOKEN_ATTRIBUTE);
+        put32(0);
+        name(node + 1, attributeName);
+        put8(EVTX_TOKEN_VALUE);
+        put8(EVTX_VALUE_STRING);
+        put16(static_cast<uint16_t>(value.size()));
+        putUtf16(value);
+    };
+    auto substitution = [&](uint16_t index, BYTE type) {
+        put8(EVTX_TOKEN_OPTIONAL_SUBSTITUTION);
+        put16(index);
+        put8(type);
+    };
+    auto defineTemplate = [&](const TemplateSpec& spec) {
+        put32(0);
+        for (int i = 0; i < 4; ++i) {
+            put32(0x5C0C0000u + spec.eventId);
+        }
+        size_t sizeField = pos;
+        put32(0);
+        size_t body = pos;
+        put32(0x0001010F);
+        startElement(L"Event", false);
+        put8(EVTX_TOKEN_CLOSE_START_ELEMENT);
+        startElement(L"System", false);
+        put8(EVTX_TOKEN_CLOSE_START_ELEMENT);
+        startElement(L"Provider", true);
+        attribute(L"Name", spec.provider);
+        endElement(EVTX_TOKEN_CLOSE_EMPTY_ELEMENT);
+        startElement(L"EventID", false);
+        put8(EVTX_TOKEN_CLOSE_START_ELEMENT);
+        substitution(0, 0x06);
+        endElement(EVTX_TOKEN_END_ELEMENT);
+        endElement(EVTX_TOKEN_END_ELEMENT);
+        startElement(L"EventData", false);
+        put8(EVTX_TOKEN_CLOSE_START_ELEMENT);
+        for (size_t i = 0; i < spec.fields.size(); ++i) {
+            bool binary = spec.fields[i].first == L"Binary";
+            startElement(binary ? L"Binary" : L"Data", !binary);
+            if (!binary) {
+                attribute(L"Name", spec.fields[i].first);
+            }
+            put8(EVTX_TOKEN_CLOSE_START_ELEMENT);
+            substitution(static_cast<uint16_t>(i + 1), spec.fields[i].second);
+            endElement(EVTX_TOKEN_END_ELEMENT);
+        }
+        endElement(EVTX_TOKEN_END_ELEMENT);
+        endElement(EVTX_TOKEN_END_ELEMENT);
+        put8(EVTX_TOKEN_EOF);
+        putAt32(sizeField, static_cast<uint32_t>(pos - body));
+    };
+    auto flushChunk = [&](uint64_t lastRecord) {
+        std::memcpy(chunk.data(), "ElfChnk", 8);
+        putAt64(8, firstRecord);
+        putAt64(16, lastRecord);
+        putAt64(24, firstRecord);
+        putAt64(32, lastRecord);
+        putAt32(40, 128);
+        putAt32(44, static_cast<uint32_t>(lastRecordOffset));
+        putAt32(48, static_cast<uint32_t>(pos));
+        file.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+        std::fill(chunk.begin(), chunk.end(), 0);
+        pos = kEvtxChunkHeaderSize;
+        names.clear();
+        std::fill(templates, templates + 4, 0);
+        firstRecord = lastRecord + 1;
+        ++chunkCount;
+    };
+
+    std::vector<BYTE> header(kEvtxHeaderSize);
+    file.write(reinterpret_cast<const char*>(header.data()), header.size());
+    const uint64_t kStartTime = 133485408000000000ULL;  // 2024-01-01T00:00:00Z
+    for (size_t i = 0; i < count && chunkCount < 0xFFFF; ++i) {
+        // Records here stay well under 2 KB
+        if (pos + 2048 > kEvtxChunkSize) {
+            flushChunk(i);
+        }
+        size_t kind = i % 100 == 99 ? 1 + (i / 100) % 3 : 0;
+        const TemplateSpec& spec = specs[kind];
+        std::wstring service = L"svc" + std::to_wstring(100000 + (i / 300) % 500).substr(1);
+        std::vector<std::vector<BYTE>> values;
+        auto value = [&](const void* data, size_t size) {
+            values.emplace_back(static_cast<const BYTE*>(data), static_cast<const BYTE*>(data) + size);
+        };
+        auto text = [&](const std::wstring& string) {
+            std::vector<char16_t> pool;
+            AddSnapshotString(pool, string.c_str());
+            value(pool.data(), pool.size() * 2);
+        };
+        const BYTE systemSid[] = {1, 1, 0, 0, 0, 0, 0, 5, 18, 0, 0, 0};
+        uint32_t number = 0;
+        value(&spec.eventId, 2);
+        switch (kind) {
+        case 0:
+            value(systemSid, sizeof(systemSid));
+            text(L"user" + std::to_wstring(i % 37));
+            number = 3;
+            value(&number, 4);
+            text(L"10.0.0." + std::to_wstring(i % 250));
+            break;
+        case 1:
+            text(service);
+            text(L"C:\\Program Files\\Synthetic\\" + service + L".exe -k run");
+            text(L"user mode service");
+            text(L"auto start");
+            text(L"LocalSystem");
+            break;
+        case 2:
+            text(L"Synthetic service " + service.substr(3));
+            text((i / 150000) % 2 ? L"stopped" : L"running");
+            text(service + ((i / 150000) % 2 ? L"/1" : L"/4"));
+            break;
+        default:
+            value(systemSid, sizeof(systemSid));
+            text(L"SYSTEM");
+            text(service);
+            text(L"C:\\Program Files\\Synthetic\\" + service + L".exe -k run");
+            number = SERVICE_WIN32_OWN_PROCESS;
+            value(&number, 4);
+            number = SERVICE_AUTO_START;
+            value(&number, 4);
+            text(L"LocalSystem");
+            break;
+        }
+
+        size_t record = pos;
+        lastRecordOffset = record;
+        put32(0x00002A2A);
+        put32(0);
+        put64(i + 1);
+        put64(kStartTime + i * 10000000ULL);
+        put32(0x0001010F);
+        size_t instance = pos;
+        put8(EVTX_TOKEN_TEMPLATE_INSTANCE);
+        put8(1);
+        put32(0x5C0C0000u + spec.eventId);
+        put32(0);
+        if (templates[kind] == 0) {
+            templates[kind] = static_cast<uint32_t>(pos);
+            defineTemplate(spec);
+        }
+        putAt32(instance + 6, templates[kind]);
+        put32(static_cast<uint32_t>(values.size()));
+        for (size_t v = 0; v < values.size(); ++v) {
+            put16(static_cast<uint16_t>(values[v].size()));
+            put8(v == 0 ? 0x06 : spec.fields[v - 1].second);
+            put8(0);
+        }
+        for (const auto& data : values) {
+            put(data.data(), data.size());
+        }
+        putAt32(record + 4, static_cast<uint32_t>(pos + 4 - record));
+        put32(static_cast<uint32_t>(pos + 4 - record));
+    }
+    if (pos > kEvtxChunkHeaderSize) {
+        flushChunk(count);
+    }
+
+    std::memcpy(header.data(), "ElfFile", 8);
+    uint64_t lastChunk = chunkCount ? chunkCount - 1 : 0;
+    uint64_t nextRecord = count + 1;
+    uint32_t headerSize = 128;
+    uint16_t versions[4] = {1, 3, static_cast<uint16_t>(kEvtxHeaderSize), chunkCount};
+    std::memcpy(&header[16], &lastChunk, 8);
+    std::memcpy(&header[24], &nextRecord, 8);
+    std::memcpy(&header[32], &headerSize, 4);
+    std::memcpy(&header[36], versions, 8);
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(header.data()), header.size());
+    return static_cast<bool>(file);
+}
+
+// Builds a chunk for bench events whose records point outside it: a template definition offset that wraps
+// past 4 GB back into the chunk header, a template length running past the chunk end and an element name
+// offset near 4 GB. Each has to be rejected without reading out of bounds.
+std::vector<BYTE> MalformedEventChunk() {
+    std::vector<BYTE> chunk(kEvtxChunkSize);
+    auto putAt32 = [&](size_t at, uint32_t value) { std::memcpy(&chunk[at], &value, 4); };
+    const size_t kRecordSize = 128;
+    const size_t kRecords = 3;
+    std::memcpy(chunk.data(), "ElfChnk", 8);
+    putAt32(48, static_cast<uint32_t>(kEvtxChunkHeaderSize + kRecords * kRecordSize));
+    for (size_t i = 0; i < kRecords; ++i) {
+        size_t record = kEvtxChunkHeaderSize + i * kRecordSize;
+        size_t instance = record + 24;
+        size_t definition = instance + 10;
+        std::memcpy(&chunk[record], "**\0\0", 4);
+        putAt32(record + 4, kRecordSize);
+        putAt32(record + kRecordSize - 4, kRecordSize);
+        chunk[instance] = EVTX_TOKEN_TEMPLATE_INSTANCE;
+        putAt32(instance + 6, static_cast<uint32_t>(definition));
+        switch (i) {
+        case 0:
+            // definition + 20 wraps to offset 12, whose length would carry the values offset to 0xFFFFFFFE
+            putAt32(instance + 6, 0xFFFFFFF8);
+            putAt32(12, 0xFFFFFFEE);
+            break;
+        case 1:
+            putAt32(definition + 20, 0xFFFFFFF0);
+            break;
+        default:
+            putAt32(definition + 20, 16);
+            chunk[definition + 24] = EVTX_TOKEN_OPEN_START_ELEMENT;
+            putAt32(definition + 24 + 7, 0xFFFFFFF9);
+            break;
+        }
+    }
+    return chunk;
+}
+
+// Benchmarks against a freshly generated in-memory SCM (never the real one):
+//   bench enum [count]   - streaming enumeration of count services (default 100000)
+//   bench deps [count]   - serial vs parallel start/stop of a layered dependency stack (default 40)
+//   bench wait [count]   - time-to-state detection lag, notifications vs polling (default 10 cycles)
+//   bench snapshot [count] - snapshot and diff of count services with 1% changed (default 20000)
+//   bench config [count] - full configuration reads of count services, first and repeat pass (default 20000)
+//   bench handlers [count] - each command handler once on each of count services, p50/p99 per handler (default 2000)
+//   bench serve [count]  - query requests on a fresh session each vs one served session (default 20000)
+//   bench apply [count]  - applying a matching manifest vs reading the same services, then 1% edited (default 5000)
+//   bench select [count] - glob and regex selectors over count names and display names (default 50000)
+//   bench offline [count] - opening and reading a synthetic SYSTEM hive of count services behind 1 GB of other data (default 1000)
+//   bench events [count] - parsing a synthetic .evtx of count records, one thread vs all cores (default 2000000),
+//                          then a chunk of out-of-bounds offsets that must yield no events
+//   bench verify [count] - hashing the binaries of count services sharing count / 3 files, then rescanning from the cache (default 600)
+//   bench statuscache [count] - status cache lookups by 1, 4 and 16 readers while the table is refreshed (default 1000)
+//   bench replay [count] - recording a start/stop flow of count services, then replaying it at 1x, 10x, 100x and max (default 20)
+//   bench search [count] - building and updating the search index of count services, then query latency (default 20000)
+//   bench start [count] - a bulk start of count services on a simulated 4-core host, all at once, capped and adaptive (default 32)
+int RunBenchmark(const std::vector<std::wstring>& args) {
+    std::wstring name = args.size() > 1 ? args[1] : L"";
+    size_t count = args.size() > 2 ? static_cast<size_t>(std::wcstoull(args[2].c_str(), nullptr, 10)) : 100000;
+
+    if (name == L"enum") {
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        memory->AddSyntheticServices(count);
+        g_scmBackend = std::move(memory);
+
+        ScmSession session;
+        auto start = std::chrono::steady_clock::now();
+        size_t seen = 0;
+        ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW&) {
+            ++seen;
+            return true;
+        });
+        double enumerateMs = ElapsedMs(start);
+
+        // Same pass with full formatting in each output format, written to a discarding stream
+        const OutputFormat formats[] = {OutputFormat::Text, OutputFormat::Json, OutputFormat::Csv, OutputFormat::Table};
+        const wchar_t* const formatNames[] = {L"TEXT ", L"JSON ", L"CSV  ", L"TABLE"};
+        double formatMs[4] = {};
+        NullWideBuffer nullBuffer;
+        std::wstreambuf* original = std::wcout.rdbuf(&nullBuffer);
+        for (int i = 0; i < 4; ++i) {
+            g_outputFormat = formats[i];
+            start = std::chrono::steady_clock::now();
+            EnumerateServices(session, {L"queryex", L"type=", L"all", L"state=", L"all"}, 1, true);
+            formatMs[i] = ElapsedMs(start);
+        }
+        g_outputFormat = OutputFormat::Text;
+        std::wcout.rdbuf(original);
+
+        Out() << L"[SC_CLONE] bench enum: " << seen << L" services" << std::endl;
+        Out() << L"        ENUMERATE          : " << enumerateMs << L" ms" << std::endl;
+        for (int i = 0; i < 4; ++i) {
+            Out() << L"        +FORMAT " << formatNames[i] << L"      : " << formatMs[i] << L" ms" << std::endl;
+        }
+        return 0;
+    }
+
+    if (name == L"deps") {
+        // A layered stack: each service depends on two services of the layer below, 100 ms per transition
+        if (args.size() <= 2) {
+            count = 40;
+        }
+        const size_t width = 8;
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        std::vector<std::wstring> names;
+        for (size_t i = 0; i < count; ++i) {
+            MemoryService service;
+            service.name = L"stack" + std::to_wstring(i);
+            service.binaryPath = L"C:\\stack\\" + service.name + L".exe";
+            service.startDelayMs = service.stopDelayMs = 100;
+            if (i >= width) {
+                size_t below = (i / width - 1) * width;
+                service.dependencies.push_back(L"stack" + std::to_wstring(below + i % width));
+                service.dependencies.push_back(L"stack" + std::to_wstring(below + (i + 1) % width));
+            }
+            memory->AddService(service);
+            names.push_back(service.name);
+        }
+        g_scmBackend = std::move(memory);
+
+        NullWideBuffer nullBuffer;
+        double timings[2][2] = {};
+        const size_t workerCounts[2] = {1, 8};
+        for (int run = 0; run < 2; ++run) {
+            TransitionOptions options;
+            options.workers = workerCounts[run];
+            ScmSession session;
+            std::wstreambuf* original = std::wcout.rdbuf(&nullBuffer);
+            auto start = std::chrono::steady_clock::now();
+            TransitionServices(session, names, true, options);
+            timings[run][0] = ElapsedMs(start);
+            start = std::chrono::steady_clock::now();
+            TransitionServices(session, names, false, options);
+            timings[run][1] = ElapsedMs(start);
+            std::wcout.rdbuf(original);
+        }
+
+        Out() << L"[SC_CLONE] bench deps: " << count << L" services, 100 ms per transition" << std::endl;
+        Out() << L"        START  serial      : " << timings[0][0] << L" ms" << std::endl;
+        Out() << L"        START  8 workers   : " << timings[1][0] << L" ms" << std::endl;
+        Out() << L"        STOP   serial      : " << timings[0][1] << L" ms" << std::endl;
+        Out() << L"        STOP   8 workers   : " << timings[1][1] << L" ms" << std::endl;
+        return 0;
+    }
+
+    if (name == L"wait") {
+        // Start/stop a service with a 250 ms transition and measure how late each waiter notices the new state
+        if (args.size() <= 2) {
+            count = 10;
+        }
+        const DWORD delayMs = 250;
+        double lag[2] = {};
+        for (int mode = 0; mode < 2; ++mode) {
+            std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+            MemoryService service;
+            service.name = L"WaitBench";
+            service.binaryPath = L"C:\\bench\\wait.exe";
+            service.startDelayMs = service.stopDelayMs = delayMs;
+            memory->AddService(service);
+            memory->SetNotificationsEnabled(mode == 0);
+            g_scmBackend = std::move(memory);
+
+            ScmSession session;
+            for (size_t i = 0; i < count; ++i) {
+                for (bool starting : {true, false}) {
+                    SC_HANDLE hService = session.Service(L"WaitBench", SERVICE_START | SERVICE_STOP | SERVICE_QUERY_STATUS);
+                    SERVICE_STATUS status;
+                    auto start = std::chrono::steady_clock::now();
+                    if (starting) {
+                        Scm().StartServiceW(hService, 0, NULL);
+                    } else {
+                        Scm().ControlService(hService, SERVICE_CONTROL_STOP, &status);
+                    }
+                    WaitForServiceState(session, L"WaitBench", starting ? SERVICE_RUNNING : SERVICE_STOPPED, 10000);
+                    lag[mode] += ElapsedMs(start) - delayMs;
+                }
+            }
+        }
+
+        Out() << L"[SC_CLONE] bench wait: " << count * 2 << L" transitions of " << delayMs << L" ms" << std::endl;
+        Out() << L"        NOTIFICATION LAG   : " << lag[0] / (count * 2) << L" ms average" << std::endl;
+        Out() << L"        POLLING LAG        : " << lag[1] / (count * 2) << L" ms average" << std::endl;
+        return 0;
+    }
+
+    if (name == L"snapshot") {
+        // Snapshot count services, change 1% of them (reconfigure, create, delete), snapshot again and diff
+        if (args.size() <= 2) {
+            count = 20000;
+        }
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        memory->AddSyntheticServices(count);
+        g_scmBackend = std::move(memory);
+
+        std::filesystem::path directory = std::filesystem::temp_directory_path();
+        std::wstring beforePath = (directory / "sc_clone_bench_before.snap").wstring();
+        std::wstring afterPath = (directory / "sc_clone_bench_after.snap").wstring();
+        NullWideBuffer nullBuffer;
+        std::wstreambuf* original = std::wcout.rdbuf(&nullBuffer);
+
+        ScmSession session;
+        auto start = std::chrono::steady_clock::now();
+        SnapshotServices(session, beforePath);
+        double snapshotMs = ElapsedMs(start);
+
+        SC_HANDLE hSCManager = session.Manager(SC_MANAGER_CONNECT | SC_MANAGER_CREATE_SERVICE);
+        for (size_t i = 1; i <= count; i += 100) {
+            wchar_t serviceName[32];
+            std::swprintf(serviceName, 32, L"svc%06zu", i);
+            SC_HANDLE hService = Scm().OpenServiceW(hSCManager, serviceName, SERVICE_CHANGE_CONFIG | DELETE);
+            if (i % 200 == 1) {
+                Scm().ChangeServiceConfigW(hService, SERVICE_NO_CHANGE, SERVICE_NO_CHANGE, SERVICE_NO_CHANGE,
+                                           L"C:\\Users\\Public\\changed.exe", NULL, NULL, NULL, NULL, NULL, NULL);
+            } else {
+                Scm().DeleteService(hService);
+                std::wstring added = std::wstring(L"added") + serviceName;
+                SC_HANDLE hAdded = Scm().CreateServiceW(hSCManager, added.c_str(), added.c_str(), SERVICE_QUERY_CONFIG,
+                                                        SERVICE_WIN32_OWN_PROCESS, SERVICE_AUTO_START, SERVICE_ERROR_NORMAL,
+                                                        L"C:\\Users\\Public\\added.exe", NULL, NULL, NULL, NULL, NULL);
+                Scm().CloseServiceHandle(hAdded);
+            }
+            Scm().CloseServiceHandle(hService);
+        }
+        SnapshotServices(session, afterPath);
+
+        start = std::chrono::steady_clock::now();
+        DiffSnapshots(beforePath, afterPath);
+        double diffMs = ElapsedMs(start);
+        std::wcout.rdbuf(original);
+
+        Out() << L"[SC_CLONE] bench snapshot: " << count << L" services, 1% changed" << std::endl;
+        Out() << L"        SNAPSHOT           : " << snapshotMs << L" ms (" << std::filesystem::file_size(beforePath) << L" bytes)" << std::endl;
+        Out() << L"        DIFF               : " << diffMs << L" ms" << std::endl;
+        std::filesystem::remove(beforePath);
+        std::filesystem::remove(afterPath);
+        return 0;
+    }
+
+    if (name == L"config") {
+        // Read every part of count services twice; one in ten has a description longer than the default size hint
+        if (args.size() <= 2) {
+            count = 20000;
+        }
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        std::vector<std::wstring> names;
+        for (size_t i = 0; i < count; ++i) {
+            MemoryService service;
+            service.name = L"cfg" + std::to_wstring(i);
+            service.binaryPath = L"C:\\bench\\" + service.name + L".exe";
+            service.description = std::wstring(i % 10 == 0 ? 2000 : 40, L'd');
+            service.resetPeriod = 86400;
+            service.failureActions.push_back(SC_ACTION{SC_ACTION_RESTART, 5000});
+            memory->AddService(service);
+            names.push_back(service.name);
+        }
+        g_scmBackend = std::move(memory);
+
+        ScmSession session;
+        SC_HANDLE hSCManager = session.Manager(SC_MANAGER_CONNECT);
+        std::vector<SC_HANDLE> handles;
+        for (const auto& serviceName : names) {
+            handles.push_back(Scm().OpenServiceW(hSCManager, serviceName.c_str(), SERVICE_QUERY_CONFIG));
+        }
+
+        ServiceConfigReader reader;
+        double passMs[2] = {};
+        size_t passTrips[2] = {};
+        for (int pass = 0; pass < 2; ++pass) {
+            size_t before = reader.RoundTrips();
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < count; ++i) {
+                ServiceConfig config;
+                reader.Read(handles[i], names[i], CONFIG_PART_ALL, config);
+            }
+            passMs[pass] = ElapsedMs(start);
+            passTrips[pass] = reader.RoundTrips() - before;
+        }
+        for (SC_HANDLE hService : handles) {
+            Scm().CloseServiceHandle(hService);
+        }
+
+        Out() << L"[SC_CLONE] bench config: " << count << L" services, 4 parts each" << std::endl;
+        Out() << L"        FIRST PASS         : " << passMs[0] << L" ms, " << passTrips[0] << L" API calls" << std::endl;
+        Out() << L"        REPEAT PASS        : " << passMs[1] << L" ms, " << passTrips[1] << L" API calls" << std::endl;
+        Out() << L"        SIZE-THEN-FETCH    : " << count * 8 << L" API calls" << std::endl;
+        return 0;
+    }
+
+    if (name == L"handlers") {
+        // Every single-service handler run count times (default 2000) over one session, each on its own service,
+        // timed per call with the SCM traffic it causes
+        if (args.size() <= 2) {
+            count = 2000;
+        }
+        TimingRecorder apiTimings;
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        memory->AddSyntheticServices(1000);
+        g_scmBackend.reset(new TimingScmBackend(std::move(memory), apiTimings));
+
+        struct HandlerStep {
+            const wchar_t* label;
+            std::vector<std::wstring> args;  // args[1] is replaced with the service name
+        };
+        const HandlerStep steps[] = {
+            {L"create", {L"create", L"", L"C:\\bench\\handler.exe"}},
+            {L"query", {L"query", L""}},
+            {L"queryex", {L"queryex", L""}},
+            {L"qdescription", {L"qdescription", L""}},
+            {L"config", {L"config", L""}},
+            {L"config manual", {L"config", L"", L"manual"}},
+            {L"failure set", {L"failure", L"", L"reset=", L"86400", L"actions=", L"restart/5000"}},
+            {L"failure", {L"failure", L""}},
+            {L"start", {L"start", L""}},
+            {L"stop", {L"stop", L""}},
+            {L"delete", {L"delete", L""}},
+        };
+        const size_t stepCount = sizeof(steps) / sizeof(steps[0]);
+        std::vector<std::vector<double>> samples(stepCount);
+        std::vector<size_t> failures(stepCount);
+
+        NullWideBuffer nullBuffer;
+        std::wstreambuf* original = std::wcout.rdbuf(&nullBuffer);
+        std::wstreambuf* originalErr = std::wcerr.rdbuf(&nullBuffer);
+        ScmSession session;
+        for (size_t i = 0; i < count; ++i) {
+            wchar_t serviceName[32];
+            std::swprintf(serviceName, 32, L"handler%06zu", i);
+            for (size_t s = 0; s < stepCount; ++s) {
+                std::vector<std::wstring> commandArgs = steps[s].args;
+                commandArgs[1] = serviceName;
+                auto start = std::chrono::steady_clock::now();
+                DWORD result = RunCommand(session, commandArgs);
+                samples[s].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+                failures[s] += result != ERROR_SUCCESS;
+            }
+        }
+        std::wcout.rdbuf(original);
+        std::wcerr.rdbuf(originalErr);
+
+        Out() << L"[SC_CLONE] bench handlers: " << count << L" services, every handler once per service" << std::endl;
+        wchar_t line[160];
+        std::swprintf(line, 160, L"        %-20ls %10ls %10ls %10ls %8ls", L"HANDLER", L"P50 us", L"P99 us", L"OPS/S", L"FAILED");
+        Out() << line << std::endl;
+        for (size_t s = 0; s < stepCount; ++s) {
+            std::vector<double>& values = samples[s];
+            double total = 0;
+            for (double value : values) {
+                total += value;
+            }
+            std::sort(values.begin(), values.end());
+            std::swprintf(line, 160, L"        %-20ls %10.1f %10.1f %10.0f %8zu", steps[s].label, TimingRecorder::Percentile(values, 0.50),
+                          TimingRecorder::Percentile(values, 0.99), total > 0 ? values.size() * 1e6 / total : 0.0, failures[s]);
+            Out() << line << std::endl;
+        }
+        apiTimings.Print(Out());
+        return 0;
+    }
+
+    if (name == L"serve") {
+        // count query requests answered by a fresh session each (what one process per request costs in SCM
+        // traffic) and by one served session reading request frames
+        if (args.size() <= 2) {
+            count = 20000;
+        }
+        TimingRecorder apiTimings;
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        memory->AddSyntheticServices(1000);
+        g_scmBackend.reset(new TimingScmBackend(std::move(memory), apiTimings));
+
+        std::vector<std::wstring> requests;
+        std::string frames;
+        for (size_t i = 0; i < count; ++i) {
+            wchar_t request[48];
+            std::swprintf(request, 48, L"query svc%06zu", i % 50 + 1);
+            requests.push_back(request);
+            std::string utf8 = WideToUtf8(request);
+            frames += std::to_string(utf8.size()) + "\n" + utf8;
+        }
+        frames += "4\nexit";
+
+        // Serves frames from memory, discarding the responses
+        class MemoryFrameChannel : public FrameChannel {
+        public:
+            explicit MemoryFrameChannel(const std::string& input) : input(input) {}
+            bool Read(char* data, size_t length) override {
+                if (input.size() - position < length) {
+                    return false;
+                }
+                std::memcpy(data, input.data() + position, length);
+                position += length;
+                return true;
+            }
+            bool Write(const char*, size_t) override {
+                return true;
+            }
+
+        private:
+            const std::string& input;
+            size_t position = 0;
+        };
+
+        NullWideBuffer nullBuffer;
+        std::wstreambuf* original = std::wcout.rdbuf(&nullBuffer);
+        double ms[2] = {};
+        size_t calls[2] = {};
+        auto countCalls = [&] {
+            size_t total = 0;
+            for (const wchar_t* api : {L"OpenSCManagerW", L"OpenServiceW", L"QueryServiceStatusEx", L"CloseServiceHandle"}) {
+                total += apiTimings.Count(api);
+            }
+            return total;
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& request : requests) {
+            ScmSession session;
+            RunCommand(session, SplitCommandLine(request));
+        }
+        ms[0] = ElapsedMs(start);
+        calls[0] = countCalls();
+
+        apiTimings.Clear();
+        start = std::chrono::steady_clock::now();
+        {
+            ScmSession session;
+            session.SetCapacity(64);
+            MemoryFrameChannel channel(frames);
+            bool stop = false;
+            ServeChannel(session, channel, stop);
+        }
+        ms[1] = ElapsedMs(start);
+        calls[1] = countCalls();
+        std::wcout.rdbuf(original);
+
+        Out() << L"[SC_CLONE] bench serve: " << count << L" query requests over 50 services" << std::endl;
+        Out() << L"        FRESH SESSION      : " << ms[0] * 1000 / count << L" us, " << double(calls[0]) / count << L" API calls per request" << std::endl;
+        Out() << L"        SERVED             : " << ms[1] * 1000 / count << L" us, " << double(calls[1]) / count << L" API calls per request" << std::endl;
+        return 0;
+    }
+
+    if (name == L"apply") {
+        // A manifest of count services (default 5000) that matches the SCM, applied against a plain parallel read
+        // of the same fields, then again with 1% of the services edited
+        if (args.size() <= 2) {
+            count = 5000;
+        }
+        TimingRecorder apiTimings;
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        std::filesystem::path directory = std::filesystem::temp_directory_path();
+        std::wstring manifestPath = (directory / "sc_clone_bench.manifest").wstring();
+        std::wstring editedPath = (directory / "sc_clone_bench_edited.manifest").wstring();
+        std::vector<std::wstring> names;
+        {
+            std::ofstream manifest{std::filesystem::path(manifestPath)};
+            std::ofstream edited{std::filesystem::path(editedPath)};
+            for (size_t i = 0; i < count; ++i) {
+                MemoryService service;
+                service.name = L"app" + std::to_wstring(i);
+                service.binaryPath = L"C:\\bench\\" + service.name + L".exe";
+                service.startType = SERVICE_AUTO_START;
+                service.description = L"Benchmark service " + std::to_wstring(i);
+                service.resetPeriod = 86400;
+                service.failureActions.push_back(SC_ACTION{SC_ACTION_RESTART, 5000});
+                memory->AddService(service);
+                names.push_back(service.name);
+
+                std::string line = WideToUtf8(service.name) + " path=\"" + WideToUtf8(service.binaryPath) +
+                                   "\" start=auto error=normal description=\"" + WideToUtf8(service.description) +
+                                   "\" reset=86400 actions=restart/5000";
+                manifest << line << "\n";
+                edited << line << (i % 100 == 0 ? " start=demand" : "") << "\n";
+            }
+        }
+        g_scmBackend.reset(new TimingScmBackend(std::move(memory), apiTimings));
+
+        NullWideBuffer nullBuffer;
+        std::wstreambuf* original = std::wcout.rdbuf(&nullBuffer);
+        auto calls = [&](std::initializer_list<const wchar_t*> apis) {
+            size_t total = 0;
+            for (const wchar_t* api : apis) {
+                total += apiTimings.Count(api);
+            }
+            return total;
+        };
+        double ms[3] = {};
+        size_t reads[3] = {};
+        size_t writes[3] = {};
+
+        ScmSession session;
+        auto start = std::chrono::steady_clock::now();
+        ParallelFor(names.size(), 8, [&](size_t i) {
+            ServiceConfig config;
+            SC_HANDLE hService = session.Service(names[i], SERVICE_QUERY_CONFIG);
+            ConfigReader().Read(hService, names[i], CONFIG_PART_BASE | CONFIG_PART_DESCRIPTION | CONFIG_PART_FAILURE_ACTIONS, config);
+        });
+        ms[0] = ElapsedMs(start);
+        reads[0] = calls({L"QueryServiceConfigW", L"QueryServiceConfig2W"});
+
+        const std::wstring* manifests[2] = {&manifestPath, &editedPath};
+        for (int run = 1; run < 3; ++run) {
+            apiTimings.Clear();
+            start = std::chrono::steady_clock::now();
+            ApplyManifest(session, {L"apply", *manifests[run - 1]});
+            ms[run] = ElapsedMs(start);
+            reads[run] = calls({L"QueryServiceConfigW", L"QueryServiceConfig2W"});
+            writes[run] = calls({L"ChangeServiceConfigW", L"ChangeServiceConfig2W"});
+        }
+        std::wcout.rdbuf(original);
+
+        Out() << L"[SC_CLONE] bench apply: " << count << L" services, 8 workers" << std::endl;
+        Out() << L"        READ ONLY          : " << ms[0] << L" ms, " << reads[0] << L" reads" << std::endl;
+        Out() << L"        APPLY UNCHANGED    : " << ms[1] << L" ms (incl. manifest parse), " << reads[1] << L" reads, " << writes[1] << L" writes" << std::endl;
+        Out() << L"        APPLY 1% CHANGED   : " << ms[2] << L" ms (incl. manifest parse), " << reads[2] << L" reads, " << writes[2] << L" writes" << std::endl;
+        std::filesystem::remove(manifestPath);
+        std::filesystem::remove(editedPath);
+        return 0;
+    }
+
+    if (name == L"select") {
+        // Compiled selectors over a synthetic list of count names with display names (default 50000), then
+        // resolved end to end against an in-memory SCM of the same size
+        if (args.size() <= 2) {
+            count = 50000;
+        }
+        // Packed into one pool, as EnumServicesStatusExW packs them into its buffer
+        const wchar_t* const families[] = {L"worker-%05zu", L"svc%06zu", L"MSSQL$INST%04zu", L"wuauserv%zu", L"Intel-Driver-%zu"};
+        std::wstring pool;
+        std::vector<size_t> offsets;
+        for (size_t i = 0; i < count; ++i) {
+            wchar_t serviceName[48];
+            std::swprintf(serviceName, 48, families[i % 5], i);
+            offsets.push_back(pool.size());
+            pool += serviceName;
+            pool += L'\0';
+            offsets.push_back(pool.size());
+            pool += std::wstring(L"Synthetic ") + (i % 7 == 0 ? L"SQL " : L"") + L"Service " + serviceName;
+            pool += L'\0';
+        }
+
+        const wchar_t* const selectorTexts[] = {L"worker-*", L"*sql*", L"SVC0?00*", L"*-driver-*9", L"/^worker-0+1/", L"/^worker-0+1|sql/"};
+        Out() << L"[SC_CLONE] bench select: " << count << L" names" << std::endl;
+        for (const wchar_t* text : selectorTexts) {
+            ServiceSelector selector;
+            selector.Compile(text);
+            size_t matched[2] = {};
+            double best[2] = {};
+            for (int withDisplay = 0; withDisplay < 2; ++withDisplay) {
+                for (int run = 0; run < 5; ++run) {
+                    size_t hits = 0;
+                    auto start = std::chrono::steady_clock::now();
+                    for (size_t i = 0; i < count; ++i) {
+                        hits += selector.Matches(&pool[offsets[2 * i]], withDisplay ? &pool[offsets[2 * i + 1]] : nullptr);
+                    }
+                    double ms = ElapsedMs(start);
+                    best[withDisplay] = run == 0 ? ms : std::min(best[withDisplay], ms);
+                    matched[withDisplay] = hits;
+                }
+            }
+            wchar_t line[160];
+            std::swprintf(line, 160, L"        %-18ls : names %7.3f ms (%zu matches), +display names %7.3f ms (%zu matches)",
+                          text, best[0], matched[0], best[1], matched[1]);
+            Out() << line << std::endl;
+
+            // A regex prefilter may only skip names the regex itself rejects
+            if (text[0] == L'/') {
+                std::wstring pattern(text + 1, std::wcslen(text) - 2);
+                std::wregex plain(pattern, std::regex_constants::ECMAScript | std::regex_constants::icase);
+                size_t expected = 0;
+                for (size_t i = 0; i < count; ++i) {
+                    expected += std::regex_search(&pool[offsets[2 * i]], plain);
+                }
+                if (expected != matched[0]) {
+                    Err() << L"[SC_CLONE] bench select: " << text << L" matched " << matched[0] << L" names, std::regex "
+                          << expected << std::endl;
+                    return ERROR_INVALID_DATA;
+                }
+            }
+        }
+
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        memory->AddSyntheticServices(count);
+        g_scmBackend = std::move(memory);
+        ScmSession session;
+        auto start = std::chrono::steady_clock::now();
+        ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [](const ENUM_SERVICE_STATUS_PROCESSW&) { return true; });
+        double enumerateMs = ElapsedMs(start);
+        std::vector<std::wstring> expanded;
+        start = std::chrono::steady_clock::now();
+        ExpandServiceSelectors(session, {L"svc00*1", L"/^svc0+42/"}, expanded);
+        Out() << L"        RESOLVE 2 SELECTORS: " << ElapsedMs(start) << L" ms, " << expanded.size() << L" services (enumeration alone: "
+              << enumerateMs << L" ms)" << std::endl;
+        return 0;
+    }
+
+    if (name == L"offline") {
+        if (args.size() <= 2) {
+            count = 1000;
+        }
+        const uint32_t padBytes = 1024u * 1024 * 1024;
+        std::wstring path = (std::filesystem::temp_directory_path() / "sc_clone_bench_SYSTEM").wstring();
+        if (!WriteSyntheticHive(path, count, padBytes)) {
+            Err() << L"[SC_CLONE] Unable to write " << path << std::endl;
+            return 1;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        std::unique_ptr<OfflineHiveBackend> offline(new OfflineHiveBackend());
+        DWORD error = offline->Open(path);
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] Unable to read the synthetic hive, error code: ", error);
+            std::filesystem::remove(path);
+            return 1;
+        }
+        double openMs = ElapsedMs(start);
+        g_scmBackend = std::move(offline);
+
+        ScmSession session;
+        std::vector<std::wstring> names;
+        start = std::chrono::steady_clock::now();
+        ForEachService(session, SERVICE_WIN32 | SERVICE_DRIVER, SERVICE_STATE_ALL, [&](const ENUM_SERVICE_STATUS_PROCESSW& entry) {
+            names.push_back(entry.lpServiceName);
+            return true;
+        });
+        double enumerateMs = ElapsedMs(start);
+
+        // Everything qdescription, config and failure print, for every service
+        start = std::chrono::steady_clock::now();
+        for (const auto& serviceName : names) {
+            ServiceConfig config;
+            ConfigReader().Read(session.Service(serviceName, SERVICE_QUERY_CONFIG), serviceName, CONFIG_PART_ALL, config);
+        }
+        double readMs = ElapsedMs(start);
+        std::filesystem::remove(path);
+
+        Out() << L"[SC_CLONE] bench offline: " << names.size() << L" services behind " << padBytes / (1024 * 1024)
+              << L" MB of other hive data" << std::endl;
+        Out() << L"        OPEN + INDEX       : " << openMs << L" ms" << std::endl;
+        Out() << L"        ENUMERATE          : " << enumerateMs << L" ms" << std::endl;
+        Out() << L"        READ ALL CONFIG    : " << readMs << L" ms" << std::endl;
+        return 0;
+    }
+
+    if (name == L"events") {
+        if (args.size() <= 2) {
+            count = 2000000;
+        }
+        std::wstring path = (std::filesystem::temp_directory_path() / "sc_clone_bench.evtx").wstring();
+        if (!WriteSyntheticEventLog(path, count)) {
+            Err() << L"[SC_CLONE] Unable to write " << path << std::endl;
+            return 1;
+        }
+        double megabytes = static_cast<double>(std::filesystem::file_size(std::filesystem::path(path))) / (1024 * 1024);
+
+        // Service names come from the events themselves; the in-memory SCM is left empty
+        g_scmBackend.reset(new MemoryScmBackend());
+        ScmSession session;
+        NullWideBuffer nullBuffer;
+        std::wstreambuf* originalOut = std::wcout.rdbuf(&nullBuffer);
+        std::wstreambuf* originalErr = std::wcerr.rdbuf(&nullBuffer);
+        // At least two workers, so that a single-core machine still times the parallel path against the serial one
+        size_t threads = std::max<size_t>(2, std::thread::hardware_concurrency());
+        double timings[2] = {};
+        const size_t workerCounts[2] = {1, threads};
+        for (int run = 0; run < 2; ++run) {
+            auto start = std::chrono::steady_clock::now();
+            ReadServiceEvents(session, {L"events", path, L"--parallel=" + std::to_wstring(workerCounts[run])});
+            timings[run] = ElapsedMs(start);
+        }
+        std::wcout.rdbuf(originalOut);
+        std::wcerr.rdbuf(originalErr);
+        std::filesystem::remove(path);
+
+        EventQuery malformedQuery;
+        for (const auto& kind : kServiceEventKinds) {
+            malformedQuery.eventIds.push_back(kind.eventId);
+        }
+        std::vector<BYTE> malformed = MalformedEventChunk();
+        std::vector<ServiceEvent> malformedEvents;
+        size_t malformedRecords = EvtxChunkReader(malformed.data(), malformedQuery, malformedEvents).Run();
+
+        Out() << L"[SC_CLONE] bench events: " << count << L" records, " << static_cast<long long>(megabytes)
+              << L" MB, 1 in 100 a service event" << std::endl;
+        for (int run = 0; run < 2; ++run) {
+            Out() << L"        " << workerCounts[run] << (workerCounts[run] == 1 ? L" THREAD   " : L" THREADS  ") << L": "
+                  << timings[run] << L" ms (" << static_cast<long long>(megabytes * 1000 / timings[run]) << L" MB/s, "
+                  << timings[run] * 1024 / megabytes / 1000 << L" s per GB)" << std::endl;
+        }
+        Out() << L"        MALFORMED CHUNK  : " << malformedRecords << L" records, " << malformedEvents.size()
+              << L" events" << std::endl;
+        return malformedEvents.empty() ? 0 : ERROR_INVALID_DATA;
+    }
+
+    if (name == L"verify") {
+        if (args.size() <= 2) {
+            count = 600;
+        }
+        // Services share binaries the way svchost.exe hosts do: count / 3 distinct 512 KB files, each either
+        // quoted with arguments, expanded from %SystemRoot% or a driver path relative to the system root
+        std::filesystem::path root = std::filesystem::temp_directory_path() / "sc_clone_bench_image";
+        std::filesystem::path cachePath = std::filesystem::temp_directory_path() / "sc_clone_bench_verify.cache";
+        std::filesystem::remove_all(root);
+        std::filesystem::remove(cachePath);
+        std::filesystem::create_directories(root / "Program Files" / "Synthetic");
+        std::filesystem::create_directories(root / "Windows" / "System32" / "drivers");
+        size_t fileCount = std::max<size_t>(1, count / 3);
+        std::vector<char> content(512 * 1024);
+        uint32_t seed = 12345;
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        for (size_t i = 0; i < count; ++i) {
+            size_t j = i % fileCount;
+            wchar_t file[32];
+            MemoryService service;
+            std::swprintf(file, 32, L"%zu", j);
+            std::wstring number = file;
+            std::swprintf(file, 32, L"svc%06zu", i);
+            service.name = file;
+            std::filesystem::path hostPath;
+            if (j % 3 == 0) {
+                service.binaryPath = L"\"C:\\Program Files\\Synthetic\\app" + number + L".exe\" -k run";
+                hostPath = root / "Program Files" / "Synthetic" / ("app" + WideToUtf8(number) + ".exe");
+            } else if (j % 3 == 1) {
+                service.binaryPath = L"%SystemRoot%\\System32\\host" + number + L".exe -k group" + number;
+                hostPath = root / "Windows" / "System32" / ("host" + WideToUtf8(number) + ".exe");
+            } else {
+                service.serviceType = SERVICE_KERNEL_DRIVER;
+                service.binaryPath = L"System32\\drivers\\drv" + number + L".sys";
+                hostPath = root / "Windows" / "System32" / "drivers" / ("drv" + WideToUtf8(number) + ".sys");
+            }
+            if (i < fileCount) {
+                for (char& byte : content) {
+                    seed = seed * 1103515245 + 12345;
+                    byte = static_cast<char>(seed >> 24);
+                }
+                std::ofstream(hostPath, std::ios::binary).write(content.data(), content.size());
+            }
+            memory->AddService(service);
+        }
+        g_scmBackend = std::move(memory);
+
+        ScmSession session;
+        NullWideBuffer nullBuffer;
+        std::wstreambuf* originalOut = std::wcout.rdbuf(&nullBuffer);
+        std::wstreambuf* originalErr = std::wcerr.rdbuf(&nullBuffer);
+        double timings[2] = {};
+        for (int run = 0; run < 2; ++run) {
+            auto start = std::chrono::steady_clock::now();
+            VerifyServiceBinaries(session, {L"verify", L"--root=" + root.wstring(), L"--cache=" + cachePath.wstring()});
+            timings[run] = ElapsedMs(start);
+        }
+        std::wcout.rdbuf(originalOut);
+        std::wcerr.rdbuf(originalErr);
+        std::filesystem::remove_all(root);
+        std::filesystem::remove(cachePath);
+
+        double megabytes = fileCount * content.size() / (1024.0 * 1024.0);
+        Out() << L"[SC_CLONE] bench verify: " << count << L" services, " << fileCount << L" binaries, "
+              << static_cast<long long>(megabytes) << L" MB" << std::endl;
+        Out() << L"        FIRST SCAN (HASH)  : " << timings[0] << L" ms (" << static_cast<long long>(megabytes * 1000 / timings[0])
+              << L" MB/s)" << std::endl;
+        Out() << L"        SECOND SCAN (CACHE): " << timings[1] << L" ms" << std::endl;
+        return 0;
+    }
+
+    if (name == L"statuscache") {
+        if (args.size() <= 2) {
+            count = 1000;
+        }
+        // A refresher thread rewrites the table every 10 ms while a churn thread keeps starting and stopping
+        // services, so readers really do race the writer
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        memory->AddSyntheticServices(count);
+        g_scmBackend = std::move(memory);
+        std::wstring path = (std::filesystem::temp_directory_path() / "sc_clone_bench_status").wstring();
+        StatusCacheWriter cacheWriter;
+        ScmSession refreshSession;
+        if (cacheWriter.Create(path, count, 10) != ERROR_SUCCESS || cacheWriter.Pass(refreshSession) != ERROR_SUCCESS) {
+            Err() << L"[SC_CLONE] Unable to write " << path << std::endl;
+            return 1;
+        }
+        std::atomic<bool> stop(false);
+        std::atomic<size_t> passes(0);
+        std::atomic<size_t> transitions(0);
+        std::thread refresher([&]() {
+            while (!stop) {
+                cacheWriter.Pass(refreshSession);
+                ++passes;
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        });
+        std::thread churn([&]() {
+            ScmSession session;
+            for (size_t i = 0; !stop; i = (i + 7) % count) {
+                wchar_t serviceName[32];
+                std::swprintf(serviceName, 32, L"svc%06zu", i + 1);
+                SC_HANDLE hService = session.Service(serviceName, SERVICE_START | SERVICE_STOP);
+                SERVICE_STATUS status;
+                if (hService && (Scm().StartServiceW(hService, 0, NULL) || Scm().ControlService(hService, SERVICE_CONTROL_STOP, &status))) {
+                    ++transitions;
+                }
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        });
+
+        Out() << L"[SC_CLONE] bench statuscache: " << count << L" services, refreshed every 10 ms during start/stop churn" << std::endl;
+        Out() << L"        READERS   LOOKUP p50 us   p99 us   OPEN+LOOKUP p50 us   HITS" << std::endl;
+        const size_t readerCounts[3] = {1, 4, 16};
+        const size_t lookups = 20000;
+        for (size_t readers : readerCounts) {
+            std::vector<std::vector<double>> lookupMicros(readers);
+            std::vector<std::vector<double>> openMicros(readers);
+            std::atomic<size_t> hits(0);
+            ParallelFor(readers, readers, [&](size_t r) {
+                StatusCacheReader reader;
+                reader.Open(path);
+                SERVICE_STATUS_PROCESS ssp;
+                for (size_t i = 0; i < lookups; ++i) {
+                    wchar_t serviceName[32];
+                    std::swprintf(serviceName, 32, L"svc%06zu", (i * 31 + r) % count + 1);
+                    std::wstring key = serviceName;
+                    auto start = std::chrono::steady_clock::now();
+                    bool hit = reader.Lookup(key, 1000, ssp);
+                    lookupMicros[r].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+                    hits += hit;
+                }
+                // What a "query --cached" process pays: map the table, then look up
+                for (size_t i = 0; i < lookups / 100; ++i) {
+                    auto start = std::chrono::steady_clock::now();
+                    StatusCacheReader fresh;
+                    fresh.Open(path);
+                    fresh.Lookup(L"svc000001", 1000, ssp);
+                    openMicros[r].push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+                }
+            });
+            std::vector<double> allLookups;
+            std::vector<double> allOpens;
+            for (size_t r = 0; r < readers; ++r) {
+                allLookups.insert(allLookups.end(), lookupMicros[r].begin(), lookupMicros[r].end());
+                allOpens.insert(allOpens.end(), openMicros[r].begin(), openMicros[r].end());
+            }
+            std::sort(allLookups.begin(), allLookups.end());
+            std::sort(allOpens.begin(), allOpens.end());
+            wchar_t line[160];
+            std::swprintf(line, 160, L"        %-9zu %13.2f %8.2f %20.2f %6.1f%%", readers, TimingRecorder::Percentile(allLookups, 0.50),
+                          TimingRecorder::Percentile(allLookups, 0.99), TimingRecorder::Percentile(allOpens, 0.50),
+                          100.0 * hits / allLookups.size());
+            Out() << line << std::endl;
+        }
+        stop = true;
+        refresher.join();
+        churn.join();
+
+        // The same question answered by the SCM stand-in, for scale (a real SCM round trip costs far more)
+        ScmSession session;
+        std::vector<double> liveMicros;
+        for (size_t i = 0; i < lookups; ++i) {
+            wchar_t serviceName[32];
+            std::swprintf(serviceName, 32, L"svc%06zu", (i * 31) % count + 1);
+            auto start = std::chrono::steady_clock::now();
+            SC_HANDLE hService = session.Service(serviceName, SERVICE_QUERY_STATUS);
+            SERVICE_STATUS_PROCESS ssp;
+            DWORD bytesNeeded = 0;
+            Scm().QueryServiceStatusEx(hService, SC_STATUS_PROCESS_INFO, reinterpret_cast<LPBYTE>(&ssp), sizeof(ssp), &bytesNeeded);
+            liveMicros.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+        }
+        std::sort(liveMicros.begin(), liveMicros.end());
+        Out() << L"        LIVE (in-memory SCM, cached handle) p50: " << TimingRecorder::Percentile(liveMicros, 0.50) << L" us; "
+              << passes.load() << L" refresh passes, " << transitions.load() << L" transitions" << std::endl;
+        std::filesystem::remove(path);
+        return 0;
+    }
+
+    if (name == L"replay") {
+        // A role of count services with 200-280 ms starts and 100 ms stops, plus one disabled service
+        if (args.size() <= 2) {
+            count = 20;
+        }
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        std::vector<std::wstring> startAll = {L"start"};
+        std::vector<std::wstring> stopAll = {L"stop"};
+        for (size_t i = 0; i < count; ++i) {
+            MemoryService service;
+            service.name = L"role" + std::to_wstring(i);
+            service.binaryPath = L"C:\\role\\" + service.name + L".exe";
+            service.startDelayMs = static_cast<DWORD>(200 + 20 * (i % 5));
+            service.stopDelayMs = 100;
+            memory->AddService(service);
+            startAll.push_back(service.name);
+            stopAll.push_back(service.name);
+        }
+        MemoryService disabled;
+        disabled.name = L"RoleDisabled";
+        disabled.startType = SERVICE_DISABLED;
+        memory->AddService(disabled);
+        startAll.push_back(L"--wait");
+        stopAll.push_back(L"--wait");
+
+        // Start everything, hit 1056, 1058 and 1062 on the way, stop everything, then read back config
+        const std::vector<std::vector<std::wstring>> flow = {
+            startAll, {L"start", L"role0"}, {L"start", L"RoleDisabled"}, {L"queryex", L"role0"},
+            stopAll, {L"stop", L"role0"}, {L"config", L"role1"}, {L"query"},
+        };
+        auto runFlow = [&](std::vector<DWORD>& results) {
+            NullWideBuffer nullBuffer;
+            std::wstreambuf* originalOut = std::wcout.rdbuf(&nullBuffer);
+            std::wstreambuf* originalErr = std::wcerr.rdbuf(&nullBuffer);
+            auto start = std::chrono::steady_clock::now();
+            {
+                ScmSession session;
+                for (const auto& command : flow) {
+                    results.push_back(DispatchCommand(session, command));
+                }
+            }
+            double elapsed = ElapsedMs(start);
+            std::wcout.rdbuf(originalOut);
+            std::wcerr.rdbuf(originalErr);
+            return elapsed;
+        };
+
+        std::wstring trace = (std::filesystem::temp_directory_path() / "sc_clone_bench.trace").wstring();
+        std::unique_ptr<RecordingScmBackend> recording(new RecordingScmBackend(std::move(memory)));
+        if (recording->Open(trace) != ERROR_SUCCESS) {
+            Err() << L"[SC_CLONE] Unable to write " << trace << std::endl;
+            return 1;
+        }
+        RecordingScmBackend* recorder = recording.get();
+        g_scmBackend = std::move(recording);
+        std::vector<DWORD> liveResults;
+        double liveMs = runFlow(liveResults);
+        size_t calls = recorder->Calls();
+        g_scmBackend.reset();
+        uintmax_t traceBytes = std::filesystem::file_size(trace);
+
+        Out() << L"[SC_CLONE] bench replay: " << count << L" services, " << calls << L" calls recorded in " << traceBytes
+              << L" bytes (" << traceBytes / std::max<size_t>(calls, 1) << L" per call)" << std::endl;
+        Out() << L"        LIVE (in-memory SCM)  : " << liveMs << L" ms" << std::endl;
+        for (double speed : {1.0, 10.0, 100.0, 0.0}) {
+            std::unique_ptr<ReplayScmBackend> replay(new ReplayScmBackend(speed));
+            if (replay->Open(trace) != ERROR_SUCCESS) {
+                Err() << L"[SC_CLONE] Unable to read " << trace << std::endl;
+                return 1;
+            }
+            g_scmBackend = std::move(replay);
+            std::vector<DWORD> results;
+            double replayMs = runFlow(results);
+            std::wstring label = speed > 0 ? L"REPLAY " + std::to_wstring(static_cast<int>(speed)) + L"x" : L"REPLAY max";
+            label.resize(22, L' ');
+            Out() << L"        " << label << L": " << replayMs << L" ms ("
+                  << (results == liveResults ? L"same results" : L"RESULTS DIFFER") << L")" << std::endl;
+        }
+        std::filesystem::remove(trace);
+        return 0;
+    }
+
+    if (name == L"search") {
+        if (args.size() <= 2) {
+            count = 20000;
+        }
+        // Services get descriptions, binary paths and accounts drawn from small vocabularies, so terms match
+        // anywhere from a handful to thousands of them
+        static const wchar_t* const kWords[] = {L"network", L"print", L"audio", L"update", L"telemetry", L"storage", L"display",
+                                                L"security", L"remote", L"bluetooth", L"sensor", L"backup", L"indexing", L"cache"};
+        static const wchar_t* const kAccounts[] = {L"LocalSystem", L"NT AUTHORITY\\LocalService", L"NT AUTHORITY\\NetworkService", L".\\svc_app"};
+        const size_t wordCount = sizeof(kWords) / sizeof(kWords[0]);
+        auto describe = [&](size_t i, size_t salt) {
+            wchar_t number[32];
+            std::swprintf(number, 32, L"%zu", (i * 7919 + salt) % 100000);
+            MemoryService service;
+            std::swprintf(number, 32, L"svc%06zu", i);
+            service.name = number;
+            const wchar_t* first = kWords[(i + salt) % wordCount];
+            const wchar_t* second = kWords[(i * 31 + salt) % wordCount];
+            service.displayName = std::wstring(L"Synthetic ") + first + L" service " + std::to_wstring(i);
+            service.description = std::wstring(L"Provides ") + first + L" and " + second + L" support for component " +
+                                  std::to_wstring((i * 7919 + salt) % 100000) + L".";
+            service.binaryPath = i % 3 ? L"C:\\Windows\\System32\\svchost.exe -k " + std::wstring(second) + L"Group -p"
+                                       : L"\"C:\\Program Files\\Vendor" + std::to_wstring(i % 97) + L"\\" + first + L"svc.exe\"";
+            service.startName = kAccounts[i % 4];
+            return service;
+        };
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        for (size_t i = 0; i < count; ++i) {
+            memory->AddService(describe(i, 0));
+        }
+        MemoryScmBackend* services = memory.get();
+        g_scmBackend = std::move(memory);
+        std::wstring indexPath = (std::filesystem::temp_directory_path() / "sc_clone_bench_search.index").wstring();
+        std::filesystem::remove(indexPath);
+
+        ScmSession session;
+        SearchIndexUpdate updates[3];
+        double updateMs[3] = {};
+        for (int pass = 0; pass < 3; ++pass) {
+            if (pass == 2) {
+                for (size_t i = 0; i < count; i += 100) {
+                    services->AddService(describe(i, 1));
+                }
+            }
+            auto start = std::chrono::steady_clock::now();
+            UpdateSearchIndex(session, indexPath, L"memory", 8, updates[pass]);
+            updateMs[pass] = ElapsedMs(start);
+        }
+
+        SearchIndexView index;
+        if (index.Open(indexPath) != ERROR_SUCCESS) {
+            Err() << L"[SC_CLONE] Unable to read " << indexPath << std::endl;
+            return 1;
+        }
+        const std::wstring terms[] = {L"n", L"sv", L"telemetry", L"BLUETOOTH", L"localservice", L"12345", L"vendor42",
+                                      L"print and", L"kgroup", L"nomatchatall"};
+        const unsigned allFields = (1u << SEARCH_FIELD_COUNT) - 1;
+        Out() << L"[SC_CLONE] bench search: " << count << L" services, " << updates[0].grams << L" trigrams, "
+              << std::filesystem::file_size(indexPath) / 1024 << L" KB index" << std::endl;
+        Out() << L"        BUILD                 : " << updateMs[0] << L" ms" << std::endl;
+        Out() << L"        UPDATE (NO CHANGES)   : " << updateMs[1] << L" ms (" << (updates[1].rewritten ? L"rewritten" : L"timestamp only") << L")" << std::endl;
+        Out() << L"        UPDATE (" << updates[2].changed << L" CHANGED)  : " << updateMs[2] << L" ms" << std::endl;
+        for (const std::wstring& term : terms) {
+            std::vector<double> micros;
+            size_t matches = 0;
+            for (int run = 0; run < 200; ++run) {
+                auto start = std::chrono::steady_clock::now();
+                matches = index.Find(term, allFields).size();
+                micros.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+            }
+            std::sort(micros.begin(), micros.end());
+
+            // The same question answered by scanning every document's text
+            std::vector<char16_t> needle = FoldSearchTerm(term);
+            auto start = std::chrono::steady_clock::now();
+            size_t scanned = 0;
+            for (uint32_t document = 0; document < index.header->documentCount; ++document) {
+                scanned += index.MatchedFields(document, needle, allFields) != 0;
+            }
+            double scanMicros = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            std::wstring label = L"\"" + term + L"\"";
+            label.resize(22, L' ');
+            Out() << L"        " << label << L": " << matches << L" matches, p50 " << micros[micros.size() / 2] << L" us, p99 "
+                  << micros[micros.size() * 99 / 100] << L" us (scan " << scanMicros << L" us"
+                  << (scanned == matches ? L"" : L", COUNTS DIFFER") << L")" << std::endl;
+        }
+        std::filesystem::remove(indexPath);
+        return 0;
+    }
+
+    if (name == L"start") {
+        if (args.size() <= 2) {
+            count = 32;
+        }
+        // A role of count services, 150-400 ms of start work each, on a host of 4 simulated cores that loses a
+        // quarter of its capacity per 4 starts beyond the core count and fails starts pending for 2 s
+        const double cores = 4;
+        const double contention = 0.25;
+        const DWORD startTimeoutMs = 2000;
+        std::vector<std::wstring> names;
+        double workMs = 0;
+        for (size_t i = 0; i < count; ++i) {
+            wchar_t serviceName[32];
+            std::swprintf(serviceName, 32, L"role%04zu", i);
+            names.push_back(serviceName);
+            workMs += 150 + 50 * (i % 6);
+        }
+        struct Run {
+            const wchar_t* label;
+            size_t maxConcurrent;
+            bool adaptive;
+        };
+        const Run runs[] = {
+            {L"ALL AT ONCE", count, false},
+            {L"--max-concurrent=4", 4, false},
+            {L"--max-concurrent=8", 8, false},
+            {L"--adaptive", 0, true},
+        };
+        Out() << L"[SC_CLONE] bench start: " << count << L" services, " << static_cast<long long>(workMs) << L" ms of start work on "
+              << cores << L" simulated cores (at best " << static_cast<long long>(workMs / cores) << L" ms)" << std::endl;
+        for (const Run& run : runs) {
+            std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+            for (size_t i = 0; i < count; ++i) {
+                MemoryService service;
+                service.name = names[i];
+                service.startDelayMs = static_cast<DWORD>(150 + 50 * (i % 6));
+                memory->AddService(service);
+            }
+            memory->SetResourceModel(cores, contention, startTimeoutMs);
+            g_scmBackend = std::move(memory);
+
+            ScmSession session;
+            std::vector<PlanNode> nodes;
+            for (const auto& serviceName : names) {
+                nodes.push_back(PlanNode{serviceName, {}, ERROR_SUCCESS});
+            }
+            TransitionOptions options;
+            options.maxConcurrent = run.maxConcurrent;
+            options.adaptive = run.adaptive;
+            options.retries = 2;
+            options.backoffMs = 250;
+            AdmissionStats stats;
+            NullWideBuffer nullBuffer;
+            std::wstreambuf* originalOut = std::wcout.rdbuf(&nullBuffer);
+            RunAdmissionPlan(session, nodes, options, stats);
+            std::wcout.rdbuf(originalOut);
+
+            std::sort(stats.timeToRunningMs.begin(), stats.timeToRunningMs.end());
+            std::wstring label = run.label;
+            label.resize(22, L' ');
+            Out() << L"        " << label << L": makespan " << static_cast<long long>(stats.makespanMs) << L" ms, " << stats.failed
+                  << L" failed, " << stats.retries << L" retries, peak " << stats.peakStarting << L" starting";
+            if (!stats.timeToRunningMs.empty()) {
+                Out() << L", time to RUNNING p50 " << static_cast<long long>(TimingRecorder::Percentile(stats.timeToRunningMs, 0.50))
+                      << L" ms, p90 " << static_cast<long long>(TimingRecorder::Percentile(stats.timeToRunningMs, 0.90)) << L" ms";
+            }
+            Out() << std::endl;
+        }
+        return 0;
+    }
+
+    Err() << L"[SC_CLONE] Usage: sc_clone bench enum|deps|wait|snapshot|config|handlers|serve|apply|select|offline|events|verify|statuscache|replay|search|start [count]" << std::endl;
+    return 1;
+}
+
+// Selects the SCM backend from a --backend= option: "scm" (advapi32, Windows only), "memory[:fixture]",
+// "offline:<SYSTEM hive>" or "replay:<trace>" (played back at replaySpeed times the recorded pace, 0 for no delays)
+bool SelectBackend(const std::wstring& spec, double replaySpeed = 1) {
+    // A file-backed source is remembered by its absolute path, so the same file is the same source from any directory
+#ifdef _WIN32
+    g_backendSource = spec.empty() ? L"scm" : spec;
+#else
+    g_backendSource = spec.empty() ? L"memory" : spec;
+#endif
+    size_t colon = spec.find(L':');
+    if (colon != std::wstring::npos && colon + 1 < spec.size()) {
+        std::error_code fsError;
+        std::filesystem::path file = std::filesystem::absolute(std::filesystem::path(spec.substr(colon + 1)), fsError);
+        if (!fsError) {
+            g_backendSource = spec.substr(0, colon + 1) + file.lexically_normal().wstring();
+        }
+    }
+    if (spec.empty()) {
+#ifdef _WIN32
+        g_scmBackend.reset(new Win32ScmBackend());
+#else
+        g_scmBackend.reset(new MemoryScmBackend());
+#endif
+        return true;
+    }
+
+#ifdef _WIN32
+    if (spec == L"scm") {
+        g_scmBackend.reset(new Win32ScmBackend());
+        return true;
+    }
+#endif
+
+    if (spec.compare(0, 6, L"memory") == 0) {
+        std::unique_ptr<MemoryScmBackend> memory(new MemoryScmBackend());
+        if (spec.size() > 7 && spec[6] == L':' && !memory->LoadFixture(spec.substr(7))) {
+            Err() << L"[SC_CLONE] Unable to load fixture: " << spec.substr(7) << std::endl;
+            return false;
+        }
+        g_scmBackend = std::move(memory);
+        return true;
+    }
+
+    // "offline:<hive>" (or --offline <hive>) reads an acquired SYSTEM hive instead of a live SCM
+    if (spec.compare(0, 8, L"offline:") == 0) {
+        std::unique_ptr<OfflineHiveBackend> offline(new OfflineHiveBackend());
+        DWORD error = offline->Open(spec.substr(8));
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] Unable to read offline hive " + spec.substr(8) + L", error code: ", error);
+            return false;
+        }
+        if (offline->Dirty()) {
+            Err() << L"[SC_CLONE] Warning: the hive is dirty; changes still in its transaction logs are not shown" << std::endl;
+        }
+        g_scmBackend = std::move(offline);
+        return true;
+    }
+
+    if (spec.compare(0, 7, L"replay:") == 0) {
+        std::unique_ptr<ReplayScmBackend> replay(new ReplayScmBackend(replaySpeed));
+        DWORD error = replay->Open(spec.substr(7));
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] Unable to read trace " + spec.substr(7) + L", error code: ", error);
+            return false;
+        }
+        g_scmBackend = std::move(replay);
+        return true;
+    }
+
+    Err() << L"[SC_CLONE] Unknown backend: " << spec << std::endl;
+    return false;
+}
+
+// Main function which handles command-line arguments and invokes relevant service management functions
+int wmain(int argc, wchar_t* argv[]) {
+    // Pull global options out of the argument list
+    std::vector<std::wstring> args;
+    std::wstring backendSpec;
+    FanOutOptions fanOut;
+    bool timings = false;
+    std::wstring recordPath;
+    double replaySpeed = 1;
+    for (int i = 1; i < argc; ++i) {
+        std::wstring arg = argv[i];
+        if (arg.compare(0, 10, L"--backend=") == 0) {
+            backendSpec = arg.substr(10);
+        } else if (arg == L"--offline" && i + 1 < argc) {
+            backendSpec = std::wstring(L"offline:") + argv[++i];
+        } else if (arg.compare(0, 10, L"--offline=") == 0) {
+            backendSpec = L"offline:" + arg.substr(10);
+        } else if (arg.compare(0, 9, L"--format=") == 0) {
+            if (!ParseOutputFormat(arg.substr(9), g_outputFormat)) {
+                Err() << L"[SC_CLONE] Unknown format: " << arg.substr(9) << L" (use text, json, csv or table)" << std::endl;
+                return 1;
+            }
+        } else if (arg == L"--timings") {
+            timings = true;
+        } else if (arg.compare(0, 9, L"--record=") == 0) {
+            recordPath = arg.substr(9);
+        } else if (arg.compare(0, 15, L"--replay-speed=") == 0) {
+            replaySpeed = arg.substr(15) == L"max" ? 0 : std::wcstod(arg.c_str() + 15, nullptr);
+            if (replaySpeed < 0 || (replaySpeed == 0 && arg.substr(15) != L"max")) {
+                Err() << L"[SC_CLONE] Invalid replay speed: " << arg.substr(15) << L" (use a factor such as 10, or max)" << std::endl;
+                return 1;
+            }
+        } else if (arg.compare(0, 8, L"--hosts=") == 0) {
+            if (!ParseHostList(arg.substr(8), fanOut.hosts)) {
+                Err() << L"[SC_CLONE] No hosts given in " << arg << std::endl;
+                return 1;
+            }
+        } else if (arg.compare(0, 15, L"--max-inflight=") == 0) {
+            fanOut.maxInFlight = std::max<size_t>(1, std::wcstoul(arg.c_str() + 15, nullptr, 10));
+        } else if (arg.compare(0, 15, L"--host-timeout=") == 0) {
+            fanOut.hostTimeoutMs = static_cast<DWORD>(std::wcstoul(arg.c_str() + 15, nullptr, 10));
+        } else {
+            args.push_back(arg);
+        }
+    }
+
+    if (!SelectBackend(backendSpec, replaySpeed)) {
+        return 1;
+    }
+    if (!recordPath.empty()) {
+        std::unique_ptr<RecordingScmBackend> recording(new RecordingScmBackend(std::move(g_scmBackend)));
+        DWORD error = recording->Open(recordPath);
+        if (error != ERROR_SUCCESS) {
+            PrintErrorMessage(L"[SC_CLONE] Unable to write trace " + recordPath + L", error code: ", error);
+            return 1;
+        }
+        g_scmBackend = std::move(recording);
+    }
+    TimingRecorder recorder;
+    if (timings) {
+        g_timings = &recorder;
+        g_scmBackend.reset(new TimingScmBackend(std::move(g_scmBackend), recorder));
+    }
+
+    // Ensure enough arguments are provided
+    static const std::set<std::wstring> kCommandsWithoutArguments = {L"query", L"queryex", L"serve", L"watch", L"verify", L"statuscache"};
+    if (args.empty() || (args.size() < 2 && !kCommandsWithoutArguments.count(args[0]))) {
+        Err() << L"[SC_CLONE] Usage: sc_clone [--backend=scm|memory[:fixture]|offline:hive|replay:trace | --offline <SYSTEM hive>] [--format=text|json|csv|table]" << std::endl;
+        Err() << L"                   [--timings] [--hosts=h1,h2|@file [--max-inflight=N] [--host-timeout=ms]]" << std::endl;
+        Err() << L"                   [--record=<trace>] [--replay-speed=N|max]" << std::endl;
+        Err() << L"                   <command> <service_name> [options]" << std::endl;
+        Err() << L"          sc_clone query|queryex [type= service|driver|all] [state= active|inactive|all]" << std::endl;
+        Err() << L"          sc_clone batch <file|->" << std::endl;
+        Err() << L"          sc_clone serve [--pipe=name] [--cache=N]" << std::endl;
+        Err() << L"          sc_clone bench <name> [count]" << std::endl;
+        return 1;
+    }
+
+    int exitCode = 0;
+    if (!fanOut.hosts.empty()) {
+        std::string batchScript;
+        if (args[0] == L"batch") {
+            std::ifstream file;
+            std::istream* input = OpenBatchSource(args[1], file);
+            if (!input) {
+                return 1;
+            }
+            batchScript.assign(std::istreambuf_iterator<char>(*input), std::istreambuf_iterator<char>());
+        }
+        exitCode = RunOnHosts(fanOut, args, batchScript);
+    } else if (args[0] == L"batch") {
+        exitCode = RunBatch(args[1]);
+    } else if (args[0] == L"serve") {
+        exitCode = ServeCommands(args);
+    } else if (args[0] == L"bench") {
+        return RunBenchmark(args);
+    } else {
+        ScmSession session;
+        RunCommand(session, args);
+    }
+
+    if (g_timings) {
+        g_timings->Print(Err());
+    }
+    return exitCode;
+}
+
+#ifndef _WIN32
+// Non-Windows entry point: widen the UTF-8 arguments and hand off to wmain
+int main(int argc, char* argv[]) {
+    std::setlocale(LC_ALL, "");
+
+    std::vector<std::wstring> wideArgs;
+    for (int i = 0; i < argc; ++i) {
+        wideArgs.push_back(Utf8ToWide(argv[i]));
+    }
+    std::vector<wchar_t*> wideArgv;
+    for (auto& arg : wideArgs) {
+        wideArgv.push_back(&arg[0]);
+    }
+    wideArgv.push_back(nullptr);
+
+    return wmain(argc, wideArgv.data());
 }
+#endif
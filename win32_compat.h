@@ -0,0 +1,321 @@
+// Minimal stand-ins for the Win32 service types, constants and error helpers used by sc_clone.cpp.
+// Only included on non-Windows builds, where the in-memory SCM backend replaces advapi32.
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef uint8_t BYTE;
+typedef BYTE* LPBYTE;
+typedef DWORD* LPDWORD;
+typedef void* LPVOID;
+typedef void* PVOID;
+typedef wchar_t WCHAR;
+typedef wchar_t* LPWSTR;
+typedef const wchar_t* LPCWSTR;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define CALLBACK
+#define INFINITE            0xFFFFFFFF
+#define WAIT_IO_COMPLETION  0x000000C0
+
+typedef struct SC_HANDLE__* SC_HANDLE;
+
+typedef struct _FILETIME {
+    DWORD dwLowDateTime;
+    DWORD dwHighDateTime;
+} FILETIME, *LPFILETIME;
+
+// Error codes
+#define ERROR_SUCCESS                     0
+#define ERROR_FILE_NOT_FOUND              2
+#define ERROR_ACCESS_DENIED               5
+#define ERROR_INVALID_HANDLE              6
+#define ERROR_NOT_ENOUGH_MEMORY           8
+#define ERROR_INVALID_DATA                13
+#define ERROR_WRITE_PROTECT               19
+#define ERROR_WRITE_FAULT                 29
+#define ERROR_INVALID_PARAMETER           87
+#define ERROR_CALL_NOT_IMPLEMENTED        120
+#define ERROR_INSUFFICIENT_BUFFER         122
+#define ERROR_INVALID_NAME                123
+#define ERROR_MORE_DATA                   234
+#define ERROR_INVALID_IMAGE_HASH          577
+#define ERROR_BADDB                       1009
+#define ERROR_DEPENDENT_SERVICES_RUNNING  1051
+#define ERROR_INVALID_SERVICE_CONTROL     1052
+#define ERROR_SERVICE_REQUEST_TIMEOUT     1053
+#define ERROR_SERVICE_ALREADY_RUNNING     1056
+#define ERROR_SERVICE_DISABLED            1058
+#define ERROR_SERVICE_DOES_NOT_EXIST      1060
+#define ERROR_SERVICE_CANNOT_ACCEPT_CTRL  1061
+#define ERROR_SERVICE_NOT_ACTIVE          1062
+#define ERROR_CIRCULAR_DEPENDENCY         1059
+#define ERROR_SERVICE_DEPENDENCY_FAIL     1068
+#define ERROR_SERVICE_MARKED_FOR_DELETE   1072
+#define ERROR_SERVICE_EXISTS              1073
+#define ERROR_SERVICE_NOTIFY_CLIENT_LAGGING 1294
+#define RPC_S_SERVER_UNAVAILABLE          1722
+
+// Service Control Manager access rights
+#define SC_MANAGER_CONNECT             0x0001
+#define SC_MANAGER_CREATE_SERVICE      0x0002
+#define SC_MANAGER_ENUMERATE_SERVICE   0x0004
+#define SC_MANAGER_LOCK                0x0008
+#define SC_MANAGER_QUERY_LOCK_STATUS   0x0010
+#define SC_MANAGER_MODIFY_BOOT_CONFIG  0x0020
+#define SC_MANAGER_ALL_ACCESS          0xF003F
+
+// Service access rights
+#define SERVICE_QUERY_CONFIG           0x0001
+#define SERVICE_CHANGE_CONFIG          0x0002
+#define SERVICE_QUERY_STATUS           0x0004
+#define SERVICE_ENUMERATE_DEPENDENTS   0x0008
+#define SERVICE_START                  0x0010
+#define SERVICE_STOP                   0x0020
+#define SERVICE_PAUSE_CONTINUE         0x0040
+#define SERVICE_INTERROGATE            0x0080
+#define SERVICE_USER_DEFINED_CONTROL   0x0100
+#define SERVICE_ALL_ACCESS             0xF01FF
+#define DELETE                         0x00010000
+
+// Service types
+#define SERVICE_KERNEL_DRIVER          0x00000001
+#define SERVICE_FILE_SYSTEM_DRIVER     0x00000002
+#define SERVICE_ADAPTER                0x00000004
+#define SERVICE_RECOGNIZER_DRIVER      0x00000008
+#define SERVICE_DRIVER                 0x0000000B
+#define SERVICE_WIN32_OWN_PROCESS      0x00000010
+#define SERVICE_WIN32_SHARE_PROCESS    0x00000020
+#define SERVICE_WIN32                  0x00000030
+#define SERVICE_INTERACTIVE_PROCESS    0x00000100
+
+// Start types
+#define SERVICE_BOOT_START             0x00000000
+#define SERVICE_SYSTEM_START           0x00000001
+#define SERVICE_AUTO_START             0x00000002
+#define SERVICE_DEMAND_START           0x00000003
+#define SERVICE_DISABLED               0x00000004
+
+// Error control
+#define SERVICE_ERROR_IGNORE           0x00000000
+#define SERVICE_ERROR_NORMAL           0x00000001
+#define SERVICE_ERROR_SEVERE           0x00000002
+#define SERVICE_ERROR_CRITICAL         0x00000003
+
+#define SERVICE_NO_CHANGE              0xFFFFFFFF
+
+// Enumeration state filters
+#define SERVICE_ACTIVE                 0x00000001
+#define SERVICE_INACTIVE               0x00000002
+#define SERVICE_STATE_ALL              0x00000003
+
+// Current states
+#define SERVICE_STOPPED                0x00000001
+#define SERVICE_START_PENDING          0x00000002
+#define SERVICE_STOP_PENDING           0x00000003
+#define SERVICE_RUNNING                0x00000004
+#define SERVICE_CONTINUE_PENDING       0x00000005
+#define SERVICE_PAUSE_PENDING          0x00000006
+#define SERVICE_PAUSED                 0x00000007
+
+// Controls
+#define SERVICE_CONTROL_STOP           0x00000001
+#define SERVICE_CONTROL_PAUSE          0x00000002
+#define SERVICE_CONTROL_CONTINUE       0x00000003
+#define SERVICE_CONTROL_INTERROGATE    0x00000004
+
+#define SERVICE_ACCEPT_STOP            0x00000001
+#define SERVICE_ACCEPT_PAUSE_CONTINUE  0x00000002
+
+// NotifyServiceStatusChange
+#define SERVICE_NOTIFY_STATUS_CHANGE     2
+#define SERVICE_NOTIFY_STOPPED           0x00000001
+#define SERVICE_NOTIFY_START_PENDING     0x00000002
+#define SERVICE_NOTIFY_STOP_PENDING      0x00000004
+#define SERVICE_NOTIFY_RUNNING           0x00000008
+#define SERVICE_NOTIFY_CONTINUE_PENDING  0x00000010
+#define SERVICE_NOTIFY_PAUSE_PENDING     0x00000020
+#define SERVICE_NOTIFY_PAUSED            0x00000040
+#define SERVICE_NOTIFY_CREATED           0x00000080
+#define SERVICE_NOTIFY_DELETED           0x00000100
+#define SERVICE_NOTIFY_DELETE_PENDING    0x00000200
+
+// QueryServiceConfig2 / ChangeServiceConfig2 info levels
+#define SERVICE_CONFIG_DESCRIPTION          1
+#define SERVICE_CONFIG_FAILURE_ACTIONS      2
+#define SERVICE_CONFIG_FAILURE_ACTIONS_FLAG 4
+
+// Registry value types (offline hive reader)
+#define REG_SZ                         1
+#define REG_EXPAND_SZ                  2
+#define REG_BINARY                     3
+#define REG_DWORD                      4
+#define REG_MULTI_SZ                   7
+
+typedef enum _SC_STATUS_TYPE {
+    SC_STATUS_PROCESS_INFO = 0
+} SC_STATUS_TYPE;
+
+typedef enum _SC_ENUM_TYPE {
+    SC_ENUM_PROCESS_INFO = 0
+} SC_ENUM_TYPE;
+
+typedef enum _SC_ACTION_TYPE {
+    SC_ACTION_NONE = 0,
+    SC_ACTION_RESTART = 1,
+    SC_ACTION_REBOOT = 2,
+    SC_ACTION_RUN_COMMAND = 3
+} SC_ACTION_TYPE;
+
+typedef struct _SERVICE_STATUS {
+    DWORD dwServiceType;
+    DWORD dwCurrentState;
+    DWORD dwControlsAccepted;
+    DWORD dwWin32ExitCode;
+    DWORD dwServiceSpecificExitCode;
+    DWORD dwCheckPoint;
+    DWORD dwWaitHint;
+} SERVICE_STATUS, *LPSERVICE_STATUS;
+
+typedef struct _SERVICE_STATUS_PROCESS {
+    DWORD dwServiceType;
+    DWORD dwCurrentState;
+    DWORD dwControlsAccepted;
+    DWORD dwWin32ExitCode;
+    DWORD dwServiceSpecificExitCode;
+    DWORD dwCheckPoint;
+    DWORD dwWaitHint;
+    DWORD dwProcessId;
+    DWORD dwServiceFlags;
+} SERVICE_STATUS_PROCESS, *LPSERVICE_STATUS_PROCESS;
+
+typedef struct _ENUM_SERVICE_STATUS_PROCESSW {
+    LPWSTR lpServiceName;
+    LPWSTR lpDisplayName;
+    SERVICE_STATUS_PROCESS ServiceStatusProcess;
+} ENUM_SERVICE_STATUS_PROCESSW, *LPENUM_SERVICE_STATUS_PROCESSW;
+
+typedef struct _ENUM_SERVICE_STATUSW {
+    LPWSTR lpServiceName;
+    LPWSTR lpDisplayName;
+    SERVICE_STATUS ServiceStatus;
+} ENUM_SERVICE_STATUSW, *LPENUM_SERVICE_STATUSW;
+
+typedef void (CALLBACK* PFN_SC_NOTIFY_CALLBACK)(PVOID pParameter);
+
+typedef struct _SERVICE_NOTIFY_2W {
+    DWORD dwVersion;
+    PFN_SC_NOTIFY_CALLBACK pfnNotifyCallback;
+    PVOID pContext;
+    DWORD dwNotificationStatus;
+    SERVICE_STATUS_PROCESS ServiceStatus;
+    DWORD dwNotificationTriggered;
+    LPWSTR pszServiceNames;
+} SERVICE_NOTIFYW, *PSERVICE_NOTIFYW;
+
+typedef struct _QUERY_SERVICE_CONFIGW {
+    DWORD dwServiceType;
+    DWORD dwStartType;
+    DWORD dwErrorControl;
+    LPWSTR lpBinaryPathName;
+    LPWSTR lpLoadOrderGroup;
+    DWORD dwTagId;
+    LPWSTR lpDependencies;
+    LPWSTR lpServiceStartName;
+    LPWSTR lpDisplayName;
+} QUERY_SERVICE_CONFIGW, *LPQUERY_SERVICE_CONFIGW;
+
+typedef struct _SC_ACTION {
+    SC_ACTION_TYPE Type;
+    DWORD Delay;
+} SC_ACTION, *LPSC_ACTION;
+
+typedef struct _SERVICE_FAILURE_ACTIONSW {
+    DWORD dwResetPeriod;
+    LPWSTR lpRebootMsg;
+    LPWSTR lpCommand;
+    DWORD cActions;
+    SC_ACTION* lpsaActions;
+} SERVICE_FAILURE_ACTIONSW, *LPSERVICE_FAILURE_ACTIONSW;
+typedef SERVICE_FAILURE_ACTIONSW SERVICE_FAILURE_ACTIONS;
+
+typedef struct _SERVICE_FAILURE_ACTIONS_FLAG {
+    BOOL fFailureActionsOnNonCrashFailures;
+} SERVICE_FAILURE_ACTIONS_FLAG, *LPSERVICE_FAILURE_ACTIONS_FLAG;
+
+typedef struct _SERVICE_DESCRIPTIONW {
+    LPWSTR lpDescription;
+} SERVICE_DESCRIPTIONW, *LPSERVICE_DESCRIPTIONW;
+
+// Thread-local last error, mirroring GetLastError/SetLastError semantics
+inline DWORD& Win32LastErrorSlot() {
+    thread_local DWORD lastError = ERROR_SUCCESS;
+    return lastError;
+}
+
+inline DWORD GetLastError() {
+    return Win32LastErrorSlot();
+}
+
+inline void SetLastError(DWORD error) {
+    Win32LastErrorSlot() = error;
+}
+
+// Text for the error codes the in-memory backend can produce (stands in for FormatMessage)
+inline const wchar_t* Win32ErrorText(DWORD error) {
+    switch (error) {
+        case ERROR_SUCCESS:                    return L"The operation completed successfully.";
+        case ERROR_FILE_NOT_FOUND:             return L"The system cannot find the file specified.";
+        case ERROR_ACCESS_DENIED:              return L"Access is denied.";
+        case ERROR_INVALID_HANDLE:             return L"The handle is invalid.";
+        case ERROR_NOT_ENOUGH_MEMORY:          return L"Not enough memory resources are available to process this command.";
+        case ERROR_INVALID_DATA:               return L"The data is invalid.";
+        case ERROR_WRITE_PROTECT:              return L"The media is write protected.";
+        case ERROR_WRITE_FAULT:                return L"The system cannot write to the specified device.";
+        case ERROR_INVALID_PARAMETER:          return L"The parameter is incorrect.";
+        case ERROR_CALL_NOT_IMPLEMENTED:       return L"This function is not supported on this system.";
+        case ERROR_INSUFFICIENT_BUFFER:        return L"The data area passed to a system call is too small.";
+        case ERROR_INVALID_NAME:               return L"The filename, directory name, or volume label syntax is incorrect.";
+        case ERROR_MORE_DATA:                  return L"More data is available.";
+        case ERROR_INVALID_IMAGE_HASH:         return L"Windows cannot verify the digital signature for this file. A recent hardware or software change might have installed a file that is signed incorrectly or damaged, or that might be malicious software from an unknown source.";
+        case ERROR_BADDB:                      return L"The configuration registry database is corrupt.";
+        case ERROR_DEPENDENT_SERVICES_RUNNING: return L"A stop control has been sent to a service that other running services are dependent on.";
+        case ERROR_INVALID_SERVICE_CONTROL:    return L"The requested control is not valid for this service.";
+        case ERROR_SERVICE_REQUEST_TIMEOUT:    return L"The service did not respond to the start or control request in a timely fashion.";
+        case ERROR_SERVICE_ALREADY_RUNNING:    return L"An instance of the service is already running.";
+        case ERROR_SERVICE_DISABLED:           return L"The service cannot be started, either because it is disabled or because it has no enabled devices associated with it.";
+        case ERROR_SERVICE_DOES_NOT_EXIST:     return L"The specified service does not exist as an installed service.";
+        case ERROR_SERVICE_CANNOT_ACCEPT_CTRL: return L"The service cannot accept control messages at this time.";
+        case ERROR_SERVICE_NOT_ACTIVE:         return L"The service has not been started.";
+        case ERROR_CIRCULAR_DEPENDENCY:        return L"Circular service dependency was specified.";
+        case ERROR_SERVICE_DEPENDENCY_FAIL:    return L"The dependency service or group failed to start.";
+        case ERROR_SERVICE_MARKED_FOR_DELETE:  return L"The specified service has been marked for deletion.";
+        case ERROR_SERVICE_EXISTS:             return L"The specified service already exists.";
+        case RPC_S_SERVER_UNAVAILABLE:         return L"The RPC server is unavailable.";
+        case ERROR_SERVICE_NOTIFY_CLIENT_LAGGING: return L"The service notification client is lagging too far behind the current state of services in the machine.";
+        default:                               return L"Unknown error.";
+    }
+}
+
+// LocalAlloc/LocalFree on top of the C heap (LPTR zero-initialises, as on Windows)
+#define LPTR 0x0040
+
+inline void* LocalAlloc(unsigned int flags, size_t bytes) {
+    return (flags & LPTR) ? std::calloc(1, bytes ? bytes : 1) : std::malloc(bytes ? bytes : 1);
+}
+
+inline void* LocalFree(void* memory) {
+    std::free(memory);
+    return nullptr;
+}